@@ -1,8 +1,7 @@
 
 #include <libubox/blobmsg.h>
 #include "uhttpd.h"
-
-static LIST_HEAD(aliases);
+#include "trie.h"
 
 struct url_alias {
 	struct list_head list;
@@ -13,24 +12,55 @@ struct url_alias {
 };
 
 void uh_alias_add(const char *from, const char *to) {
-	struct url_alias *alias = malloc(sizeof(struct url_alias));
+	struct url_alias *alias;
+	struct vhost *vh = uh_vhost_config();
+	void **slot;
+
+	if (!vh)
+		return;
+
+	alias = malloc(sizeof(struct url_alias));
+
 	alias->from = strdup(from);
 	alias->from_l = strlen(from);
 	alias->to = strdup(to);
 	alias->to_l = strlen(to);
 
-	list_add_tail(&alias->list, &aliases);
+	list_add_tail(&alias->list, &vh->aliases);
+
+	/* the first alias configured for a prefix wins */
+	slot = uh_trie_insert(&vh->alias_trie, alias->from);
+	if (slot && !*slot)
+		*slot = alias;
+}
+
+void uh_alias_free(struct vhost *vh)
+{
+	struct url_alias *alias, *tmp;
+
+	list_for_each_entry_safe(alias, tmp, &vh->aliases, list) {
+		list_del(&alias->list);
+		free((char *) alias->from);
+		free((char *) alias->to);
+		free(alias);
+	}
+
+	uh_trie_free(&vh->alias_trie);
+}
+
+void uh_alias_reset(void)
+{
+	uh_alias_free(&default_vhost);
 }
 
-bool uh_alias_transform(const char *url, char *dest, int dest_l) {
+bool uh_alias_transform(struct vhost *vh, const char *url, char *dest, int dest_l) {
 	struct url_alias *alias;
 
-	list_for_each_entry(alias, &aliases, list) {
-		if (strncmp(url, alias->from, alias->from_l) == 0) {
-			snprintf(dest, dest_l, alias->to, url + alias->from_l);
-			dest[dest_l-1] = 0;
-			return true;
-		}
+	alias = uh_trie_match(&vh->alias_trie, url, false, NULL);
+	if (alias) {
+		snprintf(dest, dest_l, alias->to, url + alias->from_l);
+		dest[dest_l-1] = 0;
+		return true;
 	}
 
 	// The URL doesn't match any alias, copy as is
@@ -24,128 +24,736 @@
 
 #include "uhttpd.h"
 
+#define ARDUINO_POOL_SIZE	2
+#define ARDUINO_HEADER_MAX	1024
+
+/*
+ * Framed protocol: every frame starts with a 9 byte header made of the
+ * payload length and the stream id (both 32 bit big endian) followed by
+ * the frame type. A request is a REQUEST frame carrying the URL, the
+ * bridge answers with any number of DATA frames followed by an END frame.
+ * An END frame sent to the bridge cancels the stream.
+ */
+#define ARDUINO_FRAME_HDR_LEN	9
+#define ARDUINO_FRAME_MAX	65536
+#define ARDUINO_MUX_MAX_PENDING	32768
+
+enum arduino_frame_type {
+	ARDUINO_FRAME_REQUEST = 1,
+	ARDUINO_FRAME_DATA = 2,
+	ARDUINO_FRAME_END = 3,
+};
+
+struct arduino_response {
+	struct client *cl;
+	struct blob_buf hdr;
+	int status_code;
+	char status_msg[64];
+	bool sniffed;
+	bool header_done;
+};
+
+struct arduino_conn {
+	struct list_head list;
+	struct ustream_fd sfd;
+	struct uloop_timeout timeout;
+	struct arduino_response resp;
+};
+
+struct arduino_mux;
+
+struct arduino_stream {
+	struct list_head list;
+	struct arduino_mux *mux;
+	struct uloop_timeout timeout;
+	struct arduino_response resp;
+	uint32_t id;
+	bool ended;
+
+	char hbuf[ARDUINO_HEADER_MAX];
+	int hlen;
+};
+
+struct arduino_mux {
+	struct ustream_fd sfd;
+	struct list_head streams;
+	uint32_t next_id;
+	bool dead;
+
+	uint8_t fhdr[ARDUINO_FRAME_HDR_LEN];
+	int fhdr_len;
+	struct arduino_stream *cur;
+	uint8_t cur_type;
+	uint32_t cur_len;
+
+	struct arduino_stream *blocked;
+};
+
 static char *url_prefix = NULL;
 static char *bridge_ip;
 static int bridge_port;
 static int bridge_timeout = 10;
+static bool bridge_framed;
+
+static struct sockaddr_in bridge_addr;
+static bool bridge_resolved;
+
+static LIST_HEAD(idle_conns);
+static int n_idle;
+
+static struct arduino_mux *mux;
 
 void uh_arduino_set_options(char *_url_prefix, char *_bridge_ip, int _bridge_port) {
+	static const struct addrinfo hints = {
+		.ai_family = AF_INET,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo *addr;
+	int ret;
+
 	url_prefix = _url_prefix;
+	arduino_dispatch.prefix = url_prefix;
 	bridge_ip = _bridge_ip;
 	bridge_port = _bridge_port;
+
+	/* Resolve the bridge address once, instead of on every request */
+	bridge_resolved = false;
+	ret = getaddrinfo(bridge_ip, NULL, &hints, &addr);
+	if (ret) {
+		fprintf(stderr, "Unable to resolve bridge address %s: %s\n",
+			bridge_ip, gai_strerror(ret));
+		return;
+	}
+
+	memcpy(&bridge_addr, addr->ai_addr, sizeof(bridge_addr));
+	bridge_addr.sin_port = htons(bridge_port);
+	bridge_resolved = true;
+	freeaddrinfo(addr);
 }
 
 void uh_arduino_set_timeout(int timeout) {
 	bridge_timeout = timeout;
 }
 
-static int send_with_timeout(int sockfd, void *data, int len) {
-	while (len>0) {
-		fd_set wfds;
-		FD_ZERO(&wfds);
-		FD_SET(sockfd, &wfds);
+void uh_arduino_set_framed(bool framed) {
+	bridge_framed = framed;
+}
+
+static int arduino_connect(void) {
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *) &bridge_addr, sizeof(bridge_addr)) < 0 &&
+	    errno != EINPROGRESS) {
+		close(fd);
+		return -1;
+	}
 
-		struct timeval tv;
-		tv.tv_sec = bridge_timeout;
-		tv.tv_usec = 0;
+	return fd;
+}
 
-		if (select(sockfd+1, NULL, &wfds, NULL, &tv) <= 0)
-			return -1;
-		ssize_t l = send(sockfd, data, len, 0);
-		if (l<0)
-			return l;
-		len -= l;
-		data += l;
+/* raw connection to the bridge, for users other than the HTTP handler */
+int uh_arduino_connect(void) {
+	if (!bridge_resolved) {
+		errno = EHOSTUNREACH;
+		return -1;
 	}
-	return 0;
+
+	return arduino_connect();
 }
 
-static ssize_t recv_with_timeout(int sockfd, void *data, int len) {
-	fd_set rfds;
-	FD_ZERO(&rfds);
-	FD_SET(sockfd, &rfds);
+static void arduino_response_init(struct arduino_response *r, struct client *cl) {
+	r->cl = cl;
+	r->status_code = 200;
+	strcpy(r->status_msg, "OK");
+	blob_buf_init(&r->hdr, 0);
+}
 
-	struct timeval tv;
-	tv.tv_sec = bridge_timeout;
-	tv.tv_usec = 0;
+static void arduino_send_header(struct arduino_response *r) {
+	struct client *cl = r->cl;
+	struct blob_attr *cur;
+	int rem;
 
-	if (select(sockfd+1, &rfds, NULL, NULL, &tv) <= 0)
-		return -1;
-	return recv(sockfd, data, len, 0);
+	r->header_done = true;
+	uh_http_header(cl, r->status_code, r->status_msg);
+	blob_for_each_attr(cur, r->hdr.head, rem)
+		ustream_printf(cl->us, "%s: %s\r\n", blobmsg_name(cur), blobmsg_data(cur));
+	ustream_printf(cl->us, "\r\n");
 }
 
-static void arduino_main(struct client *cl, struct path_info *pi, char *url)
-{
-	/* Retrieve bridge address */
-	struct hostent *server = gethostbyname(bridge_ip);
-	if (server == NULL)
-		goto error;
-	struct sockaddr_in serv_addr;
-	memset(&serv_addr, 0, sizeof(serv_addr));
-	serv_addr.sin_family = AF_INET;
-	serv_addr.sin_port = htons(bridge_port);
-	memcpy(&serv_addr.sin_addr.s_addr, server->h_addr, server->h_length);
-	
-	/* Open socket and try to connect */
-	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (sockfd < 0)
-		goto error;
-	if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) 
-		goto error_connect;
+static void arduino_parse_status(struct arduino_response *r, const char *val) {
+	char *sep;
+	int code;
+
+	code = strtoul(val, &sep, 10);
+	if (code < 100 || code > 999)
+		return;
+
+	while (*sep == ' ')
+		sep++;
+
+	r->status_code = code;
+	snprintf(r->status_msg, sizeof(r->status_msg), "%s", *sep ? sep : "OK");
+}
+
+/*
+ * The bridge may prefix its response with CGI style headers, starting with
+ * a "Status" line. Anything else is passed on as body of a 200 response.
+ * Returns the number of header bytes consumed from buf.
+ */
+static int arduino_process_header(struct arduino_response *r, char *buf, int len, bool eof) {
+	char *line = buf, *newline, *val;
+	int line_len;
+
+	if (!r->sniffed) {
+		if (len < 6) {
+			if (eof)
+				arduino_send_header(r);
+			return 0;
+		}
+
+		if (memcmp(buf, "Status", 6) != 0) {
+			arduino_send_header(r);
+			return 0;
+		}
+
+		r->sniffed = true;
+	}
+
+	while (line < buf + len &&
+	       (newline = memchr(line, '\n', buf + len - line)) != NULL) {
+		line_len = newline + 1 - line;
+		if (newline > line && newline[-1] == '\r')
+			newline--;
+
+		*newline = 0;
+		if (newline == line) {
+			arduino_send_header(r);
+			return line + line_len - buf;
+		}
+
+		val = uh_split_header(line);
+		if (val) {
+			if (!strcmp(line, "Status"))
+				arduino_parse_status(r, val);
+			else
+				blobmsg_add_string(&r->hdr, line, val);
+		}
+
+		line += line_len;
+	}
+
+	/* incomplete header block, send what we have */
+	if (eof)
+		arduino_send_header(r);
+
+	return line - buf;
+}
+
+static void arduino_conn_free(struct arduino_conn *c) {
+	if (c->list.next)
+		list_del(&c->list);
+
+	uloop_timeout_cancel(&c->timeout);
+	ustream_free(&c->sfd.stream);
+	close(c->sfd.fd.fd);
+	blob_buf_free(&c->resp.hdr);
+	free(c);
+}
+
+static void arduino_read_cb(struct ustream *s, int bytes) {
+	struct arduino_conn *c = container_of(s, struct arduino_conn, sfd.stream);
+	struct client *cl = c->resp.cl;
+	char *buf;
+	int len;
+
+	if (!cl) {
+		/* idle connection, nothing is expected here */
+		ustream_get_read_buf(s, &len);
+		ustream_consume(s, len);
+		return;
+	}
+
+	uloop_timeout_set(&c->timeout, bridge_timeout * 1000);
+
+	if (!c->resp.header_done) {
+		buf = ustream_get_read_buf(s, &len);
+		len = arduino_process_header(&c->resp, buf, buf ? len : 0, s->eof);
+		if (len)
+			ustream_consume(s, len);
+
+		if (!c->resp.header_done)
+			return;
+	}
+
+	while (1) {
+		if (!s->eof && ustream_pending_data(cl->us, true)) {
+			ustream_set_read_blocked(s, true);
+			return;
+		}
+
+		buf = ustream_get_read_buf(s, &len);
+		if (!buf || !len)
+			break;
+
+		uh_chunk_write(cl, buf, len);
+		ustream_consume(s, len);
+	}
+
+	if (s->eof)
+		ustream_state_change(s);
+}
+
+static void arduino_state_cb(struct ustream *s) {
+	struct arduino_conn *c = container_of(s, struct arduino_conn, sfd.stream);
+	struct client *cl = c->resp.cl;
+	socklen_t sl = sizeof(int);
+	int err = 0;
+
+	if (!cl) {
+		/* idle connection was dropped by the bridge */
+		n_idle--;
+		arduino_conn_free(c);
+		return;
+	}
+
+	if (s->write_error && !c->resp.header_done) {
+		getsockopt(c->sfd.fd.fd, SOL_SOCKET, SO_ERROR, &err, &sl);
+		uh_client_error(cl, 500, "Internal Server Error",
+				"Couldn't connect to bridge: %s",
+				strerror(err ? err : ECONNRESET));
+		return;
+	}
+
+	if (!s->eof || ustream_pending_data(s, false))
+		return;
+
+	if (!c->resp.header_done)
+		arduino_send_header(&c->resp);
+
+	uh_request_done(cl);
+}
+
+static void arduino_timeout_cb(struct uloop_timeout *timeout) {
+	struct arduino_conn *c = container_of(timeout, struct arduino_conn, timeout);
+
+	if (!c->resp.header_done)
+		uh_client_error(c->resp.cl, 504, "Gateway Timeout",
+				"The bridge did not respond in time");
+	else
+		uh_request_done(c->resp.cl);
+}
+
+static struct arduino_conn *arduino_conn_new(void) {
+	struct arduino_conn *c;
+	int fd;
+
+	fd = arduino_connect();
+	if (fd < 0)
+		return NULL;
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		close(fd);
+		return NULL;
+	}
+
+	c->timeout.cb = arduino_timeout_cb;
+	c->sfd.stream.string_data = true;
+	c->sfd.stream.notify_read = arduino_read_cb;
+	c->sfd.stream.notify_state = arduino_state_cb;
+	ustream_fd_init(&c->sfd, fd);
+
+	return c;
+}
+
+/*
+ * Keep a few connections to the bridge established in advance, so that
+ * the TCP handshake is not paid for while a request is waiting. The bridge
+ * closes the connection at the end of each response, so every connection
+ * serves a single request and is replaced once taken from the pool.
+ */
+static void arduino_pool_fill(void) {
+	struct arduino_conn *c;
+
+	while (n_idle < ARDUINO_POOL_SIZE) {
+		c = arduino_conn_new();
+		if (!c)
+			return;
+
+		list_add_tail(&c->list, &idle_conns);
+		n_idle++;
+	}
+}
+
+static struct arduino_conn *arduino_conn_get(void) {
+	struct arduino_conn *c;
+
+	while (!list_empty(&idle_conns)) {
+		c = list_first_entry(&idle_conns, struct arduino_conn, list);
+		list_del(&c->list);
+		n_idle--;
+
+		if (!c->sfd.stream.eof && !c->sfd.stream.write_error)
+			return c;
+
+		arduino_conn_free(c);
+	}
+
+	return arduino_conn_new();
+}
+
+static void arduino_free(struct client *cl) {
+	struct arduino_conn *c = cl->dispatch.arduino.conn;
+
+	if (!c)
+		return;
+
+	cl->dispatch.arduino.conn = NULL;
+	arduino_conn_free(c);
+}
+
+static void arduino_close_fds(struct client *cl) {
+	struct arduino_conn *c = cl->dispatch.arduino.conn;
+
+	if (c)
+		close(c->sfd.fd.fd);
+}
+
+static void arduino_write_cb(struct client *cl) {
+	struct arduino_conn *c = cl->dispatch.arduino.conn;
+
+	if (!c || ustream_pending_data(cl->us, true))
+		return;
+
+	ustream_set_read_blocked(&c->sfd.stream, false);
+	arduino_read_cb(&c->sfd.stream, 0);
+}
+
+static bool arduino_conn_start(struct client *cl, char *url) {
+	struct arduino_conn *c;
+
+	c = arduino_conn_get();
+	if (!c)
+		return false;
+
+	arduino_response_init(&c->resp, cl);
+
+	cl->dispatch.arduino.conn = c;
+	cl->dispatch.free = arduino_free;
+	cl->dispatch.close_fds = arduino_close_fds;
+	cl->dispatch.write_cb = arduino_write_cb;
 
 	/* Send requested URL (without the prefix) */
-	url += strlen(url_prefix);
-	if (send_with_timeout(sockfd, url, strlen(url)) < 0)
-		goto error_chatting;
-	if (send_with_timeout(sockfd, "\r\n", 2) < 0)
-		goto error_chatting;
-
-	/* Wait response */
-	bool header_sent = false;
-	int readed = 0;
-	uint8_t buff[1024];
-	for (;;) {
-		ssize_t l = recv_with_timeout(sockfd, buff+readed, 1024-readed);
-		if (l <= 0)
+	ustream_printf(&c->sfd.stream, "%s\r\n", url);
+	uloop_timeout_set(&c->timeout, bridge_timeout * 1000);
+
+	arduino_pool_fill();
+
+	return true;
+}
+
+static void arduino_mux_send(struct arduino_mux *m, uint32_t id, uint8_t type,
+			     const char *data, int len) {
+	uint8_t hdr[ARDUINO_FRAME_HDR_LEN];
+	uint32_t val;
+
+	val = htonl(len);
+	memcpy(&hdr[0], &val, 4);
+	val = htonl(id);
+	memcpy(&hdr[4], &val, 4);
+	hdr[8] = type;
+
+	ustream_write(&m->sfd.stream, (char *) hdr, sizeof(hdr), true);
+	if (len)
+		ustream_write(&m->sfd.stream, data, len, false);
+}
+
+static struct arduino_stream *arduino_mux_find(uint32_t id) {
+	struct arduino_stream *st;
+
+	list_for_each_entry(st, &mux->streams, list)
+		if (st->id == id)
+			return st;
+
+	return NULL;
+}
+
+static void arduino_stream_data(struct arduino_stream *st, char *data, int len, bool eof) {
+	struct arduino_response *r = &st->resp;
+	int n;
+
+	if (!r->header_done) {
+		n = min(len, (int) sizeof(st->hbuf) - st->hlen);
+		if (n)
+			memcpy(st->hbuf + st->hlen, data, n);
+		st->hlen += n;
+		data += n;
+		len -= n;
+
+		n = arduino_process_header(r, st->hbuf, st->hlen,
+					   eof || st->hlen == sizeof(st->hbuf));
+		st->hlen -= n;
+		memmove(st->hbuf, st->hbuf + n, st->hlen);
+
+		if (!r->header_done)
+			return;
+
+		if (st->hlen)
+			uh_chunk_write(r->cl, st->hbuf, st->hlen);
+		st->hlen = 0;
+	}
+
+	if (len)
+		uh_chunk_write(r->cl, data, len);
+
+	/* the connection is shared, stop reading until this client catches up */
+	if (ustream_pending_data(r->cl->us, true) > ARDUINO_MUX_MAX_PENDING)
+		st->mux->blocked = st;
+}
+
+static void arduino_stream_end(struct arduino_stream *st) {
+	st->ended = true;
+	arduino_stream_data(st, NULL, 0, true);
+	uh_request_done(st->resp.cl);
+}
+
+static void arduino_mux_close(void) {
+	struct arduino_mux *m = mux;
+	struct arduino_stream *st;
+	struct client *cl;
+
+	/*
+	 * Failing a stream can start a queued request, which has to get a
+	 * new connection instead of joining this one.
+	 */
+	mux = NULL;
+	m->dead = true;
+	while (!list_empty(&m->streams)) {
+		st = list_first_entry(&m->streams, struct arduino_stream, list);
+		cl = st->resp.cl;
+		st->ended = true;
+
+		if (!st->resp.header_done)
+			uh_client_error(cl, 502, "Bad Gateway",
+					"Lost connection to bridge");
+		else
+			uh_request_done(cl);
+	}
+
+	ustream_free(&m->sfd.stream);
+	close(m->sfd.fd.fd);
+	free(m);
+}
+
+static void arduino_mux_frame_done(void) {
+	struct arduino_stream *st = mux->cur;
+
+	mux->fhdr_len = 0;
+	mux->cur = NULL;
+
+	if (st && mux->cur_type == ARDUINO_FRAME_END)
+		arduino_stream_end(st);
+}
+
+static void arduino_mux_read_cb(struct ustream *s, int bytes) {
+	uint32_t val;
+	char *buf;
+	int len, n;
+
+	while (mux && &mux->sfd.stream == s) {
+		if (mux->blocked) {
+			ustream_set_read_blocked(s, true);
+			return;
+		}
+
+		buf = ustream_get_read_buf(s, &len);
+		if (!buf || !len)
 			break;
-		/* If header was sent, just proxy received data... */
-		if (header_sent) {
-			fwrite(buff, 1, l, stdout);
+
+		if (mux->fhdr_len < ARDUINO_FRAME_HDR_LEN) {
+			n = min(len, ARDUINO_FRAME_HDR_LEN - mux->fhdr_len);
+			memcpy(mux->fhdr + mux->fhdr_len, buf, n);
+			mux->fhdr_len += n;
+			ustream_consume(s, n);
+
+			if (mux->fhdr_len < ARDUINO_FRAME_HDR_LEN)
+				continue;
+
+			memcpy(&val, &mux->fhdr[0], 4);
+			mux->cur_len = ntohl(val);
+			memcpy(&val, &mux->fhdr[4], 4);
+			mux->cur = arduino_mux_find(ntohl(val));
+			mux->cur_type = mux->fhdr[8];
+
+			if (mux->cur_len > ARDUINO_FRAME_MAX) {
+				/* out of sync, there is no way to recover */
+				s->eof = true;
+				ustream_state_change(s);
+				return;
+			}
+
+			if (!mux->cur_len)
+				arduino_mux_frame_done();
+
 			continue;
 		}
 
-		/* ...else accumulate bytes */
-		readed += l;
-		if (readed <= 6) 
-			continue;
+		n = min(len, mux->cur_len);
+		if (mux->cur && mux->cur_type == ARDUINO_FRAME_DATA) {
+			uloop_timeout_set(&mux->cur->timeout, bridge_timeout * 1000);
+			arduino_stream_data(mux->cur, buf, n, false);
+		}
+
+		ustream_consume(s, n);
+		mux->cur_len -= n;
+		if (!mux->cur_len)
+			arduino_mux_frame_done();
+	}
+}
+
+static void arduino_mux_state_cb(struct ustream *s) {
+	if ((s->eof || s->write_error) && mux && &mux->sfd.stream == s)
+		arduino_mux_close();
+}
+
+static bool arduino_mux_get(void) {
+	int fd;
+
+	if (mux)
+		return true;
+
+	fd = arduino_connect();
+	if (fd < 0)
+		return false;
+
+	mux = calloc(1, sizeof(*mux));
+	if (!mux) {
+		close(fd);
+		return false;
+	}
+
+	INIT_LIST_HEAD(&mux->streams);
+	mux->next_id = 1;
+	mux->sfd.stream.notify_read = arduino_mux_read_cb;
+	mux->sfd.stream.notify_state = arduino_mux_state_cb;
+	ustream_fd_init(&mux->sfd, fd);
+
+	return true;
+}
+
+static void arduino_stream_free(struct client *cl) {
+	struct arduino_stream *st = cl->dispatch.arduino.stream;
+	struct arduino_mux *m;
+
+	if (!st)
+		return;
+
+	m = st->mux;
+
+	cl->dispatch.arduino.stream = NULL;
+	uloop_timeout_cancel(&st->timeout);
+	list_del(&st->list);
+
+	if (m->cur == st)
+		m->cur = NULL;
+
+	if (m->blocked == st) {
+		m->blocked = NULL;
+		ustream_set_read_blocked(&m->sfd.stream, false);
+	}
+
+	/* tell the bridge to stop working on an abandoned request */
+	if (!st->ended && !m->dead)
+		arduino_mux_send(m, st->id, ARDUINO_FRAME_END, NULL, 0);
+
+	blob_buf_free(&st->resp.hdr);
+	free(st);
+}
+
+static void arduino_stream_close_fds(struct client *cl) {
+	if (mux)
+		close(mux->sfd.fd.fd);
+}
+
+static void arduino_stream_write_cb(struct client *cl) {
+	struct arduino_stream *st = cl->dispatch.arduino.stream;
+	struct arduino_mux *m;
+
+	if (!st)
+		return;
+
+	m = st->mux;
+	if (m->blocked != st ||
+	    ustream_pending_data(cl->us, true) > ARDUINO_MUX_MAX_PENDING)
+		return;
+
+	m->blocked = NULL;
+	ustream_set_read_blocked(&m->sfd.stream, false);
+	arduino_mux_read_cb(&m->sfd.stream, 0);
+}
+
+static void arduino_stream_timeout_cb(struct uloop_timeout *timeout) {
+	struct arduino_stream *st = container_of(timeout, struct arduino_stream, timeout);
+	struct client *cl = st->resp.cl;
+
+	/* only this stream is given up, the connection stays usable */
+	arduino_mux_send(st->mux, st->id, ARDUINO_FRAME_END, NULL, 0);
+	st->ended = true;
+
+	if (!st->resp.header_done)
+		uh_client_error(cl, 504, "Gateway Timeout",
+				"The bridge did not respond in time");
+	else
+		uh_request_done(cl);
+}
+
+static bool arduino_stream_start(struct client *cl, char *url) {
+	struct arduino_stream *st;
+
+	if (!arduino_mux_get())
+		return false;
+
+	st = calloc(1, sizeof(*st));
+	if (!st)
+		return false;
+
+	arduino_response_init(&st->resp, cl);
+	st->mux = mux;
+	st->id = mux->next_id++;
+	if (!mux->next_id)
+		mux->next_id = 1;
+
+	st->timeout.cb = arduino_stream_timeout_cb;
+	uloop_timeout_set(&st->timeout, bridge_timeout * 1000);
+	list_add_tail(&st->list, &mux->streams);
+
+	cl->dispatch.arduino.stream = st;
+	cl->dispatch.free = arduino_stream_free;
+	cl->dispatch.close_fds = arduino_stream_close_fds;
+	cl->dispatch.write_cb = arduino_stream_write_cb;
+
+	arduino_mux_send(mux, st->id, ARDUINO_FRAME_REQUEST, url, strlen(url));
+
+	return true;
+}
+
+static bool arduino_start_request(struct client *cl, char *url) {
+	if (!bridge_resolved) {
+		errno = EHOSTUNREACH;
+		return false;
+	}
+
+	/* Requested URL is sent without the prefix */
+	url += strlen(url_prefix);
+
+	if (bridge_framed)
+		return arduino_stream_start(cl, url);
 
-		/* When we have enough bytes check for an header */
-		if (memcmp("Status", buff, 6)) {
-			/* No header found, forge one, and send it before data */
-			printf("Status: 200\r\n\r\n");
-		} 
-		fwrite(buff, 1, readed, stdout);
-		readed = 0;
-		header_sent = true;
-	}
-	if (!header_sent) {
-		/* We fall here if the response is shortes than 6 bytes */
-		printf("Status: 200\r\n\r\n");
-		fwrite(buff, 1, readed, stdout);
-	}
-	fflush(stdout);
-	close(sockfd);
-	return;
-
-error_chatting:
-error_connect:
-	close(sockfd);
-error:
-	printf("Status: 500\r\n");
-	printf("\r\n");
-	printf("Couldn't connect to bridge:\r\n");
-	printf("%s\r\n", strerror(errno));
-	fflush(stdout);
+	return arduino_conn_start(cl, url);
 }
 
 enum arduino_hdr {
@@ -170,11 +778,11 @@ static void arduino_handle_request(struct client *cl, char *url, struct path_inf
 		/* Authorization required! */
 		return;
 
-	if (uh_create_process(cl, pi, url, arduino_main)) 
+	if (arduino_start_request(cl, url))
 		return;
 
 	uh_client_error(cl, 500, "Internal Server Error",
-			"Failed to process request: %s", strerror(errno));
+			"Couldn't connect to bridge: %s", strerror(errno));
 }
 
 static bool check_arduino_url(const char *url)
@@ -185,6 +793,7 @@ static bool check_arduino_url(const char *url)
 }
 
 struct dispatch_handler arduino_dispatch = {
+	.name = "arduino",
 	.script = true,
 	.check_url = check_arduino_url,
 	.handle_request = arduino_handle_request,
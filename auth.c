@@ -24,13 +24,138 @@
 #include <shadow.h>
 #endif
 #include "uhttpd.h"
+#include "trie.h"
+
+#define UH_AUTH_CACHE_SIZE	64
+#define UH_AUTH_CACHE_TTL	60
+
+struct auth_cache_entry {
+	uint64_t key;
+	const struct auth_realm *realm;
+	char *pass;
+	time_t expire;
+	bool valid;
+};
 
 static LIST_HEAD(auth_realms);
+static LIST_HEAD(retired_realms);
+
+/*
+ * Results of password verification, indexed by a seeded hash of the realm,
+ * user and presented password, so that repeated requests with the same
+ * credentials do not run crypt() every time. The hash only picks the slot,
+ * a cached result is used only if the stored password matches as well.
+ */
+static struct auth_cache_entry auth_cache[UH_AUTH_CACHE_SIZE];
+static uint64_t auth_cache_seed;
+
+static void uh_auth_cache_clear(struct auth_cache_entry *e)
+{
+	if (e->pass) {
+		memset(e->pass, 0, strlen(e->pass));
+		free(e->pass);
+	}
+
+	memset(e, 0, sizeof(*e));
+}
+
+static void uh_auth_cache_flush(void)
+{
+	int i;
+
+	for (i = 0; i < UH_AUTH_CACHE_SIZE; i++)
+		uh_auth_cache_clear(&auth_cache[i]);
+}
+
+/*
+ * The run time only depends on the length of the presented password, so a
+ * guess can't be refined by timing the comparison against a cached one.
+ */
+static bool uh_auth_pass_equal(const char *pass, const char *stored)
+{
+	size_t len = strlen(pass), stored_len = strlen(stored);
+	unsigned char diff = len != stored_len;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		diff |= pass[i] ^ (i < stored_len ? stored[i] : 0);
+
+	return !diff;
+}
+
+static uint64_t uh_auth_hash(uint64_t hash, const char *str)
+{
+	/* FNV-1a, including the terminating zero as separator */
+	do {
+		hash = (hash ^ (uint8_t) *str) * 0x100000001b3ULL;
+	} while (*str++);
+
+	return hash;
+}
+
+static time_t uh_auth_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static bool uh_auth_verify(const struct auth_realm *realm, const char *user, const char *pass)
+{
+	struct auth_cache_entry *e;
+	const char *hash;
+	uint64_t key;
+	time_t now;
+	bool valid;
+	int fd;
+
+	if (!auth_cache_seed) {
+		fd = open("/dev/urandom", O_RDONLY);
+		if (fd < 0 || read(fd, &auth_cache_seed, sizeof(auth_cache_seed)) <= 0)
+			auth_cache_seed = time(NULL) ^ ((uint64_t) getpid() << 32);
+		if (fd >= 0)
+			close(fd);
+		auth_cache_seed |= 1;
+	}
+
+	key = auth_cache_seed ^ 0xcbf29ce484222325ULL;
+	key = uh_auth_hash(key, realm->pass);
+	key = uh_auth_hash(key, user);
+	key = uh_auth_hash(key, pass);
+
+	now = uh_auth_time();
+	e = &auth_cache[key % UH_AUTH_CACHE_SIZE];
+	if (e->key == key && e->realm == realm && e->expire > now &&
+	    uh_auth_pass_equal(pass, e->pass))
+		return e->valid;
+
+	if (!strcmp(pass, realm->pass)) {
+		valid = true;
+	} else {
+		hash = crypt(pass, realm->pass);
+		valid = hash && !strcmp(hash, realm->pass);
+	}
+
+	uh_auth_cache_clear(e);
+	e->pass = strdup(pass);
+	if (!e->pass)
+		return valid;
+
+	e->key = key;
+	e->realm = realm;
+	e->valid = valid;
+	e->expire = now + UH_AUTH_CACHE_TTL;
+
+	return valid;
+}
 
 void uh_auth_add(const char *path, const char *user, const char *pass)
 {
 	struct auth_realm *new = NULL;
+	struct vhost *vh = uh_vhost_config();
 	struct passwd *pwd;
+	void **slot;
 	const char *new_pass = NULL;
 	char *dest_path, *dest_user, *dest_pass;
 
@@ -38,6 +163,9 @@ void uh_auth_add(const char *path, const char *user, const char *pass)
 	struct spwd *spwd;
 #endif
 
+	if (!vh)
+		return;
+
 	/* given password refers to a passwd entry */
 	if ((strlen(pass) > 3) && !strncmp(pass, "$p$", 3)) {
 #ifdef HAVE_SHADOW
@@ -70,7 +198,44 @@ void uh_auth_add(const char *path, const char *user, const char *pass)
 	new->path = strcpy(dest_path, path);
 	new->user = strcpy(dest_user, user);
 	new->pass = strcpy(dest_pass, new_pass);
+
+	/* realms for the same path are chained, newest first */
+	slot = uh_trie_insert(&vh->realm_trie, new->path);
+	if (!slot) {
+		free(new);
+		return;
+	}
+
+	new->next = *slot;
+	*slot = new;
 	list_add(&new->list, &auth_realms);
+	uh_auth_cache_flush();
+}
+
+void uh_auth_reset(void)
+{
+	struct auth_realm *realm, *tmp;
+
+	/* queued script requests may still refer to their realm for
+	 * REMOTE_USER, only free old realms once the queue has drained */
+	list_for_each_entry_safe(realm, tmp, &auth_realms, list)
+		list_move_tail(&realm->list, &retired_realms);
+
+	if (!script_stats.queued) {
+		list_for_each_entry_safe(realm, tmp, &retired_realms, list) {
+			list_del(&realm->list);
+			free(realm);
+		}
+	}
+
+	uh_trie_free(&default_vhost.realm_trie);
+	uh_auth_cache_flush();
+}
+
+/* the realms themselves are retired along with all others by uh_auth_reset */
+void uh_auth_free(struct vhost *vh)
+{
+	uh_trie_free(&vh->realm_trie);
 }
 
 bool uh_auth_check(struct client *cl, struct path_info *pi)
@@ -80,7 +245,6 @@ bool uh_auth_check(struct client *cl, struct path_info *pi)
 	bool user_match = false;
 	char *user = NULL;
 	char *pass = NULL;
-	int plen;
 
 	if (pi->auth && !strncasecmp(pi->auth, "Basic ", 6)) {
 		const char *auth = pi->auth + 6;
@@ -94,16 +258,8 @@ bool uh_auth_check(struct client *cl, struct path_info *pi)
 	}
 
 	req->realm = NULL;
-	plen = strlen(pi->name);
-	list_for_each_entry(realm, &auth_realms, list) {
-		int rlen = strlen(realm->path);
-
-		if (plen < rlen)
-			continue;
-
-		if (strncasecmp(pi->name, realm->path, rlen) != 0)
-			continue;
-
+	realm = uh_trie_match(&uh_client_vhost(cl)->realm_trie, pi->name, false, NULL);
+	for (; realm; realm = realm->next) {
 		req->realm = realm;
 		if (!user)
 			break;
@@ -118,9 +274,7 @@ bool uh_auth_check(struct client *cl, struct path_info *pi)
 	if (!req->realm)
 		return true;
 
-	if (user_match &&
-	    (!strcmp(pass, realm->pass) ||
-	     !strcmp(crypt(pass, realm->pass), realm->pass)))
+	if (user_match && uh_auth_verify(realm, user, pass))
 		return true;
 
 	uh_http_header(cl, 401, "Authorization Required");
@@ -0,0 +1,338 @@
+/*
+ * uhttpd - Tiny single-threaded httpd
+ *
+ *   Copyright (C) 2010-2013 Jo-Philipp Wich <xm@subsignal.org>
+ *   Copyright (C) 2013 Felix Fietkau <nbd@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Stand-in for the Arduino Yun bridge used by the benchmark scenarios.
+ * It speaks both the legacy protocol (URL line, response until close) and
+ * the framed one, which is detected from the first byte of a connection:
+ * a frame header starts with the high byte of its length, which is always
+ * zero, while a URL never does.
+ *
+ *   /echo/<text>	200 response carrying <text>
+ *   /delay/<ms>	200 response sent after <ms> milliseconds
+ *   /size/<bytes>	200 response of <bytes> bytes, split into DATA frames
+ *
+ * Anything else gets a 404.
+ */
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libubox/uloop.h>
+#include <libubox/usock.h>
+#include <libubox/ustream.h>
+#include <libubox/utils.h>
+
+#define STUB_FRAME_HDR_LEN	9
+#define STUB_FRAME_MAX		65536
+#define STUB_DATA_LEN		16384
+
+enum stub_frame_type {
+	STUB_FRAME_REQUEST = 1,
+	STUB_FRAME_DATA = 2,
+	STUB_FRAME_END = 3,
+};
+
+struct stub_conn {
+	struct ustream_fd sfd;
+	struct list_head jobs;
+	bool sniffed;
+	bool framed;
+	bool closing;
+};
+
+struct stub_job {
+	struct list_head list;
+	struct uloop_timeout timeout;
+	struct stub_conn *c;
+	uint32_t id;
+	char url[];
+};
+
+static struct uloop_fd server;
+
+static void stub_conn_free(struct stub_conn *c)
+{
+	struct stub_job *j, *tmp;
+
+	list_for_each_entry_safe(j, tmp, &c->jobs, list) {
+		uloop_timeout_cancel(&j->timeout);
+		list_del(&j->list);
+		free(j);
+	}
+
+	ustream_free(&c->sfd.stream);
+	close(c->sfd.fd.fd);
+	free(c);
+}
+
+static void stub_send(struct stub_conn *c, uint32_t id, uint8_t type,
+		      const char *data, int len)
+{
+	uint8_t hdr[STUB_FRAME_HDR_LEN];
+	uint32_t val;
+
+	if (!c->framed) {
+		ustream_write(&c->sfd.stream, data, len, false);
+		return;
+	}
+
+	val = htonl(len);
+	memcpy(&hdr[0], &val, 4);
+	val = htonl(id);
+	memcpy(&hdr[4], &val, 4);
+	hdr[8] = type;
+
+	ustream_write(&c->sfd.stream, (char *) hdr, sizeof(hdr), true);
+	if (len)
+		ustream_write(&c->sfd.stream, data, len, false);
+}
+
+/* a NULL body is replaced by len bytes of filler */
+static void stub_respond(struct stub_conn *c, uint32_t id, int code,
+			 const char *body, long len)
+{
+	static char fill[STUB_DATA_LEN];
+	char hdr[128];
+	long n;
+
+	n = snprintf(hdr, sizeof(hdr),
+		     "Status: %d %s\r\nContent-Type: text/plain\r\n\r\n",
+		     code, code == 200 ? "OK" : "Not Found");
+	stub_send(c, id, STUB_FRAME_DATA, hdr, n);
+
+	if (!body && !fill[0])
+		memset(fill, 'x', sizeof(fill));
+
+	while (len > 0) {
+		n = len < STUB_DATA_LEN ? len : STUB_DATA_LEN;
+		stub_send(c, id, STUB_FRAME_DATA, body ? body : fill, n);
+		if (body)
+			body += n;
+		len -= n;
+	}
+
+	if (c->framed) {
+		stub_send(c, id, STUB_FRAME_END, NULL, 0);
+		return;
+	}
+
+	/* the legacy protocol ends a response by closing the connection */
+	c->closing = true;
+	ustream_state_change(&c->sfd.stream);
+}
+
+static void stub_job_run(struct stub_job *j)
+{
+	struct stub_conn *c = j->c;
+	char *url = j->url;
+
+	list_del(&j->list);
+
+	if (!strncmp(url, "/echo/", 6))
+		stub_respond(c, j->id, 200, url + 6, strlen(url + 6));
+	else if (!strncmp(url, "/delay/", 7))
+		stub_respond(c, j->id, 200, "delayed\n", 8);
+	else if (!strncmp(url, "/size/", 6))
+		stub_respond(c, j->id, 200, NULL, atol(url + 6));
+	else
+		stub_respond(c, j->id, 404, "Not Found\n", 10);
+
+	free(j);
+}
+
+static void stub_job_timeout_cb(struct uloop_timeout *t)
+{
+	stub_job_run(container_of(t, struct stub_job, timeout));
+}
+
+static void stub_job_add(struct stub_conn *c, uint32_t id, const char *url, int len)
+{
+	struct stub_job *j;
+
+	j = calloc(1, sizeof(*j) + len + 1);
+	if (!j)
+		return;
+
+	j->c = c;
+	j->id = id;
+	memcpy(j->url, url, len);
+	list_add_tail(&j->list, &c->jobs);
+
+	if (!strncmp(j->url, "/delay/", 7)) {
+		j->timeout.cb = stub_job_timeout_cb;
+		uloop_timeout_set(&j->timeout, atoi(j->url + 7));
+		return;
+	}
+
+	stub_job_run(j);
+}
+
+static void stub_job_cancel(struct stub_conn *c, uint32_t id)
+{
+	struct stub_job *j;
+
+	list_for_each_entry(j, &c->jobs, list) {
+		if (j->id != id)
+			continue;
+
+		uloop_timeout_cancel(&j->timeout);
+		list_del(&j->list);
+		free(j);
+		return;
+	}
+}
+
+/* returns the number of bytes used, 0 if the frame is incomplete */
+static int stub_read_frame(struct stub_conn *c, char *buf, int len)
+{
+	uint32_t flen, id;
+
+	if (len < STUB_FRAME_HDR_LEN)
+		return 0;
+
+	memcpy(&flen, buf, 4);
+	memcpy(&id, buf + 4, 4);
+	flen = ntohl(flen);
+	id = ntohl(id);
+
+	if (flen > STUB_FRAME_MAX)
+		return -1;
+
+	if (len < STUB_FRAME_HDR_LEN + flen)
+		return 0;
+
+	switch (buf[8]) {
+	case STUB_FRAME_REQUEST:
+		stub_job_add(c, id, buf + STUB_FRAME_HDR_LEN, flen);
+		break;
+	case STUB_FRAME_END:
+		stub_job_cancel(c, id);
+		break;
+	}
+
+	return STUB_FRAME_HDR_LEN + flen;
+}
+
+static void stub_read_cb(struct ustream *s, int bytes)
+{
+	struct stub_conn *c = container_of(s, struct stub_conn, sfd.stream);
+	char *buf, *eol;
+	int len, n;
+
+	while (!c->closing) {
+		buf = ustream_get_read_buf(s, &len);
+		if (!buf || !len)
+			return;
+
+		if (!c->sniffed) {
+			c->sniffed = true;
+			c->framed = !buf[0];
+		}
+
+		if (!c->framed) {
+			eol = memchr(buf, '\n', len);
+			if (!eol)
+				return;
+
+			n = eol + 1 - buf;
+			if (eol > buf && eol[-1] == '\r')
+				eol--;
+
+			*eol = 0;
+			stub_job_add(c, 0, buf, eol - buf);
+			ustream_consume(s, n);
+			continue;
+		}
+
+		n = stub_read_frame(c, buf, len);
+		if (n < 0) {
+			c->closing = true;
+			ustream_state_change(s);
+			return;
+		}
+
+		if (!n)
+			return;
+
+		ustream_consume(s, n);
+	}
+}
+
+static void stub_write_cb(struct ustream *s, int bytes)
+{
+	struct stub_conn *c = container_of(s, struct stub_conn, sfd.stream);
+
+	if (c->closing && !ustream_pending_data(s, true))
+		ustream_state_change(s);
+}
+
+static void stub_state_cb(struct ustream *s)
+{
+	struct stub_conn *c = container_of(s, struct stub_conn, sfd.stream);
+
+	if (s->eof || s->write_error ||
+	    (c->closing && !ustream_pending_data(s, true)))
+		stub_conn_free(c);
+}
+
+static void stub_accept_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct stub_conn *c;
+	int sfd;
+
+	while ((sfd = accept(fd->fd, NULL, NULL)) >= 0) {
+		c = calloc(1, sizeof(*c));
+		if (!c) {
+			close(sfd);
+			continue;
+		}
+
+		INIT_LIST_HEAD(&c->jobs);
+		c->sfd.stream.notify_read = stub_read_cb;
+		c->sfd.stream.notify_write = stub_write_cb;
+		c->sfd.stream.notify_state = stub_state_cb;
+		ustream_fd_init(&c->sfd, sfd);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const char *port = argc > 1 ? argv[1] : "5555";
+
+	uloop_init();
+
+	server.cb = stub_accept_cb;
+	server.fd = usock(USOCK_TCP | USOCK_SERVER | USOCK_IPV4ONLY |
+			  USOCK_NUMERIC, "127.0.0.1", port);
+	if (server.fd < 0) {
+		fprintf(stderr, "Failed to listen on port %s\n", port);
+		return 1;
+	}
+
+	uloop_fd_add(&server, ULOOP_READ);
+	uloop_run();
+	uloop_done();
+
+	return 0;
+}
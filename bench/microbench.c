@@ -0,0 +1,312 @@
+/*
+ * uhttpd - Tiny single-threaded httpd
+ *
+ *   Copyright (C) 2010-2013 Jo-Philipp Wich <xm@subsignal.org>
+ *   Copyright (C) 2013 Felix Fietkau <nbd@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Microbenchmarks for the parser and lookup hot paths. client.c and file.c
+ * are compiled into this file so their static helpers can be called
+ * directly, the remaining modules are linked in as usual. Every benchmark
+ * works on a fixed corpus, so numbers are comparable between builds.
+ */
+
+#include "../client.c"
+#include "../file.c"
+
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLES	1
+#else
+#define HAVE_CYCLES	0
+#endif
+
+char uh_buf[4096];
+
+struct bench {
+	const char *name;
+	void (*run)(unsigned int i);
+};
+
+static volatile unsigned long bench_sink;
+static double bench_time = 0.5;
+
+static const char * const request_line =
+	"GET /cgi-bin/luci/admin/status/overview?status=1&_=0.4729 HTTP/1.1\r\n";
+
+static const char * const request_headers =
+	"GET /cgi-bin/luci/admin/status/overview?status=1&_=0.4729 HTTP/1.1\r\n"
+	"Host: 192.168.1.1\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+		"(KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+		"image/avif,image/webp,*/*;q=0.8\r\n"
+	"Accept-Encoding: gzip, deflate\r\n"
+	"Accept-Language: en-US,en;q=0.9\r\n"
+	"Referer: http://192.168.1.1/cgi-bin/luci/admin/status/overview\r\n"
+	"Cookie: sysauth=8b1c2f0e6a1d4e5f9a0b3c7d2e4f6a8b\r\n"
+	"Connection: keep-alive\r\n";
+
+static const char * const urls[] = {
+	"/index.html",
+	"/cgi-bin/luci/admin/network/wireless?tab=general%20settings",
+	"/luci-static/resources/view/status/include/10_system.js",
+	"/ubus/%7B%22jsonrpc%22%3A%222.0%22%2C%22method%22%3A%22call%22%7D",
+	"/files/My%20Documents/Caf%C3%A9%20M%C3%BCnchen%20%282023%29.pdf",
+};
+
+static const char * const paths[] = {
+	"/www/index.html",
+	"/www/./luci-static//resources/../resources/cbi.js",
+	"/www/cgi-bin/../luci-static/bootstrap/./cascade.css",
+	"/www//files/a/b/c/../../d/./e/../../../image.PNG",
+	"/www/files/archive.tar.unknown",
+};
+
+static const char * const headers[] = {
+	"Host: 192.168.1.1",
+	"Content-Type: application/x-www-form-urlencoded",
+	"Accept-Language:en-US,en;q=0.9",
+	"Cookie:    sysauth=8b1c2f0e6a1d4e5f9a0b3c7d2e4f6a8b",
+	"X-Requested-With: XMLHttpRequest",
+};
+
+static const char * const b64[] = {
+	"cm9vdDo=",
+	"cm9vdDpwYXNzd29yZA==",
+	"YWRtaW5pc3RyYXRvcjpjb3JyZWN0IGhvcnNlIGJhdHRlcnkgc3RhcGxl",
+	"dXNlcjp0aGlzIGlzIGEgcmF0aGVyIGxvbmcgcGFzc3dvcmQgd2l0aCBzcGFjZXMgaW4gaXQ=",
+};
+
+#define CORPUS_IDX(c, i)	((i) % ARRAY_SIZE(c))
+
+static struct client bench_cl;
+static struct ustream bench_us;
+
+static int bench_us_write(struct ustream *s, const char *buf, int len, bool more)
+{
+	return len;
+}
+
+static void bench_client_init(void)
+{
+	bench_us.write = bench_us_write;
+	bench_us.string_data = true;
+	ustream_init_defaults(&bench_us);
+
+	bench_cl.us = &bench_us;
+	bench_cl.state = CLIENT_STATE_INIT;
+}
+
+static void bench_client_feed(const char *data)
+{
+	int len = strlen(data), maxlen;
+	char *buf;
+
+	buf = ustream_reserve(&bench_us, len, &maxlen);
+	memcpy(buf, data, len);
+	ustream_fill_read(&bench_us, len);
+
+	uh_client_read_cb(&bench_cl);
+
+	/* the header block is left open, start over with the next request */
+	bench_sink += bench_cl.state + bench_cl.request.method;
+	bench_cl.state = CLIENT_STATE_INIT;
+}
+
+static void bench_parse_request(unsigned int i)
+{
+	bench_client_feed(request_line);
+}
+
+static void bench_parse_headers(unsigned int i)
+{
+	bench_client_feed(request_headers);
+}
+
+static void bench_urldecode(unsigned int i)
+{
+	const char *url = urls[CORPUS_IDX(urls, i)];
+	char buf[1024];
+
+	bench_sink += uh_urldecode(buf, sizeof(buf), url, strlen(url));
+}
+
+static void bench_urlencode(unsigned int i)
+{
+	const char *url = urls[CORPUS_IDX(urls, i)];
+	char buf[1024];
+
+	bench_sink += uh_urlencode(buf, sizeof(buf), url, strlen(url));
+}
+
+static void bench_b64decode(unsigned int i)
+{
+	const char *str = b64[CORPUS_IDX(b64, i)];
+	char buf[256];
+
+	bench_sink += uh_b64decode(buf, sizeof(buf), str, strlen(str));
+}
+
+static void bench_canonpath(unsigned int i)
+{
+	char buf[PATH_MAX];
+
+	bench_sink += (unsigned long) canonpath(paths[CORPUS_IDX(paths, i)], buf);
+}
+
+static void bench_mime_lookup(unsigned int i)
+{
+	bench_sink += (unsigned long) uh_file_mime_lookup(paths[CORPUS_IDX(paths, i)]);
+}
+
+static void bench_mktag(unsigned int i)
+{
+	struct stat s = {
+		.st_ino = 1234567 + i,
+		.st_size = 48213,
+		.st_mtime = 1700000000,
+	};
+	char buf[128];
+
+	bench_sink += (unsigned long) uh_file_mktag(&s, buf, sizeof(buf));
+}
+
+static void bench_split_header(unsigned int i)
+{
+	const char *hdr = headers[CORPUS_IDX(headers, i)];
+	char buf[256];
+
+	strcpy(buf, hdr);
+	bench_sink += (unsigned long) uh_split_header(buf);
+}
+
+static void bench_alias_transform(unsigned int i)
+{
+	char buf[1024];
+
+	bench_sink += uh_alias_transform(&default_vhost, urls[CORPUS_IDX(urls, i)], buf, sizeof(buf));
+}
+
+static const struct bench benches[] = {
+	{ "client_parse_request", bench_parse_request },
+	{ "client_parse_header", bench_parse_headers },
+	{ "uh_urldecode", bench_urldecode },
+	{ "uh_urlencode", bench_urlencode },
+	{ "uh_b64decode", bench_b64decode },
+	{ "canonpath", bench_canonpath },
+	{ "uh_file_mime_lookup", bench_mime_lookup },
+	{ "uh_file_mktag", bench_mktag },
+	{ "uh_split_header", bench_split_header },
+	{ "uh_alias_transform", bench_alias_transform },
+};
+
+static uint64_t bench_cycles(void)
+{
+#if HAVE_CYCLES
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void bench_run(const struct bench *b)
+{
+	unsigned long iter = 1000, n = 0, i;
+	uint64_t start, end, c_start, c_end;
+
+	/* warm up caches and branch predictors */
+	for (i = 0; i < iter; i++)
+		b->run(i);
+
+	start = uh_time_us();
+	c_start = bench_cycles();
+	do {
+		for (i = 0; i < iter; i++)
+			b->run(n + i);
+
+		n += iter;
+		end = uh_time_us();
+	} while (end - start < bench_time * 1e6);
+	c_end = bench_cycles();
+
+	printf("%-24s %12lu %10.1f", b->name, n, (end - start) * 1e3 / n);
+	if (HAVE_CYCLES)
+		printf(" %10.1f", (double) (c_end - c_start) / n);
+	printf("\n");
+}
+
+static int usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-t seconds] [benchmark ...]\n"
+		"\n"
+		"	-t seconds	Run time per benchmark, default 0.5\n"
+		"	-l		List available benchmarks\n"
+		"\n", name);
+
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	bool found;
+	int ch, i, j;
+
+	while ((ch = getopt(argc, argv, "t:l")) != -1) {
+		switch (ch) {
+		case 't':
+			bench_time = atof(optarg);
+			break;
+
+		case 'l':
+			for (i = 0; i < ARRAY_SIZE(benches); i++)
+				printf("%s\n", benches[i].name);
+			return 0;
+
+		default:
+			return usage(argv[0]);
+		}
+	}
+
+	if (bench_time <= 0)
+		return usage(argv[0]);
+
+	conf.http_keepalive = 20;
+	uh_alias_add("/luci-static/", "/www/static/%s");
+	uh_alias_add("/ubus", "/cgi-bin/ubus%s");
+	uh_alias_add("/files/My%20Documents/", "/mnt/share/%s");
+	bench_client_init();
+
+	printf("%-24s %12s %10s", "benchmark", "iterations", "ns/op");
+	if (HAVE_CYCLES)
+		printf(" %10s", "cycles/op");
+	printf("\n");
+
+	for (i = 0; i < ARRAY_SIZE(benches); i++) {
+		found = optind == argc;
+		for (j = optind; j < argc; j++)
+			if (!strcmp(argv[j], benches[i].name))
+				found = true;
+
+		if (found)
+			bench_run(&benches[i]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,223 @@
+#!/bin/sh
+#
+# Run the canned benchmark scenarios against a temporary uhttpd instance.
+# Results are printed as one JSON object per line.
+#
+# usage: run.sh <build-dir>
+#
+# BENCH_PORT, BENCH_CONCURRENCY and BENCH_REQUESTS override the defaults,
+# BENCH_TLS_CERT and BENCH_TLS_KEY enable the HTTPS scenario.
+#
+# If the stand-in TLS library was built, it replaces libustream-ssl and a
+# throwaway certificate is generated unless one was given. The script then
+# also checks that a second handshake resumes the session of the first one,
+# through the session cache, a session ticket and TLS 1.3 resumption, that
+# HTTP/2 is negotiated through ALPN, and that a file downloaded with kernel
+# TLS enabled arrives intact. Where the kernel has a tls module, the download
+# also has to have been offloaded, elsewhere it stays in userspace.
+#
+# The Arduino scenarios go through the framed bridge protocol to a local
+# stand-in bridge, the script fails if any of those requests do.
+
+BUILD=$(cd "${1:-.}" && pwd)
+PORT=${BENCH_PORT:-8088}
+TLS_PORT=$((PORT + 1))
+ARDUINO_PORT=$((PORT + 2))
+CONC=${BENCH_CONCURRENCY:-16}
+REQS=${BENCH_REQUESTS:-10000}
+BENCH="$BUILD/uhttpd-bench"
+TMP=$(mktemp -d)
+PIDS=""
+
+cleanup() {
+	[ -n "$PIDS" ] && kill $PIDS 2>/dev/null
+	wait 2>/dev/null
+	rm -rf "$TMP"
+}
+trap cleanup EXIT INT TERM
+
+export LD_LIBRARY_PATH="$BUILD${LD_LIBRARY_PATH:+:$LD_LIBRARY_PATH}"
+
+# docroot
+mkdir -p "$TMP/www/dir" "$TMP/www/cgi-bin"
+head -c 512 /dev/zero | tr '\0' 'x' > "$TMP/www/small.html"
+head -c 8388608 /dev/zero > "$TMP/www/large.bin"
+i=0
+while [ $i -lt 256 ]; do
+	: > "$TMP/www/dir/file-$i.txt"
+	i=$((i + 1))
+done
+
+cat > "$TMP/www/cgi-bin/echo" <<'CGI'
+#!/bin/sh
+printf 'Content-Type: text/plain\r\n\r\n'
+cat
+CGI
+chmod 755 "$TMP/www/cgi-bin/echo"
+
+cat > "$TMP/hello.lua" <<'LUA'
+function handle_request(env)
+	uhttpd.send("Status: 200 OK\r\nContent-Type: text/plain\r\n\r\nHello\n")
+end
+LUA
+
+ARGS="-f -h $TMP/www -p 127.0.0.1:$PORT -x /cgi-bin -n 8 -t 10"
+
+if [ -e "$BUILD/uhttpd_lua.so" ]; then
+	ARGS="$ARGS -l /lua -L $TMP/hello.lua"
+	HAVE_LUA=1
+fi
+
+if [ -e "$BUILD/uhttpd_ubus.so" ] && [ -x "$BUILD/uhttpd-bench-ubus" ] &&
+   command -v ubusd >/dev/null; then
+	ubusd -s "$TMP/ubus.sock" &
+	PIDS="$PIDS $!"
+	sleep 1
+	"$BUILD/uhttpd-bench-ubus" "$TMP/ubus.sock" &
+	PIDS="$PIDS $!"
+	ARGS="$ARGS -u /ubus -U $TMP/ubus.sock -a"
+	HAVE_UBUS=1
+fi
+
+if [ -x "$BUILD/uhttpd-bench-arduino" ]; then
+	"$BUILD/uhttpd-bench-arduino" "$ARDUINO_PORT" &
+	PIDS="$PIDS $!"
+	echo "Y:/arduino:127.0.0.1:$ARDUINO_PORT:5:framed" > "$TMP/httpd.conf"
+	ARGS="$ARGS -c $TMP/httpd.conf"
+	HAVE_ARDUINO=1
+fi
+
+if [ -e "$BUILD/tls-stub/libustream-ssl.so" ] && command -v openssl >/dev/null; then
+	export LD_LIBRARY_PATH="$BUILD/tls-stub:$LD_LIBRARY_PATH"
+	if [ -z "$BENCH_TLS_CERT" ] || [ -z "$BENCH_TLS_KEY" ]; then
+		BENCH_TLS_CERT="$TMP/crt.pem"
+		BENCH_TLS_KEY="$TMP/key.pem"
+		openssl req -x509 -newkey rsa:2048 -nodes -subj /CN=localhost -days 1 \
+			-keyout "$BENCH_TLS_KEY" -out "$BENCH_TLS_CERT" 2>/dev/null
+	fi
+	head -c 3000000 /dev/urandom | base64 > "$TMP/www/random.txt"
+	ARGS="$ARGS -2 -Y -X /status"
+	HAVE_TLS_STUB=1
+fi
+
+if [ -n "$BENCH_TLS_CERT" ] && [ -n "$BENCH_TLS_KEY" ]; then
+	ARGS="$ARGS -s 127.0.0.1:$TLS_PORT -C $BENCH_TLS_CERT -K $BENCH_TLS_KEY"
+	HAVE_TLS=1
+fi
+
+"$BUILD/uhttpd" $ARGS &
+PIDS="$PIDS $!"
+
+i=0
+until "$BENCH" -n 1 "http://127.0.0.1:$PORT/small.html" >/dev/null 2>&1; do
+	i=$((i + 1))
+	if [ $i -gt 50 ]; then
+		echo "uhttpd did not come up" >&2
+		exit 1
+	fi
+	sleep 0.1
+done
+
+URL="http://127.0.0.1:$PORT"
+
+# the bridge stub only answers 200 if the request made it through intact
+arduino() {
+	res=$("$BENCH" -k -c "$CONC" "$@")
+	echo "$res"
+	case "$res" in
+	*'"errors":0,"non_2xx":0,'*) ;;
+	*) echo "bridge requests failed: $*" >&2; FAILED=1 ;;
+	esac
+}
+
+# the ALPN answer has to be the first protocol both sides support
+tls_alpn() {
+	name=$1
+	want=$2
+	shift 2
+	got=$(echo | openssl s_client -connect "127.0.0.1:$TLS_PORT" "$@" 2>/dev/null |
+		sed -n 's/^ALPN protocol: //p')
+	echo "{\"scenario\":\"$name\",\"alpn\":\"${got:-none}\"}"
+	[ "${got:-none}" = "$want" ] || FAILED=1
+}
+
+# fetch over TLS 1.2, the only version the stand-in library offloads
+tls_get() {
+	printf 'GET %s HTTP/1.0\r\n\r\n' "$1" |
+		openssl s_client -connect "127.0.0.1:$TLS_PORT" -tls1_2 -quiet \
+		-ign_eof 2>/dev/null | sed '1,/^\r$/d'
+}
+
+tls_offload() {
+	before=$(tls_get /status | sed -n 's/^tls_offloaded: //p')
+	if tls_get /random.txt | cmp -s - "$TMP/www/random.txt"; then
+		intact=true
+	else
+		intact=false
+		FAILED=1
+	fi
+	after=$(tls_get /status | sed -n 's/^tls_offloaded: //p')
+	offloaded=$((after - before))
+	echo "{\"scenario\":\"tls-offload\",\"intact\":$intact,\"offloaded\":$offloaded}"
+
+	# the tls module is loaded on demand, by the download above
+	grep -qw tls /proc/sys/net/ipv4/tcp_available_ulp 2>/dev/null &&
+		[ "$offloaded" -eq 0 ] && FAILED=1
+}
+
+# connect twice, the second handshake has to resume the first session
+tls_resume() {
+	name=$1
+	shift
+	rm -f "$TMP/tls.sess"
+	# wait for the response, TLS 1.3 tickets only arrive after the handshake
+	printf 'HEAD /small.html HTTP/1.0\r\n\r\n' |
+		openssl s_client -connect "127.0.0.1:$TLS_PORT" -ign_eof "$@" \
+		-sess_out "$TMP/tls.sess" >/dev/null 2>&1
+	if printf 'HEAD /small.html HTTP/1.0\r\n\r\n' |
+		openssl s_client -connect "127.0.0.1:$TLS_PORT" -ign_eof "$@" \
+		-sess_in "$TMP/tls.sess" 2>/dev/null | grep -q '^Reused,'; then
+		echo "{\"scenario\":\"$name\",\"resumed\":true}"
+	else
+		echo "{\"scenario\":\"$name\",\"resumed\":false}"
+		FAILED=1
+	fi
+}
+
+"$BENCH" -N static-small -k -c "$CONC" -n "$REQS" "$URL/small.html"
+"$BENCH" -N static-small-close -c "$CONC" -n "$REQS" "$URL/small.html"
+"$BENCH" -N static-small-pipelined -P 8 -c "$CONC" -n "$REQS" "$URL/small.html"
+"$BENCH" -N static-large -k -c 4 -n 200 "$URL/large.bin"
+"$BENCH" -N dirlist -k -c "$CONC" -n $((REQS / 10)) "$URL/dir/"
+"$BENCH" -N cgi-echo -k -c "$CONC" -n $((REQS / 10)) -b 1024 "$URL/cgi-bin/echo"
+
+[ -n "$HAVE_LUA" ] &&
+	"$BENCH" -N lua-hello -k -c "$CONC" -n "$REQS" "$URL/lua"
+
+if [ -n "$HAVE_UBUS" ]; then
+	printf '%s' '{"jsonrpc":"2.0","id":1,"method":"call","params":["00000000000000000000000000000000","bench","echo",{"msg":"hello"}]}' \
+		> "$TMP/ubus.json"
+	"$BENCH" -N ubus-echo -k -c "$CONC" -n "$REQS" -b "@$TMP/ubus.json" \
+		-H "Content-Type: application/json" "$URL/ubus"
+fi
+
+if [ -n "$HAVE_ARDUINO" ]; then
+	arduino -N arduino-echo -n "$REQS" "$URL/arduino/echo/hello"
+	arduino -N arduino-delay -n $((REQS / 10)) "$URL/arduino/delay/10"
+	arduino -N arduino-large -n $((REQS / 10)) "$URL/arduino/size/262144"
+fi
+
+[ -n "$HAVE_TLS" ] &&
+	"$BENCH" -N https-small -k -c "$CONC" -n "$REQS" "https://127.0.0.1:$TLS_PORT/small.html"
+
+if [ -n "$HAVE_TLS_STUB" ]; then
+	tls_resume tls-resume-cache -tls1_2 -no_ticket
+	tls_resume tls-resume-ticket -tls1_2
+	tls_resume tls-resume-tls13 -tls1_3
+	tls_alpn tls-alpn-h2 h2 -alpn h2,http/1.1
+	tls_alpn tls-alpn-http11 http/1.1 -alpn http/1.1
+	tls_alpn tls-alpn-none none -alpn spdy/3
+	tls_offload
+fi
+
+[ -z "$FAILED" ]
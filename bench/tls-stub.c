@@ -0,0 +1,787 @@
+/*
+ * uhttpd - Tiny single-threaded httpd
+ *
+ *   Copyright (C) 2010-2013 Jo-Philipp Wich <xm@subsignal.org>
+ *   Copyright (C) 2013 Felix Fietkau <nbd@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Stand-in libustream-ssl on top of OpenSSL for the benchmark scenarios.
+ * Besides the regular ustream_ssl_ops it implements the optional entry
+ * points of ustream-ssl-ext.h, so the TLS features which depend on them
+ * can be exercised without a patched ustream-ssl.
+ *
+ * Session caching and tickets are off until uhttpd turns them on, so a
+ * resumed session shows that the extension calls took effect. The keys
+ * for kernel TLS are only exported for TLS 1.2 with AES-GCM, before any
+ * application data was sent, other connections stay in userspace.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef linux
+#include <linux/tls.h>
+#endif
+
+#include <openssl/bio.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+#include <libubox/ustream.h>
+#include <libubox/ustream-ssl.h>
+
+#include "../ustream-ssl-ext.h"
+
+#define STUB_TICKET_KEY_LEN	48
+
+/* per connection flags, kept in the app data of the SSL object */
+#define STUB_DATA_SENT		(1 << 0)
+#define STUB_TX_OFFLOAD		(1 << 1)
+
+struct ustream_ssl_ctx {
+	SSL_CTX *ssl;
+	bool server;
+
+	uint8_t *alpn;
+	unsigned int alpn_len;
+
+	uint8_t *ticket_keys;
+	int n_ticket_keys;
+};
+
+enum {
+	STUB_SSL_OK = 0,
+	STUB_SSL_PENDING = -1,
+	STUB_SSL_ERROR = -2,
+};
+
+static BIO_METHOD *stub_bio_method;
+
+static unsigned long stub_flags(struct ustream_ssl *us)
+{
+	return (uintptr_t) SSL_get_app_data(us->ssl);
+}
+
+static void stub_set_flags(struct ustream_ssl *us, unsigned long flags)
+{
+	SSL_set_app_data(us->ssl, (void *) (uintptr_t) (stub_flags(us) | flags));
+}
+
+static int stub_bio_write(BIO *b, const char *buf, int len)
+{
+	struct ustream *s = BIO_get_data(b);
+
+	BIO_clear_retry_flags(b);
+	if (s->write_error)
+		return -1;
+
+	return ustream_write(s, buf, len, false);
+}
+
+static int stub_bio_read(BIO *b, char *buf, int len)
+{
+	struct ustream *s = BIO_get_data(b);
+	char *data;
+	int avail;
+
+	BIO_clear_retry_flags(b);
+	data = ustream_get_read_buf(s, &avail);
+	if (!data || !avail) {
+		if (s->eof)
+			return 0;
+
+		BIO_set_retry_read(b);
+		return -1;
+	}
+
+	if (len > avail)
+		len = avail;
+
+	memcpy(buf, data, len);
+	ustream_consume(s, len);
+
+	return len;
+}
+
+static int stub_bio_puts(BIO *b, const char *str)
+{
+	return stub_bio_write(b, str, strlen(str));
+}
+
+static long stub_bio_ctrl(BIO *b, int cmd, long num, void *ptr)
+{
+	struct ustream *s = BIO_get_data(b);
+
+	switch (cmd) {
+	case BIO_CTRL_FLUSH:
+		return 1;
+	case BIO_CTRL_EOF:
+		return s->eof;
+	default:
+		return 0;
+	}
+}
+
+static int stub_bio_create(BIO *b)
+{
+	BIO_set_init(b, 1);
+	return 1;
+}
+
+static int stub_bio_destroy(BIO *b)
+{
+	BIO_set_data(b, NULL);
+	return 1;
+}
+
+static BIO *stub_bio_new(struct ustream *s)
+{
+	BIO *b;
+
+	if (!stub_bio_method) {
+		stub_bio_method = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK,
+					       "ustream");
+		if (!stub_bio_method)
+			return NULL;
+
+		BIO_meth_set_write(stub_bio_method, stub_bio_write);
+		BIO_meth_set_read(stub_bio_method, stub_bio_read);
+		BIO_meth_set_puts(stub_bio_method, stub_bio_puts);
+		BIO_meth_set_ctrl(stub_bio_method, stub_bio_ctrl);
+		BIO_meth_set_create(stub_bio_method, stub_bio_create);
+		BIO_meth_set_destroy(stub_bio_method, stub_bio_destroy);
+	}
+
+	b = BIO_new(stub_bio_method);
+	if (b)
+		BIO_set_data(b, s);
+
+	return b;
+}
+
+static void stub_error(struct ustream_ssl *us, int error)
+{
+	us->error = error;
+	uloop_timeout_set(&us->error_timer, 0);
+}
+
+static void stub_error_cb(struct uloop_timeout *t)
+{
+	struct ustream_ssl *us = container_of(t, struct ustream_ssl, error_timer);
+	char buf[128];
+
+	ERR_error_string_n(us->error, buf, sizeof(buf));
+	if (us->notify_error)
+		us->notify_error(us, us->error, buf);
+
+	us->stream.write_error = true;
+	ustream_state_change(&us->stream);
+}
+
+static int stub_ssl_result(struct ustream_ssl *us, int ret)
+{
+	int err = SSL_get_error(us->ssl, ret);
+
+	switch (err) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		return STUB_SSL_PENDING;
+	case SSL_ERROR_ZERO_RETURN:
+		return 0;
+	default:
+		stub_error(us, ERR_peek_last_error() ? ERR_peek_last_error() : err);
+		ERR_clear_error();
+		return STUB_SSL_ERROR;
+	}
+}
+
+static void stub_check_conn(struct ustream_ssl *us)
+{
+	int ret;
+
+	if (us->connected || us->error)
+		return;
+
+	ret = SSL_do_handshake(us->ssl);
+	if (ret != 1) {
+		stub_ssl_result(us, ret);
+		return;
+	}
+
+	us->connected = true;
+	if (us->notify_connected)
+		us->notify_connected(us);
+
+	ustream_write_pending(&us->stream);
+}
+
+static bool stub_poll(struct ustream_ssl *us)
+{
+	bool more = false;
+	char *buf;
+	int len, ret;
+
+	stub_check_conn(us);
+	if (!us->connected || us->error)
+		return false;
+
+	while (1) {
+		len = 0;
+		buf = ustream_reserve(&us->stream, 1, &len);
+		if (!buf || !len)
+			break;
+
+		ret = SSL_read(us->ssl, buf, len);
+		if (ret <= 0)
+			ret = stub_ssl_result(us, ret);
+
+		switch (ret) {
+		case STUB_SSL_PENDING:
+			return more;
+		case STUB_SSL_ERROR:
+			return false;
+		case 0:
+			us->stream.eof = true;
+			ustream_state_change(&us->stream);
+			return false;
+		default:
+			ustream_fill_read(&us->stream, ret);
+			more = true;
+			break;
+		}
+	}
+
+	return more;
+}
+
+static void stub_conn_notify_read(struct ustream *s, int bytes)
+{
+	stub_poll(container_of(s->next, struct ustream_ssl, stream));
+}
+
+static void stub_conn_notify_write(struct ustream *s, int bytes)
+{
+	struct ustream_ssl *us = container_of(s->next, struct ustream_ssl, stream);
+
+	stub_check_conn(us);
+	ustream_write_pending(s->next);
+}
+
+static void stub_conn_notify_state(struct ustream *s)
+{
+	struct ustream_ssl *us = container_of(s->next, struct ustream_ssl, stream);
+
+	/* a close before the handshake finished leaves nothing to read */
+	if (s->eof && us->connected)
+		stub_poll(us);
+
+	s->next->write_error = true;
+	ustream_state_change(s->next);
+}
+
+static int stub_stream_write(struct ustream *s, const char *buf, int len, bool more)
+{
+	struct ustream_ssl *us = container_of(s, struct ustream_ssl, stream);
+	int ret;
+
+	if (!us->connected || us->error)
+		return 0;
+
+	/* let the connection drain first */
+	if (us->conn->w.data_bytes)
+		return 0;
+
+	/* the kernel builds the records */
+	if (stub_flags(us) & STUB_TX_OFFLOAD)
+		return ustream_write(us->conn, buf, len, more);
+
+	stub_set_flags(us, STUB_DATA_SENT);
+	ret = SSL_write(us->ssl, buf, len);
+	if (ret > 0)
+		return ret;
+
+	ret = stub_ssl_result(us, ret);
+	return ret == STUB_SSL_ERROR ? -1 : 0;
+}
+
+static void stub_stream_set_read_blocked(struct ustream *s)
+{
+	struct ustream_ssl *us = container_of(s, struct ustream_ssl, stream);
+
+	ustream_set_read_blocked(us->conn, !!s->read_blocked);
+}
+
+static bool stub_stream_poll(struct ustream *s)
+{
+	struct ustream_ssl *us = container_of(s, struct ustream_ssl, stream);
+	bool fd_poll;
+
+	fd_poll = ustream_poll(us->conn);
+	return stub_poll(us) || fd_poll;
+}
+
+static void stub_stream_free(struct ustream *s)
+{
+	struct ustream_ssl *us = container_of(s, struct ustream_ssl, stream);
+
+	if (us->conn) {
+		us->conn->next = NULL;
+		us->conn->notify_read = NULL;
+		us->conn->notify_write = NULL;
+		us->conn->notify_state = NULL;
+	}
+
+	uloop_timeout_cancel(&us->error_timer);
+	SSL_free(us->ssl);
+
+	us->ctx = NULL;
+	us->ssl = NULL;
+	us->conn = NULL;
+	us->connected = false;
+	us->error = 0;
+}
+
+static int stub_init(struct ustream_ssl *us, struct ustream *conn,
+		     struct ustream_ssl_ctx *ctx, bool server)
+{
+	struct ustream *s = &us->stream;
+	BIO *bio;
+	SSL *ssl;
+
+	ssl = SSL_new(ctx->ssl);
+	if (!ssl)
+		return -ENOMEM;
+
+	bio = stub_bio_new(conn);
+	if (!bio) {
+		SSL_free(ssl);
+		return -ENOMEM;
+	}
+
+	SSL_set_bio(ssl, bio, bio);
+	if (server)
+		SSL_set_accept_state(ssl);
+	else
+		SSL_set_connect_state(ssl);
+
+	us->error_timer.cb = stub_error_cb;
+	us->server = server;
+	us->conn = conn;
+	us->ctx = ctx;
+	us->ssl = ssl;
+
+	conn->next = s;
+	conn->notify_read = stub_conn_notify_read;
+	conn->notify_write = stub_conn_notify_write;
+	conn->notify_state = stub_conn_notify_state;
+
+	s->free = stub_stream_free;
+	s->write = stub_stream_write;
+	s->poll = stub_stream_poll;
+	s->set_read_blocked = stub_stream_set_read_blocked;
+	ustream_init_defaults(s);
+
+	/* a client speaks first */
+	if (!server)
+		stub_check_conn(us);
+
+	return 0;
+}
+
+static struct ustream_ssl_ctx *stub_context_new(bool server)
+{
+	struct ustream_ssl_ctx *ctx;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+
+	ctx->server = server;
+	ctx->ssl = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+	if (!ctx->ssl) {
+		free(ctx);
+		return NULL;
+	}
+
+	SSL_CTX_set_app_data(ctx->ssl, ctx);
+	SSL_CTX_set_min_proto_version(ctx->ssl, TLS1_2_VERSION);
+	SSL_CTX_set_options(ctx->ssl, SSL_OP_NO_COMPRESSION |
+			    SSL_OP_CIPHER_SERVER_PREFERENCE);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	SSL_CTX_set_options(ctx->ssl, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+#ifdef SSL_OP_NO_RENEGOTIATION
+	/* a new handshake would change the keys under an offloaded socket */
+	SSL_CTX_set_options(ctx->ssl, SSL_OP_NO_RENEGOTIATION);
+#endif
+	SSL_CTX_set_verify(ctx->ssl, SSL_VERIFY_NONE, NULL);
+
+	if (server) {
+		SSL_CTX_set_session_cache_mode(ctx->ssl, SSL_SESS_CACHE_OFF);
+		SSL_CTX_set_options(ctx->ssl, SSL_OP_NO_TICKET);
+		SSL_CTX_set_num_tickets(ctx->ssl, 0);
+	}
+
+	return ctx;
+}
+
+static int stub_context_set_crt_file(struct ustream_ssl_ctx *ctx, const char *file)
+{
+	if (SSL_CTX_use_certificate_chain_file(ctx->ssl, file) == 1 ||
+	    SSL_CTX_use_certificate_file(ctx->ssl, file, SSL_FILETYPE_ASN1) == 1)
+		return 0;
+
+	return -1;
+}
+
+static int stub_context_set_key_file(struct ustream_ssl_ctx *ctx, const char *file)
+{
+	if (SSL_CTX_use_PrivateKey_file(ctx->ssl, file, SSL_FILETYPE_PEM) == 1 ||
+	    SSL_CTX_use_PrivateKey_file(ctx->ssl, file, SSL_FILETYPE_ASN1) == 1)
+		return 0;
+
+	return -1;
+}
+
+static void stub_context_free(struct ustream_ssl_ctx *ctx)
+{
+	SSL_CTX_free(ctx->ssl);
+	free(ctx->alpn);
+	if (ctx->ticket_keys)
+		OPENSSL_cleanse(ctx->ticket_keys,
+				ctx->n_ticket_keys * STUB_TICKET_KEY_LEN);
+	free(ctx->ticket_keys);
+	free(ctx);
+}
+
+const struct ustream_ssl_ops ustream_ssl_ops = {
+	.context_new = stub_context_new,
+	.context_set_crt_file = stub_context_set_crt_file,
+	.context_set_key_file = stub_context_set_key_file,
+	.context_free = stub_context_free,
+	.init = stub_init,
+};
+
+int ustream_ssl_context_set_session_cache(struct ustream_ssl_ctx *ctx,
+					  int size, int timeout)
+{
+	static const unsigned char sid_ctx[] = "uhttpd";
+
+	if (!ctx->server)
+		return -1;
+
+	SSL_CTX_set_session_id_context(ctx->ssl, sid_ctx, sizeof(sid_ctx) - 1);
+	SSL_CTX_set_session_cache_mode(ctx->ssl, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(ctx->ssl, size);
+	SSL_CTX_set_timeout(ctx->ssl, timeout);
+
+	return 0;
+}
+
+/* returns the index of the key called name, -1 if there is none */
+static int stub_ticket_key_find(struct ustream_ssl_ctx *ctx, const unsigned char *name)
+{
+	int i;
+
+	for (i = 0; i < ctx->n_ticket_keys; i++)
+		if (!memcmp(ctx->ticket_keys + i * STUB_TICKET_KEY_LEN, name, 16))
+			return i;
+
+	return -1;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int stub_ticket_hmac_init(EVP_MAC_CTX *hctx, uint8_t *secret)
+{
+	OSSL_PARAM params[] = {
+		OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, secret, 16),
+		OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+		OSSL_PARAM_construct_end(),
+	};
+
+	return EVP_MAC_CTX_set_params(hctx, params);
+}
+#else
+static int stub_ticket_hmac_init(HMAC_CTX *hctx, uint8_t *secret)
+{
+	return HMAC_Init_ex(hctx, secret, 16, EVP_sha256(), NULL);
+}
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int stub_ticket_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+			  EVP_CIPHER_CTX *ectx, EVP_MAC_CTX *hctx, int enc)
+#else
+static int stub_ticket_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+			  EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc)
+#endif
+{
+	struct ustream_ssl_ctx *ctx = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+	uint8_t *key;
+	int idx;
+
+	if (enc) {
+		if (!ctx->n_ticket_keys || RAND_bytes(iv, 16) != 1)
+			return -1;
+
+		idx = 0;
+		key = ctx->ticket_keys;
+		memcpy(name, key, 16);
+		if (EVP_EncryptInit_ex(ectx, EVP_aes_128_cbc(), NULL, key + 32, iv) != 1)
+			return -1;
+	} else {
+		/* an unknown key means a full handshake, not an error */
+		idx = stub_ticket_key_find(ctx, name);
+		if (idx < 0)
+			return 0;
+
+		key = ctx->ticket_keys + idx * STUB_TICKET_KEY_LEN;
+		if (EVP_DecryptInit_ex(ectx, EVP_aes_128_cbc(), NULL, key + 32, iv) != 1)
+			return -1;
+	}
+
+	if (stub_ticket_hmac_init(hctx, key + 16) != 1)
+		return -1;
+
+	/* tickets of an older key are renewed with the current one */
+	return idx ? 2 : 1;
+}
+
+int ustream_ssl_context_set_ticket_keys(struct ustream_ssl_ctx *ctx,
+					const void *keys, int n_keys, int key_len)
+{
+	uint8_t *copy = NULL;
+
+	if (!ctx->server || n_keys < 0 ||
+	    (n_keys && key_len != STUB_TICKET_KEY_LEN))
+		return -1;
+
+	if (n_keys) {
+		copy = malloc(n_keys * STUB_TICKET_KEY_LEN);
+		if (!copy)
+			return -1;
+
+		memcpy(copy, keys, n_keys * STUB_TICKET_KEY_LEN);
+	}
+
+	if (ctx->ticket_keys)
+		OPENSSL_cleanse(ctx->ticket_keys,
+				ctx->n_ticket_keys * STUB_TICKET_KEY_LEN);
+	free(ctx->ticket_keys);
+	ctx->ticket_keys = copy;
+	ctx->n_ticket_keys = n_keys;
+
+	if (!n_keys) {
+		SSL_CTX_set_options(ctx->ssl, SSL_OP_NO_TICKET);
+		SSL_CTX_set_num_tickets(ctx->ssl, 0);
+		return 0;
+	}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx->ssl, stub_ticket_cb);
+#else
+	SSL_CTX_set_tlsext_ticket_key_cb(ctx->ssl, stub_ticket_cb);
+#endif
+	SSL_CTX_clear_options(ctx->ssl, SSL_OP_NO_TICKET);
+	SSL_CTX_set_num_tickets(ctx->ssl, 2);
+
+	return 0;
+}
+
+static int stub_alpn_select_cb(SSL *ssl, const unsigned char **out,
+			       unsigned char *outlen, const unsigned char *in,
+			       unsigned int inlen, void *arg)
+{
+	struct ustream_ssl_ctx *ctx = arg;
+	unsigned char *sel;
+
+	/* our list goes first, so the server preference wins */
+	if (SSL_select_next_proto(&sel, outlen, ctx->alpn, ctx->alpn_len,
+				  in, inlen) != OPENSSL_NPN_NEGOTIATED)
+		return SSL_TLSEXT_ERR_NOACK;
+
+	*out = sel;
+	return SSL_TLSEXT_ERR_OK;
+}
+
+int ustream_ssl_context_set_alpn(struct ustream_ssl_ctx *ctx, const char *protos)
+{
+	const char *p, *next;
+	uint8_t *wire, *w;
+	size_t len;
+
+	if (!ctx->server)
+		return -1;
+
+	/* "h2,http/1.1" becomes "\x02h2\x08http/1.1" */
+	wire = malloc(strlen(protos) + 1);
+	if (!wire)
+		return -1;
+
+	for (p = protos, w = wire; *p; p = next) {
+		next = strchrnul(p, ',');
+		len = next - p;
+		if (*next)
+			next++;
+
+		if (!len || len > 255) {
+			free(wire);
+			return -1;
+		}
+
+		*w++ = len;
+		memcpy(w, p, len);
+		w += len;
+	}
+
+	free(ctx->alpn);
+	ctx->alpn = wire;
+	ctx->alpn_len = w - wire;
+
+	SSL_CTX_set_alpn_select_cb(ctx->ssl, ctx->alpn_len ? stub_alpn_select_cb : NULL,
+				   ctx);
+
+	return 0;
+}
+
+bool ustream_ssl_session_reused(struct ustream_ssl *us)
+{
+	return us->ssl && SSL_session_reused(us->ssl);
+}
+
+#ifdef linux
+/* the TLS 1.2 key block: client key, server key, client salt, server salt */
+static int stub_key_block(SSL *ssl, const SSL_CIPHER *cipher, uint8_t *out, int len)
+{
+	static const char label[] = "key expansion";
+	uint8_t master[SSL_MAX_MASTER_KEY_LENGTH];
+	uint8_t seed[sizeof(label) - 1 + 2 * SSL3_RANDOM_SIZE];
+	size_t master_len, out_len = len;
+	EVP_PKEY_CTX *pctx;
+	int ret = -1;
+
+	master_len = SSL_SESSION_get_master_key(SSL_get_session(ssl), master,
+						sizeof(master));
+	memcpy(seed, label, sizeof(label) - 1);
+	SSL_get_server_random(ssl, seed + sizeof(label) - 1, SSL3_RANDOM_SIZE);
+	SSL_get_client_random(ssl, seed + sizeof(label) - 1 + SSL3_RANDOM_SIZE,
+			      SSL3_RANDOM_SIZE);
+
+	pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_TLS1_PRF, NULL);
+	if (pctx &&
+	    EVP_PKEY_derive_init(pctx) == 1 &&
+	    EVP_PKEY_CTX_set_tls1_prf_md(pctx, SSL_CIPHER_get_handshake_digest(cipher)) == 1 &&
+	    EVP_PKEY_CTX_set1_tls1_prf_secret(pctx, master, master_len) == 1 &&
+	    EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, seed, sizeof(seed)) == 1 &&
+	    EVP_PKEY_derive(pctx, out, &out_len) == 1)
+		ret = 0;
+
+	EVP_PKEY_CTX_free(pctx);
+	OPENSSL_cleanse(master, sizeof(master));
+
+	return ret;
+}
+#endif
+
+int ustream_ssl_get_tx_crypto_info(struct ustream_ssl *us, void *info, int len)
+{
+#ifdef linux
+	struct tls12_crypto_info_aes_gcm_128 *ci128 = info;
+	struct tls12_crypto_info_aes_gcm_256 *ci256 = info;
+	uint8_t kb[2 * TLS_CIPHER_AES_GCM_256_KEY_SIZE +
+		   2 * TLS_CIPHER_AES_GCM_256_SALT_SIZE];
+	const SSL_CIPHER *cipher;
+	const uint8_t *key, *salt;
+	int key_len, info_len;
+
+	if (!us->server || !us->connected || us->error ||
+	    SSL_version(us->ssl) != TLS1_2_VERSION)
+		return 0;
+
+	/* the sequence number is only known up to the first data record */
+	if (stub_flags(us) & STUB_DATA_SENT)
+		return 0;
+
+	cipher = SSL_get_current_cipher(us->ssl);
+	switch (cipher ? SSL_CIPHER_get_cipher_nid(cipher) : NID_undef) {
+	case NID_aes_128_gcm:
+		key_len = TLS_CIPHER_AES_GCM_128_KEY_SIZE;
+		info_len = sizeof(*ci128);
+		break;
+	case NID_aes_256_gcm:
+		key_len = TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+		info_len = sizeof(*ci256);
+		break;
+	default:
+		return 0;
+	}
+
+	if (len < info_len)
+		return -1;
+
+	if (stub_key_block(us->ssl, cipher, kb, 2 * (key_len + 4)))
+		return 0;
+
+	key = kb + key_len;
+	salt = kb + 2 * key_len + 4;
+
+	/*
+	 * Finished was record 0, so data starts at 1. The explicit nonce
+	 * starts there as well, like OpenSSL does it.
+	 */
+	memset(info, 0, info_len);
+	if (key_len == TLS_CIPHER_AES_GCM_128_KEY_SIZE) {
+		ci128->info.version = TLS_1_2_VERSION;
+		ci128->info.cipher_type = TLS_CIPHER_AES_GCM_128;
+		memcpy(ci128->key, key, key_len);
+		memcpy(ci128->salt, salt, sizeof(ci128->salt));
+		ci128->iv[sizeof(ci128->iv) - 1] = 1;
+		ci128->rec_seq[sizeof(ci128->rec_seq) - 1] = 1;
+	} else {
+		ci256->info.version = TLS_1_2_VERSION;
+		ci256->info.cipher_type = TLS_CIPHER_AES_GCM_256;
+		memcpy(ci256->key, key, key_len);
+		memcpy(ci256->salt, salt, sizeof(ci256->salt));
+		ci256->iv[sizeof(ci256->iv) - 1] = 1;
+		ci256->rec_seq[sizeof(ci256->rec_seq) - 1] = 1;
+	}
+
+	OPENSSL_cleanse(kb, sizeof(kb));
+
+	return info_len;
+#else
+	return 0;
+#endif
+}
+
+void ustream_ssl_set_tx_offload(struct ustream_ssl *us)
+{
+	stub_set_flags(us, STUB_TX_OFFLOAD);
+
+	/* alerts encrypted with the old state would corrupt the stream */
+	SSL_set0_wbio(us->ssl, BIO_new(BIO_s_null()));
+}
@@ -0,0 +1,97 @@
+/*
+ * uhttpd - Tiny single-threaded httpd
+ *
+ *   Copyright (C) 2010-2013 Jo-Philipp Wich <xm@subsignal.org>
+ *   Copyright (C) 2013 Felix Fietkau <nbd@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Minimal ubus daemon for the benchmark scenarios, provides a "bench"
+ * object whose "echo" method returns its "msg" argument.
+ */
+
+#include <stdio.h>
+
+#include <libubox/blobmsg.h>
+#include <libubox/uloop.h>
+#include <libubox/utils.h>
+#include <libubus.h>
+
+enum {
+	ECHO_MSG,
+	__ECHO_MAX
+};
+
+static const struct blobmsg_policy echo_policy[__ECHO_MAX] = {
+	[ECHO_MSG] = { .name = "msg", .type = BLOBMSG_TYPE_STRING },
+};
+
+static struct blob_buf b;
+
+static int bench_echo(struct ubus_context *ctx, struct ubus_object *obj,
+		      struct ubus_request_data *req, const char *method,
+		      struct blob_attr *msg)
+{
+	struct blob_attr *tb[__ECHO_MAX];
+
+	blobmsg_parse(echo_policy, __ECHO_MAX, tb, blob_data(msg), blob_len(msg));
+
+	blob_buf_init(&b, 0);
+	blobmsg_add_string(&b, "msg",
+		tb[ECHO_MSG] ? blobmsg_get_string(tb[ECHO_MSG]) : "");
+	ubus_send_reply(ctx, req, b.head);
+
+	return 0;
+}
+
+static const struct ubus_method bench_methods[] = {
+	UBUS_METHOD("echo", bench_echo, echo_policy),
+};
+
+static struct ubus_object_type bench_type =
+	UBUS_OBJECT_TYPE("bench", bench_methods);
+
+static struct ubus_object bench_object = {
+	.name = "bench",
+	.type = &bench_type,
+	.methods = bench_methods,
+	.n_methods = ARRAY_SIZE(bench_methods),
+};
+
+int main(int argc, char **argv)
+{
+	struct ubus_context *ctx;
+
+	uloop_init();
+
+	ctx = ubus_connect(argc > 1 ? argv[1] : NULL);
+	if (!ctx) {
+		fprintf(stderr, "Failed to connect to ubus\n");
+		return 1;
+	}
+
+	ubus_add_uloop(ctx);
+	if (ubus_add_object(ctx, &bench_object)) {
+		fprintf(stderr, "Failed to register the bench object\n");
+		return 1;
+	}
+
+	uloop_run();
+
+	ubus_free(ctx);
+	uloop_done();
+
+	return 0;
+}
@@ -0,0 +1,723 @@
+/*
+ * uhttpd - Tiny single-threaded httpd
+ *
+ *   Copyright (C) 2010-2013 Jo-Philipp Wich <xm@subsignal.org>
+ *   Copyright (C) 2013 Felix Fietkau <nbd@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * uhttpd-bench - HTTP load generator
+ *
+ * Opens a fixed number of connections and keeps each of them busy with up
+ * to a configurable number of pipelined requests. Every response latency
+ * is recorded, the summary is printed as a single JSON object.
+ */
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <dlfcn.h>
+
+#include <libubox/uloop.h>
+#include <libubox/ustream.h>
+#include <libubox/usock.h>
+#ifdef HAVE_TLS
+#include <libubox/ustream-ssl.h>
+#endif
+
+#define BENCH_MAX_PIPELINE	64
+
+enum resp_state {
+	RESP_HEADER,
+	RESP_BODY,
+	RESP_CHUNK_SIZE,
+	RESP_CHUNK_DATA,
+	RESP_CHUNK_END,
+	RESP_UNTIL_CLOSE,
+};
+
+struct bench_conn {
+	struct ustream_fd sfd;
+#ifdef HAVE_TLS
+	struct ustream_ssl ssl;
+#endif
+	struct ustream *us;
+	struct uloop_timeout reconnect;
+	bool connected;
+	bool closing;
+
+	uint64_t sent[BENCH_MAX_PIPELINE];
+	int head, n_sent;
+
+	enum resp_state state;
+	long long remaining;
+	int status;
+	bool close;
+};
+
+static struct {
+	const char *name;
+	const char *host;
+	const char *port;
+	const char *path;
+	const char *method;
+	bool tls;
+	bool keepalive;
+	int concurrency;
+	int pipeline;
+	long total;
+	int duration;
+	char *request;
+	int request_len;
+} opt = {
+	.name = "default",
+	.method = "GET",
+	.concurrency = 1,
+	.pipeline = 1,
+	.total = 1000,
+};
+
+static struct {
+	long issued;
+	long done;
+	long errors;
+	long non_2xx;
+	long outstanding;
+	unsigned long long bytes;
+	uint32_t *latency;
+	long n_latency, size_latency;
+	uint64_t start, end;
+	bool stop;
+} stats;
+
+static struct bench_conn *conns;
+
+#ifdef HAVE_TLS
+static struct ustream_ssl_ops *ssl_ops;
+static void *ssl_ctx;
+#endif
+
+static void conn_open(struct bench_conn *c);
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void bench_check_done(void)
+{
+	if (stats.stop && !stats.outstanding)
+		uloop_end();
+}
+
+static bool bench_may_issue(void)
+{
+	if (stats.stop)
+		return false;
+
+	if (!opt.duration && stats.issued >= opt.total) {
+		stats.stop = true;
+		return false;
+	}
+
+	return true;
+}
+
+static void record_latency(uint64_t usec)
+{
+	if (stats.n_latency == stats.size_latency) {
+		stats.size_latency = stats.size_latency ? stats.size_latency * 2 : 4096;
+		stats.latency = realloc(stats.latency,
+			stats.size_latency * sizeof(*stats.latency));
+		if (!stats.latency) {
+			perror("realloc()");
+			exit(1);
+		}
+	}
+
+	stats.latency[stats.n_latency++] = usec > UINT32_MAX ? UINT32_MAX : usec;
+}
+
+static void conn_fill(struct bench_conn *c)
+{
+	int depth = opt.keepalive ? opt.pipeline : 1;
+
+	while (c->n_sent < depth && bench_may_issue()) {
+		ustream_write(c->us, opt.request, opt.request_len, false);
+		c->sent[(c->head + c->n_sent) % BENCH_MAX_PIPELINE] = now_us();
+		c->n_sent++;
+		stats.issued++;
+		stats.outstanding++;
+	}
+}
+
+static struct bench_conn *conn_from_stream(struct ustream *s)
+{
+#ifdef HAVE_TLS
+	if (opt.tls)
+		return container_of(s, struct bench_conn, ssl.stream);
+#endif
+	return container_of(s, struct bench_conn, sfd.stream);
+}
+
+/* streams are not freed from their own callbacks, close from a timer */
+static void conn_schedule_close(struct bench_conn *c)
+{
+	c->closing = true;
+	uloop_timeout_set(&c->reconnect, 0);
+}
+
+static void conn_close(struct bench_conn *c)
+{
+	if (!c->connected)
+		return;
+
+	/* requests still in flight are lost */
+	stats.errors += c->n_sent;
+	stats.outstanding -= c->n_sent;
+	c->n_sent = 0;
+
+#ifdef HAVE_TLS
+	if (opt.tls)
+		ustream_free(&c->ssl.stream);
+#endif
+	ustream_free(&c->sfd.stream);
+	close(c->sfd.fd.fd);
+	c->connected = false;
+}
+
+static void conn_complete(struct bench_conn *c, int status)
+{
+	uint64_t sent = c->sent[c->head];
+
+	c->head = (c->head + 1) % BENCH_MAX_PIPELINE;
+	c->n_sent--;
+	stats.outstanding--;
+	stats.done++;
+	record_latency(now_us() - sent);
+
+	if (status < 200 || status > 399)
+		stats.non_2xx++;
+
+	c->state = RESP_HEADER;
+	if (c->close || !opt.keepalive)
+		conn_schedule_close(c);
+	else
+		conn_fill(c);
+
+	bench_check_done();
+}
+
+static bool header_value(const char *hdr, const char *name, const char *value)
+{
+	const char *p;
+	int len = strlen(name);
+
+	for (p = hdr; (p = strstr(p, "\r\n")) != NULL; ) {
+		p += 2;
+		if (strncasecmp(p, name, len) || p[len] != ':')
+			continue;
+
+		p += len + 1;
+		while (*p == ' ')
+			p++;
+
+		if (!value)
+			return true;
+
+		return !strncasecmp(p, value, strlen(value));
+	}
+
+	return false;
+}
+
+static long long header_number(const char *hdr, const char *name)
+{
+	const char *p;
+	int len = strlen(name);
+
+	for (p = hdr; (p = strstr(p, "\r\n")) != NULL; ) {
+		p += 2;
+		if (!strncasecmp(p, name, len) && p[len] == ':')
+			return strtoll(p + len + 1, NULL, 10);
+	}
+
+	return -1;
+}
+
+/* returns 1 once a header block has been consumed */
+static int conn_parse_header(struct bench_conn *c, char *buf, int len)
+{
+	int status;
+	char *end;
+	int minor;
+
+	end = strstr(buf, "\r\n\r\n");
+	if (!end)
+		return 0;
+
+	end[2] = 0;
+	/* anything in flight on this connection is counted as failed */
+	if (sscanf(buf, "HTTP/1.%d %d", &minor, &status) != 2)
+		return -1;
+
+	c->close = header_value(buf, "Connection", "close") ||
+		   (minor == 0 && !header_value(buf, "Connection", "keep-alive"));
+
+	if (!strcmp(opt.method, "HEAD") || status == 204 || status == 304 ||
+	    status < 200) {
+		c->remaining = 0;
+		c->state = RESP_BODY;
+	} else if (header_value(buf, "Transfer-Encoding", "chunked")) {
+		c->state = RESP_CHUNK_SIZE;
+	} else if ((c->remaining = header_number(buf, "Content-Length")) >= 0) {
+		c->state = RESP_BODY;
+	} else {
+		c->state = RESP_UNTIL_CLOSE;
+		c->close = true;
+	}
+
+	ustream_consume(c->us, end + 4 - buf);
+	c->status = status;
+	return 1;
+}
+
+static void conn_read_cb(struct ustream *s, int bytes)
+{
+	struct bench_conn *c = conn_from_stream(s);
+	char *buf, *eol;
+	int len, n;
+
+	stats.bytes += bytes;
+
+	while (!c->closing && c->n_sent > 0) {
+		buf = ustream_get_read_buf(s, &len);
+		if (!buf)
+			buf = "", len = 0;
+
+		switch (c->state) {
+		case RESP_HEADER:
+			n = conn_parse_header(c, buf, len);
+			if (n < 0) {
+				conn_schedule_close(c);
+				return;
+			}
+			if (!n)
+				return;
+			break;
+
+		case RESP_BODY:
+			n = c->remaining < len ? c->remaining : len;
+			ustream_consume(s, n);
+			c->remaining -= n;
+			if (c->remaining)
+				return;
+			conn_complete(c, c->status);
+			break;
+
+		case RESP_CHUNK_SIZE:
+			eol = len ? strstr(buf, "\r\n") : NULL;
+			if (!eol)
+				return;
+			c->remaining = strtoll(buf, NULL, 16);
+			ustream_consume(s, eol + 2 - buf);
+			c->state = c->remaining ? RESP_CHUNK_DATA : RESP_CHUNK_END;
+			c->remaining += 2;
+			break;
+
+		case RESP_CHUNK_DATA:
+			n = c->remaining < len ? c->remaining : len;
+			if (!n)
+				return;
+			ustream_consume(s, n);
+			c->remaining -= n;
+			if (!c->remaining)
+				c->state = RESP_CHUNK_SIZE;
+			break;
+
+		case RESP_CHUNK_END:
+			if (len < 2)
+				return;
+			ustream_consume(s, 2);
+			conn_complete(c, c->status);
+			break;
+
+		case RESP_UNTIL_CLOSE:
+			if (!len)
+				return;
+			ustream_consume(s, len);
+			break;
+		}
+	}
+}
+
+static void conn_notify_state(struct ustream *s)
+{
+	struct bench_conn *c = conn_from_stream(s);
+
+	if (!s->eof && !s->write_error)
+		return;
+
+	/* a response delimited by the connection close is complete now */
+	if (c->state == RESP_UNTIL_CLOSE && c->n_sent > 0 && !s->write_error) {
+		c->close = true;
+		conn_complete(c, c->status);
+		return;
+	}
+
+	conn_schedule_close(c);
+}
+
+static void conn_reconnect_cb(struct uloop_timeout *t)
+{
+	struct bench_conn *c = container_of(t, struct bench_conn, reconnect);
+
+	conn_close(c);
+
+	/* this may be what notices the request count was reached */
+	if (bench_may_issue())
+		conn_open(c);
+	else
+		bench_check_done();
+}
+
+static void conn_open(struct bench_conn *c)
+{
+	int fd;
+
+	fd = usock(USOCK_TCP | USOCK_NONBLOCK | USOCK_NUMERIC, opt.host, opt.port);
+	if (fd < 0) {
+		stats.errors++;
+		stats.stop = true;
+		bench_check_done();
+		return;
+	}
+
+	memset(&c->sfd, 0, sizeof(c->sfd));
+	c->us = &c->sfd.stream;
+	c->us->string_data = true;
+	c->us->notify_read = conn_read_cb;
+	c->us->notify_state = conn_notify_state;
+	ustream_fd_init(&c->sfd, fd);
+
+#ifdef HAVE_TLS
+	if (opt.tls) {
+		memset(&c->ssl, 0, sizeof(c->ssl));
+		c->us = &c->ssl.stream;
+		c->us->string_data = true;
+		c->us->notify_read = conn_read_cb;
+		c->us->notify_state = conn_notify_state;
+		ssl_ops->init(&c->ssl, &c->sfd.stream, ssl_ctx, false);
+	}
+#endif
+
+	c->connected = true;
+	c->closing = false;
+	c->head = 0;
+	c->n_sent = 0;
+	c->state = RESP_HEADER;
+	conn_fill(c);
+}
+
+static void bench_deadline_cb(struct uloop_timeout *t)
+{
+	stats.stop = true;
+	bench_check_done();
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+static uint32_t percentile(int permille)
+{
+	long idx;
+
+	if (!stats.n_latency)
+		return 0;
+
+	idx = (stats.n_latency * permille + 999) / 1000 - 1;
+	if (idx < 0)
+		idx = 0;
+
+	return stats.latency[idx];
+}
+
+static void bench_report(void)
+{
+	double secs = (stats.end - stats.start) / 1e6;
+
+	qsort(stats.latency, stats.n_latency, sizeof(*stats.latency), cmp_u32);
+
+	printf("{\"scenario\":\"%s\",\"method\":\"%s\",\"url\":\"%s://%s:%s%s\","
+	       "\"concurrency\":%d,\"pipeline\":%d,\"keepalive\":%s,"
+	       "\"requests\":%ld,\"errors\":%ld,\"non_2xx\":%ld,"
+	       "\"bytes\":%llu,\"duration_s\":%.3f,\"rps\":%.1f,"
+	       "\"throughput_mbit\":%.2f,\"latency_us\":{\"min\":%u,"
+	       "\"p50\":%u,\"p99\":%u,\"p999\":%u,\"max\":%u}}\n",
+	       opt.name, opt.method, opt.tls ? "https" : "http",
+	       opt.host, opt.port, opt.path,
+	       opt.concurrency, opt.keepalive ? opt.pipeline : 1,
+	       opt.keepalive ? "true" : "false",
+	       stats.done, stats.errors, stats.non_2xx,
+	       stats.bytes, secs, secs > 0 ? stats.done / secs : 0,
+	       secs > 0 ? stats.bytes * 8 / secs / 1e6 : 0,
+	       stats.n_latency ? stats.latency[0] : 0,
+	       percentile(500), percentile(990), percentile(999),
+	       stats.n_latency ? stats.latency[stats.n_latency - 1] : 0);
+}
+
+static int parse_url(char *url)
+{
+	char *p;
+
+	if (!strncmp(url, "https://", 8)) {
+		opt.tls = true;
+		url += 8;
+	} else if (!strncmp(url, "http://", 7)) {
+		url += 7;
+	} else {
+		return -1;
+	}
+
+	p = strchr(url, '/');
+	opt.path = p ? strdup(p) : "/";
+	if (p)
+		*p = 0;
+
+	opt.port = opt.tls ? "443" : "80";
+	if (*url == '[') {
+		opt.host = ++url;
+		p = strchr(url, ']');
+		if (!p)
+			return -1;
+		*p++ = 0;
+		if (*p == ':')
+			opt.port = p + 1;
+	} else {
+		opt.host = url;
+		p = strrchr(url, ':');
+		if (p) {
+			*p = 0;
+			opt.port = p + 1;
+		}
+	}
+
+	return 0;
+}
+
+static char *read_body(const char *arg, long *len)
+{
+	struct stat st;
+	char *body;
+	int fd;
+
+	/* "@file" sends the contents of a file, a number that many bytes */
+	if (arg[0] != '@') {
+		*len = atol(arg);
+		body = malloc(*len + 1);
+		if (body)
+			memset(body, 'x', *len);
+		return body;
+	}
+
+	fd = open(arg + 1, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st))
+		return NULL;
+
+	body = malloc(st.st_size + 1);
+	if (body && read(fd, body, st.st_size) != st.st_size) {
+		free(body);
+		body = NULL;
+	}
+
+	close(fd);
+	*len = st.st_size;
+	return body;
+}
+
+static int build_request(char **headers, int n_headers, const char *body, long body_len)
+{
+	FILE *f;
+	size_t size;
+	int i;
+
+	f = open_memstream(&opt.request, &size);
+	if (!f)
+		return -1;
+
+	fprintf(f, "%s %s HTTP/1.1\r\nHost: %s\r\n", opt.method, opt.path, opt.host);
+	if (!opt.keepalive)
+		fprintf(f, "Connection: close\r\n");
+	for (i = 0; i < n_headers; i++)
+		fprintf(f, "%s\r\n", headers[i]);
+	if (body)
+		fprintf(f, "Content-Length: %ld\r\n", body_len);
+	fprintf(f, "\r\n");
+	if (body)
+		fwrite(body, 1, body_len, f);
+	fclose(f);
+
+	opt.request_len = size;
+	return 0;
+}
+
+#ifdef HAVE_TLS
+static int init_tls(void)
+{
+	void *dlh;
+
+	dlh = dlopen("libustream-ssl.so", RTLD_LAZY | RTLD_LOCAL);
+	if (!dlh) {
+		fprintf(stderr, "Failed to load ustream-ssl library: %s\n", dlerror());
+		return -1;
+	}
+
+	ssl_ops = dlsym(dlh, "ustream_ssl_ops");
+	if (!ssl_ops)
+		return -1;
+
+	ssl_ctx = ssl_ops->context_new(false);
+	return ssl_ctx ? 0 : -1;
+}
+#endif
+
+static int usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options] http[s]://host[:port]/path\n"
+		"	-c count        Number of concurrent connections, default is 1\n"
+		"	-n count        Total number of requests, default is 1000\n"
+		"	-d seconds      Run for the given time instead of a request count\n"
+		"	-k              Use keep-alive connections\n"
+		"	-P depth        Pipeline up to depth requests per connection, implies -k\n"
+		"	-m method       Request method, default is GET\n"
+		"	-b size|@file   Send a request body of the given size or file contents\n"
+		"	-H header       Add a request header, multiple allowed\n"
+		"	-N name         Scenario name used in the report\n"
+		"\n", name);
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	static struct uloop_timeout deadline = {
+		.cb = bench_deadline_cb
+	};
+	char *headers[32];
+	int n_headers = 0;
+	char *body = NULL;
+	long body_len = 0;
+	int ch, i;
+
+	while ((ch = getopt(argc, argv, "c:n:d:kP:m:b:H:N:")) != -1) {
+		switch (ch) {
+		case 'c':
+			opt.concurrency = atoi(optarg);
+			break;
+		case 'n':
+			opt.total = atol(optarg);
+			break;
+		case 'd':
+			opt.duration = atoi(optarg);
+			break;
+		case 'k':
+			opt.keepalive = true;
+			break;
+		case 'P':
+			opt.pipeline = atoi(optarg);
+			opt.keepalive = true;
+			break;
+		case 'm':
+			opt.method = optarg;
+			break;
+		case 'b':
+			body = read_body(optarg, &body_len);
+			if (!body) {
+				fprintf(stderr, "Unable to read request body %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'H':
+			if (n_headers < 32)
+				headers[n_headers++] = optarg;
+			break;
+		case 'N':
+			opt.name = optarg;
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+
+	if (optind >= argc || parse_url(argv[optind]))
+		return usage(argv[0]);
+
+	if (opt.concurrency < 1 || opt.pipeline < 1 ||
+	    opt.pipeline > BENCH_MAX_PIPELINE)
+		return usage(argv[0]);
+
+	if (body && !strcmp(opt.method, "GET"))
+		opt.method = "POST";
+
+	if (build_request(headers, n_headers, body, body_len))
+		return 1;
+
+#ifdef HAVE_TLS
+	if (opt.tls && init_tls())
+		return 1;
+#else
+	if (opt.tls) {
+		fprintf(stderr, "TLS support not compiled\n");
+		return 1;
+	}
+#endif
+
+	conns = calloc(opt.concurrency, sizeof(*conns));
+	if (!conns)
+		return 1;
+
+	uloop_init();
+
+	if (opt.duration)
+		uloop_timeout_set(&deadline, opt.duration * 1000);
+
+	stats.start = now_us();
+	for (i = 0; i < opt.concurrency; i++) {
+		conns[i].reconnect.cb = conn_reconnect_cb;
+		conn_open(&conns[i]);
+	}
+
+	uloop_run();
+	stats.end = now_us();
+	uloop_done();
+
+	bench_report();
+
+	return stats.errors ? 2 : 0;
+}
@@ -0,0 +1,574 @@
+/*
+ * uhttpd - Tiny single-threaded httpd
+ *
+ *   Copyright (C) 2010-2013 Jo-Philipp Wich <xm@subsignal.org>
+ *   Copyright (C) 2013 Felix Fietkau <nbd@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <strings.h>
+
+#include <libubox/avl.h>
+#include <libubox/blobmsg.h>
+
+#include "uhttpd.h"
+
+/*
+ * Response cache for script handlers. Only GET responses are stored, and
+ * only if the script allows it with Cache-Control max-age or s-maxage.
+ * While an entry is regenerated, identical requests either get the stale
+ * copy (within stale-while-revalidate) or wait for the new one, so only a
+ * single process runs per entry. All entries share one memory budget and
+ * the least recently used ones go first.
+ */
+
+#define UH_CACHE_VARY_MAX	8
+#define UH_CACHE_KEY_MAX	2048
+#define UH_CACHE_AGE_MAX	2147483647
+
+struct uh_cache_key {
+	uint32_t hash;
+	const char *str;
+};
+
+struct uh_cache_entry {
+	struct uh_cache_key key;
+	struct avl_node avl;
+	struct list_head lru;
+	struct list_head waiters;
+	struct client *leader;
+	int refs;
+
+	uint64_t stored;
+	uint64_t expire;
+	uint64_t stale;
+
+	int status_code;
+	char status_msg[64];
+	char *data;
+	int hdr_len;
+	int body_len;
+	int size;
+};
+
+struct uh_cache_fill {
+	struct uh_cache_entry *e;
+	char *buf;
+	int len;
+	int buf_len;
+	int hdr_len;
+
+	int status_code;
+	char status_msg[64];
+	int max_age;
+	int s_maxage;
+	int swr;
+	bool cacheable;
+};
+
+struct uh_cache_waiter {
+	struct list_head list;
+	struct client *cl;
+};
+
+static int uh_cache_cmp(const void *k1, const void *k2, void *ptr);
+
+static AVL_TREE(cache, uh_cache_cmp, false, NULL);
+static LIST_HEAD(cache_lru);
+static int cache_used;
+
+static char *cache_vary[UH_CACHE_VARY_MAX];
+static int n_cache_vary;
+
+struct cache_stats cache_stats;
+
+static int uh_cache_cmp(const void *k1, const void *k2, void *ptr)
+{
+	const struct uh_cache_key *a = k1, *b = k2;
+
+	if (a->hash != b->hash)
+		return a->hash < b->hash ? -1 : 1;
+
+	return strcmp(a->str, b->str);
+}
+
+static uint32_t uh_cache_hash(const char *str)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*str) {
+		hash ^= (unsigned char) *str++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static bool uh_cache_is_vary(const char *name)
+{
+	int i;
+
+	for (i = 0; i < n_cache_vary; i++)
+		if (!strcasecmp(cache_vary[i], name))
+			return true;
+
+	return false;
+}
+
+void uh_cache_add_vary(const char *name)
+{
+	if (n_cache_vary == UH_CACHE_VARY_MAX) {
+		fprintf(stderr, "Too many cache vary headers, ignoring %s\n", name);
+		return;
+	}
+
+	cache_vary[n_cache_vary++] = strdup(name);
+}
+
+static void uh_cache_free(struct uh_cache_entry *e)
+{
+	avl_delete(&cache, &e->avl);
+	list_del(&e->lru);
+	cache_used -= e->size;
+	cache_stats.used = cache_used;
+
+	free(e->data);
+	free(e);
+}
+
+static bool uh_cache_busy(struct uh_cache_entry *e)
+{
+	return e->leader || e->refs || !list_empty(&e->waiters);
+}
+
+static void uh_cache_shrink(void)
+{
+	struct uh_cache_entry *e, *tmp;
+
+	list_for_each_entry_safe(e, tmp, &cache_lru, lru) {
+		if (cache_used <= conf.cache_size)
+			break;
+
+		if (!uh_cache_busy(e))
+			uh_cache_free(e);
+	}
+}
+
+void uh_cache_reset(void)
+{
+	struct uh_cache_entry *e, *tmp;
+	int i;
+
+	for (i = 0; i < n_cache_vary; i++)
+		free(cache_vary[i]);
+
+	n_cache_vary = 0;
+
+	/* the key format may change, entries in use are dropped when done */
+	list_for_each_entry_safe(e, tmp, &cache_lru, lru)
+		if (!uh_cache_busy(e))
+			uh_cache_free(e);
+}
+
+static const char *uh_cache_header_value(struct client *cl, const char *name)
+{
+	struct blob_attr *cur;
+	int rem;
+
+	blob_for_each_attr(cur, cl->hdr.head, rem)
+		if (!strcasecmp(blobmsg_name(cur), name))
+			return blobmsg_data(cur);
+
+	return NULL;
+}
+
+static bool uh_cache_make_key(struct client *cl, char *buf, int len)
+{
+	const char *url = blobmsg_data(blob_data(cl->hdr.head));
+	struct vhost *vh = uh_client_vhost(cl);
+	const char *val;
+	int i, ofs;
+
+	/* personalized responses must never be shared unless keyed on */
+	if ((uh_cache_header_value(cl, "authorization") && !uh_cache_is_vary("authorization")) ||
+	    (uh_cache_header_value(cl, "cookie") && !uh_cache_is_vary("cookie")))
+		return false;
+
+	/* the same URL is a different resource on every virtual host */
+	ofs = snprintf(buf, len, "%s\n%s\n%s", vh->name ? vh->name : "",
+		       uh_vhost_docroot(vh), url);
+	for (i = 0; i < n_cache_vary && ofs < len; i++) {
+		val = uh_cache_header_value(cl, cache_vary[i]);
+		ofs += snprintf(buf + ofs, len - ofs, "\n%s", val ? val : "");
+	}
+
+	return ofs < len;
+}
+
+static struct uh_cache_entry *uh_cache_new(struct uh_cache_key *key)
+{
+	struct uh_cache_entry *e;
+	char *str;
+	int len = strlen(key->str) + 1;
+
+	e = calloc_a(sizeof(*e), &str, len);
+	if (!e)
+		return NULL;
+
+	e->key.hash = key->hash;
+	e->key.str = memcpy(str, key->str, len);
+	e->avl.key = &e->key;
+	e->size = sizeof(*e) + len;
+	INIT_LIST_HEAD(&e->waiters);
+
+	avl_insert(&cache, &e->avl);
+	list_add_tail(&e->lru, &cache_lru);
+	cache_used += e->size;
+	cache_stats.used = cache_used;
+
+	return e;
+}
+
+static void uh_cache_send(struct client *cl, struct uh_cache_entry *e)
+{
+	uint64_t age = (uh_time_ms() - e->stored) / 1000;
+
+	list_move_tail(&e->lru, &cache_lru);
+
+	uh_http_header(cl, e->status_code, e->status_msg);
+	ustream_write(cl->us, e->data, e->hdr_len, true);
+	ustream_printf(cl->us, "Age: %llu\r\n\r\n", (unsigned long long) age);
+
+	if (cl->request.method != UH_HTTP_MSG_HEAD && e->body_len)
+		uh_chunk_write(cl, e->data + e->hdr_len, e->body_len);
+
+	uh_request_done(cl);
+}
+
+static void uh_cache_waiter_free(struct client *cl)
+{
+	struct uh_cache_waiter *w = cl->dispatch.req_data;
+
+	list_del(&w->list);
+	free(w);
+}
+
+static bool uh_cache_wait(struct client *cl, struct uh_cache_entry *e)
+{
+	struct uh_cache_waiter *w;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return false;
+
+	w->cl = cl;
+	list_add_tail(&w->list, &e->waiters);
+	cl->dispatch.req_data = w;
+	cl->dispatch.req_free = uh_cache_waiter_free;
+	cache_stats.collapsed++;
+
+	return true;
+}
+
+/*
+ * Look up a script request in the cache. Returns true if the request has
+ * been answered or is waiting for another one to fill the entry, false if
+ * the handler has to run. In the latter case the response is recorded if
+ * this request is the one regenerating the entry.
+ */
+bool uh_cache_request(struct client *cl)
+{
+	struct http_request *req = &cl->request;
+	struct uh_cache_entry *e;
+	struct uh_cache_fill *f;
+	struct uh_cache_key key;
+	char buf[UH_CACHE_KEY_MAX];
+	uint64_t now;
+
+	if (!conf.cache_size || req->cache_bypass || req->redirect_status != 200)
+		return false;
+
+	if (req->method != UH_HTTP_MSG_GET && req->method != UH_HTTP_MSG_HEAD)
+		return false;
+
+	if (req->content_length > 0 || req->transfer_chunked)
+		return false;
+
+	if (!uh_cache_make_key(cl, buf, sizeof(buf)))
+		return false;
+
+	key.str = buf;
+	key.hash = uh_cache_hash(buf);
+	now = uh_time_ms();
+
+	e = avl_find_element(&cache, &key, e, avl);
+	if (e && e->data && now < e->expire) {
+		cache_stats.hits++;
+		uh_cache_send(cl, e);
+		return true;
+	}
+
+	if (e && e->leader) {
+		if (e->data && now < e->stale) {
+			cache_stats.stale++;
+			uh_cache_send(cl, e);
+			return true;
+		}
+
+		return uh_cache_wait(cl, e);
+	}
+
+	cache_stats.misses++;
+
+	/* a HEAD response has no body to store */
+	if (req->method != UH_HTTP_MSG_GET)
+		return false;
+
+	if (e && now >= e->stale && !uh_cache_busy(e)) {
+		uh_cache_free(e);
+		e = NULL;
+	}
+
+	if (!e) {
+		e = uh_cache_new(&key);
+		if (!e)
+			return false;
+	}
+
+	f = calloc(1, sizeof(*f));
+	if (!f) {
+		if (!e->data)
+			uh_cache_free(e);
+		return false;
+	}
+
+	f->e = e;
+	f->max_age = -1;
+	f->s_maxage = -1;
+	f->cacheable = true;
+	e->leader = cl;
+	cl->dispatch.cache = f;
+	uh_cache_shrink();
+
+	return false;
+}
+
+static void uh_cache_append(struct uh_cache_fill *f, const void *data, int len)
+{
+	int max_len = conf.cache_size / 4;
+	int new_len;
+	char *buf;
+
+	if (!f->cacheable)
+		return;
+
+	if (f->len + len > max_len) {
+		f->cacheable = false;
+		return;
+	}
+
+	if (f->len + len > f->buf_len) {
+		new_len = max(f->buf_len * 2, 1024);
+		while (new_len < f->len + len)
+			new_len *= 2;
+
+		buf = realloc(f->buf, min(new_len, max_len));
+		if (!buf) {
+			f->cacheable = false;
+			return;
+		}
+
+		f->buf = buf;
+		f->buf_len = min(new_len, max_len);
+	}
+
+	memcpy(f->buf + f->len, data, len);
+	f->len += len;
+}
+
+/* delta-seconds, too large values are cut down as RFC 9111 asks for */
+static int uh_cache_seconds(const char *arg)
+{
+	long val = strtol(arg, NULL, 10);
+
+	return val < 0 ? 0 : min(val, UH_CACHE_AGE_MAX);
+}
+
+static void uh_cache_control(struct uh_cache_fill *f, const char *val)
+{
+	char *buf, *tok, *arg, *save;
+
+	buf = strcpy(alloca(strlen(val) + 1), val);
+	for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		tok += strspn(tok, " \t");
+		arg = strchr(tok, '=');
+		if (arg)
+			*arg++ = 0;
+
+		tok[strcspn(tok, " \t")] = 0;
+		if (!strcasecmp(tok, "no-store") || !strcasecmp(tok, "no-cache") ||
+		    !strcasecmp(tok, "private"))
+			f->cacheable = false;
+		else if (arg && !strcasecmp(tok, "max-age"))
+			f->max_age = uh_cache_seconds(arg);
+		else if (arg && !strcasecmp(tok, "s-maxage"))
+			f->s_maxage = uh_cache_seconds(arg);
+		else if (arg && !strcasecmp(tok, "stale-while-revalidate"))
+			f->swr = uh_cache_seconds(arg);
+	}
+}
+
+static void uh_cache_check_vary(struct uh_cache_fill *f, const char *val)
+{
+	char *buf, *tok, *save;
+
+	buf = strcpy(alloca(strlen(val) + 1), val);
+	for (tok = strtok_r(buf, ", \t", &save); tok; tok = strtok_r(NULL, ", \t", &save))
+		if (!uh_cache_is_vary(tok))
+			f->cacheable = false;
+}
+
+void uh_cache_header(struct client *cl, const char *name, const char *val)
+{
+	struct uh_cache_fill *f = cl->dispatch.cache;
+
+	if (!f)
+		return;
+
+	if (!strcasecmp(name, "Cache-Control"))
+		uh_cache_control(f, val);
+	else if (!strcasecmp(name, "Vary"))
+		uh_cache_check_vary(f, val);
+	else if (!strcasecmp(name, "Set-Cookie"))
+		f->cacheable = false;
+
+	uh_cache_append(f, name, strlen(name));
+	uh_cache_append(f, ": ", 2);
+	uh_cache_append(f, val, strlen(val));
+	uh_cache_append(f, "\r\n", 2);
+}
+
+void uh_cache_header_end(struct client *cl, int code, const char *msg)
+{
+	struct uh_cache_fill *f = cl->dispatch.cache;
+
+	if (!f)
+		return;
+
+	switch (code) {
+	case 200:
+	case 203:
+	case 301:
+	case 404:
+	case 410:
+		break;
+	default:
+		f->cacheable = false;
+		break;
+	}
+
+	f->status_code = code;
+	snprintf(f->status_msg, sizeof(f->status_msg), "%s", msg);
+	f->hdr_len = f->len;
+}
+
+void uh_cache_data(struct client *cl, const void *data, int len)
+{
+	uh_cache_append(cl->dispatch.cache, data, len);
+}
+
+static void uh_cache_store(struct uh_cache_entry *e, struct uh_cache_fill *f, int ttl)
+{
+	uint64_t now = uh_time_ms();
+	int old_len = e->data ? e->hdr_len + e->body_len : 0;
+
+	e->size += f->len - old_len;
+	cache_used += f->len - old_len;
+	cache_stats.used = cache_used;
+	cache_stats.stored++;
+
+	free(e->data);
+	e->data = f->buf;
+	e->hdr_len = f->hdr_len;
+	e->body_len = f->len - f->hdr_len;
+	e->status_code = f->status_code;
+	memcpy(e->status_msg, f->status_msg, sizeof(e->status_msg));
+	e->stored = now;
+	e->expire = now + (uint64_t) ttl * 1000;
+	e->stale = e->expire + (uint64_t) f->swr * 1000;
+	f->buf = NULL;
+}
+
+static void uh_cache_release(struct uh_cache_entry *e)
+{
+	struct uh_cache_waiter *w;
+	struct client *cl;
+
+	/*
+	 * Finishing a request may start the next one on the same connection,
+	 * keep the entry around and stop once someone else took over.
+	 */
+	e->refs++;
+	while (!e->leader && !list_empty(&e->waiters)) {
+		w = list_first_entry(&e->waiters, struct uh_cache_waiter, list);
+		cl = w->cl;
+
+		list_del(&w->list);
+		free(w);
+		cl->dispatch.req_data = NULL;
+		cl->dispatch.req_free = NULL;
+
+		if (e->data && uh_time_ms() < e->stale) {
+			uh_cache_send(cl, e);
+			continue;
+		}
+
+		/* nothing usable came out of it, run the handler after all */
+		cl->request.cache_bypass = true;
+		uh_handle_request(cl);
+	}
+	e->refs--;
+}
+
+/*
+ * Called once the leading request is complete, store the response if the
+ * handler finished cleanly and hand it to everyone waiting for it.
+ */
+void uh_cache_finish(struct client *cl, bool ok)
+{
+	struct uh_cache_fill *f = cl->dispatch.cache;
+	struct uh_cache_entry *e;
+	int ttl;
+
+	if (!f)
+		return;
+
+	cl->dispatch.cache = NULL;
+	e = f->e;
+	e->leader = NULL;
+
+	ttl = f->s_maxage >= 0 ? f->s_maxage : f->max_age;
+	if (ok && f->cacheable && f->buf && f->status_code && ttl > 0)
+		uh_cache_store(e, f, ttl);
+
+	free(f->buf);
+	free(f);
+
+	uh_cache_release(e);
+
+	if (!e->data && !uh_cache_busy(e))
+		uh_cache_free(e);
+
+	uh_cache_shrink();
+}
@@ -10,6 +10,13 @@ void uh_captive_set_host(const char *host, const char *url) {
 	captive_url = strdup(url);
 }
 
+void uh_captive_reset(void) {
+	free(captive_host);
+	free(captive_url);
+	captive_host = NULL;
+	captive_url = NULL;
+}
+
 bool uh_captive_check_host(const char *host) {
 	/* Captive host support configured? */
 	if (captive_host==NULL || captive_url==NULL)
@@ -22,7 +22,7 @@
 
 static LIST_HEAD(interpreters);
 
-void uh_interpreter_add(const char *ext, const char *path)
+void uh_interpreter_add(const char *ext, const char *path, bool config)
 {
 	struct interpreter *in;
 	char *new_ext, *new_path;
@@ -33,9 +33,25 @@ void uh_interpreter_add(const char *ext, const char *path)
 
 	in->ext = strcpy(new_ext, ext);
 	in->path = strcpy(new_path, path);
+	in->config = config;
 	list_add_tail(&in->list, &interpreters);
 }
 
+void uh_interpreter_reset(void)
+{
+	struct interpreter *in, *tmp;
+
+	list_for_each_entry_safe(in, tmp, &interpreters, list) {
+		if (!in->config)
+			continue;
+
+		list_del(&in->list);
+		free(in);
+	}
+}
+
+static bool check_cgi_path(struct path_info *pi, const char *url);
+
 static void cgi_main(struct client *cl, struct path_info *pi, char *url)
 {
 	const struct interpreter *ip = pi->ip;
@@ -67,6 +83,10 @@ static void cgi_handle_request(struct client *cl, char *url, struct path_info *p
 {
 	unsigned int mode = S_IFREG | S_IXOTH;
 
+	/* the interpreter list may have been reloaded while the request
+	 * was queued */
+	check_cgi_path(pi, url);
+
 	if (!pi->ip && !((pi->stat.st_mode & mode) == mode)) {
 		uh_client_error(cl, 403, "Forbidden",
 				"You don't have permission to access %s on this server.",
@@ -107,7 +127,9 @@ static bool check_cgi_path(struct path_info *pi, const char *url)
 }
 
 struct dispatch_handler cgi_dispatch = {
+	.name = "cgi",
 	.script = true,
+	.cache = true,
 	.check_path = check_cgi_path,
 	.handle_request = cgi_handle_request,
 };
@@ -17,6 +17,8 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE
+
 #include <libubox/blobmsg.h>
 #include <ctype.h>
 
@@ -32,6 +34,7 @@ const char * const http_versions[] = {
 	[UH_HTTP_VER_0_9] = "HTTP/0.9",
 	[UH_HTTP_VER_1_0] = "HTTP/1.0",
 	[UH_HTTP_VER_1_1] = "HTTP/1.1",
+	[UH_HTTP_VER_2] = "HTTP/2.0",
 };
 
 const char * const http_methods[] = {
@@ -49,6 +52,10 @@ void uh_http_header(struct client *cl, int code, const char *summary)
 	if (!uh_use_chunked(cl))
 		enc = "";
 
+	r->status = code;
+	if (!r->t_first_byte)
+		r->t_first_byte = uh_time_us();
+
 	if (r->connection_close)
 		conn = "Connection: close";
 	else
@@ -62,7 +69,7 @@ void uh_http_header(struct client *cl, int code, const char *summary)
 		ustream_printf(cl->us, "Keep-Alive: timeout=%d\r\n", conf.http_keepalive);
 }
 
-static void uh_connection_close(struct client *cl)
+void uh_connection_close(struct client *cl)
 {
 	cl->state = CLIENT_STATE_CLOSE;
 	cl->us->eof = true;
@@ -71,6 +78,8 @@ static void uh_connection_close(struct client *cl)
 
 static void uh_dispatch_done(struct client *cl)
 {
+	uh_cache_finish(cl, false);
+	uh_collapse_finish(cl, false);
 	if (cl->dispatch.free)
 		cl->dispatch.free(cl);
 	if (cl->dispatch.req_free)
@@ -109,15 +118,23 @@ static void uh_poll_connection(struct client *cl)
 void uh_request_done(struct client *cl)
 {
 	uh_chunk_eof(cl);
+	uh_stats_request_done(cl);
+	uh_log_request(cl);
 	uh_dispatch_done(cl);
 	memset(&cl->dispatch, 0, sizeof(cl->dispatch));
 
+	if (cl->h2)
+		return uh_h2_stream_done(cl);
+
 	if (!conf.http_keepalive || cl->request.connection_close)
 		return uh_connection_close(cl);
 
 	cl->state = CLIENT_STATE_INIT;
 	cl->requests++;
 	uh_poll_connection(cl);
+
+	/* keep the client list ordered by the time connections went idle */
+	list_move_tail(&cl->list, &clients);
 }
 
 void __printf(4, 5)
@@ -170,9 +187,11 @@ static int client_parse_request(struct client *cl, char *data)
 
 	blobmsg_add_string(&cl->hdr, "URL", path);
 
+	uh_vhost_put(cl->request.vhost);
 	memset(&cl->request, 0, sizeof(cl->request));
 	h_method = find_idx(http_methods, ARRAY_SIZE(http_methods), type);
-	h_version = find_idx(http_versions, ARRAY_SIZE(http_versions), version);
+	/* HTTP/2 is only spoken after the connection preface */
+	h_version = find_idx(http_versions, UH_HTTP_VER_1_1 + 1, version);
 	if (h_method < 0 || h_version < 0) {
 		req->version = UH_HTTP_VER_1_0;
 		return CLIENT_STATE_DONE;
@@ -197,9 +216,13 @@ static bool client_init_cb(struct client *cl, char *buf, int len)
 	if (newline == buf)
 		return true;
 
+	if (conf.http2 && !cl->requests && !strncmp(buf, "PRI ", 4))
+		return uh_h2_accept(cl, buf, len);
+
 	*newline = 0;
 	blob_buf_init(&cl->hdr, 0);
 	cl->state = client_parse_request(cl, buf);
+	cl->request.t_begin = uh_time_us();
 	ustream_consume(cl->us, newline + 2 - buf);
 	if (cl->state == CLIENT_STATE_DONE)
 		uh_header_error(cl, 400, "Bad Request");
@@ -221,16 +244,33 @@ static bool rfc1918_filter_check(struct client *cl)
 	return false;
 }
 
-static void client_header_complete(struct client *cl)
+void uh_client_header_complete(struct client *cl)
 {
 	struct http_request *r = &cl->request;
 
+	r->start = uh_time_us();
+	r->bytes_mark = cl->bytes_out + cl->us->w.data_bytes;
+
 	if (!rfc1918_filter_check(cl))
 		return;
 
+	if (!uh_limit_request(cl)) {
+		r->connection_close = true;
+		uh_http_header(cl, 429, "Too Many Requests");
+		ustream_printf(cl->us, "Retry-After: 1\r\n");
+		ustream_printf(cl->us, "Content-Type: text/html\r\n\r\n");
+		uh_chunk_printf(cl, "<h1>Too Many Requests</h1>"
+				"Request rate limit exceeded.");
+		uh_request_done(cl);
+		return;
+	}
+
 	if (r->expect_cont)
 		ustream_printf(cl->us, "HTTP/1.1 100 Continue\r\n\r\n");
 
+	if (r->upgrade && uh_websocket_request(cl))
+		return;
+
 	switch(r->ua) {
 	case UH_UA_MSIE_OLD:
 		if (r->method != UH_HTTP_MSG_POST)
@@ -247,53 +287,38 @@ static void client_header_complete(struct client *cl)
 	uh_handle_request(cl);
 }
 
-static void client_parse_header(struct client *cl, char *data)
+/*
+ * Handle a request header, name is expected in lower case. Also used for the
+ * header fields of HTTP/2 streams, which don't go through the line parser.
+ */
+void uh_client_header(struct client *cl, const char *name, const char *val)
 {
 	struct http_request *r = &cl->request;
 	char *err;
-	char *name;
-	char *val;
-
-	if (!*data) {
-		uloop_timeout_cancel(&cl->timeout);
-		cl->state = CLIENT_STATE_DATA;
-		client_header_complete(cl);
-		return;
-	}
 
-	val = uh_split_header(data);
-	if (!val) {
-		cl->state = CLIENT_STATE_DONE;
-		return;
-	}
-
-	for (name = data; *name; name++)
-		if (isupper(*name))
-			*name = tolower(*name);
-
-	if (!strcmp(data, "expect")) {
+	if (!strcmp(name, "expect")) {
 		if (!strcasecmp(val, "100-continue"))
 			r->expect_cont = true;
 		else {
 			uh_header_error(cl, 412, "Precondition Failed");
 			return;
 		}
-	} else if (!strcmp(data, "content-length")) {
+	} else if (!strcmp(name, "content-length")) {
 		r->content_length = strtoul(val, &err, 0);
 		if (err && *err) {
 			uh_header_error(cl, 400, "Bad Request");
 			return;
 		}
-	} else if (!strcmp(data, "transfer-encoding")) {
+	} else if (!strcmp(name, "transfer-encoding")) {
 		if (!strcmp(val, "chunked"))
 			r->transfer_chunked = true;
-	} else if (!strcmp(data, "connection")) {
+	} else if (!strcmp(name, "connection")) {
 		if (!strcasecmp(val, "close"))
 			r->connection_close = true;
 		else if (!strcasecmp(val, "keep-alive"))
 			r->connection_close = false;
-	} else if (!strcmp(data, "user-agent")) {
-		char *str;
+	} else if (!strcmp(name, "user-agent")) {
+		const char *str;
 
 		if (strstr(val, "Opera"))
 			r->ua = UH_UA_OPERA;
@@ -319,14 +344,41 @@ static void client_parse_header(struct client *cl, char *data)
 			r->ua = UH_UA_GECKO;
 		else if (strstr(val, "Konqueror"))
 			r->ua = UH_UA_KONQUEROR;
-	} else if (!strcmp(data, "host")) {
+	} else if (!strcmp(name, "upgrade")) {
+		r->upgrade = !strcasecmp(val, "websocket");
+	} else if (!strcmp(name, "host")) {
 		r->captive_redirect = uh_captive_check_host(val);
+		uh_vhost_select(cl, val);
 	}
 
 
-	blobmsg_add_string(&cl->hdr, data, val);
+	blobmsg_add_string(&cl->hdr, name, val);
+}
+
+static void client_parse_header(struct client *cl, char *data)
+{
+	char *name;
+	char *val;
+
+	if (!*data) {
+		uloop_timeout_cancel(&cl->timeout);
+		cl->state = CLIENT_STATE_DATA;
+		uh_client_header_complete(cl);
+		return;
+	}
+
+	val = uh_split_header(data);
+	if (!val) {
+		cl->state = CLIENT_STATE_DONE;
+		return;
+	}
+
+	for (name = data; *name; name++)
+		if (isupper(*name))
+			*name = tolower(*name);
 
 	cl->state = CLIENT_STATE_HEADER;
+	uh_client_header(cl, data, val);
 }
 
 void client_poll_post_data(struct client *cl)
@@ -351,7 +403,8 @@ void client_poll_post_data(struct client *cl)
 		if (!d->data_send)
 			return;
 
-		cur_len = min(r->content_length, len);
+		/* after an upgrade, everything belongs to the new protocol */
+		cur_len = r->upgraded ? len : min(r->content_length, len);
 		if (cur_len) {
 			if (d->data_blocked)
 				break;
@@ -359,7 +412,8 @@ void client_poll_post_data(struct client *cl)
 			if (d->data_send)
 				cur_len = d->data_send(cl, buf, cur_len);
 
-			r->content_length -= cur_len;
+			if (!r->upgraded)
+				r->content_length -= cur_len;
 			ustream_consume(cl->us, cur_len);
 			continue;
 		}
@@ -395,13 +449,16 @@ void client_poll_post_data(struct client *cl)
 	}
 
 	buf = ustream_get_read_buf(cl->us, &len);
-	if (!r->content_length && !r->transfer_chunked &&
+	if (!r->content_length && !r->transfer_chunked && !r->upgraded &&
 		cl->state != CLIENT_STATE_DONE) {
 		if (cl->dispatch.data_done)
 			cl->dispatch.data_done(cl);
 
 		cl->state = CLIENT_STATE_DONE;
 	}
+
+	if (cl->h2)
+		uh_h2_stream_poll(cl);
 }
 
 static bool client_data_cb(struct client *cl, char *buf, int len)
@@ -434,6 +491,7 @@ static read_cb_t read_cbs[] = {
 	[CLIENT_STATE_INIT] = client_init_cb,
 	[CLIENT_STATE_HEADER] = client_header_cb,
 	[CLIENT_STATE_DATA] = client_data_cb,
+	[CLIENT_STATE_H2] = uh_h2_read,
 };
 
 void uh_client_read_cb(struct client *cl)
@@ -459,17 +517,27 @@ void uh_client_read_cb(struct client *cl)
 	} while(1);
 }
 
-static void client_close(struct client *cl)
+/* drop the request state of a client, but leave its connection alone */
+void uh_client_release(struct client *cl)
 {
-	n_clients--;
 	uh_dispatch_done(cl);
+	memset(&cl->dispatch, 0, sizeof(cl->dispatch));
+	uh_vhost_put(cl->request.vhost);
+	cl->request.vhost = NULL;
 	uloop_timeout_cancel(&cl->timeout);
+	blob_buf_free(&cl->hdr);
+}
+
+static void client_close(struct client *cl)
+{
+	n_clients--;
+	uh_limit_release(cl);
+	uh_client_release(cl);
 	if (cl->tls)
 		uh_tls_client_detach(cl);
 	ustream_free(&cl->sfd.stream);
 	close(cl->sfd.fd.fd);
 	list_del(&cl->list);
-	blob_buf_free(&cl->hdr);
 	free(cl);
 
 	uh_unblock_listeners();
@@ -480,7 +548,8 @@ void uh_client_notify_state(struct client *cl)
 	struct ustream *s = cl->us;
 
 	if (!s->write_error) {
-		if (cl->state == CLIENT_STATE_DATA)
+		/* an upgraded connection has no request body to wait for */
+		if (cl->state == CLIENT_STATE_DATA && !cl->request.upgraded)
 			return;
 
 		if (!s->eof || s->w.data_bytes)
@@ -494,6 +563,7 @@ static void client_ustream_read_cb(struct ustream *s, int bytes)
 {
 	struct client *cl = container_of(s, struct client, sfd.stream);
 
+	uh_stats.bytes_in += bytes;
 	uh_client_read_cb(cl);
 }
 
@@ -501,6 +571,8 @@ static void client_ustream_write_cb(struct ustream *s, int bytes)
 {
 	struct client *cl = container_of(s, struct client, sfd.stream);
 
+	uh_stats.bytes_out += bytes;
+	cl->bytes_out += bytes;
 	if (cl->dispatch.write_cb)
 		cl->dispatch.write_cb(cl);
 }
@@ -527,7 +599,7 @@ static void set_addr(struct uh_addr *addr, void *src)
 	}
 }
 
-bool uh_accept_client(int fd, bool tls)
+bool uh_accept_client(int fd, bool tls, const struct sockaddr_in6 *srv_addr)
 {
 	static struct client *next_client;
 	struct client *cl;
@@ -542,14 +614,27 @@ bool uh_accept_client(int fd, bool tls)
 	cl = next_client;
 
 	sl = sizeof(addr);
+#ifdef linux
+	sfd = accept4(fd, (struct sockaddr *) &addr, &sl, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
 	sfd = accept(fd, (struct sockaddr *) &addr, &sl);
+#endif
 	if (sfd < 0)
 		return false;
 
 	set_addr(&cl->peer_addr, &addr);
-	sl = sizeof(addr);
-	getsockname(sfd, (struct sockaddr *) &addr, &sl);
-	set_addr(&cl->srv_addr, &addr);
+	if (!uh_limit_accept(cl)) {
+		close(sfd);
+		return true;
+	}
+
+	if (!srv_addr) {
+		sl = sizeof(addr);
+		getsockname(sfd, (struct sockaddr *) &addr, &sl);
+		srv_addr = &addr;
+	}
+
+	set_addr(&cl->srv_addr, (void *) srv_addr);
 
 	cl->us = &cl->sfd.stream;
 	if (tls) {
@@ -568,11 +653,83 @@ bool uh_accept_client(int fd, bool tls)
 
 	next_client = NULL;
 	n_clients++;
+	uh_stats.accepted++;
 	cl->id = client_id++;
 
 	return true;
 }
 
+static bool uh_client_idle(struct client *cl)
+{
+	if (cl->state != CLIENT_STATE_INIT || !cl->requests)
+		return false;
+
+	return !cl->us->r.data_bytes && !cl->us->w.data_bytes;
+}
+
+/*
+ * Close the keep-alive connection which has been idle for the longest time
+ * to make room for a new client.
+ */
+bool uh_evict_idle_client(void)
+{
+	struct client *cl;
+
+	list_for_each_entry(cl, &clients, list) {
+		if (!uh_client_idle(cl))
+			continue;
+
+		client_close(cl);
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Accept a connection only to answer it with a canned 503 response. The
+ * response fits into any socket buffer, so a single non-blocking write is
+ * enough and no client state needs to be allocated. A TLS client expects a
+ * handshake, plain text would only be reported as a protocol error, so such
+ * connections are closed without a response.
+ */
+bool uh_reject_client(int fd, bool tls)
+{
+	static const char response[] =
+		"HTTP/1.0 503 Service Unavailable\r\n"
+		"Retry-After: 1\r\n"
+		"Connection: close\r\n"
+		"Content-Type: text/plain\r\n"
+		"Content-Length: 20\r\n"
+		"\r\n"
+		"Server is too busy.\n";
+	int sfd;
+
+#ifdef linux
+	sfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	sfd = accept(fd, NULL, NULL);
+	if (sfd >= 0)
+		fcntl(sfd, F_SETFL, fcntl(sfd, F_GETFL) | O_NONBLOCK);
+#endif
+	if (sfd < 0)
+		return false;
+
+	if (tls) {
+		close(sfd);
+		return true;
+	}
+
+	if (write(sfd, response, sizeof(response) - 1) < 0) {
+		/* ignore, the connection is dropped either way */
+	}
+
+	shutdown(sfd, SHUT_WR);
+	close(sfd);
+
+	return true;
+}
+
 void uh_close_fds(void)
 {
 	struct client *cl;
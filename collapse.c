@@ -0,0 +1,336 @@
+/*
+ * uhttpd - Tiny single-threaded httpd
+ *
+ *   Copyright (C) 2010-2013 Jo-Philipp Wich <xm@subsignal.org>
+ *   Copyright (C) 2013 Felix Fietkau <nbd@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <strings.h>
+
+#include <libubox/blobmsg.h>
+
+#include "uhttpd.h"
+#include "trie.h"
+
+/*
+ * Request collapsing for script handlers. A GET which is identical to one
+ * already in flight, same URL and same credentials, does not start its own
+ * process. It follows the running request instead and gets a copy of its
+ * status, headers and body as they are produced. The start of the response
+ * is kept around so followers can still join once output has started.
+ */
+
+#define UH_COLLAPSE_REPLAY_MAX	(64 * 1024)
+#define UH_COLLAPSE_PENDING_MAX	(256 * 1024)
+#define UH_COLLAPSE_KEY_MAX	2048
+
+struct uh_collapse {
+	struct list_head list;
+	struct list_head followers;
+	struct client *leader;
+	char *key;
+
+	char *buf;
+	int len;
+	int buf_len;
+	int hdr_len;
+
+	int status_code;
+	char status_msg[64];
+	bool headers_done;
+	bool closed;
+};
+
+struct uh_collapse_follower {
+	struct list_head list;
+	struct client *cl;
+};
+
+static LIST_HEAD(collapse_inflight);
+static struct uh_trie collapse_trie;
+
+unsigned long collapse_followers;
+
+void uh_collapse_add(const char *prefix)
+{
+	void **slot;
+
+	slot = uh_trie_insert(&collapse_trie, prefix);
+	if (slot)
+		*slot = &collapse_trie;
+}
+
+void uh_collapse_reset(void)
+{
+	uh_trie_free(&collapse_trie);
+}
+
+static const char *uh_collapse_header_value(struct client *cl, const char *name)
+{
+	struct blob_attr *cur;
+	int rem;
+
+	blob_for_each_attr(cur, cl->hdr.head, rem)
+		if (!strcmp(blobmsg_name(cur), name))
+			return blobmsg_data(cur);
+
+	return "";
+}
+
+static bool uh_collapse_make_key(struct client *cl, char *buf, int len)
+{
+	struct vhost *vh = uh_client_vhost(cl);
+	int ofs;
+
+	/*
+	 * Requests from different users or for different virtual hosts must
+	 * not see each other's responses.
+	 */
+	ofs = snprintf(buf, len, "%s\n%s\n%s\n%s\n%s",
+		       vh->name ? vh->name : "", uh_vhost_docroot(vh),
+		       (char *) blobmsg_data(blob_data(cl->hdr.head)),
+		       uh_collapse_header_value(cl, "authorization"),
+		       uh_collapse_header_value(cl, "cookie"));
+
+	return ofs < len;
+}
+
+static void uh_collapse_append(struct uh_collapse *c, const void *data, int len)
+{
+	int new_len;
+	char *buf;
+
+	if (c->closed)
+		return;
+
+	if (c->len + len > UH_COLLAPSE_REPLAY_MAX) {
+		c->closed = true;
+		return;
+	}
+
+	if (c->len + len > c->buf_len) {
+		new_len = max(c->buf_len * 2, 1024);
+		while (new_len < c->len + len)
+			new_len *= 2;
+
+		buf = realloc(c->buf, new_len);
+		if (!buf) {
+			c->closed = true;
+			return;
+		}
+
+		c->buf = buf;
+		c->buf_len = new_len;
+	}
+
+	memcpy(c->buf + c->len, data, len);
+	c->len += len;
+}
+
+static void uh_collapse_follower_free(struct client *cl)
+{
+	struct uh_collapse_follower *f = cl->dispatch.req_data;
+
+	list_del(&f->list);
+	free(f);
+}
+
+static void uh_collapse_detach(struct uh_collapse_follower *f)
+{
+	struct client *cl = f->cl;
+
+	list_del(&f->list);
+	free(f);
+	cl->dispatch.req_data = NULL;
+	cl->dispatch.req_free = NULL;
+}
+
+/* the response was cut short, make sure the client notices */
+static void uh_collapse_abort(struct uh_collapse_follower *f)
+{
+	struct client *cl = f->cl;
+
+	uh_collapse_detach(f);
+	uh_connection_close(cl);
+}
+
+static void uh_collapse_send_headers(struct uh_collapse *c, struct client *cl)
+{
+	uh_http_header(cl, c->status_code, c->status_msg);
+	ustream_write(cl->us, c->buf, c->hdr_len, true);
+	ustream_printf(cl->us, "\r\n");
+}
+
+/*
+ * Attach a request to an identical one in flight. Returns true if the
+ * request follows another one, otherwise it may become the leader which
+ * others can follow.
+ */
+bool uh_collapse_request(struct client *cl, const char *url)
+{
+	struct http_request *req = &cl->request;
+	struct uh_collapse_follower *f;
+	struct uh_collapse *c;
+	char key[UH_COLLAPSE_KEY_MAX];
+
+	if (req->collapse_bypass || req->method != UH_HTTP_MSG_GET ||
+	    req->content_length > 0 || req->transfer_chunked)
+		return false;
+
+	if (!uh_trie_match(&collapse_trie, url, true, NULL))
+		return false;
+
+	if (!uh_collapse_make_key(cl, key, sizeof(key)))
+		return false;
+
+	list_for_each_entry(c, &collapse_inflight, list) {
+		if (c->closed || strcmp(c->key, key) != 0)
+			continue;
+
+		f = calloc(1, sizeof(*f));
+		if (!f)
+			return false;
+
+		f->cl = cl;
+		list_add_tail(&f->list, &c->followers);
+		cl->dispatch.req_data = f;
+		cl->dispatch.req_free = uh_collapse_follower_free;
+		collapse_followers++;
+
+		/* catch up with what the leader has sent so far */
+		if (c->headers_done) {
+			uh_collapse_send_headers(c, cl);
+			if (c->len > c->hdr_len)
+				uh_chunk_write(cl, c->buf + c->hdr_len, c->len - c->hdr_len);
+		}
+
+		return true;
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return false;
+
+	c->key = strdup(key);
+	if (!c->key) {
+		free(c);
+		return false;
+	}
+
+	INIT_LIST_HEAD(&c->followers);
+	c->leader = cl;
+	list_add_tail(&c->list, &collapse_inflight);
+	cl->dispatch.collapse = c;
+
+	return false;
+}
+
+void uh_collapse_header(struct client *cl, const char *name, const char *val)
+{
+	struct uh_collapse *c = cl->dispatch.collapse;
+
+	if (!c)
+		return;
+
+	uh_collapse_append(c, name, strlen(name));
+	uh_collapse_append(c, ": ", 2);
+	uh_collapse_append(c, val, strlen(val));
+	uh_collapse_append(c, "\r\n", 2);
+}
+
+void uh_collapse_header_end(struct client *cl, int code, const char *msg)
+{
+	struct uh_collapse *c = cl->dispatch.collapse;
+	struct uh_collapse_follower *f, *tmp;
+
+	if (!c)
+		return;
+
+	c->status_code = code;
+	snprintf(c->status_msg, sizeof(c->status_msg), "%s", msg);
+	c->hdr_len = c->len;
+	c->headers_done = true;
+
+	/* without the complete header block, everyone runs on their own */
+	if (c->closed) {
+		list_for_each_entry_safe(f, tmp, &c->followers, list) {
+			struct client *fcl = f->cl;
+
+			uh_collapse_detach(f);
+			fcl->request.collapse_bypass = true;
+			uh_handle_request(fcl);
+		}
+		return;
+	}
+
+	list_for_each_entry(f, &c->followers, list)
+		uh_collapse_send_headers(c, f->cl);
+}
+
+void uh_collapse_data(struct client *cl, const void *data, int len)
+{
+	struct uh_collapse *c = cl->dispatch.collapse;
+	struct uh_collapse_follower *f, *tmp;
+
+	uh_collapse_append(c, data, len);
+
+	list_for_each_entry_safe(f, tmp, &c->followers, list) {
+		/* a follower which can't keep up is not allowed to hold up memory */
+		if (f->cl->us->w.data_bytes > UH_COLLAPSE_PENDING_MAX) {
+			uh_collapse_abort(f);
+			continue;
+		}
+
+		uh_chunk_write(f->cl, data, len);
+	}
+}
+
+/*
+ * Called when the leading request is done. If the response was complete,
+ * the followers are done as well. Followers which did not get anything
+ * yet run the handler themselves, the others lose their connection.
+ */
+void uh_collapse_finish(struct client *cl, bool ok)
+{
+	struct uh_collapse *c = cl->dispatch.collapse;
+	struct uh_collapse_follower *f;
+	struct client *fcl;
+
+	if (!c)
+		return;
+
+	cl->dispatch.collapse = NULL;
+	list_del(&c->list);
+
+	while (!list_empty(&c->followers)) {
+		f = list_first_entry(&c->followers, struct uh_collapse_follower, list);
+		fcl = f->cl;
+
+		if (ok) {
+			uh_collapse_detach(f);
+			uh_request_done(fcl);
+		} else if (c->headers_done) {
+			uh_collapse_abort(f);
+		} else {
+			uh_collapse_detach(f);
+			fcl->request.collapse_bypass = true;
+			uh_handle_request(fcl);
+		}
+	}
+
+	free(c->buf);
+	free(c->key);
+	free(c);
+}
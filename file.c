@@ -23,6 +23,9 @@
 
 #include <sys/types.h>
 #include <sys/dir.h>
+#ifdef linux
+#include <sys/sendfile.h>
+#endif
 #include <time.h>
 #include <strings.h>
 #include <dirent.h>
@@ -31,23 +34,37 @@
 
 #include "uhttpd.h"
 #include "mimetypes.h"
+#include "trie.h"
 
-static LIST_HEAD(index_files);
 static LIST_HEAD(dispatch_handlers);
-static LIST_HEAD(pending_requests);
+static struct uh_trie dispatch_trie;
+static LIST_HEAD(running_requests);
 static int n_requests;
 
+struct script_stats script_stats;
+
 struct deferred_request {
 	struct list_head list;
 	struct dispatch_handler *d;
 	struct client *cl;
 	struct path_info pi;
+	struct uloop_timeout timeout;
+	uint64_t queued;
 	bool called, path;
 };
 
+struct dispatch_limit {
+	struct list_head list;
+	const char *name;
+	int max;
+};
+
+static LIST_HEAD(dispatch_limits);
+
 struct index_file {
 	struct list_head list;
 	const char *name;
+	bool config;
 };
 
 enum file_hdr {
@@ -60,13 +77,45 @@ enum file_hdr {
 	__HDR_MAX
 };
 
-void uh_index_add(const char *filename)
+void uh_index_add(const char *filename, bool config)
 {
+	struct vhost *vh = uh_vhost_config();
 	struct index_file *idx;
 
+	if (!vh) {
+		if (config)
+			free((char *) filename);
+		return;
+	}
+
 	idx = calloc(1, sizeof(*idx));
 	idx->name = filename;
-	list_add_tail(&idx->list, &index_files);
+	idx->config = config;
+	list_add_tail(&idx->list, &vh->index_files);
+}
+
+static void uh_index_clear(struct vhost *vh, bool all)
+{
+	struct index_file *idx, *tmp;
+
+	list_for_each_entry_safe(idx, tmp, &vh->index_files, list) {
+		if (!idx->config && !all)
+			continue;
+
+		list_del(&idx->list);
+		free((char *) idx->name);
+		free(idx);
+	}
+}
+
+void uh_index_reset(void)
+{
+	uh_index_clear(&default_vhost, false);
+}
+
+void uh_index_free(struct vhost *vh)
+{
+	uh_index_clear(vh, true);
 }
 
 static char * canonpath(const char *path, char *path_resolved)
@@ -131,8 +180,10 @@ uh_path_lookup(struct client *cl, const char *url)
 	static char path_info[PATH_MAX];
 	static struct path_info p;
 
-	const char *docroot = conf.docroot;
+	struct vhost *vh = uh_client_vhost(cl);
+	const char *docroot = uh_vhost_docroot(vh);
 	int docroot_len = strlen(docroot);
+	struct list_head *index_files = &vh->index_files;
 	char *pathptr = NULL;
 	bool slash;
 
@@ -242,9 +293,12 @@ uh_path_lookup(struct client *cl, const char *url)
 		return &p;
 	}
 
-	/* try to locate index file */
+	/* try to locate index file, virtual hosts default to the global list */
+	if (list_empty(index_files))
+		index_files = &default_vhost.index_files;
+
 	len = path_phys + sizeof(path_phys) - pathptr - 1;
-	list_for_each_entry(idx, &index_files, list) {
+	list_for_each_entry(idx, index_files, list) {
 		if (strlen(idx->name) > len)
 			continue;
 
@@ -533,11 +587,83 @@ static void uh_file_dirlist(struct client *cl, struct path_info *pi)
 	uh_request_done(cl);
 }
 
+#ifdef linux
+/*
+ * With the kernel encrypting outgoing records, the rest of the body is sent
+ * as a single chunk straight from the page cache. A block which does not
+ * fit into the socket goes through the stream instead, which then tells us
+ * once there is room again.
+ */
+static bool file_sendfile(struct client *cl)
+{
+	struct ustream *conn = &cl->sfd.stream;
+	int fd = cl->dispatch.file.fd;
+	struct stat s;
+	ssize_t r;
+	off_t pos;
+
+	if (!cl->dispatch.file.sendfile) {
+		if (cl->us->w.data_bytes || conn->w.data_bytes)
+			return false;
+
+		pos = lseek(fd, 0, SEEK_CUR);
+		if (pos < 0 || fstat(fd, &s) || s.st_size <= pos)
+			return false;
+
+		cl->dispatch.file.sendfile = true;
+		cl->dispatch.file.remain = s.st_size - pos;
+
+		if (uh_use_chunked(cl))
+			ustream_printf(cl->us, "%llX\r\n",
+				       (unsigned long long) cl->dispatch.file.remain);
+	}
+
+	while (cl->dispatch.file.remain > 0) {
+		if (cl->us->w.data_bytes || conn->w.data_bytes)
+			return true;
+
+		r = sendfile(cl->sfd.fd.fd, fd, NULL,
+			     min(cl->dispatch.file.remain, 65536));
+		if (r < 0 && errno == EINTR)
+			continue;
+
+		if (r < 0 && errno == EAGAIN) {
+			r = read(fd, uh_buf, min(cl->dispatch.file.remain, sizeof(uh_buf)));
+			if (r > 0)
+				ustream_write(cl->us, uh_buf, r, true);
+		} else if (r > 0) {
+			uh_stats.bytes_out += r;
+			cl->bytes_out += r;
+		}
+
+		/* the file was truncated or the connection is gone */
+		if (r <= 0) {
+			uh_connection_close(cl);
+			return true;
+		}
+
+		cl->dispatch.file.remain -= r;
+		uloop_timeout_set(&cl->timeout, conf.network_timeout * 1000);
+	}
+
+	if (uh_use_chunked(cl))
+		ustream_printf(cl->us, "\r\n");
+
+	uh_request_done(cl);
+	return true;
+}
+#endif
+
 static void file_write_cb(struct client *cl)
 {
 	int fd = cl->dispatch.file.fd;
 	int r;
 
+#ifdef linux
+	if (cl->ktls && file_sendfile(cl))
+		return;
+#endif
+
 	while (cl->us->w.data_bytes < 256) {
 		r = read(fd, uh_buf, sizeof(uh_buf));
 		if (r < 0) {
@@ -633,15 +759,82 @@ error:
 
 void uh_dispatch_add(struct dispatch_handler *d)
 {
+	INIT_LIST_HEAD(&d->pending);
+	d->stats = uh_stats_handler(d->name);
 	list_add_tail(&d->list, &dispatch_handlers);
 }
 
+void uh_dispatch_set_limit(const char *name, int max)
+{
+	struct dispatch_limit *l;
+	char *new_name;
+
+	l = calloc_a(sizeof(*l), &new_name, strlen(name) + 1);
+	if (!l)
+		return;
+
+	l->name = strcpy(new_name, name);
+	l->max = max;
+	list_add_tail(&l->list, &dispatch_limits);
+}
+
+void uh_dispatch_reset_limits(void)
+{
+	struct dispatch_limit *l, *tmp;
+
+	list_for_each_entry_safe(l, tmp, &dispatch_limits, list) {
+		list_del(&l->list);
+		free(l);
+	}
+}
+
+/*
+ * Build the prefix tree for URL based handlers. Must be called after all
+ * handlers have been registered and their prefixes are configured.
+ */
+static void uh_run_pending_requests(void);
+
+void uh_dispatch_compile(void)
+{
+	struct dispatch_handler *d;
+	struct dispatch_limit *l;
+	void **slot;
+
+	uh_trie_free(&dispatch_trie);
+	list_for_each_entry(d, &dispatch_handlers, list) {
+		d->max_requests = 0;
+		list_for_each_entry(l, &dispatch_limits, list)
+			if (d->name && !strcmp(l->name, d->name))
+				d->max_requests = l->max;
+
+		if (!d->check_url || !d->prefix)
+			continue;
+
+		slot = uh_trie_insert(&dispatch_trie, d->prefix);
+		if (slot && !*slot)
+			*slot = d;
+	}
+
+	/* limits may have been raised by a reload */
+	uh_run_pending_requests();
+}
+
 static struct dispatch_handler *
-dispatch_find(const char *url, struct path_info *pi)
+dispatch_find(struct client *cl, const char *url, struct path_info *pi)
 {
+	struct vhost *vh = uh_client_vhost(cl);
 	struct dispatch_handler *d;
 
+	if (!pi) {
+		d = uh_trie_match(&dispatch_trie, url, true, NULL);
+		if (d && uh_vhost_handler_allowed(vh, d->name))
+			return d;
+	}
+
 	list_for_each_entry(d, &dispatch_handlers, list) {
+		if (!uh_vhost_handler_allowed(vh, d->name))
+			continue;
+
 		if (pi) {
 			if (d->check_url)
 				continue;
@@ -649,7 +842,7 @@ dispatch_find(const char *url, struct path_info *pi)
 			if (d->check_path(pi, url))
 				return d;
 		} else {
-			if (d->check_path)
+			if (d->check_path || d->prefix)
 				continue;
 
 			if (d->check_url(url))
@@ -660,44 +853,153 @@ dispatch_find(const char *url, struct path_info *pi)
 	return NULL;
 }
 
-static void
-uh_invoke_script(struct client *cl, struct dispatch_handler *d, struct path_info *pi)
+static bool uh_addr_equal(const struct uh_addr *a, const struct uh_addr *b)
 {
-	char *url = blobmsg_data(blob_data(cl->hdr.head));
+	if (a->family != b->family)
+		return false;
 
-	n_requests++;
-	d->handle_request(cl, url, pi);
+	if (a->family == AF_INET)
+		return a->in.s_addr == b->in.s_addr;
+
+	return !memcmp(&a->in6, &b->in6, sizeof(a->in6));
 }
 
-static void uh_complete_request(struct client *cl)
+static int uh_client_script_requests(struct client *cl)
 {
 	struct deferred_request *dr;
+	int n = 0;
 
-	n_requests--;
+	list_for_each_entry(dr, &running_requests, list)
+		if (uh_addr_equal(&dr->cl->peer_addr, &cl->peer_addr))
+			n++;
 
-	while (!list_empty(&pending_requests)) {
-		if (n_requests >= conf.max_script_requests)
-			return;
+	return n;
+}
 
-		dr = list_first_entry(&pending_requests, struct deferred_request, list);
-		list_del(&dr->list);
+static bool uh_handler_available(struct dispatch_handler *d)
+{
+	if (d->script && n_requests >= conf.max_script_requests)
+		return false;
+
+	if (d->max_requests && d->n_requests >= d->max_requests)
+		return false;
+
+	return true;
+}
+
+static void
+uh_invoke_script(struct deferred_request *dr, struct path_info *pi)
+{
+	struct dispatch_handler *d = dr->d;
+	char *url = blobmsg_data(blob_data(dr->cl->hdr.head));
+
+	dr->called = true;
+	dr->cl->request.t_dispatch = uh_time_us();
+	list_add_tail(&dr->list, &running_requests);
+	if (d->script)
+		n_requests++;
+	d->n_requests++;
+	script_stats.dispatched++;
+
+	d->handle_request(dr->cl, url, pi);
+}
 
-		dr->called = true;
-		uh_invoke_script(dr->cl, dr->d, dr->path ? &dr->pi : NULL);
+/*
+ * Pick the next deferred request to run. Within each handler queue the
+ * oldest request from the client address with the fewest running requests
+ * wins, across handlers the one which has been waiting longest.
+ */
+static struct deferred_request *uh_next_pending_request(void)
+{
+	struct deferred_request *dr, *cand, *best = NULL;
+	struct dispatch_handler *d;
+	int n, cand_n;
+
+	list_for_each_entry(d, &dispatch_handlers, list) {
+		if (list_empty(&d->pending) || !uh_handler_available(d))
+			continue;
+
+		cand = NULL;
+		cand_n = 0;
+		list_for_each_entry(dr, &d->pending, list) {
+			n = uh_client_script_requests(dr->cl);
+			if (conf.max_client_script_requests &&
+			    n >= conf.max_client_script_requests)
+				continue;
+
+			if (cand && n >= cand_n)
+				continue;
+
+			cand = dr;
+			cand_n = n;
+			if (!n)
+				break;
+		}
+
+		if (cand && (!best || cand->queued < best->queued))
+			best = cand;
 	}
+
+	return best;
 }
 
+static void uh_run_pending_requests(void)
+{
+	struct deferred_request *dr;
+	uint64_t wait;
+
+	while ((dr = uh_next_pending_request()) != NULL) {
+		list_del(&dr->list);
+		uloop_timeout_cancel(&dr->timeout);
+		script_stats.queued--;
+
+		wait = uh_time_ms() - dr->queued;
+		script_stats.wait_ms_total += wait;
+		if (wait > script_stats.wait_ms_max)
+			script_stats.wait_ms_max = wait;
+
+		uh_invoke_script(dr, dr->path ? &dr->pi : NULL);
+	}
+}
 
 static void
 uh_free_pending_request(struct client *cl)
 {
 	struct deferred_request *dr = cl->dispatch.req_data;
+	bool called = dr->called;
+
+	uloop_timeout_cancel(&dr->timeout);
+	list_del(&dr->list);
+
+	if (called) {
+		if (dr->d->script)
+			n_requests--;
+		dr->d->n_requests--;
+	} else {
+		script_stats.queued--;
+	}
 
-	if (dr->called)
-		uh_complete_request(cl);
-	else
-		list_del(&dr->list);
 	free(dr);
+
+	if (called)
+		uh_run_pending_requests();
+}
+
+static void uh_pending_request_timeout_cb(struct uloop_timeout *timeout)
+{
+	struct deferred_request *dr = container_of(timeout, struct deferred_request, timeout);
+	struct client *cl = dr->cl;
+
+	script_stats.expired++;
+
+	/* any request body is left unread, so the connection can't be reused */
+	cl->request.connection_close = true;
+	uh_http_header(cl, 503, "Service Unavailable");
+	ustream_printf(cl->us, "Retry-After: %d\r\n", conf.script_queue_timeout);
+	ustream_printf(cl->us, "Content-Type: text/html\r\n\r\n");
+	uh_chunk_printf(cl, "<h1>Service Unavailable</h1>"
+			"The server is too busy to handle the request.");
+	uh_request_done(cl);
 }
 
 static int field_len(const char *ptr)
@@ -744,20 +1046,46 @@ uh_defer_script(struct client *cl, struct dispatch_handler *d, struct path_info
 	cl->dispatch.req_data = dr;
 	dr->cl = cl;
 	dr->d = d;
-	list_add(&dr->list, &pending_requests);
+	dr->queued = uh_time_ms();
+	list_add_tail(&dr->list, &d->pending);
+
+	script_stats.deferred++;
+	if (++script_stats.queued > script_stats.max_queued)
+		script_stats.max_queued = script_stats.queued;
+
+	dr->timeout.cb = uh_pending_request_timeout_cb;
+	if (conf.script_queue_timeout > 0)
+		uloop_timeout_set(&dr->timeout, conf.script_queue_timeout * 1000);
 }
 
 static void
 uh_invoke_handler(struct client *cl, struct dispatch_handler *d, char *url, struct path_info *pi)
 {
-	if (!d->script)
+	struct deferred_request *dr;
+
+	cl->request.stats = d->stats;
+
+	if (d->cache && (uh_cache_request(cl) || uh_collapse_request(cl, url)))
+		return;
+
+	if (!d->script && !d->max_requests)
 		return d->handle_request(cl, url, pi);
 
-	if (n_requests >= conf.max_script_requests)
+	if (!uh_handler_available(d) || !list_empty(&d->pending) ||
+	    (conf.max_client_script_requests &&
+	     uh_client_script_requests(cl) >= conf.max_client_script_requests))
 		return uh_defer_script(cl, d, pi);
 
-	cl->dispatch.req_free = uh_complete_request;
-	uh_invoke_script(cl, d, pi);
+	dr = calloc(1, sizeof(*dr));
+	if (!dr)
+		return uh_client_error(cl, 500, "Internal Server Error",
+				       "Out of memory");
+
+	dr->cl = cl;
+	dr->d = d;
+	cl->dispatch.req_data = dr;
+	cl->dispatch.req_free = uh_free_pending_request;
+	uh_invoke_script(dr, pi);
 }
 
 static bool __handle_file_request(struct client *cl, char *url)
@@ -788,7 +1116,7 @@ static bool __handle_file_request(struct client *cl, char *url)
 	if (!uh_auth_check(cl, pi))
 		return true;
 
-	d = dispatch_find(url, pi);
+	d = dispatch_find(cl, url, pi);
 	if (d)
 		uh_invoke_handler(cl, d, url, pi);
 	else
@@ -811,11 +1139,13 @@ void uh_handle_request(struct client *cl)
 		return;
 	}
 
+	req->t_dispatch = uh_time_us();
+
 	/* Aliasing */
-	uh_alias_transform(orig_url, url, 1024);
+	uh_alias_transform(uh_client_vhost(cl), orig_url, url, 1024);
 
 	req->redirect_status = 200;
-	d = dispatch_find(url, NULL);
+	d = dispatch_find(cl, url, NULL);
 	if (d)
 		return uh_invoke_handler(cl, d, url, NULL);
 
@@ -0,0 +1,506 @@
+/*
+ * uhttpd - Tiny single-threaded httpd
+ *
+ *   Copyright (C) 2010-2013 Jo-Philipp Wich <xm@subsignal.org>
+ *   Copyright (C) 2013 Felix Fietkau <nbd@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "uhttpd.h"
+#include "hpack.h"
+
+/*
+ * HPACK header compression (RFC 7541). Requests are decoded with the full
+ * dynamic table. Responses are encoded without touching the peer's dynamic
+ * table, only names and values from the static table are referenced, which
+ * keeps the encoder stateless.
+ */
+
+#define HPACK_STR_MAX	8192
+
+struct hpack_field {
+	const char *name;
+	const char *value;
+};
+
+struct uh_hpack_entry {
+	int size;
+	char *name;
+	char *value;
+	int value_len;
+};
+
+/*
+ * The Huffman code is canonical, codes of the same length are consecutive
+ * and ordered by symbol. Per length, the number of codes and the first code
+ * are enough to map a code to its position in the symbol list.
+ */
+static const uint8_t hpack_huff_count[31] = {
+	0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+	0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+
+static const uint32_t hpack_huff_first[31] = {
+	0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+	0x14, 0x5c, 0xf8, 0x1fc, 0x3f8, 0x7fa,
+	0xffa, 0x1ff8, 0x3ffc, 0x7ffc, 0xfffe, 0x1fffc,
+	0x3fff8, 0x7fff0, 0xfffe6, 0x1fffdc, 0x3fffd2, 0x7fffd8,
+	0xffffea, 0x1ffffec, 0x3ffffe0, 0x7ffffde, 0xfffffe2, 0x1ffffffe,
+	0x3ffffffc
+};
+
+static const uint16_t hpack_huff_sym[257] = {
+	48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37,
+	45, 46, 47, 51, 52, 53, 54, 55, 56, 57, 61, 65,
+	95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+	58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+	77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89,
+	106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44, 59,
+	88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62,
+	0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+	195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161,
+	167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+	132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+	173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+	233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+	151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+	183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159,
+	171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+	200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+	255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245,
+	246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+	6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+	21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220,
+	249, 10, 13, 22, 256
+};
+
+static const struct hpack_field hpack_static[] = {
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" },
+};
+
+#define HPACK_STATIC_COUNT	ARRAY_SIZE(hpack_static)
+
+void uh_hpack_init(struct uh_hpack *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->limit = UH_HPACK_TABLE_SIZE;
+}
+
+static void hpack_evict(struct uh_hpack *h, int limit)
+{
+	struct uh_hpack_entry *e;
+	int idx;
+
+	while (h->count && h->size > limit) {
+		idx = (h->head + UH_HPACK_ENTRIES - h->count + 1) % UH_HPACK_ENTRIES;
+		e = h->ring[idx];
+		h->ring[idx] = NULL;
+		h->size -= e->size;
+		h->count--;
+		free(e);
+	}
+}
+
+void uh_hpack_free(struct uh_hpack *h)
+{
+	hpack_evict(h, -1);
+}
+
+static struct uh_hpack_entry *
+hpack_add(struct uh_hpack *h, const char *name, const char *value, int value_len)
+{
+	struct uh_hpack_entry *e;
+	int name_len = strlen(name);
+	int size = name_len + value_len + 32;
+
+	/* an entry larger than the table clears it and is not added */
+	if (size > h->limit) {
+		hpack_evict(h, -1);
+		return NULL;
+	}
+
+	/*
+	 * The name may refer to an entry which is about to be evicted, so it
+	 * has to be copied before making room (RFC 7541, section 4.4).
+	 */
+	e = malloc(sizeof(*e) + name_len + value_len + 2);
+	if (!e)
+		return NULL;
+
+	e->size = size;
+	e->name = (char *) (e + 1);
+	e->value = e->name + name_len + 1;
+	e->value_len = value_len;
+	memcpy(e->name, name, name_len + 1);
+	memcpy(e->value, value, value_len);
+	e->value[value_len] = 0;
+
+	hpack_evict(h, h->limit - size);
+
+	h->head = (h->head + 1) % UH_HPACK_ENTRIES;
+	h->ring[h->head] = e;
+	h->size += size;
+	h->count++;
+
+	return e;
+}
+
+static bool hpack_lookup(struct uh_hpack *h, uint32_t idx, const char **name,
+			 const char **value, int *value_len)
+{
+	struct uh_hpack_entry *e;
+
+	if (!idx)
+		return false;
+
+	if (idx <= HPACK_STATIC_COUNT) {
+		*name = hpack_static[idx - 1].name;
+		*value = hpack_static[idx - 1].value;
+		*value_len = strlen(*value);
+		return true;
+	}
+
+	idx -= HPACK_STATIC_COUNT;
+	if (idx > h->count)
+		return false;
+
+	e = h->ring[(h->head + UH_HPACK_ENTRIES - idx + 1) % UH_HPACK_ENTRIES];
+	*name = e->name;
+	*value = e->value;
+	*value_len = e->value_len;
+
+	return true;
+}
+
+static bool hpack_int(const uint8_t **p, const uint8_t *end, int prefix, uint32_t *val)
+{
+	uint32_t max = (1 << prefix) - 1;
+	uint32_t v;
+	int shift = 0;
+	uint8_t b;
+
+	if (*p >= end)
+		return false;
+
+	v = *(*p)++ & max;
+	if (v < max)
+		goto out;
+
+	do {
+		/* nothing legitimate needs more than 28 bits */
+		if (*p >= end || shift > 21)
+			return false;
+
+		b = *(*p)++;
+		v += (uint32_t) (b & 0x7f) << shift;
+		shift += 7;
+	} while (b & 0x80);
+
+out:
+	*val = v;
+	return true;
+}
+
+static int hpack_huff_decode(const uint8_t *src, int len, char *buf, int buf_len)
+{
+	uint32_t code = 0, ofs;
+	int bits = 0, base = 0, out = 0;
+	int i, j;
+
+	for (i = 0; i < len; i++) {
+		for (j = 7; j >= 0; j--) {
+			code = (code << 1) | ((src[i] >> j) & 1);
+			bits++;
+
+			ofs = code - hpack_huff_first[bits];
+			if (ofs >= hpack_huff_count[bits]) {
+				base += hpack_huff_count[bits];
+				if (bits == 30)
+					return -1;
+
+				continue;
+			}
+
+			/* EOS must not appear in the encoded data */
+			if (hpack_huff_sym[base + ofs] == 256 || out >= buf_len)
+				return -1;
+
+			buf[out++] = hpack_huff_sym[base + ofs];
+			code = 0;
+			bits = 0;
+			base = 0;
+		}
+	}
+
+	/* padding is a prefix of EOS, at most 7 bits long */
+	if (bits > 7 || code != (1U << bits) - 1)
+		return -1;
+
+	return out;
+}
+
+static int hpack_string(const uint8_t **p, const uint8_t *end, char *buf, int buf_len)
+{
+	uint32_t len;
+	bool huff;
+	int ret;
+
+	if (*p >= end)
+		return -1;
+
+	huff = **p & 0x80;
+	if (!hpack_int(p, end, 7, &len) || len > end - *p)
+		return -1;
+
+	if (huff) {
+		ret = hpack_huff_decode(*p, len, buf, buf_len - 1);
+		if (ret < 0)
+			return -1;
+	} else {
+		if (len >= buf_len)
+			return -1;
+
+		memcpy(buf, *p, len);
+		ret = len;
+	}
+
+	buf[ret] = 0;
+	*p += len;
+
+	return ret;
+}
+
+/*
+ * Decode a complete header block. The callback gets every field in order,
+ * it may stop decoding by returning false. Returns 0 on success, -1 if the
+ * block can't be decoded, which is fatal for the connection.
+ */
+int uh_hpack_decode(struct uh_hpack *h, const uint8_t *buf, int len,
+		    uh_hpack_cb cb, void *priv)
+{
+	static char name_buf[HPACK_STR_MAX], value_buf[HPACK_STR_MAX];
+	const uint8_t *p = buf, *end = buf + len;
+	const char *name, *value, *dummy;
+	struct uh_hpack_entry *e;
+	bool fields = false;
+	int value_len, prefix;
+	uint32_t idx;
+	uint8_t b;
+
+	while (p < end) {
+		b = *p;
+
+		if (b & 0x80) {
+			if (!hpack_int(&p, end, 7, &idx) ||
+			    !hpack_lookup(h, idx, &name, &value, &value_len))
+				return -1;
+
+			fields = true;
+			if (!cb(priv, name, value, value_len))
+				return 0;
+
+			continue;
+		}
+
+		if ((b & 0xe0) == 0x20) {
+			/* size updates are only allowed before the first field */
+			if (fields || !hpack_int(&p, end, 5, &idx) ||
+			    idx > UH_HPACK_TABLE_SIZE)
+				return -1;
+
+			h->limit = idx;
+			hpack_evict(h, h->limit);
+			continue;
+		}
+
+		/* literal, with incremental indexing or without */
+		prefix = (b & 0x40) ? 6 : 4;
+		if (!hpack_int(&p, end, prefix, &idx))
+			return -1;
+
+		if (idx) {
+			if (!hpack_lookup(h, idx, &name, &dummy, &value_len))
+				return -1;
+
+			/* adding the new entry may evict the one named here */
+			if (idx > HPACK_STATIC_COUNT) {
+				strcpy(name_buf, name);
+				name = name_buf;
+			}
+		} else {
+			if (hpack_string(&p, end, name_buf, sizeof(name_buf)) < 0)
+				return -1;
+
+			name = name_buf;
+		}
+
+		value_len = hpack_string(&p, end, value_buf, sizeof(value_buf));
+		if (value_len < 0)
+			return -1;
+
+		value = value_buf;
+		if (prefix == 6) {
+			e = hpack_add(h, name, value, value_len);
+			if (e) {
+				name = e->name;
+				value = e->value;
+			}
+		}
+
+		fields = true;
+		if (!cb(priv, name, value, value_len))
+			return 0;
+	}
+
+	return 0;
+}
+
+static int hpack_put_int(uint8_t *buf, int len, int prefix, uint8_t flags, uint32_t val)
+{
+	uint32_t max = (1 << prefix) - 1;
+	int ofs = 0;
+
+	if (len < 1)
+		return -1;
+
+	if (val < max) {
+		buf[ofs++] = flags | val;
+		return ofs;
+	}
+
+	buf[ofs++] = flags | max;
+	val -= max;
+	while (val >= 0x80) {
+		if (ofs >= len)
+			return -1;
+
+		buf[ofs++] = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
+
+	if (ofs >= len)
+		return -1;
+
+	buf[ofs++] = val;
+	return ofs;
+}
+
+static int hpack_put_string(uint8_t *buf, int len, const char *str)
+{
+	int str_len = strlen(str);
+	int ofs;
+
+	ofs = hpack_put_int(buf, len, 7, 0, str_len);
+	if (ofs < 0 || ofs + str_len > len)
+		return -1;
+
+	memcpy(buf + ofs, str, str_len);
+	return ofs + str_len;
+}
+
+/* encode one field, returns the number of bytes used or -1 if it doesn't fit */
+int uh_hpack_encode(uint8_t *buf, int len, const char *name, const char *val)
+{
+	int i, name_idx = 0, ofs, ret;
+
+	for (i = 0; i < HPACK_STATIC_COUNT; i++) {
+		if (strcmp(hpack_static[i].name, name) != 0)
+			continue;
+
+		if (!strcmp(hpack_static[i].value, val))
+			return hpack_put_int(buf, len, 7, 0x80, i + 1);
+
+		if (!name_idx)
+			name_idx = i + 1;
+	}
+
+	/* literal without indexing */
+	ofs = hpack_put_int(buf, len, 4, 0, name_idx);
+	if (ofs < 0)
+		return -1;
+
+	if (!name_idx) {
+		ret = hpack_put_string(buf + ofs, len - ofs, name);
+		if (ret < 0)
+			return -1;
+
+		ofs += ret;
+	}
+
+	ret = hpack_put_string(buf + ofs, len - ofs, val);
+	if (ret < 0)
+		return -1;
+
+	return ofs + ret;
+}
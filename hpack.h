@@ -0,0 +1,47 @@
+/*
+ * uhttpd - Tiny single-threaded httpd
+ *
+ *   Copyright (C) 2010-2013 Jo-Philipp Wich <xm@subsignal.org>
+ *   Copyright (C) 2013 Felix Fietkau <nbd@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __UHTTPD_HPACK_H
+#define __UHTTPD_HPACK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define UH_HPACK_TABLE_SIZE	4096
+#define UH_HPACK_ENTRIES	(UH_HPACK_TABLE_SIZE / 32)
+
+struct uh_hpack_entry;
+
+struct uh_hpack {
+	struct uh_hpack_entry *ring[UH_HPACK_ENTRIES];
+	int head;
+	int count;
+	int size;
+	int limit;
+};
+
+typedef bool (*uh_hpack_cb)(void *priv, const char *name, const char *val, int val_len);
+
+void uh_hpack_init(struct uh_hpack *h);
+void uh_hpack_free(struct uh_hpack *h);
+int uh_hpack_decode(struct uh_hpack *h, const uint8_t *buf, int len,
+		    uh_hpack_cb cb, void *priv);
+int uh_hpack_encode(uint8_t *buf, int len, const char *name, const char *val);
+
+#endif
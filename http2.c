@@ -0,0 +1,1247 @@
+/*
+ * uhttpd - Tiny single-threaded httpd
+ *
+ *   Copyright (C) 2010-2013 Jo-Philipp Wich <xm@subsignal.org>
+ *   Copyright (C) 2013 Felix Fietkau <nbd@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+
+#include <libubox/blobmsg.h>
+
+#include "uhttpd.h"
+#include "hpack.h"
+
+/*
+ * HTTP/2 (RFC 7540). Every stream is handled as a client of its own, with a
+ * ustream that is not backed by a socket. The request is fed into it as if
+ * it had been read from the network, so all handlers work unchanged. What
+ * the handlers write is an HTTP/1.1 response, its header block is turned
+ * into a HEADERS frame and the body is sent in DATA frames as far as the
+ * flow control windows allow. Everything else stays buffered in the stream,
+ * which gives handlers the same backpressure as a slow socket.
+ */
+
+#define H2_PREFACE		"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN		(sizeof(H2_PREFACE) - 1)
+
+#define H2_FRAME_HDR		9
+#define H2_FRAME_MAX		16384
+#define H2_WINDOW		65535
+#define H2_WINDOW_MAX		0x7fffffff
+#define H2_MAX_STREAMS		32
+#define H2_HEADER_LIST_MAX	16384
+#define H2_HEADER_BLOCK_MAX	(32 * 1024)
+#define H2_HEAD_MAX		8192
+#define H2_CONN_PENDING_MAX	(32 * 1024)
+#define H2_STREAM_BUFFERS	32
+
+enum h2_frame_type {
+	H2_DATA,
+	H2_HEADERS,
+	H2_PRIORITY,
+	H2_RST_STREAM,
+	H2_SETTINGS,
+	H2_PUSH_PROMISE,
+	H2_PING,
+	H2_GOAWAY,
+	H2_WINDOW_UPDATE,
+	H2_CONTINUATION,
+};
+
+#define H2_FLAG_END_STREAM	0x01
+#define H2_FLAG_ACK		0x01
+#define H2_FLAG_END_HEADERS	0x04
+#define H2_FLAG_PADDED		0x08
+#define H2_FLAG_PRIORITY	0x20
+
+enum h2_error {
+	H2_NO_ERROR,
+	H2_PROTOCOL_ERROR,
+	H2_INTERNAL_ERROR,
+	H2_FLOW_CONTROL_ERROR,
+	H2_SETTINGS_TIMEOUT,
+	H2_STREAM_CLOSED,
+	H2_FRAME_SIZE_ERROR,
+	H2_REFUSED_STREAM,
+	H2_CANCEL,
+	H2_COMPRESSION_ERROR,
+	H2_CONNECT_ERROR,
+	H2_ENHANCE_YOUR_CALM,
+};
+
+enum h2_setting {
+	H2_SETTINGS_HEADER_TABLE_SIZE = 1,
+	H2_SETTINGS_ENABLE_PUSH,
+	H2_SETTINGS_MAX_CONCURRENT_STREAMS,
+	H2_SETTINGS_INITIAL_WINDOW_SIZE,
+	H2_SETTINGS_MAX_FRAME_SIZE,
+	H2_SETTINGS_MAX_HEADER_LIST_SIZE,
+};
+
+struct h2_conn {
+	struct client *cl;
+	struct list_head streams;
+	int n_streams;
+	uint32_t last_stream;
+
+	struct uh_hpack hpack;
+	struct uloop_timeout idle;
+
+	uint8_t frame[H2_FRAME_HDR + H2_FRAME_MAX];
+	int frame_len;
+
+	/* a header block may span a HEADERS and several CONTINUATION frames */
+	uint8_t *block;
+	int block_len;
+	uint32_t block_stream;
+	uint8_t block_flags;
+
+	int64_t send_window;
+	int32_t recv_window;
+	int32_t initial_window;
+
+	bool goaway;
+	bool dead;
+};
+
+struct h2_stream {
+	struct list_head list;
+	struct h2_conn *conn;
+	uint32_t id;
+
+	struct client cl;
+	struct ustream us;
+
+	int64_t send_window;
+	int32_t recv_window;
+
+	/* request pseudo header fields, until the request is set up */
+	int method;
+	char *path;
+	char *authority;
+	char *cookie;
+	int header_size;
+
+	/* response header block written by the handler */
+	char *head;
+	int head_len;
+
+	bool committed;
+	bool malformed;
+	bool bad_method;
+	bool has_length;
+	bool chunked_body;
+	bool chunk_started;
+	bool head_done;
+	bool input_done;
+	bool done;
+	bool closed;
+};
+
+static void h2_put32(uint8_t *p, uint32_t val)
+{
+	p[0] = val >> 24;
+	p[1] = val >> 16;
+	p[2] = val >> 8;
+	p[3] = val;
+}
+
+static uint32_t h2_get32(const uint8_t *p)
+{
+	return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void h2_send_frame(struct h2_conn *c, uint8_t type, uint8_t flags,
+			  uint32_t id, const void *data, int len)
+{
+	uint8_t hdr[H2_FRAME_HDR];
+
+	hdr[0] = len >> 16;
+	hdr[1] = len >> 8;
+	hdr[2] = len;
+	hdr[3] = type;
+	hdr[4] = flags;
+	h2_put32(hdr + 5, id & H2_WINDOW_MAX);
+
+	ustream_write(c->cl->us, (const char *) hdr, sizeof(hdr), len > 0);
+	if (len > 0)
+		ustream_write(c->cl->us, data, len, false);
+}
+
+static void h2_send_u32(struct h2_conn *c, uint8_t type, uint32_t id, uint32_t val)
+{
+	uint8_t buf[4];
+
+	h2_put32(buf, val);
+	h2_send_frame(c, type, 0, id, buf, sizeof(buf));
+}
+
+static void h2_conn_error(struct h2_conn *c, enum h2_error code)
+{
+	uint8_t buf[8];
+
+	if (c->dead)
+		return;
+
+	h2_put32(buf, c->last_stream);
+	h2_put32(buf + 4, code);
+	h2_send_frame(c, H2_GOAWAY, 0, 0, buf, sizeof(buf));
+
+	c->dead = true;
+	uh_connection_close(c->cl);
+}
+
+static struct h2_stream *h2_stream_find(struct h2_conn *c, uint32_t id)
+{
+	struct h2_stream *st;
+
+	list_for_each_entry(st, &c->streams, list)
+		if (st->id == id)
+			return st;
+
+	return NULL;
+}
+
+static void h2_stream_rst(struct h2_stream *st, enum h2_error code)
+{
+	if (st->closed)
+		return;
+
+	st->closed = true;
+	h2_send_u32(st->conn, H2_RST_STREAM, st->id, code);
+}
+
+/* reset a stream whose handler may still be running, it is freed later */
+static void h2_stream_abort(struct h2_stream *st, enum h2_error code)
+{
+	h2_stream_rst(st, code);
+	uh_connection_close(&st->cl);
+}
+
+static void h2_idle_cb(struct uloop_timeout *timeout)
+{
+	struct h2_conn *c = container_of(timeout, struct h2_conn, idle);
+
+	c->goaway = true;
+	h2_conn_error(c, H2_NO_ERROR);
+}
+
+static void h2_conn_idle(struct h2_conn *c)
+{
+	int sec = conf.http_keepalive ? conf.http_keepalive : conf.network_timeout;
+
+	if (c->n_streams)
+		return;
+
+	if (c->goaway)
+		h2_conn_error(c, H2_NO_ERROR);
+	else
+		uloop_timeout_set(&c->idle, sec * 1000);
+}
+
+static void __h2_stream_free(struct h2_stream *st)
+{
+	list_del(&st->list);
+	st->conn->n_streams--;
+	uh_client_release(&st->cl);
+	ustream_free(&st->us);
+	free(st->path);
+	free(st->authority);
+	free(st->cookie);
+	free(st->head);
+	free(st);
+}
+
+static void h2_stream_free(struct h2_stream *st)
+{
+	struct h2_conn *c = st->conn;
+
+	__h2_stream_free(st);
+	h2_conn_idle(c);
+}
+
+/* let the other end know the response is complete */
+static void h2_stream_end(struct h2_stream *st)
+{
+	if (st->closed)
+		return;
+
+	if (!st->head_done) {
+		h2_stream_rst(st, H2_INTERNAL_ERROR);
+		return;
+	}
+
+	h2_send_frame(st->conn, H2_DATA, H2_FLAG_END_STREAM, st->id, NULL, 0);
+
+	/* the rest of the request body is not going to be read */
+	if (!st->input_done)
+		h2_send_u32(st->conn, H2_RST_STREAM, st->id, H2_NO_ERROR);
+
+	st->closed = true;
+}
+
+static void h2_stream_state_cb(struct ustream *s)
+{
+	struct h2_stream *st = container_of(s, struct h2_stream, us);
+
+	if (st->done) {
+		if (s->w.data_bytes && !st->closed)
+			return;
+
+		h2_stream_end(st);
+	} else {
+		h2_stream_rst(st, H2_INTERNAL_ERROR);
+	}
+
+	h2_stream_free(st);
+}
+
+/* flush the streams in turn, as far as the connection can take it */
+static void h2_conn_flush(struct h2_conn *c)
+{
+	struct h2_stream *st;
+	int n = c->n_streams;
+
+	while (n-- > 0 && c->cl->us->w.data_bytes < H2_CONN_PENDING_MAX) {
+		st = list_first_entry(&c->streams, struct h2_stream, list);
+		list_move_tail(&st->list, &c->streams);
+
+		if (st->us.w.data_bytes)
+			ustream_write_pending(&st->us);
+	}
+}
+
+static bool h2_hop_header(const char *name)
+{
+	static const char * const hop[] = {
+		"connection", "keep-alive", "proxy-connection",
+		"transfer-encoding", "upgrade",
+	};
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(hop); i++)
+		if (!strcmp(name, hop[i]))
+			return true;
+
+	return false;
+}
+
+static void h2_send_headers(struct h2_stream *st, const uint8_t *block, int len)
+{
+	struct h2_conn *c = st->conn;
+	uint8_t type = H2_HEADERS;
+	int cur;
+
+	do {
+		cur = min(len, H2_FRAME_MAX);
+		len -= cur;
+		h2_send_frame(c, type, len ? 0 : H2_FLAG_END_HEADERS, st->id, block, cur);
+		block += cur;
+		type = H2_CONTINUATION;
+	} while (len > 0);
+}
+
+/* turn the HTTP/1.1 response header block into a HEADERS frame */
+static int h2_stream_send_head(struct h2_stream *st, int len)
+{
+	static uint8_t block[2 * H2_HEAD_MAX];
+	char *line, *next, *val, *p, status[4];
+	int code, ofs, ret;
+
+	st->head[len] = 0;
+	line = st->head;
+	next = strstr(line, "\r\n");
+	*next = 0;
+
+	p = strchr(line, ' ');
+	if (strncmp(line, "HTTP/", 5) != 0 || !p)
+		return -1;
+
+	code = atoi(p + 1);
+	if (code < 100 || code > 999)
+		return -1;
+
+	snprintf(status, sizeof(status), "%d", code);
+	ofs = uh_hpack_encode(block, sizeof(block), ":status", status);
+	if (ofs < 0)
+		return -1;
+
+	for (line = next + 2; *line; line = next + 2) {
+		next = strstr(line, "\r\n");
+		*next = 0;
+		if (!*line)
+			break;
+
+		val = strchr(line, ':');
+		if (!val)
+			continue;
+
+		*val++ = 0;
+		while (isspace(*val))
+			val++;
+
+		for (p = line; *p; p++)
+			*p = tolower(*p);
+
+		if (h2_hop_header(line))
+			continue;
+
+		ret = uh_hpack_encode(block + ofs, sizeof(block) - ofs, line, val);
+		if (ret < 0)
+			return -1;
+
+		ofs += ret;
+	}
+
+	h2_send_headers(st, block, ofs);
+
+	/* an interim response, the final one follows */
+	st->head_len = 0;
+	if (code < 200)
+		return 0;
+
+	st->head_done = true;
+	free(st->head);
+	st->head = NULL;
+
+	return 0;
+}
+
+/* collect the response header block, returns the number of bytes used */
+static int h2_stream_head(struct h2_stream *st, const char *buf, int len)
+{
+	int old = st->head_len;
+	int start = max(old - 3, 0);
+	char *end;
+	int n;
+
+	if (!st->head) {
+		st->head = malloc(H2_HEAD_MAX + 1);
+		if (!st->head)
+			return -1;
+	}
+
+	n = min(len, H2_HEAD_MAX - old);
+	if (!n)
+		return -1;
+
+	memcpy(st->head + old, buf, n);
+	st->head_len += n;
+
+	end = memmem(st->head + start, st->head_len - start, "\r\n\r\n", 4);
+	if (!end)
+		return n;
+
+	n = end + 4 - st->head;
+	if (h2_stream_send_head(st, n) < 0)
+		return -1;
+
+	return n - old;
+}
+
+static int h2_stream_body(struct h2_stream *st, const char *buf, int len)
+{
+	struct h2_conn *c = st->conn;
+	int sent = 0;
+	int cur;
+
+	len = min(len, min(st->send_window, c->send_window));
+	while (sent < len && c->cl->us->w.data_bytes < H2_CONN_PENDING_MAX) {
+		cur = min(len - sent, H2_FRAME_MAX);
+		h2_send_frame(c, H2_DATA, 0, st->id, buf + sent, cur);
+		st->send_window -= cur;
+		c->send_window -= cur;
+		sent += cur;
+	}
+
+	return sent;
+}
+
+static int h2_stream_write(struct ustream *s, const char *buf, int len, bool more)
+{
+	struct h2_stream *st = container_of(s, struct h2_stream, us);
+	int ret = 0;
+	int cur;
+
+	/* nobody is listening anymore */
+	if (st->closed || st->conn->dead)
+		return len;
+
+	while (!st->head_done && ret < len) {
+		cur = h2_stream_head(st, buf + ret, len - ret);
+		if (cur < 0) {
+			h2_stream_abort(st, H2_INTERNAL_ERROR);
+			return len;
+		}
+
+		ret += cur;
+	}
+
+	if (ret < len)
+		ret += h2_stream_body(st, buf + ret, len - ret);
+
+	st->cl.bytes_out += ret;
+	return ret;
+}
+
+static void h2_stream_read_cb(struct ustream *s, int bytes)
+{
+	struct h2_stream *st = container_of(s, struct h2_stream, us);
+
+	uh_client_read_cb(&st->cl);
+}
+
+static void h2_stream_write_cb(struct ustream *s, int bytes)
+{
+	struct h2_stream *st = container_of(s, struct h2_stream, us);
+	struct client *cl = &st->cl;
+
+	if (cl->dispatch.write_cb)
+		cl->dispatch.write_cb(cl);
+}
+
+static void h2_stream_timeout(struct uloop_timeout *timeout)
+{
+	struct client *cl = container_of(timeout, struct client, timeout);
+
+	uh_connection_close(cl);
+}
+
+/* open the stream window again once the handler has consumed the body */
+static void h2_stream_window(struct h2_stream *st)
+{
+	int inc;
+
+	if (st->input_done || st->closed)
+		return;
+
+	inc = H2_WINDOW - st->recv_window - st->us.r.data_bytes;
+	if (inc < H2_WINDOW / 2)
+		return;
+
+	st->recv_window += inc;
+	h2_send_u32(st->conn, H2_WINDOW_UPDATE, st->id, inc);
+}
+
+void uh_h2_stream_poll(struct client *cl)
+{
+	h2_stream_window(cl->h2);
+}
+
+/* called once the handler is done with the request */
+void uh_h2_stream_done(struct client *cl)
+{
+	struct h2_stream *st = cl->h2;
+
+	cl->state = CLIENT_STATE_DONE;
+	uloop_timeout_cancel(&cl->timeout);
+
+	st->done = true;
+	st->us.eof = true;
+	ustream_state_change(&st->us);
+}
+
+static bool h2_stream_push(struct h2_stream *st, const char *data, int len, bool contiguous)
+{
+	int maxlen, cur;
+	char *buf;
+
+	while (len > 0) {
+		buf = ustream_reserve(&st->us, contiguous ? len : 1, &maxlen);
+		if (!buf)
+			return false;
+
+		cur = min(len, maxlen);
+		memcpy(buf, data, cur);
+		ustream_fill_read(&st->us, cur);
+		data += cur;
+		len -= cur;
+	}
+
+	return true;
+}
+
+/*
+ * Pass request body data on to the handler. Handlers expect the body of a
+ * request without a length to be chunked, so it is encoded that way.
+ */
+static bool h2_stream_feed(struct h2_stream *st, const char *data, int len, bool end)
+{
+	char hdr[16];
+	int hdr_len;
+
+	if (st->chunked_body) {
+		if (len) {
+			hdr_len = snprintf(hdr, sizeof(hdr), "%s%X\r\n",
+					   st->chunk_started ? "\r\n" : "", len);
+			if (!h2_stream_push(st, hdr, hdr_len, true))
+				return false;
+
+			st->chunk_started = true;
+		}
+
+		if (!h2_stream_push(st, data, len, false))
+			return false;
+
+		if (end && !h2_stream_push(st, st->chunk_started ? "\r\n0\r\n" : "0\r\n",
+					   st->chunk_started ? 5 : 3, true))
+			return false;
+	} else if (st->has_length) {
+		if (!h2_stream_push(st, data, len, false))
+			return false;
+	}
+
+	if (end)
+		st->input_done = true;
+
+	return true;
+}
+
+static bool h2_stream_commit(struct h2_stream *st)
+{
+	struct client *cl = &st->cl;
+	struct http_request *r = &cl->request;
+
+	st->committed = true;
+	if (!st->path || *st->path != '/' || st->method < 0) {
+		st->malformed = true;
+		return false;
+	}
+
+	blob_buf_init(&cl->hdr, 0);
+	blobmsg_add_string(&cl->hdr, "URL", st->path);
+	r->method = st->method;
+	r->version = UH_HTTP_VER_2;
+	r->t_begin = uh_time_us();
+
+	cl->state = CLIENT_STATE_HEADER;
+	if (st->authority)
+		uh_client_header(cl, "host", st->authority);
+
+	return cl->state == CLIENT_STATE_HEADER;
+}
+
+static bool h2_pseudo_header(struct h2_stream *st, const char *name, const char *val)
+{
+	int i;
+
+	if (!strcmp(name, ":method")) {
+		for (i = 0; i <= UH_HTTP_MSG_HEAD; i++)
+			if (!strcmp(http_methods[i], val))
+				break;
+
+		st->bad_method = i > UH_HTTP_MSG_HEAD;
+		st->method = st->bad_method ? UH_HTTP_MSG_GET : i;
+	} else if (!strcmp(name, ":path")) {
+		free(st->path);
+		st->path = strdup(val);
+	} else if (!strcmp(name, ":authority")) {
+		free(st->authority);
+		st->authority = strdup(val);
+	} else if (strcmp(name, ":scheme") != 0) {
+		return false;
+	}
+
+	return true;
+}
+
+static bool h2_stream_cookie(struct h2_stream *st, const char *val)
+{
+	int len = st->cookie ? strlen(st->cookie) : 0;
+	char *cookie;
+
+	cookie = realloc(st->cookie, len + strlen(val) + 3);
+	if (!cookie)
+		return false;
+
+	sprintf(cookie + len, "%s%s", len ? "; " : "", val);
+	st->cookie = cookie;
+
+	return true;
+}
+
+static bool h2_header_cb(void *priv, const char *name, const char *val, int val_len)
+{
+	struct h2_stream *st = priv;
+	struct client *cl = &st->cl;
+	const char *p;
+
+	/* the rest of the block is still decoded, to keep the table in sync */
+	if (st->malformed || (st->committed && cl->state != CLIENT_STATE_HEADER))
+		return true;
+
+	st->header_size += strlen(name) + val_len + 32;
+	if (st->header_size > H2_HEADER_LIST_MAX ||
+	    memchr(val, 0, val_len) || strpbrk(val, "\r\n")) {
+		st->malformed = true;
+		return true;
+	}
+
+	if (*name == ':') {
+		if (st->committed || !h2_pseudo_header(st, name, val))
+			st->malformed = true;
+
+		return true;
+	}
+
+	for (p = name; *p; p++) {
+		if (isupper(*p) || *p <= ' ' || *p == ':') {
+			st->malformed = true;
+			return true;
+		}
+	}
+
+	if (!st->committed && !h2_stream_commit(st))
+		return true;
+
+	if (!strcmp(name, "cookie")) {
+		if (!h2_stream_cookie(st, val))
+			st->malformed = true;
+
+		return true;
+	}
+
+	/* connection specific fields have no meaning here */
+	if (h2_hop_header(name) || !strcmp(name, "te"))
+		return true;
+
+	if (!strcmp(name, "content-length"))
+		st->has_length = true;
+
+	uh_client_header(cl, name, val);
+	return true;
+}
+
+static bool h2_ignore_cb(void *priv, const char *name, const char *val, int val_len)
+{
+	return true;
+}
+
+/* the request header block is complete, hand the request to the handlers */
+static void h2_stream_begin(struct h2_stream *st, bool end)
+{
+	struct client *cl = &st->cl;
+	struct http_request *r = &cl->request;
+
+	if (!st->malformed && !st->committed)
+		h2_stream_commit(st);
+
+	if (st->malformed) {
+		h2_stream_rst(st, H2_PROTOCOL_ERROR);
+		h2_stream_free(st);
+		return;
+	}
+
+	/* already answered while looking at the header fields */
+	if (cl->state != CLIENT_STATE_HEADER)
+		return;
+
+	if (st->cookie)
+		uh_client_header(cl, "cookie", st->cookie);
+
+	if (st->bad_method) {
+		uh_client_error(cl, 400, "Bad Request", NULL);
+		return;
+	}
+
+	st->input_done = end;
+	if (end && r->content_length > 0) {
+		h2_stream_rst(st, H2_PROTOCOL_ERROR);
+		h2_stream_free(st);
+		return;
+	}
+
+	if (!end && !st->has_length && r->method == UH_HTTP_MSG_POST) {
+		r->transfer_chunked = 1;
+		st->chunked_body = true;
+	}
+
+	cl->state = CLIENT_STATE_DATA;
+	uh_client_header_complete(cl);
+	if (cl->state == CLIENT_STATE_DATA)
+		client_poll_post_data(cl);
+}
+
+static void h2_stream_open(struct h2_conn *c, uint32_t id, bool end)
+{
+	struct h2_stream *st;
+	struct client *cl;
+
+	if (c->n_streams >= H2_MAX_STREAMS || c->goaway)
+		goto refuse;
+
+	st = calloc(1, sizeof(*st));
+	if (!st)
+		goto refuse;
+
+	st->conn = c;
+	st->id = id;
+	st->method = -1;
+	st->send_window = c->initial_window;
+	st->recv_window = H2_WINDOW;
+	list_add_tail(&st->list, &c->streams);
+	c->n_streams++;
+	uloop_timeout_cancel(&c->idle);
+	uh_stats.h2_streams++;
+
+	st->us.write = h2_stream_write;
+	st->us.notify_read = h2_stream_read_cb;
+	st->us.notify_write = h2_stream_write_cb;
+	st->us.notify_state = h2_stream_state_cb;
+	st->us.string_data = true;
+	st->us.r.max_buffers = H2_STREAM_BUFFERS;
+	ustream_init_defaults(&st->us);
+
+	cl = &st->cl;
+	INIT_LIST_HEAD(&cl->list);
+	cl->us = &st->us;
+	cl->h2 = st;
+	cl->id = c->cl->id;
+	cl->tls = c->cl->tls;
+	cl->srv_addr = c->cl->srv_addr;
+	cl->peer_addr = c->cl->peer_addr;
+	cl->limit = c->cl->limit;
+	cl->timeout.cb = h2_stream_timeout;
+
+	if (uh_hpack_decode(&c->hpack, c->block, c->block_len, h2_header_cb, st) < 0) {
+		h2_conn_error(c, H2_COMPRESSION_ERROR);
+		return;
+	}
+
+	h2_stream_begin(st, end);
+	return;
+
+refuse:
+	if (uh_hpack_decode(&c->hpack, c->block, c->block_len, h2_ignore_cb, NULL) < 0) {
+		h2_conn_error(c, H2_COMPRESSION_ERROR);
+		return;
+	}
+
+	h2_send_u32(c, H2_RST_STREAM, id, H2_REFUSED_STREAM);
+}
+
+static void h2_header_block(struct h2_conn *c)
+{
+	uint32_t id = c->block_stream;
+	struct h2_stream *st;
+
+	c->block_stream = 0;
+
+	if (id > c->last_stream) {
+		c->last_stream = id;
+		h2_stream_open(c, id, c->block_flags & H2_FLAG_END_STREAM);
+		return;
+	}
+
+	/* trailers, or a stream which is gone already */
+	if (uh_hpack_decode(&c->hpack, c->block, c->block_len, h2_ignore_cb, NULL) < 0) {
+		h2_conn_error(c, H2_COMPRESSION_ERROR);
+		return;
+	}
+
+	st = h2_stream_find(c, id);
+	if (!st || st->input_done)
+		return;
+
+	if (!(c->block_flags & H2_FLAG_END_STREAM)) {
+		h2_stream_abort(st, H2_PROTOCOL_ERROR);
+		return;
+	}
+
+	if (!h2_stream_feed(st, NULL, 0, true))
+		h2_stream_abort(st, H2_INTERNAL_ERROR);
+}
+
+static bool h2_block_append(struct h2_conn *c, const uint8_t *data, int len)
+{
+	if (!c->block) {
+		c->block = malloc(H2_HEADER_BLOCK_MAX);
+		if (!c->block)
+			return false;
+	}
+
+	if (c->block_len + len > H2_HEADER_BLOCK_MAX)
+		return false;
+
+	memcpy(c->block + c->block_len, data, len);
+	c->block_len += len;
+
+	return true;
+}
+
+static bool h2_unpad(uint8_t flags, const uint8_t **data, int *len)
+{
+	int pad;
+
+	if (!(flags & H2_FLAG_PADDED))
+		return true;
+
+	if (*len < 1)
+		return false;
+
+	pad = **data;
+	(*data)++;
+	(*len)--;
+	if (pad > *len)
+		return false;
+
+	*len -= pad;
+	return true;
+}
+
+static void h2_handle_headers(struct h2_conn *c, uint32_t id, uint8_t flags,
+			      const uint8_t *data, int len)
+{
+	if (!(id & 1) || !h2_unpad(flags, &data, &len))
+		return h2_conn_error(c, H2_PROTOCOL_ERROR);
+
+	if (flags & H2_FLAG_PRIORITY) {
+		if (len < 5)
+			return h2_conn_error(c, H2_FRAME_SIZE_ERROR);
+
+		data += 5;
+		len -= 5;
+	}
+
+	c->block_len = 0;
+	c->block_stream = id;
+	c->block_flags = flags;
+	if (!h2_block_append(c, data, len))
+		return h2_conn_error(c, H2_ENHANCE_YOUR_CALM);
+
+	if (flags & H2_FLAG_END_HEADERS)
+		h2_header_block(c);
+}
+
+static void h2_handle_continuation(struct h2_conn *c, uint32_t id, uint8_t flags,
+				   const uint8_t *data, int len)
+{
+	if (!c->block_stream)
+		return h2_conn_error(c, H2_PROTOCOL_ERROR);
+
+	if (!h2_block_append(c, data, len))
+		return h2_conn_error(c, H2_ENHANCE_YOUR_CALM);
+
+	if (flags & H2_FLAG_END_HEADERS)
+		h2_header_block(c);
+}
+
+static void h2_handle_data(struct h2_conn *c, uint32_t id, uint8_t flags,
+			   const uint8_t *data, int len)
+{
+	struct h2_stream *st;
+	int frame_len = len;
+
+	if (!id || !h2_unpad(flags, &data, &len))
+		return h2_conn_error(c, H2_PROTOCOL_ERROR);
+
+	/* flow control counts the whole frame, padding included */
+	c->recv_window -= frame_len;
+	if (c->recv_window < 0)
+		return h2_conn_error(c, H2_FLOW_CONTROL_ERROR);
+
+	if (c->recv_window < H2_WINDOW / 2) {
+		h2_send_u32(c, H2_WINDOW_UPDATE, 0, H2_WINDOW - c->recv_window);
+		c->recv_window = H2_WINDOW;
+	}
+
+	st = h2_stream_find(c, id);
+	if (!st) {
+		if (id > c->last_stream)
+			h2_conn_error(c, H2_PROTOCOL_ERROR);
+
+		return;
+	}
+
+	if (st->input_done)
+		return h2_stream_abort(st, H2_STREAM_CLOSED);
+
+	st->recv_window -= frame_len;
+	if (st->recv_window < 0)
+		return h2_stream_abort(st, H2_FLOW_CONTROL_ERROR);
+
+	if (!h2_stream_feed(st, (const char *) data, len, flags & H2_FLAG_END_STREAM))
+		return h2_stream_abort(st, H2_INTERNAL_ERROR);
+
+	h2_stream_window(st);
+}
+
+static void h2_handle_settings(struct h2_conn *c, uint32_t id, uint8_t flags,
+			       const uint8_t *data, int len)
+{
+	struct h2_stream *st;
+	uint32_t val;
+	int delta;
+
+	if (id)
+		return h2_conn_error(c, H2_PROTOCOL_ERROR);
+
+	if (flags & H2_FLAG_ACK) {
+		if (len)
+			h2_conn_error(c, H2_FRAME_SIZE_ERROR);
+		return;
+	}
+
+	if (len % 6)
+		return h2_conn_error(c, H2_FRAME_SIZE_ERROR);
+
+	for (; len > 0; data += 6, len -= 6) {
+		val = h2_get32(data + 2);
+
+		switch (data[0] << 8 | data[1]) {
+		case H2_SETTINGS_ENABLE_PUSH:
+			if (val > 1)
+				return h2_conn_error(c, H2_PROTOCOL_ERROR);
+			break;
+
+		case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+			if (val > H2_WINDOW_MAX)
+				return h2_conn_error(c, H2_FLOW_CONTROL_ERROR);
+
+			delta = val - c->initial_window;
+			c->initial_window = val;
+			list_for_each_entry(st, &c->streams, list)
+				st->send_window += delta;
+			break;
+
+		case H2_SETTINGS_MAX_FRAME_SIZE:
+			/* frames are never sent larger than the default anyway */
+			if (val < H2_FRAME_MAX || val > 0xffffff)
+				return h2_conn_error(c, H2_PROTOCOL_ERROR);
+			break;
+		}
+	}
+
+	h2_send_frame(c, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+	h2_conn_flush(c);
+}
+
+static void h2_handle_window_update(struct h2_conn *c, uint32_t id,
+				    const uint8_t *data, int len)
+{
+	struct h2_stream *st;
+	uint32_t inc;
+
+	if (len != 4)
+		return h2_conn_error(c, H2_FRAME_SIZE_ERROR);
+
+	inc = h2_get32(data) & H2_WINDOW_MAX;
+	if (!id) {
+		if (!inc)
+			return h2_conn_error(c, H2_PROTOCOL_ERROR);
+
+		c->send_window += inc;
+		if (c->send_window > H2_WINDOW_MAX)
+			return h2_conn_error(c, H2_FLOW_CONTROL_ERROR);
+	} else {
+		st = h2_stream_find(c, id);
+		if (!st)
+			return;
+
+		if (!inc)
+			return h2_stream_abort(st, H2_PROTOCOL_ERROR);
+
+		st->send_window += inc;
+		if (st->send_window > H2_WINDOW_MAX)
+			return h2_stream_abort(st, H2_FLOW_CONTROL_ERROR);
+	}
+
+	h2_conn_flush(c);
+}
+
+static void h2_handle_frame(struct h2_conn *c)
+{
+	const uint8_t *f = c->frame;
+	const uint8_t *data = f + H2_FRAME_HDR;
+	int len = f[0] << 16 | f[1] << 8 | f[2];
+	uint8_t type = f[3], flags = f[4];
+	uint32_t id = h2_get32(f + 5) & H2_WINDOW_MAX;
+	struct h2_stream *st;
+
+	/* nothing may come between the frames of a header block */
+	if (c->block_stream && (type != H2_CONTINUATION || id != c->block_stream))
+		return h2_conn_error(c, H2_PROTOCOL_ERROR);
+
+	switch (type) {
+	case H2_DATA:
+		return h2_handle_data(c, id, flags, data, len);
+
+	case H2_HEADERS:
+		return h2_handle_headers(c, id, flags, data, len);
+
+	case H2_CONTINUATION:
+		return h2_handle_continuation(c, id, flags, data, len);
+
+	case H2_PRIORITY:
+		if (!id)
+			h2_conn_error(c, H2_PROTOCOL_ERROR);
+		return;
+
+	case H2_RST_STREAM:
+		if (!id)
+			return h2_conn_error(c, H2_PROTOCOL_ERROR);
+		if (len != 4)
+			return h2_conn_error(c, H2_FRAME_SIZE_ERROR);
+
+		st = h2_stream_find(c, id);
+		if (st) {
+			st->closed = true;
+			h2_stream_free(st);
+		}
+		return;
+
+	case H2_SETTINGS:
+		return h2_handle_settings(c, id, flags, data, len);
+
+	case H2_PUSH_PROMISE:
+		return h2_conn_error(c, H2_PROTOCOL_ERROR);
+
+	case H2_PING:
+		if (id)
+			return h2_conn_error(c, H2_PROTOCOL_ERROR);
+		if (len != 8)
+			return h2_conn_error(c, H2_FRAME_SIZE_ERROR);
+
+		if (!(flags & H2_FLAG_ACK))
+			h2_send_frame(c, H2_PING, H2_FLAG_ACK, 0, data, len);
+		return;
+
+	case H2_GOAWAY:
+		if (id)
+			return h2_conn_error(c, H2_PROTOCOL_ERROR);
+
+		/* finish what was started, then close */
+		c->goaway = true;
+		h2_conn_idle(c);
+		return;
+
+	case H2_WINDOW_UPDATE:
+		return h2_handle_window_update(c, id, data, len);
+	}
+}
+
+bool uh_h2_read(struct client *cl, char *buf, int len)
+{
+	struct h2_conn *c = cl->dispatch.h2;
+	int ofs = 0, need, cur;
+
+	while (ofs < len && !c->dead) {
+		need = H2_FRAME_HDR;
+		if (c->frame_len >= H2_FRAME_HDR)
+			need += c->frame[0] << 16 | c->frame[1] << 8 | c->frame[2];
+
+		if (need > sizeof(c->frame)) {
+			h2_conn_error(c, H2_FRAME_SIZE_ERROR);
+			break;
+		}
+
+		cur = min(need - c->frame_len, len - ofs);
+		memcpy(c->frame + c->frame_len, buf + ofs, cur);
+		c->frame_len += cur;
+		ofs += cur;
+
+		if (c->frame_len < need)
+			continue;
+
+		/* with the frame header complete, the payload length is known */
+		if (need == H2_FRAME_HDR &&
+		    (c->frame[0] || c->frame[1] || c->frame[2]))
+			continue;
+
+		c->frame_len = 0;
+		h2_handle_frame(c);
+	}
+
+	ustream_consume(cl->us, len);
+	return true;
+}
+
+static void h2_conn_free(struct client *cl)
+{
+	struct h2_conn *c = cl->dispatch.h2;
+
+	while (!list_empty(&c->streams))
+		__h2_stream_free(list_first_entry(&c->streams, struct h2_stream, list));
+
+	uloop_timeout_cancel(&c->idle);
+	uh_hpack_free(&c->hpack);
+	free(c->block);
+	free(c);
+}
+
+static void h2_conn_write_cb(struct client *cl)
+{
+	h2_conn_flush(cl->dispatch.h2);
+}
+
+static void h2_conn_close_fds(struct client *cl)
+{
+	struct h2_conn *c = cl->dispatch.h2;
+	struct h2_stream *st;
+
+	list_for_each_entry(st, &c->streams, list)
+		if (st->cl.dispatch.close_fds)
+			st->cl.dispatch.close_fds(&st->cl);
+}
+
+/*
+ * Called with the start of the first request on a connection. If it is the
+ * HTTP/2 connection preface, the connection switches over for good.
+ */
+bool uh_h2_accept(struct client *cl, char *buf, int len)
+{
+	static const uint8_t settings[] = {
+		0, H2_SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, 0, H2_MAX_STREAMS,
+		0, H2_SETTINGS_MAX_HEADER_LIST_SIZE,
+		0, 0, H2_HEADER_LIST_MAX >> 8, H2_HEADER_LIST_MAX & 0xff,
+	};
+	struct h2_conn *c;
+
+	if (len < H2_PREFACE_LEN)
+		return false;
+
+	if (memcmp(buf, H2_PREFACE, H2_PREFACE_LEN) != 0 ||
+	    !(c = calloc(1, sizeof(*c)))) {
+		uh_client_error(cl, 400, "Bad Request", NULL);
+		uh_connection_close(cl);
+		return true;
+	}
+
+	ustream_consume(cl->us, H2_PREFACE_LEN);
+	uloop_timeout_cancel(&cl->timeout);
+
+	c->cl = cl;
+	INIT_LIST_HEAD(&c->streams);
+	uh_hpack_init(&c->hpack);
+	c->idle.cb = h2_idle_cb;
+	c->send_window = H2_WINDOW;
+	c->recv_window = H2_WINDOW;
+	c->initial_window = H2_WINDOW;
+
+	cl->dispatch.h2 = c;
+	cl->dispatch.free = h2_conn_free;
+	cl->dispatch.write_cb = h2_conn_write_cb;
+	cl->dispatch.close_fds = h2_conn_close_fds;
+	cl->state = CLIENT_STATE_H2;
+	uh_stats.h2_connections++;
+
+	h2_send_frame(c, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+	h2_conn_idle(c);
+
+	return true;
+}
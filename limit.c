@@ -0,0 +1,198 @@
+/*
+ * uhttpd - Tiny single-threaded httpd
+ *
+ *   Copyright (C) 2010-2013 Jo-Philipp Wich <xm@subsignal.org>
+ *   Copyright (C) 2013 Felix Fietkau <nbd@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "uhttpd.h"
+
+/*
+ * Per peer address accounting. The table is a fixed size open addressing
+ * hash with a short probe window, so lookups never allocate and never walk
+ * more than a couple of cache lines. Entries without open connections are
+ * recycled in least recently used order once a window is full; if that is
+ * not possible the client is let through unaccounted.
+ */
+
+#define UH_LIMIT_SLOTS	1024
+#define UH_LIMIT_PROBE	8
+
+struct uh_limit_entry {
+	struct in6_addr addr;
+	uint64_t last;
+	int tokens;
+	uint16_t conns;
+	bool used;
+};
+
+static struct uh_limit_entry limit_table[UH_LIMIT_SLOTS];
+static uint32_t limit_seed;
+
+unsigned long limit_rejected_conns;
+unsigned long limit_rejected_requests;
+
+static void uh_limit_key(struct in6_addr *key, const struct uh_addr *addr)
+{
+	int bits = conf.limit_ipv6_prefix;
+	int i;
+
+	memset(key, 0, sizeof(*key));
+
+	if (addr->family == AF_INET) {
+		key->s6_addr[10] = 0xff;
+		key->s6_addr[11] = 0xff;
+		memcpy(&key->s6_addr[12], &addr->in, sizeof(addr->in));
+		return;
+	}
+
+	/* IPv4 peers of a dual stack socket are still one host each */
+	if (IN6_IS_ADDR_V4MAPPED(&addr->in6)) {
+		*key = addr->in6;
+		return;
+	}
+
+	if (bits <= 0 || bits > 128)
+		bits = 128;
+
+	for (i = 0; i < 16 && bits > 0; i++, bits -= 8)
+		key->s6_addr[i] = addr->in6.s6_addr[i] &
+			(bits >= 8 ? 0xff : 0xff << (8 - bits));
+}
+
+static uint32_t uh_limit_hash(const struct in6_addr *key)
+{
+	uint32_t h = 2166136261U ^ limit_seed;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		h ^= key->s6_addr[i];
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+static struct uh_limit_entry *uh_limit_get(const struct uh_addr *addr, uint64_t now)
+{
+	struct uh_limit_entry *e, *victim = NULL;
+	struct in6_addr key;
+	uint32_t h;
+	int i, fd;
+
+	/* an unpredictable seed keeps clients from aiming at one bucket */
+	if (!limit_seed) {
+		fd = open("/dev/urandom", O_RDONLY);
+		if (fd < 0 || read(fd, &limit_seed, sizeof(limit_seed)) <= 0)
+			limit_seed = now ^ getpid();
+		if (fd >= 0)
+			close(fd);
+		limit_seed |= 1;
+	}
+
+	uh_limit_key(&key, addr);
+	h = uh_limit_hash(&key);
+
+	for (i = 0; i < UH_LIMIT_PROBE; i++) {
+		e = &limit_table[(h + i) % UH_LIMIT_SLOTS];
+
+		if (e->used && !memcmp(&e->addr, &key, sizeof(key)))
+			return e;
+
+		if (!e->used) {
+			if (!victim || victim->used)
+				victim = e;
+			continue;
+		}
+
+		if (e->conns)
+			continue;
+
+		if (!victim || (victim->used && e->last < victim->last))
+			victim = e;
+	}
+
+	if (!victim)
+		return NULL;
+
+	memset(victim, 0, sizeof(*victim));
+	victim->addr = key;
+	victim->used = true;
+	victim->last = now;
+	victim->tokens = conf.limit_burst * 1000;
+
+	return victim;
+}
+
+bool uh_limit_accept(struct client *cl)
+{
+	struct uh_limit_entry *e;
+
+	if (!conf.limit_conns && !conf.limit_rate)
+		return true;
+
+	e = uh_limit_get(&cl->peer_addr, uh_time_ms());
+	if (!e)
+		return true;
+
+	if (conf.limit_conns && e->conns >= conf.limit_conns) {
+		limit_rejected_conns++;
+		return false;
+	}
+
+	if (!conf.limit_rate)
+		e->last = uh_time_ms();
+
+	e->conns++;
+	cl->limit = e;
+
+	return true;
+}
+
+void uh_limit_release(struct client *cl)
+{
+	if (!cl->limit)
+		return;
+
+	cl->limit->conns--;
+	cl->limit = NULL;
+}
+
+/* token bucket, tokens are kept in thousandths to refill once per ms */
+bool uh_limit_request(struct client *cl)
+{
+	struct uh_limit_entry *e = cl->limit;
+	int burst = conf.limit_burst * 1000;
+	uint64_t now;
+
+	if (!conf.limit_rate || !e)
+		return true;
+
+	now = uh_time_ms();
+	if (now - e->last >= (uint64_t) burst / conf.limit_rate)
+		e->tokens = burst;
+	else
+		e->tokens = min(burst, e->tokens + (int) (now - e->last) * conf.limit_rate);
+
+	e->last = now;
+
+	if (e->tokens < 1000) {
+		limit_rejected_requests++;
+		return false;
+	}
+
+	e->tokens -= 1000;
+	return true;
+}
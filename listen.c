@@ -32,6 +32,7 @@ struct listener {
 	struct sockaddr_in6 addr;
 	bool tls;
 	bool blocked;
+	bool wildcard;
 };
 
 static LIST_HEAD(listeners);
@@ -87,8 +88,20 @@ static void listener_cb(struct uloop_fd *fd, unsigned int events)
 {
 	struct listener *l = container_of(fd, struct listener, fd);
 
+	while (conf.shed_load && conf.max_connections) {
+		if (n_clients < conf.max_connections || uh_evict_idle_client()) {
+			if (!uh_accept_client(fd->fd, l->tls, l->wildcard ? NULL : &l->addr))
+				return;
+
+			continue;
+		}
+
+		if (!uh_reject_client(fd->fd, l->tls))
+			return;
+	}
+
 	while (1) {
-		if (!uh_accept_client(fd->fd, l->tls))
+		if (!uh_accept_client(fd->fd, l->tls, l->wildcard ? NULL : &l->addr))
 			break;
 	}
 
@@ -96,6 +109,23 @@ static void listener_cb(struct uloop_fd *fd, unsigned int events)
 		uh_block_listener(l);
 }
 
+static void uh_listener_addr(struct listener *l)
+{
+	struct sockaddr_in *sin = (struct sockaddr_in *) &l->addr;
+	socklen_t sl = sizeof(l->addr);
+
+	/* connections on a wildcard listener may arrive on any local address,
+	 * those have to be looked up per client */
+	l->wildcard = true;
+	if (getsockname(l->fd.fd, (struct sockaddr *) &l->addr, &sl))
+		return;
+
+	if (sin->sin_family == AF_INET)
+		l->wildcard = sin->sin_addr.s_addr == htonl(INADDR_ANY);
+	else
+		l->wildcard = IN6_IS_ADDR_UNSPECIFIED(&l->addr.sin6_addr);
+}
+
 void uh_setup_listeners(void)
 {
 	struct listener *l;
@@ -121,6 +151,27 @@ void uh_setup_listeners(void)
 			setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes));
 		}
 
+		/* sockets are bound while parsing the command line, apply the
+		 * backlog here so that the option order does not matter */
+		if (conf.listen_backlog)
+			listen(sock, conf.listen_backlog);
+
+#ifdef linux
+		/* only wake up once the request has arrived */
+		if (conf.tcp_defer_accept > 0)
+			setsockopt(sock, SOL_TCP, TCP_DEFER_ACCEPT,
+				   &conf.tcp_defer_accept, sizeof(conf.tcp_defer_accept));
+
+#ifdef TCP_FASTOPEN
+		/* accept request data carried in the SYN */
+		if (conf.tcp_fastopen > 0)
+			setsockopt(sock, SOL_TCP, TCP_FASTOPEN,
+				   &conf.tcp_fastopen, sizeof(conf.tcp_fastopen));
+#endif
+#endif
+
+		uh_listener_addr(l);
+
 		l->fd.cb = listener_cb;
 		uloop_fd_add(&l->fd, ULOOP_READ);
 	}
@@ -132,7 +183,6 @@ int uh_socket_bind(const char *host, const char *port, bool tls)
 	int yes = 1;
 	int status;
 	int bound = 0;
-	struct listener *l = NULL;
 	struct addrinfo *addrs = NULL, *p = NULL;
 	static struct addrinfo hints = {
 		.ai_family = AF_UNSPEC,
@@ -179,17 +229,10 @@ int uh_socket_bind(const char *host, const char *port, bool tls)
 			goto error;
 		}
 
-		fd_cloexec(sock);
-
-		l = calloc(1, sizeof(*l));
-		if (!l)
+		if (!uh_socket_adopt(sock, tls))
 			goto error;
 
-		l->fd.fd = sock;
-		l->tls = tls;
-		list_add_tail(&l->list, &listeners);
 		bound++;
-
 		continue;
 
 error:
@@ -201,3 +244,133 @@ error:
 
 	return bound;
 }
+
+int uh_socket_adopt(int sock, bool tls)
+{
+	struct listener *l;
+
+	l = calloc(1, sizeof(*l));
+	if (!l)
+		return 0;
+
+	fd_cloexec(sock);
+	l->fd.fd = sock;
+	l->tls = tls;
+	list_add_tail(&l->list, &listeners);
+
+	return 1;
+}
+
+/* take over a listening socket opened by a supervisor */
+int uh_socket_inherit(int sock, bool tls)
+{
+	int val = 0;
+	socklen_t len = sizeof(val);
+
+	if (getsockopt(sock, SOL_SOCKET, SO_ACCEPTCONN, &val, &len) || !val) {
+		fprintf(stderr, "Error: fd %d is not a listening socket\n", sock);
+		return 0;
+	}
+
+	return uh_socket_adopt(sock, tls);
+}
+
+void uh_close_listeners(void)
+{
+	struct listener *l, *tmp;
+
+	list_for_each_entry_safe(l, tmp, &listeners, list) {
+		if (!l->blocked)
+			uloop_fd_delete(&l->fd);
+		close(l->fd.fd);
+		list_del(&l->list);
+		free(l);
+	}
+
+	n_blocked = 0;
+}
+
+/*
+ * Listener handoff for binary upgrades: every listening socket is passed as
+ * SCM_RIGHTS message over a SOCK_SEQPACKET socket, the single data byte
+ * carries the TLS flag. An empty message terminates the list.
+ */
+int uh_listeners_send(int sock)
+{
+	struct listener *l;
+	struct msghdr msg = {};
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char buf[CMSG_SPACE(sizeof(int))];
+	char tls;
+	int n = 0;
+
+	iov.iov_base = &tls;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	list_for_each_entry(l, &listeners, list) {
+		tls = l->tls;
+		msg.msg_control = buf;
+		msg.msg_controllen = sizeof(buf);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &l->fd.fd, sizeof(int));
+
+		if (sendmsg(sock, &msg, 0) < 0)
+			return -1;
+
+		n++;
+	}
+
+	if (send(sock, "", 0, 0) < 0)
+		return -1;
+
+	return n;
+}
+
+int uh_listeners_recv(int sock, int *n_tls)
+{
+	struct msghdr msg = {};
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char buf[CMSG_SPACE(sizeof(int))];
+	char tls;
+	int fd, len;
+	int bound = 0;
+
+	iov.iov_base = &tls;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	while (1) {
+		msg.msg_control = buf;
+		msg.msg_controllen = sizeof(buf);
+
+		len = recvmsg(sock, &msg, 0);
+		if (len <= 0)
+			break;
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+		if (!uh_socket_adopt(fd, tls)) {
+			close(fd);
+			continue;
+		}
+
+		if (tls)
+			(*n_tls)++;
+		bound++;
+	}
+
+	return bound;
+}
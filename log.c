@@ -0,0 +1,292 @@
+/*
+ * uhttpd - Tiny single-threaded httpd
+ *
+ *   Copyright (C) 2010-2013 Jo-Philipp Wich <xm@subsignal.org>
+ *   Copyright (C) 2013 Felix Fietkau <nbd@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <arpa/inet.h>
+#include <time.h>
+
+#include <libubox/blobmsg.h>
+
+#include "uhttpd.h"
+
+/*
+ * Access log records are formatted into a ring buffer and written out in
+ * large chunks from a timer, so a slow log device only ever delays the
+ * loop once per flush instead of once per request. Records which do not
+ * fit into the ring are dropped and counted.
+ */
+
+#define UH_LOG_RING_SIZE	(64 * 1024)
+#define UH_LOG_RECORD_SIZE	2048
+#define UH_LOG_FLUSH_INTERVAL	1000
+
+enum log_format {
+	LOG_FMT_COMMON,
+	LOG_FMT_COMBINED,
+	LOG_FMT_JSON,
+};
+
+static char log_ring[UH_LOG_RING_SIZE];
+static unsigned int log_head, log_tail;
+static int log_fd = -1;
+static enum log_format log_format;
+static unsigned int log_sample_count;
+
+unsigned long log_dropped;
+
+static void uh_log_flush(void);
+
+static void uh_log_flush_cb(struct uloop_timeout *timeout)
+{
+	uh_log_flush();
+}
+
+static struct uloop_timeout log_timer = {
+	.cb = uh_log_flush_cb
+};
+
+static unsigned int uh_log_used(void)
+{
+	return log_head - log_tail;
+}
+
+static void uh_log_flush(void)
+{
+	unsigned int off, len;
+	int ret;
+
+	while (uh_log_used() > 0) {
+		off = log_tail % UH_LOG_RING_SIZE;
+		len = min(uh_log_used(), UH_LOG_RING_SIZE - off);
+
+		ret = write(log_fd, log_ring + off, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		/* the device is gone or full, drop what is buffered */
+		if (ret <= 0) {
+			for (; log_tail != log_head; log_tail++)
+				if (log_ring[log_tail % UH_LOG_RING_SIZE] == '\n')
+					log_dropped++;
+			break;
+		}
+
+		log_tail += ret;
+	}
+
+	log_head = log_tail = 0;
+}
+
+static void uh_log_append(const char *buf, unsigned int len)
+{
+	unsigned int off, n;
+
+	if (len > UH_LOG_RING_SIZE - uh_log_used()) {
+		log_dropped++;
+		return;
+	}
+
+	off = log_head % UH_LOG_RING_SIZE;
+	n = min(len, UH_LOG_RING_SIZE - off);
+	memcpy(log_ring + off, buf, n);
+	memcpy(log_ring, buf + n, len - n);
+	log_head += len;
+
+	if (uh_log_used() > UH_LOG_RING_SIZE / 2)
+		uloop_timeout_set(&log_timer, 0);
+	else if (!log_timer.pending)
+		uloop_timeout_set(&log_timer, UH_LOG_FLUSH_INTERVAL);
+}
+
+static const char *uh_log_header(struct client *cl, const char *name)
+{
+	struct blob_attr *cur;
+	int rem;
+
+	blob_for_each_attr(cur, cl->hdr.head, rem)
+		if (!strcmp(blobmsg_name(cur), name))
+			return blobmsg_data(cur);
+
+	return NULL;
+}
+
+static const char *uh_log_time(void)
+{
+	static char buf[64];
+	static time_t last;
+	time_t now = time(NULL);
+	struct tm tm;
+
+	if (now == last)
+		return buf;
+
+	last = now;
+	localtime_r(&now, &tm);
+	if (log_format == LOG_FMT_JSON)
+		strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S%z", &tm);
+	else
+		strftime(buf, sizeof(buf), "%d/%b/%Y:%H:%M:%S %z", &tm);
+
+	return buf;
+}
+
+/* quote a string for JSON or the quoted fields of the common format */
+static int uh_log_quote(char *buf, int len, const char *str)
+{
+	int i = 0;
+
+	if (!str)
+		str = "";
+
+	for (; *str && i < len - 7; str++) {
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\') {
+			buf[i++] = '\\';
+			buf[i++] = c;
+		} else if (c < 0x20 || c == 0x7f) {
+			i += sprintf(buf + i, "\\u%04x", c);
+		} else {
+			buf[i++] = c;
+		}
+	}
+
+	buf[i] = 0;
+	return i;
+}
+
+static long uh_log_delta(uint64_t from, uint64_t to)
+{
+	if (!from || !to || to < from)
+		return -1;
+
+	return to - from;
+}
+
+void uh_log_request(struct client *cl)
+{
+	struct http_request *r = &cl->request;
+	char buf[UH_LOG_RECORD_SIZE];
+	char url[1024], referer[256], agent[256];
+	char addr[INET6_ADDRSTRLEN];
+	unsigned long long sent;
+	uint64_t now;
+	int len;
+
+	if (log_fd < 0 || !r->t_begin)
+		return;
+
+	/* failed requests are always logged, the rest can be sampled */
+	if (conf.log_sample > 1 && r->status < 400 &&
+	    log_sample_count++ % conf.log_sample)
+		return;
+
+	now = uh_time_us();
+	inet_ntop(cl->peer_addr.family, &cl->peer_addr.in6, addr, sizeof(addr));
+	sent = cl->bytes_out + cl->us->w.data_bytes - r->bytes_mark;
+
+	uh_log_quote(url, sizeof(url), uh_log_header(cl, "URL"));
+	uh_log_quote(referer, sizeof(referer), uh_log_header(cl, "referer"));
+	uh_log_quote(agent, sizeof(agent), uh_log_header(cl, "user-agent"));
+
+	if (log_format == LOG_FMT_JSON)
+		len = snprintf(buf, sizeof(buf),
+			"{\"time\":\"%s\",\"remote\":\"%s\",\"method\":\"%s\","
+			"\"url\":\"%s\",\"protocol\":\"%s\",\"status\":%d,"
+			"\"bytes\":%llu,\"referer\":\"%s\",\"user_agent\":\"%s\","
+			"\"header_us\":%ld,\"dispatch_us\":%ld,"
+			"\"first_byte_us\":%ld,\"total_us\":%ld}\n",
+			uh_log_time(), addr, http_methods[r->method], url,
+			http_versions[r->version], r->status, sent, referer, agent,
+			uh_log_delta(r->t_begin, r->start),
+			uh_log_delta(r->start, r->t_dispatch),
+			uh_log_delta(r->t_begin, r->t_first_byte),
+			uh_log_delta(r->t_begin, now));
+	else
+		len = snprintf(buf, sizeof(buf),
+			"%s - - [%s] \"%s %s %s\" %d %llu%s%s%s%s%s %ld %ld %ld %ld\n",
+			addr, uh_log_time(),
+			http_methods[r->method], url, http_versions[r->version],
+			r->status, sent,
+			log_format == LOG_FMT_COMBINED ? " \"" : "",
+			log_format == LOG_FMT_COMBINED ? referer : "",
+			log_format == LOG_FMT_COMBINED ? "\" \"" : "",
+			log_format == LOG_FMT_COMBINED ? agent : "",
+			log_format == LOG_FMT_COMBINED ? "\"" : "",
+			uh_log_delta(r->t_begin, r->start),
+			uh_log_delta(r->start, r->t_dispatch),
+			uh_log_delta(r->t_begin, r->t_first_byte),
+			uh_log_delta(r->t_begin, now));
+
+	if (len >= (int) sizeof(buf)) {
+		len = sizeof(buf) - 1;
+		buf[len - 1] = '\n';
+	}
+
+	uh_log_append(buf, len);
+}
+
+void uh_log_reopen(void)
+{
+	int fd;
+
+	if (!conf.log_file)
+		return;
+
+	fd = open(conf.log_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "uhttpd: unable to open access log %s: %s\n",
+			conf.log_file, strerror(errno));
+		return;
+	}
+
+	if (log_fd >= 0) {
+		uh_log_flush();
+		close(log_fd);
+	}
+
+	log_fd = fd;
+}
+
+int uh_log_init(void)
+{
+	const char *fmt = conf.log_format;
+
+	if (!conf.log_file)
+		return 0;
+
+	if (!fmt || !strcmp(fmt, "common"))
+		log_format = LOG_FMT_COMMON;
+	else if (!strcmp(fmt, "combined"))
+		log_format = LOG_FMT_COMBINED;
+	else if (!strcmp(fmt, "json"))
+		log_format = LOG_FMT_JSON;
+	else {
+		fprintf(stderr, "Error: Unknown access log format %s\n", fmt);
+		return -1;
+	}
+
+	uh_log_reopen();
+	return log_fd < 0 ? -1 : 0;
+}
+
+void uh_log_done(void)
+{
+	if (log_fd >= 0)
+		uh_log_flush();
+}
@@ -280,7 +280,9 @@ static bool check_lua_url(const char *url)
 }
 
 static struct dispatch_handler lua_dispatch = {
+	.name = "lua",
 	.script = true,
+	.cache = true,
 	.check_url = check_lua_url,
 	.handle_request = lua_handle_request,
 };
@@ -290,6 +292,7 @@ static int lua_plugin_init(const struct uhttpd_ops *o, struct config *c)
 	ops = o;
 	_conf = c;
 	_L = uh_lua_state_init();
+	lua_dispatch.prefix = conf.lua_prefix;
 	ops->dispatch_add(&lua_dispatch);
 	return 0;
 }
@@ -36,17 +36,248 @@
 
 char uh_buf[4096];
 
+static char **uh_argv;
+static char *uh_exe;
+static struct config cmdline_conf;
+static int signal_fds[2] = { -1, -1 };
+static int upgrade_fd = -1;
+static bool draining;
+
+static void uh_config_parse(bool reload);
+
+static void uh_ubus_cache_reset(void)
+{
+	struct ubus_cache_rule *rule, *tmp;
+
+	list_for_each_entry_safe(rule, tmp, &conf.ubus_cache_rules, list) {
+		list_del(&rule->list);
+		free(rule);
+	}
+}
+
+static void uh_config_reload(void)
+{
+	const char *path = conf.file;
+
+	if (!path)
+		path = "/etc/httpd.conf";
+
+	/* keep the current configuration if the file went away */
+	if (access(path, R_OK)) {
+		fprintf(stderr, "uhttpd: not reloading %s: %s\n",
+				path, strerror(errno));
+		return;
+	}
+
+	uh_vhost_reset();
+	uh_auth_reset();
+	uh_alias_reset();
+	uh_proxy_reset();
+	uh_websocket_reset();
+	uh_captive_reset();
+	uh_index_reset();
+	uh_interpreter_reset();
+	uh_dispatch_reset_limits();
+	uh_ubus_cache_reset();
+	uh_cache_reset();
+	uh_collapse_reset();
+
+	if (conf.error_handler != cmdline_conf.error_handler)
+		free((char *) conf.error_handler);
+
+	conf.error_handler = cmdline_conf.error_handler;
+	conf.script_queue_timeout = cmdline_conf.script_queue_timeout;
+	conf.max_client_script_requests = cmdline_conf.max_client_script_requests;
+	conf.ubus_cache_size = cmdline_conf.ubus_cache_size;
+	conf.cache_size = cmdline_conf.cache_size;
+
+	uh_config_parse(true);
+	uh_dispatch_compile();
+}
+
+static void uh_drain_cb(struct uloop_timeout *timeout)
+{
+	static uint64_t deadline;
+
+	if (!deadline)
+		deadline = uh_time_ms() +
+			(conf.script_timeout + conf.network_timeout) * 1000;
+
+	while (uh_evict_idle_client())
+		;
+
+	if (!n_clients || uh_time_ms() >= deadline) {
+		uloop_end();
+		return;
+	}
+
+	uloop_timeout_set(timeout, 1000);
+}
+
+static void uh_upgrade_ack_cb(struct uloop_fd *fd, unsigned int events)
+{
+	static struct uloop_timeout drain_timer = {
+		.cb = uh_drain_cb
+	};
+	char c;
+	int len;
+
+	len = read(fd->fd, &c, 1);
+	if (len < 0 && errno == EAGAIN)
+		return;
+
+	uloop_fd_delete(fd);
+	close(fd->fd);
+
+	if (len != 1) {
+		fprintf(stderr, "uhttpd: upgrade failed, keeping the current process\n");
+		return;
+	}
+
+	/* the new process owns the listeners now, finish the remaining
+	 * requests and exit */
+	draining = true;
+	uh_close_listeners();
+	uh_drain_cb(&drain_timer);
+}
+
+static void uh_upgrade(void)
+{
+	static struct uloop_fd ack_fd = {
+		.cb = uh_upgrade_ack_cb
+	};
+	char fd_str[12];
+	int sv[2];
+
+	if (ack_fd.registered || draining)
+		return;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv)) {
+		perror("socketpair()");
+		return;
+	}
+
+	switch (fork()) {
+	case -1:
+		perror("fork()");
+		close(sv[0]);
+		close(sv[1]);
+		return;
+
+	case 0:
+		close(sv[0]);
+		snprintf(fd_str, sizeof(fd_str), "%d", sv[1]);
+		setenv("UHTTPD_UPGRADE_FD", fd_str, 1);
+		execvp(uh_exe, uh_argv);
+		_exit(1);
+	}
+
+	close(sv[1]);
+	fd_cloexec(sv[0]);
+
+	if (uh_listeners_send(sv[0]) < 0) {
+		perror("sendmsg()");
+		close(sv[0]);
+		return;
+	}
+
+	ack_fd.fd = sv[0];
+	uloop_fd_add(&ack_fd, ULOOP_READ);
+}
+
+static void uh_signal_fd_cb(struct uloop_fd *fd, unsigned int events)
+{
+	char sig;
+
+	while (read(fd->fd, &sig, 1) == 1) {
+		if (sig == SIGHUP)
+			uh_config_reload();
+		else if (sig == SIGUSR1)
+			uh_log_reopen();
+		else if (sig == SIGUSR2)
+			uh_upgrade();
+	}
+}
+
+static void uh_signal_handler(int sig)
+{
+	char c = sig;
+
+	if (write(signal_fds[1], &c, 1) < 0) {
+		/* pipe full, a notification is pending anyway */
+	}
+}
+
+static void uh_setup_signals(void)
+{
+	static struct uloop_fd signal_fd = {
+		.cb = uh_signal_fd_cb
+	};
+	int i;
+
+	if (pipe(signal_fds)) {
+		perror("pipe()");
+		return;
+	}
+
+	for (i = 0; i < 2; i++) {
+		fd_cloexec(signal_fds[i]);
+		fcntl(signal_fds[i], F_SETFL,
+		      fcntl(signal_fds[i], F_GETFL) | O_NONBLOCK);
+	}
+
+	signal_fd.fd = signal_fds[0];
+	uloop_fd_add(&signal_fd, ULOOP_READ);
+
+	signal(SIGHUP, uh_signal_handler);
+	signal(SIGUSR1, uh_signal_handler);
+	signal(SIGUSR2, uh_signal_handler);
+}
+
 static int run_server(void)
 {
 	uloop_init();
+	uh_setup_signals();
 	uh_setup_listeners();
 	uh_plugin_post_init();
+	uh_dispatch_compile();
+
+	/* tell the previous process to hand over and drain */
+	if (upgrade_fd >= 0) {
+		if (write(upgrade_fd, "", 1) < 0)
+			perror("write()");
+		close(upgrade_fd);
+		upgrade_fd = -1;
+	}
+
 	uloop_run();
+	uh_log_done();
 
 	return 0;
 }
 
-static void uh_config_parse(void)
+static void uh_ubus_cache_add(const char *object, const char *method, int ttl)
+{
+	struct ubus_cache_rule *rule;
+	char *new_object, *new_method;
+
+	if (ttl <= 0)
+		return;
+
+	rule = calloc_a(sizeof(*rule),
+		&new_object, strlen(object) + 1,
+		&new_method, strlen(method) + 1);
+
+	if (!rule)
+		return;
+
+	rule->object = strcpy(new_object, object);
+	rule->method = strcpy(new_method, method);
+	rule->ttl = ttl;
+	list_add_tail(&rule->list, &conf.ubus_cache_rules);
+}
+
+static void uh_config_parse(bool reload)
 {
 	const char *path = conf.file;
 	FILE *c;
@@ -55,6 +286,7 @@ static void uh_config_parse(void)
 	char *col2;
 	char *col3;
 	char *col4;
+	char *col5;
 	char *eol;
 
 	if (!path)
@@ -89,15 +321,25 @@ static void uh_config_parse(void)
 
 			uh_captive_set_host(strdup(col1), strdup(col2));
 		} else if (!strncmp(line, "Y:", 2)) {
+			/* the bridge keeps connections, changes need a restart */
+			if (reload)
+				continue;
+
 			if (!(col1 = strchr(line, ':')) || (*col1++ = 0) ||
 				!(col2 = strchr(col1, ':')) || (*col2++ = 0) ||
 				!(col3 = strchr(col2, ':')) || (*col3++ = 0))
 				continue;
 
 			if (strchr(col3, ':')) {
-				// 4 arguments
-				if (!(col4 = strchr(col3, ':')) || (*col4++ = 0) ||
-					!(eol = strchr(col4, '\n')) || (*eol++ = 0))
+				// 4 or 5 arguments
+				if (!(col4 = strchr(col3, ':')) || (*col4++ = 0))
+					continue;
+				if (strchr(col4, ':')) {
+					if (!(col5 = strchr(col4, ':')) || (*col5++ = 0) ||
+						!(eol = strchr(col5, '\n')) || (*eol++ = 0))
+						continue;
+					uh_arduino_set_framed(!strcmp(col5, "framed"));
+				} else if (!(eol = strchr(col4, '\n')) || (*eol++ = 0))
 					continue;
 				uh_arduino_set_timeout(atoi(col4));
 			} else {
@@ -106,18 +348,119 @@ static void uh_config_parse(void)
 					continue;
 			}
 			uh_arduino_set_options(strdup(col1), strdup(col2), atoi(col3));
+		} else if (!strncmp(line, "P:", 2)) {
+			if (!(col1 = strchr(line, ':')) || (*col1++ = 0) ||
+				!(col2 = strchr(col1, ':')) || (*col2++ = 0) ||
+				!(eol = strchr(col2, '\n')) || (*eol++  = 0))
+				continue;
+
+			uh_proxy_add(col1, col2);
+		} else if (!strncmp(line, "WS:", 3)) {
+			if (!(col1 = strchr(line, ':')) || (*col1++ = 0) ||
+				!(col2 = strchr(col1, ':')) || (*col2++ = 0) ||
+				!(eol = strchr(col2, '\n')) || (*eol++  = 0))
+				continue;
+
+			uh_websocket_add(col1, col2);
+		} else if (!strncmp(line, "PB:", 3)) {
+			if (!(col1 = strchr(line, ':')) || (*col1++ = 0) ||
+				!(col2 = strchr(col1, ':')) || (*col2++ = 0) ||
+				!(eol = strchr(col2, '\n')) || (*eol++  = 0))
+				continue;
+
+			uh_proxy_set_balance(col1, col2);
+		} else if (!strncmp(line, "PF:", 3)) {
+			if (!(col1 = strchr(line, ':')) || (*col1++ = 0) ||
+				!(col2 = strchr(col1, ':')) || (*col2++ = 0) ||
+				!(col3 = strchr(col2, ':')) || (*col3++ = 0) ||
+				!(eol = strchr(col3, '\n')) || (*eol++  = 0))
+				continue;
+
+			uh_proxy_set_fails(col1, atoi(col2), atoi(col3));
+		} else if (!strncmp(line, "PH:", 3)) {
+			if (!(col1 = strchr(line, ':')) || (*col1++ = 0) ||
+				!(col2 = strchr(col1, ':')) || (*col2++ = 0) ||
+				!(col3 = strchr(col2, ':')) || (*col3++ = 0) ||
+				!(eol = strchr(col3, '\n')) || (*eol++  = 0))
+				continue;
+
+			uh_proxy_set_probe(col1, atoi(col2), col3);
+		} else if (!strncmp(line, "V:", 2)) {
+			if (!(col1 = strchr(line, ':')) || (*col1++ = 0) ||
+				!(col2 = strchr(col1, ':')) || (*col2++ = 0) ||
+				!(eol = strchr(col2, '\n')) || (*eol++  = 0))
+				continue;
+
+			uh_vhost_begin(col1, col2);
+		} else if (!strncmp(line, "VH:", 3)) {
+			if (!(col1 = strchr(line, ':')) || (*col1++ = 0) ||
+				!(eol = strchr(col1, '\n')) || (*eol++  = 0))
+				continue;
+
+			uh_vhost_set_handlers(col1);
 		} else if (!strncmp(line, "I:", 2)) {
 			if (!(col1 = strchr(line, ':')) || (*col1++ = 0) ||
 				!(eol = strchr(col1, '\n')) || (*eol++  = 0))
 				continue;
 
-			uh_index_add(strdup(col1));
+			uh_index_add(strdup(col1), true);
 		} else if (!strncmp(line, "E404:", 5)) {
 			if (!(col1 = strchr(line, ':')) || (*col1++ = 0) ||
 				!(eol = strchr(col1, '\n')) || (*eol++  = 0))
 				continue;
 
 			conf.error_handler = strdup(col1);
+		} else if (!strncmp(line, "SQ:", 3)) {
+			if (!(col1 = strchr(line, ':')) || (*col1++ = 0) ||
+				!(eol = strchr(col1, '\n')) || (*eol++  = 0))
+				continue;
+
+			conf.script_queue_timeout = atoi(col1);
+		} else if (!strncmp(line, "SC:", 3)) {
+			if (!(col1 = strchr(line, ':')) || (*col1++ = 0) ||
+				!(eol = strchr(col1, '\n')) || (*eol++  = 0))
+				continue;
+
+			conf.max_client_script_requests = atoi(col1);
+		} else if (!strncmp(line, "S:", 2)) {
+			if (!(col1 = strchr(line, ':')) || (*col1++ = 0) ||
+				!(col2 = strchr(col1, ':')) || (*col2++ = 0) ||
+				!(eol = strchr(col2, '\n')) || (*eol++  = 0))
+				continue;
+
+			uh_dispatch_set_limit(col1, atoi(col2));
+		} else if (!strncmp(line, "UM:", 3)) {
+			if (!(col1 = strchr(line, ':')) || (*col1++ = 0) ||
+				!(eol = strchr(col1, '\n')) || (*eol++  = 0))
+				continue;
+
+			conf.ubus_cache_size = atoi(col1);
+		} else if (!strncmp(line, "U:", 2)) {
+			if (!(col1 = strchr(line, ':')) || (*col1++ = 0) ||
+				!(col2 = strchr(col1, ':')) || (*col2++ = 0) ||
+				!(col3 = strchr(col2, ':')) || (*col3++ = 0) ||
+				!(eol = strchr(col3, '\n')) || (*eol++  = 0))
+				continue;
+
+			uh_ubus_cache_add(col1, col2, atoi(col3));
+		} else if (!strncmp(line, "CM:", 3)) {
+			if (!(col1 = strchr(line, ':')) || (*col1++ = 0) ||
+				!(eol = strchr(col1, '\n')) || (*eol++  = 0))
+				continue;
+
+			conf.cache_size = atoi(col1);
+		} else if (!strncmp(line, "CV:", 3)) {
+			if (!(col1 = strchr(line, ':')) || (*col1++ = 0) ||
+				!(eol = strchr(col1, '\n')) || (*eol++  = 0))
+				continue;
+
+			uh_cache_add_vary(col1);
+		} else if (!strncmp(line, "RC:", 3)) {
+			if (!(col1 = strchr(line, ':')) || (*col1++ = 0) ||
+				!(eol = strchr(col1, '\n')) || (*eol++  = 0))
+				continue;
+
+			uh_collapse_add(col1);
 		}
 		else if ((line[0] == '*') && (strchr(line, ':') != NULL)) {
 			if (!(col1 = strchr(line, '*')) || (*col1++ = 0) ||
@@ -125,11 +468,12 @@ static void uh_config_parse(void)
 				!(eol = strchr(col2, '\n')) || (*eol++  = 0))
 				continue;
 
-			uh_interpreter_add(col1, col2);
+			uh_interpreter_add(col1, col2, true);
 		}
 	}
 
 	fclose(c);
+	uh_vhost_end();
 }
 
 static int add_listener_arg(char *arg, bool tls)
@@ -148,6 +492,64 @@ static int add_listener_arg(char *arg, bool tls)
 	return uh_socket_bind(host, port, tls);
 }
 
+static int add_inherited_arg(char *arg, int *n_tls)
+{
+	char *s;
+	bool tls = false;
+
+	s = strchr(arg, ':');
+	if (s) {
+		*s++ = 0;
+		tls = !strcmp(s, "tls");
+	}
+
+	if (tls)
+		(*n_tls)++;
+
+	return uh_socket_inherit(atoi(arg), tls);
+}
+
+/*
+ * systemd style socket activation, sockets start at fd 3. Sockets named
+ * "https" or "tls" in LISTEN_FDNAMES are served with TLS.
+ */
+static int add_activated_listeners(int *n_tls)
+{
+	const char *env;
+	char *names = NULL, *name;
+	int i, n, bound = 0;
+	bool tls;
+
+	env = getenv("LISTEN_PID");
+	if (!env || atoi(env) != getpid())
+		return 0;
+
+	env = getenv("LISTEN_FDS");
+	n = env ? atoi(env) : 0;
+
+	env = getenv("LISTEN_FDNAMES");
+	if (env)
+		names = strdup(env);
+
+	name = names ? strtok(names, ":") : NULL;
+	for (i = 0; i < n; i++) {
+		tls = name && (!strcmp(name, "https") || !strcmp(name, "tls"));
+		if (tls)
+			(*n_tls)++;
+
+		bound += uh_socket_inherit(3 + i, tls);
+		if (name)
+			name = strtok(NULL, ":");
+	}
+
+	free(names);
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+
+	return bound;
+}
+
 static int usage(const char *name)
 {
 	fprintf(stderr,
@@ -155,10 +557,12 @@ static int usage(const char *name)
 		"	-f              Do not fork to background\n"
 		"	-c file         Configuration file, default is '/etc/httpd.conf'\n"
 		"	-p [addr:]port  Bind to specified address and port, multiple allowed\n"
+		"	-F fd[:tls]     Listen on an already bound socket, multiple allowed\n"
 #ifdef HAVE_TLS
 		"	-s [addr:]port  Like -p but provide HTTPS on this port\n"
 		"	-C file         ASN.1 server certificate file\n"
 		"	-K file         ASN.1 server private key file\n"
+		"	-Y              Let the kernel encrypt HTTPS file downloads (kTLS)\n"
 #endif
 		"	-h directory    Specify the document root, default is '.'\n"
 		"	-E string       Use given virtual URL as 404 error handler\n"
@@ -168,6 +572,13 @@ static int usage(const char *name)
 		"	-R              Enable RFC1918 filter\n"
 		"	-n count        Maximum allowed number of concurrent script requests\n"
 		"	-N count        Maximum allowed number of concurrent connections\n"
+		"	-B count        Listen backlog size, default is %d\n"
+		"	-P count        Maximum allowed number of concurrent connections per client address\n"
+		"	-q rate[:burst] Maximum request rate per client address and second\n"
+		"	-z bits         IPv6 prefix length to account client addresses by, default is 64\n"
+		"	-w seconds      Defer accepting connections until data arrives (TCP_DEFER_ACCEPT)\n"
+		"	-o count        Enable TCP Fast Open with the given queue length\n"
+		"	-O              Answer connections beyond the limit with 503 instead of queueing them\n"
 #ifdef HAVE_LUA
 		"	-l string       URL prefix for Lua handler, default is '/lua'\n"
 		"	-L file         Lua handler script, omit to disable Lua\n"
@@ -177,15 +588,20 @@ static int usage(const char *name)
 		"	-U file         Override ubus socket path\n"
 		"	-a              Do not authenticate JSON-RPC requests against UBUS session api\n"
 #endif
+		"	-G file         Write an access log to the given file, reopened on SIGUSR1\n"
+		"	-g format       Access log format: common, combined or json, default is common\n"
+		"	-j count        Only log every n-th successful request\n"
+		"	-X string       URL prefix for the server status page, disabled by default\n"
 		"	-x string       URL prefix for CGI handler, default is '/cgi-bin'\n"
 		"	-i .ext=path    Use interpreter at path for files with the given extension\n"
 		"	-t seconds      CGI, Lua and UBUS script timeout in seconds, default is 60\n"
 		"	-T seconds      Network timeout in seconds, default is 30\n"
 		"	-k seconds      HTTP keepalive timeout\n"
+		"	-2              Enable HTTP/2, negotiated via TLS ALPN or by prior knowledge\n"
 		"	-d string       URL decode given string\n"
 		"	-r string       Specify basic auth realm\n"
 		"	-m string       MD5 crypt given string\n"
-		"\n", name
+		"\n", name, UH_LIMIT_CLIENTS
 	);
 	return 1;
 }
@@ -196,15 +612,19 @@ static void init_defaults(void)
 	conf.network_timeout = 30;
 	conf.http_keepalive = 20;
 	conf.max_script_requests = 3;
+	conf.script_queue_timeout = 30;
 	conf.max_connections = 100;
+	conf.limit_ipv6_prefix = 64;
 	conf.realm = "Protected Area";
 	conf.cgi_prefix = "/cgi-bin";
 	conf.cgi_path = "/sbin:/usr/sbin:/bin:/usr/bin";
+	conf.ubus_cache_size = 64 * 1024;
+	INIT_LIST_HEAD(&conf.ubus_cache_rules);
 
-	uh_index_add("index.html");
-	uh_index_add("index.htm");
-	uh_index_add("default.html");
-	uh_index_add("default.htm");
+	uh_index_add("index.html", false);
+	uh_index_add("index.htm", false);
+	uh_index_add("default.html", false);
+	uh_index_add("default.htm", false);
 }
 
 static void fixup_prefix(char *str)
@@ -225,13 +645,13 @@ static void fixup_prefix(char *str)
 int main(int argc, char **argv)
 {
 	bool nofork = false;
-	char *port;
+	char *port, *burst;
 	int opt, ch;
 	int cur_fd;
 	int bound = 0;
+	int n_tls = 0;
 
 #ifdef HAVE_TLS
-	int n_tls = 0;
 	const char *tls_key = NULL, *tls_crt = NULL;
 #endif
 
@@ -239,10 +659,26 @@ int main(int argc, char **argv)
 
 	uh_dispatch_add(&arduino_dispatch);
 	uh_dispatch_add(&cgi_dispatch);
+	uh_dispatch_add(&proxy_dispatch);
 	init_defaults();
 	signal(SIGPIPE, SIG_IGN);
 
-	while ((ch = getopt(argc, argv, "afSDRC:K:E:I:p:s:h:c:l:L:d:r:m:n:N:x:i:t:k:T:A:u:U:")) != -1) {
+	uh_argv = argv;
+	uh_exe = argv[0];
+	if (strchr(argv[0], '/') && realpath(argv[0], uh_buf))
+		uh_exe = strdup(uh_buf);
+
+	port = getenv("UHTTPD_UPGRADE_FD");
+	if (port) {
+		upgrade_fd = atoi(port);
+		unsetenv("UHTTPD_UPGRADE_FD");
+		fd_cloexec(upgrade_fd);
+		bound += uh_listeners_recv(upgrade_fd, &n_tls);
+	} else {
+		bound += add_activated_listeners(&n_tls);
+	}
+
+	while ((ch = getopt(argc, argv, "afSDRO2YC:K:F:E:I:p:s:h:c:l:L:d:r:m:n:N:B:P:q:z:w:o:x:X:G:g:j:i:t:k:T:A:u:U:")) != -1) {
 		switch(ch) {
 #ifdef HAVE_TLS
 		case 'C':
@@ -253,21 +689,37 @@ int main(int argc, char **argv)
 			tls_key = optarg;
 			break;
 
+		case 'Y':
+			conf.ktls = 1;
+			break;
+
 		case 's':
 			n_tls++;
 			/* fall through */
 #else
 		case 'C':
 		case 'K':
+		case 'Y':
 		case 's':
 			fprintf(stderr, "uhttpd: TLS support not compiled, "
 			                "ignoring -%c\n", opt);
 			break;
 #endif
 		case 'p':
+			/* listeners are inherited from the previous process */
+			if (upgrade_fd >= 0)
+				break;
+
 			bound += add_listener_arg(optarg, (ch == 's'));
 			break;
 
+		case 'F':
+			if (upgrade_fd >= 0)
+				break;
+
+			bound += add_inherited_arg(optarg, &n_tls);
+			break;
+
 		case 'h':
 			if (!realpath(optarg, uh_buf)) {
 				fprintf(stderr, "Error: Invalid directory %s: %s\n",
@@ -292,7 +744,7 @@ int main(int argc, char **argv)
 						optarg);
 				exit(1);
 			}
-			uh_index_add(optarg);
+			uh_index_add(optarg, false);
 			break;
 
 		case 'S':
@@ -315,11 +767,62 @@ int main(int argc, char **argv)
 			conf.max_connections = atoi(optarg);
 			break;
 
+		case 'B':
+			conf.listen_backlog = atoi(optarg);
+			break;
+
+		case 'P':
+			conf.limit_conns = atoi(optarg);
+			break;
+
+		case 'q':
+			conf.limit_rate = atoi(optarg);
+			burst = strchr(optarg, ':');
+			conf.limit_burst = burst ? atoi(burst + 1) : conf.limit_rate;
+			break;
+
+		case 'z':
+			conf.limit_ipv6_prefix = atoi(optarg);
+			break;
+
+		case 'w':
+			conf.tcp_defer_accept = atoi(optarg);
+			break;
+
+		case 'o':
+			conf.tcp_fastopen = atoi(optarg);
+			break;
+
+		case 'O':
+			conf.shed_load = 1;
+			break;
+
+		case '2':
+			conf.http2 = 1;
+			break;
+
 		case 'x':
 			fixup_prefix(optarg);
 			conf.cgi_prefix = optarg;
 			break;
 
+		case 'G':
+			conf.log_file = optarg;
+			break;
+
+		case 'g':
+			conf.log_format = optarg;
+			break;
+
+		case 'j':
+			conf.log_sample = atoi(optarg);
+			break;
+
+		case 'X':
+			fixup_prefix(optarg);
+			conf.status_prefix = optarg;
+			break;
+
 		case 'i':
 			port = strchr(optarg, '=');
 			if (optarg[0] != '.' || !port) {
@@ -329,7 +832,7 @@ int main(int argc, char **argv)
 			}
 
 			*port++ = 0;
-			uh_interpreter_add(optarg, port);
+			uh_interpreter_add(optarg, port, false);
 			break;
 
 		case 't':
@@ -427,7 +930,12 @@ int main(int argc, char **argv)
 		}
 	}
 
-	uh_config_parse();
+	cmdline_conf = conf;
+	uh_config_parse(false);
+	uh_status_init();
+
+	if (uh_log_init())
+		return 1;
 
 	if (!bound) {
 		fprintf(stderr, "Error: No sockets bound, unable to continue\n");
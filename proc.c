@@ -185,6 +185,8 @@ static void proc_handle_close(struct relay *r, int ret)
 		return;
 	}
 
+	uh_cache_finish(r->cl, !ret);
+	uh_collapse_finish(r->cl, true);
 	uh_request_done(r->cl);
 }
 
@@ -208,6 +210,8 @@ static void proc_handle_header(struct relay *r, const char *name, const char *va
 		return;
 	}
 
+	uh_cache_header(cl, name, val);
+	uh_collapse_header(cl, name, val);
 	blobmsg_add_string(&cl->dispatch.proc.hdr, name, val);
 }
 
@@ -219,6 +223,8 @@ static void proc_handle_header_end(struct relay *r)
 	int rem;
 
 	uloop_timeout_cancel(&p->timeout);
+	uh_cache_header_end(cl, p->status_code, p->status_msg);
+	uh_collapse_header_end(cl, p->status_code, p->status_msg);
 	uh_http_header(cl, cl->dispatch.proc.status_code, cl->dispatch.proc.status_msg);
 	blob_for_each_attr(cur, cl->dispatch.proc.hdr.head, rem)
 		ustream_printf(cl->us, "%s: %s\r\n", blobmsg_name(cur), blobmsg_data(cur));
@@ -0,0 +1,1234 @@
+/*
+ * uhttpd - Tiny single-threaded httpd
+ *
+ *   Copyright (C) 2010-2013 Jo-Philipp Wich <xm@subsignal.org>
+ *   Copyright (C) 2013 Felix Fietkau <nbd@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <strings.h>
+
+#include <libubox/blobmsg.h>
+
+#include "uhttpd.h"
+#include "trie.h"
+
+/*
+ * Reverse proxy for HTTP/1.1 upstreams. Connections are kept open after a
+ * response and handed to the next request for the same upstream, so a
+ * proxied request normally costs one write and one read on an established
+ * socket. Responses are streamed to the client through the relay code,
+ * which also takes care of flow control in that direction.
+ *
+ * Every prefix maps to a pool of one or more upstreams. Upstreams which
+ * fail to connect or to answer max_fails times in a row are skipped for
+ * fail_timeout seconds, upstreams with a health check are skipped for as
+ * long as their probe fails.
+ */
+
+#define PROXY_IDLE_MAX		16
+#define PROXY_IDLE_TIMEOUT	15
+#define PROXY_UPLOAD_MAX	(64 * 1024)
+#define PROXY_MAX_FAILS		3
+#define PROXY_FAIL_TIMEOUT	10
+#define PROXY_PROBE_TIMEOUT	5
+
+enum proxy_balance {
+	PROXY_BALANCE_LEAST_CONN,
+	PROXY_BALANCE_P2C,
+};
+
+struct proxy_probe;
+
+struct proxy_upstream {
+	struct list_head list;
+	struct list_head idle;
+	int n_idle;
+	int refs;
+
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	char name[128];
+
+	/* passive failure detection */
+	int max_fails;
+	int fail_timeout;
+	int fails;
+	uint64_t down_until;
+
+	/* active health checks */
+	char *probe_url;
+	int probe_interval;
+	bool probe_failed;
+	struct uloop_timeout probe_timer;
+	struct proxy_probe *probe;
+
+	int active;
+	unsigned long requests;
+	unsigned long failures;
+	unsigned long probe_failures;
+	unsigned long responses;
+	uint64_t latency_us;
+	uint64_t ewma_us;
+};
+
+struct proxy_member {
+	struct list_head list;
+	struct proxy_upstream *up;
+};
+
+struct proxy_route {
+	struct list_head list;
+	struct list_head members;
+	int n_members;
+	int refs;
+
+	char *prefix;
+	char *path;
+
+	enum proxy_balance balance;
+	int max_fails;
+	int fail_timeout;
+	char *probe_url;
+	int probe_interval;
+};
+
+struct proxy_conn {
+	struct list_head list;
+	struct proxy_upstream *up;
+	struct uloop_timeout timeout;
+	struct relay r;
+	int idle_timeout;
+	int requests;
+};
+
+struct proxy_probe {
+	struct ustream_fd sfd;
+	struct uloop_timeout timeout;
+	struct proxy_upstream *up;
+};
+
+static LIST_HEAD(upstreams);
+static LIST_HEAD(routes);
+static struct uh_trie proxy_trie;
+
+static const char * const hop_headers[] = {
+	"connection",
+	"keep-alive",
+	"proxy-connection",
+	"te",
+	"trailer",
+	"transfer-encoding",
+	"upgrade",
+	"expect",
+};
+
+static bool proxy_connect(struct client *cl, struct proxy_upstream *up, bool fresh);
+static void proxy_probe_timer_cb(struct uloop_timeout *timeout);
+static void proxy_probe_free(struct proxy_probe *pr);
+
+static struct proxy_upstream *proxy_upstream_get(const char *host, const char *port)
+{
+	static const struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct proxy_upstream *up;
+	struct addrinfo *ai;
+	int ret;
+
+	/* resolve once, instead of on every connection */
+	ret = getaddrinfo(host, port, &hints, &ai);
+	if (ret) {
+		fprintf(stderr, "Unable to resolve upstream address %s: %s\n",
+			host, gai_strerror(ret));
+		return NULL;
+	}
+
+	list_for_each_entry(up, &upstreams, list) {
+		if (up->addr_len != ai->ai_addrlen ||
+		    memcmp(&up->addr, ai->ai_addr, ai->ai_addrlen))
+			continue;
+
+		up->refs++;
+		freeaddrinfo(ai);
+		return up;
+	}
+
+	up = calloc(1, sizeof(*up));
+	if (!up) {
+		freeaddrinfo(ai);
+		return NULL;
+	}
+
+	INIT_LIST_HEAD(&up->idle);
+	memcpy(&up->addr, ai->ai_addr, ai->ai_addrlen);
+	up->addr_len = ai->ai_addrlen;
+	up->refs = 1;
+	up->max_fails = PROXY_MAX_FAILS;
+	up->fail_timeout = PROXY_FAIL_TIMEOUT;
+	up->probe_timer.cb = proxy_probe_timer_cb;
+	snprintf(up->name, sizeof(up->name),
+		 strchr(host, ':') ? "[%s]:%s" : "%s:%s", host, port);
+	list_add_tail(&up->list, &upstreams);
+	freeaddrinfo(ai);
+
+	return up;
+}
+
+static void proxy_conn_free(struct proxy_conn *c)
+{
+	if (c->list.next) {
+		list_del(&c->list);
+		c->up->n_idle--;
+	}
+
+	uloop_timeout_cancel(&c->timeout);
+	ustream_free(&c->r.sfd.stream);
+	close(c->r.sfd.fd.fd);
+	free(c);
+}
+
+static void proxy_upstream_flush(struct proxy_upstream *up)
+{
+	struct proxy_conn *c, *tmp;
+
+	list_for_each_entry_safe(c, tmp, &up->idle, list)
+		proxy_conn_free(c);
+}
+
+static void proxy_upstream_put(struct proxy_upstream *up)
+{
+	if (!up || --up->refs > 0)
+		return;
+
+	proxy_upstream_flush(up);
+	uloop_timeout_cancel(&up->probe_timer);
+	if (up->probe)
+		proxy_probe_free(up->probe);
+
+	list_del(&up->list);
+	free(up->probe_url);
+	free(up);
+}
+
+static void proxy_route_put(struct proxy_route *route)
+{
+	struct proxy_member *m, *tmp;
+
+	if (!route || --route->refs > 0)
+		return;
+
+	list_for_each_entry_safe(m, tmp, &route->members, list) {
+		list_del(&m->list);
+		proxy_upstream_put(m->up);
+		free(m);
+	}
+
+	free(route->prefix);
+	free(route->path);
+	free(route->probe_url);
+	free(route);
+}
+
+static struct proxy_route *proxy_route_get(const char *prefix)
+{
+	struct proxy_route *route;
+	int len = strlen(prefix);
+	void **slot;
+
+	while (len > 1 && prefix[len - 1] == '/')
+		len--;
+
+	list_for_each_entry(route, &routes, list)
+		if (!strncmp(route->prefix, prefix, len) && !route->prefix[len])
+			return route;
+
+	route = calloc(1, sizeof(*route));
+	if (!route)
+		return NULL;
+
+	route->prefix = strndup(prefix, len);
+	if (!route->prefix) {
+		free(route);
+		return NULL;
+	}
+
+	INIT_LIST_HEAD(&route->members);
+	route->refs = 1;
+	route->max_fails = PROXY_MAX_FAILS;
+	route->fail_timeout = PROXY_FAIL_TIMEOUT;
+	list_add_tail(&route->list, &routes);
+
+	slot = uh_trie_insert(&proxy_trie, route->prefix);
+	if (slot)
+		*slot = route;
+
+	return route;
+}
+
+/* health settings belong to the upstream, the last route configuring them wins */
+static void proxy_route_apply(struct proxy_route *route)
+{
+	struct proxy_upstream *up;
+	struct proxy_member *m;
+
+	list_for_each_entry(m, &route->members, list) {
+		up = m->up;
+		up->max_fails = route->max_fails;
+		up->fail_timeout = route->fail_timeout;
+
+		if (!route->probe_url)
+			continue;
+
+		free(up->probe_url);
+		up->probe_url = strdup(route->probe_url);
+		up->probe_interval = route->probe_interval;
+		if (!up->probe && !up->probe_timer.pending)
+			uloop_timeout_set(&up->probe_timer, 0);
+	}
+}
+
+void uh_proxy_add(const char *prefix, const char *target)
+{
+	struct proxy_upstream *up;
+	struct proxy_route *route;
+	struct proxy_member *m;
+	char *host, *port, *path, *sep;
+	int path_len = 0;
+
+	host = strcpy(alloca(strlen(target) + 1), target);
+
+	sep = strchr(host, '/');
+	path = NULL;
+	if (sep) {
+		path_len = strlen(sep);
+		path = memcpy(alloca(path_len + 1), sep, path_len + 1);
+		*sep = 0;
+
+		while (path_len > 0 && path[path_len - 1] == '/')
+			path_len--;
+
+		path[path_len] = 0;
+	}
+
+	if (*host == '[') {
+		sep = strchr(++host, ']');
+		if (!sep || sep[1] != ':')
+			goto error;
+
+		*sep = 0;
+		port = sep + 2;
+	} else {
+		port = strrchr(host, ':');
+		if (!port)
+			goto error;
+
+		*port++ = 0;
+	}
+
+	route = proxy_route_get(prefix);
+	if (!route)
+		return;
+
+	up = proxy_upstream_get(host, port);
+	if (!up)
+		return;
+
+	m = calloc(1, sizeof(*m));
+	if (!m) {
+		proxy_upstream_put(up);
+		return;
+	}
+
+	/* all members of a pool share the path of the first one */
+	if (path && !route->path && !route->n_members)
+		route->path = strdup(path);
+
+	m->up = up;
+	list_add_tail(&m->list, &route->members);
+	route->n_members++;
+	proxy_route_apply(route);
+
+	return;
+
+error:
+	fprintf(stderr, "Invalid upstream %s, expected host:port[/path]\n", target);
+}
+
+void uh_proxy_set_balance(const char *prefix, const char *method)
+{
+	struct proxy_route *route = proxy_route_get(prefix);
+
+	if (!route)
+		return;
+
+	if (!strcmp(method, "p2c"))
+		route->balance = PROXY_BALANCE_P2C;
+	else if (!strcmp(method, "least_conn"))
+		route->balance = PROXY_BALANCE_LEAST_CONN;
+	else
+		fprintf(stderr, "Unknown balancing method %s\n", method);
+}
+
+void uh_proxy_set_fails(const char *prefix, int max_fails, int fail_timeout)
+{
+	struct proxy_route *route = proxy_route_get(prefix);
+
+	if (!route)
+		return;
+
+	route->max_fails = max(max_fails, 0);
+	route->fail_timeout = max(fail_timeout, 1);
+	proxy_route_apply(route);
+}
+
+void uh_proxy_set_probe(const char *prefix, int interval, const char *url)
+{
+	struct proxy_route *route = proxy_route_get(prefix);
+
+	if (!route || interval <= 0 || *url != '/')
+		return;
+
+	free(route->probe_url);
+	route->probe_url = strdup(url);
+	route->probe_interval = interval;
+	proxy_route_apply(route);
+}
+
+void uh_proxy_reset(void)
+{
+	struct proxy_upstream *up;
+	struct proxy_route *route, *tmp;
+
+	list_for_each_entry(up, &upstreams, list) {
+		up->max_fails = PROXY_MAX_FAILS;
+		up->fail_timeout = PROXY_FAIL_TIMEOUT;
+		up->probe_interval = 0;
+		up->probe_failed = false;
+		uloop_timeout_cancel(&up->probe_timer);
+		free(up->probe_url);
+		up->probe_url = NULL;
+	}
+
+	list_for_each_entry_safe(route, tmp, &routes, list) {
+		list_del(&route->list);
+		proxy_route_put(route);
+	}
+
+	uh_trie_free(&proxy_trie);
+}
+
+static int proxy_socket(struct proxy_upstream *up)
+{
+	int fd, one = 1;
+
+	fd = socket(up->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (connect(fd, (struct sockaddr *) &up->addr, up->addr_len) < 0 &&
+	    errno != EINPROGRESS) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void proxy_upstream_failed(struct proxy_upstream *up)
+{
+	up->failures++;
+	if (!up->max_fails || ++up->fails < up->max_fails)
+		return;
+
+	/* eject, the first request after the timeout tries again */
+	up->down_until = uh_time_ms() + up->fail_timeout * 1000;
+	proxy_upstream_flush(up);
+}
+
+static void proxy_upstream_ok(struct proxy_upstream *up, uint64_t usec)
+{
+	up->fails = 0;
+	up->down_until = 0;
+	up->responses++;
+	up->latency_us += usec;
+	up->ewma_us = up->ewma_us ? up->ewma_us + ((int64_t) usec - (int64_t) up->ewma_us) / 8 : usec;
+}
+
+static void proxy_probe_free(struct proxy_probe *pr)
+{
+	pr->up->probe = NULL;
+	uloop_timeout_cancel(&pr->timeout);
+	ustream_free(&pr->sfd.stream);
+	close(pr->sfd.fd.fd);
+	free(pr);
+}
+
+static void proxy_probe_done(struct proxy_probe *pr, bool ok)
+{
+	struct proxy_upstream *up = pr->up;
+
+	proxy_probe_free(pr);
+
+	if (ok) {
+		up->probe_failed = false;
+		up->fails = 0;
+		up->down_until = 0;
+	} else {
+		up->probe_failed = true;
+		up->probe_failures++;
+		proxy_upstream_flush(up);
+	}
+
+	if (up->probe_url)
+		uloop_timeout_set(&up->probe_timer, up->probe_interval * 1000);
+}
+
+static void proxy_probe_read_cb(struct ustream *s, int bytes)
+{
+	struct proxy_probe *pr = container_of(s, struct proxy_probe, sfd.stream);
+	char *buf;
+	int len, code;
+
+	buf = ustream_get_read_buf(s, &len);
+	if (!buf || !strchr(buf, '\n'))
+		return;
+
+	/* any 2xx or 3xx status counts as healthy */
+	code = 0;
+	if (!strncmp(buf, "HTTP/1.", 7) && buf[8] == ' ')
+		code = atoi(buf + 9);
+
+	proxy_probe_done(pr, code >= 200 && code < 400);
+}
+
+static void proxy_probe_state_cb(struct ustream *s)
+{
+	struct proxy_probe *pr = container_of(s, struct proxy_probe, sfd.stream);
+
+	if (s->eof || s->write_error)
+		proxy_probe_done(pr, false);
+}
+
+static void proxy_probe_timeout_cb(struct uloop_timeout *timeout)
+{
+	struct proxy_probe *pr = container_of(timeout, struct proxy_probe, timeout);
+
+	proxy_probe_done(pr, false);
+}
+
+static void proxy_probe_timer_cb(struct uloop_timeout *timeout)
+{
+	struct proxy_upstream *up = container_of(timeout, struct proxy_upstream, probe_timer);
+	struct proxy_probe *pr;
+	int fd;
+
+	if (!up->probe_url || up->probe)
+		return;
+
+	pr = calloc(1, sizeof(*pr));
+	if (!pr)
+		goto retry;
+
+	fd = proxy_socket(up);
+	if (fd < 0) {
+		free(pr);
+		up->probe_failed = true;
+		up->probe_failures++;
+		goto retry;
+	}
+
+	pr->up = up;
+	pr->timeout.cb = proxy_probe_timeout_cb;
+	pr->sfd.stream.string_data = true;
+	pr->sfd.stream.notify_read = proxy_probe_read_cb;
+	pr->sfd.stream.notify_state = proxy_probe_state_cb;
+	ustream_fd_init(&pr->sfd, fd);
+	up->probe = pr;
+
+	ustream_printf(&pr->sfd.stream,
+		       "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+		       up->probe_url, up->name);
+	uloop_timeout_set(&pr->timeout,
+			  min(up->probe_interval, PROXY_PROBE_TIMEOUT) * 1000);
+	return;
+
+retry:
+	uloop_timeout_set(&up->probe_timer, up->probe_interval * 1000);
+}
+
+static bool proxy_upstream_usable(struct proxy_upstream *up, struct proxy_upstream *skip,
+				  bool strict, uint64_t now)
+{
+	if (up == skip)
+		return false;
+
+	return !strict || (!up->probe_failed && up->down_until <= now);
+}
+
+static bool proxy_upstream_better(struct proxy_upstream *a, struct proxy_upstream *b,
+				  enum proxy_balance balance)
+{
+	if (!b)
+		return true;
+
+	if (a->active != b->active)
+		return a->active < b->active;
+
+	/* spread ties evenly, or prefer the faster upstream for p2c */
+	if (balance == PROXY_BALANCE_P2C)
+		return a->ewma_us < b->ewma_us;
+
+	return a->requests < b->requests;
+}
+
+/*
+ * Pick an upstream from the pool, either the one with the fewest active
+ * requests or the better of two random choices. Upstreams which failed
+ * recently are only considered if nothing else is left.
+ */
+static struct proxy_upstream *proxy_select(struct proxy_route *route, struct proxy_upstream *skip)
+{
+	struct proxy_upstream *best = NULL;
+	struct proxy_member *m;
+	uint64_t now = uh_time_ms();
+	bool strict = true;
+	int n = 0, i = 0;
+	int pick[2];
+
+	list_for_each_entry(m, &route->members, list)
+		n += proxy_upstream_usable(m->up, skip, strict, now);
+
+	if (!n) {
+		strict = false;
+		list_for_each_entry(m, &route->members, list)
+			n += proxy_upstream_usable(m->up, skip, strict, now);
+	}
+
+	if (!n)
+		return skip;
+
+	pick[0] = pick[1] = -1;
+	if (route->balance == PROXY_BALANCE_P2C && n > 2) {
+		pick[0] = random() % n;
+		pick[1] = random() % (n - 1);
+		if (pick[1] >= pick[0])
+			pick[1]++;
+	}
+
+	list_for_each_entry(m, &route->members, list) {
+		if (!proxy_upstream_usable(m->up, skip, strict, now))
+			continue;
+
+		if ((pick[0] < 0 || i == pick[0] || i == pick[1]) &&
+		    proxy_upstream_better(m->up, best, route->balance))
+			best = m->up;
+
+		i++;
+	}
+
+	return best;
+}
+
+static void proxy_idle_read_cb(struct ustream *s, int bytes)
+{
+	struct proxy_conn *c = container_of(s, struct proxy_conn, r.sfd.stream);
+
+	/* nothing is expected on an idle connection */
+	proxy_conn_free(c);
+}
+
+static void proxy_idle_state_cb(struct ustream *s)
+{
+	struct proxy_conn *c = container_of(s, struct proxy_conn, r.sfd.stream);
+
+	if (s->eof || s->write_error)
+		proxy_conn_free(c);
+}
+
+static void proxy_timeout_cb(struct uloop_timeout *timeout)
+{
+	struct proxy_conn *c = container_of(timeout, struct proxy_conn, timeout);
+
+	if (!c->r.cl) {
+		proxy_conn_free(c);
+		return;
+	}
+
+	proxy_upstream_failed(c->up);
+	uh_client_error(c->r.cl, 504, "Gateway Timeout",
+			"The upstream server did not respond in time");
+}
+
+static struct proxy_conn *proxy_conn_new(struct proxy_upstream *up)
+{
+	struct proxy_conn *c;
+	int fd;
+
+	fd = proxy_socket(up);
+	if (fd < 0)
+		return NULL;
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		close(fd);
+		return NULL;
+	}
+
+	c->up = up;
+	c->idle_timeout = PROXY_IDLE_TIMEOUT;
+	c->timeout.cb = proxy_timeout_cb;
+	c->r.sfd.stream.string_data = true;
+	c->r.sfd.stream.notify_read = proxy_idle_read_cb;
+	c->r.sfd.stream.notify_state = proxy_idle_state_cb;
+	ustream_fd_init(&c->r.sfd, fd);
+
+	return c;
+}
+
+/*
+ * Most recently used first, the longer a connection sat idle, the more
+ * likely the upstream is about to close it.
+ */
+static struct proxy_conn *proxy_conn_get(struct proxy_upstream *up, bool fresh)
+{
+	struct proxy_conn *c;
+
+	while (!fresh && !list_empty(&up->idle)) {
+		c = list_first_entry(&up->idle, struct proxy_conn, list);
+		list_del(&c->list);
+		up->n_idle--;
+		uloop_timeout_cancel(&c->timeout);
+
+		if (!c->r.sfd.stream.eof && !c->r.sfd.stream.write_error)
+			return c;
+
+		proxy_conn_free(c);
+	}
+
+	return proxy_conn_new(up);
+}
+
+static void proxy_conn_release(struct proxy_conn *c, bool reuse)
+{
+	struct proxy_upstream *up = c->up;
+	struct ustream *s = &c->r.sfd.stream;
+
+	c->r.cl = NULL;
+	up->active--;
+
+	if (!reuse || up->n_idle >= PROXY_IDLE_MAX || s->eof || s->write_error ||
+	    ustream_pending_data(s, false) || ustream_pending_data(s, true)) {
+		proxy_conn_free(c);
+		return;
+	}
+
+	s->notify_read = proxy_idle_read_cb;
+	s->notify_state = proxy_idle_state_cb;
+	s->notify_write = NULL;
+	ustream_set_read_blocked(s, false);
+
+	list_add(&c->list, &up->idle);
+	up->n_idle++;
+	uloop_timeout_set(&c->timeout, c->idle_timeout * 1000);
+}
+
+static bool proxy_hop_header(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(hop_headers); i++)
+		if (!strcasecmp(name, hop_headers[i]))
+			return true;
+
+	return false;
+}
+
+static void proxy_send_request(struct client *cl)
+{
+	struct dispatch_proxy *p = &cl->dispatch.proxy;
+	struct http_request *req = &cl->request;
+	struct ustream *us = &p->conn->r.sfd.stream;
+	const char *name, *fwd = NULL;
+	char addr[INET6_ADDRSTRLEN];
+	struct blob_attr *cur;
+	bool host = false;
+	int rem;
+
+	ustream_printf(us, "%s %s HTTP/1.1\r\n", http_methods[req->method], p->url);
+
+	blob_for_each_attr(cur, cl->hdr.head, rem) {
+		name = blobmsg_name(cur);
+		if (!strcmp(name, "URL") || proxy_hop_header(name))
+			continue;
+
+		if (!strcmp(name, "x-forwarded-for")) {
+			fwd = blobmsg_data(cur);
+			continue;
+		}
+
+		if (!strcmp(name, "host"))
+			host = true;
+
+		ustream_printf(us, "%s: %s\r\n", name, (char *) blobmsg_data(cur));
+	}
+
+	if (!host)
+		ustream_printf(us, "Host: %s\r\n", p->up->name);
+
+	inet_ntop(cl->peer_addr.family, &cl->peer_addr.in6, addr, sizeof(addr));
+	ustream_printf(us, "X-Forwarded-For: %s%s%s\r\n",
+		       fwd ? fwd : "", fwd ? ", " : "", addr);
+	ustream_printf(us, "X-Forwarded-Proto: %s\r\n", cl->tls ? "https" : "http");
+
+	if (p->upload_chunked)
+		ustream_printf(us, "Transfer-Encoding: chunked\r\n");
+
+	ustream_printf(us, "Connection: keep-alive\r\n\r\n");
+}
+
+static bool proxy_status_cb(struct relay *r, char *line)
+{
+	struct dispatch_proxy *p = &r->cl->dispatch.proxy;
+	char *sep;
+	int code;
+
+	if (strncmp(line, "HTTP/1.", 7) || line[8] != ' ')
+		return false;
+
+	code = strtoul(line + 9, &sep, 10);
+	if (code < 100 || code > 999)
+		return false;
+
+	while (*sep == ' ')
+		sep++;
+
+	p->status_code = code;
+	snprintf(p->status_msg, sizeof(p->status_msg), "%s", *sep ? sep : "OK");
+	p->keepalive = line[7] != '0';
+	p->chunked = false;
+	p->content_length = -1;
+	blob_buf_init(&p->hdr, 0);
+
+	return true;
+}
+
+static void proxy_header_cb(struct relay *r, const char *name, const char *val)
+{
+	struct proxy_conn *c = container_of(r, struct proxy_conn, r);
+	struct client *cl = r->cl;
+	struct dispatch_proxy *p = &cl->dispatch.proxy;
+	const char *sep;
+
+	if (!strcasecmp(name, "connection")) {
+		if (strcasestr(val, "close"))
+			p->keepalive = false;
+		else if (strcasestr(val, "keep-alive"))
+			p->keepalive = true;
+		return;
+	}
+
+	if (!strcasecmp(name, "keep-alive")) {
+		/* give the connection back before the upstream drops it */
+		sep = strstr(val, "timeout=");
+		if (sep && atoi(sep + 8) > 0)
+			c->idle_timeout = max(atoi(sep + 8) - 1, 1);
+		return;
+	}
+
+	if (!strcasecmp(name, "transfer-encoding")) {
+		p->chunked = !!strcasestr(val, "chunked");
+		return;
+	}
+
+	if (!strcasecmp(name, "content-length")) {
+		p->content_length = strtoll(val, NULL, 10);
+
+		/* the body is passed on unchanged if it is not chunked */
+		if (uh_use_chunked(cl))
+			return;
+	}
+
+	if (proxy_hop_header(name))
+		return;
+
+	blobmsg_add_string(&p->hdr, name, val);
+}
+
+static void proxy_header_end(struct relay *r)
+{
+	struct proxy_conn *c = container_of(r, struct proxy_conn, r);
+	struct client *cl = r->cl;
+	struct dispatch_proxy *p = &cl->dispatch.proxy;
+	struct blob_attr *cur;
+	int rem;
+
+	/* interim response, wait for the final one */
+	if (p->status_code < 200) {
+		r->status_cb = proxy_status_cb;
+		r->header_cb = proxy_header_cb;
+		return;
+	}
+
+	uloop_timeout_cancel(&c->timeout);
+	proxy_upstream_ok(c->up, uh_time_us() - p->start);
+	uh_http_header(cl, p->status_code, p->status_msg);
+	blob_for_each_attr(cur, p->hdr.head, rem)
+		ustream_printf(cl->us, "%s: %s\r\n", blobmsg_name(cur), blobmsg_data(cur));
+
+	ustream_printf(cl->us, "\r\n");
+
+	r->framed = true;
+	if (cl->request.method == UH_HTTP_MSG_HEAD ||
+	    p->status_code == 204 || p->status_code == 304)
+		r->content_length = 0;
+	else if (p->chunked)
+		r->chunk_state = RELAY_CHUNK_SIZE;
+	else if (p->content_length >= 0)
+		r->content_length = p->content_length;
+	else {
+		/* delimited by the end of the connection */
+		r->framed = false;
+		p->keepalive = false;
+	}
+}
+
+static void proxy_close_cb(struct relay *r, int ret)
+{
+	struct client *cl = r->cl;
+	struct dispatch_proxy *p = &cl->dispatch.proxy;
+	struct proxy_conn *c = p->conn;
+	struct proxy_upstream *up = c->up;
+	bool stale, truncated;
+
+	if (r->header_cb) {
+		/*
+		 * A kept alive connection may have been closed by the upstream
+		 * just as the request went out, try again on a new one if the
+		 * request can be repeated. Otherwise the upstream failed and
+		 * another member of the pool gets a chance.
+		 */
+		stale = r->status_cb && c->requests > 1;
+		if (!stale)
+			proxy_upstream_failed(up);
+
+		if (r->status_cb && !p->retried && !p->has_body) {
+			p->retried = true;
+			p->conn = NULL;
+			proxy_conn_release(c, false);
+
+			if (!stale)
+				up = proxy_select(p->route, up);
+
+			if (up && proxy_connect(cl, up, stale))
+				return;
+		}
+
+		uh_client_error(cl, 502, "Bad Gateway",
+				"The upstream server did not produce a valid response");
+		return;
+	}
+
+	/* the rest of the request body can not be told apart from the next request */
+	if (!p->upload_done)
+		cl->request.connection_close = true;
+
+	/* a framed body only ends early if the upstream went away */
+	truncated = ret && r->framed;
+
+	p->conn = NULL;
+	proxy_conn_release(c, !ret && p->keepalive && p->upload_done);
+
+	/*
+	 * The headers are out already, closing the connection is the only way
+	 * left to tell the client that the body is incomplete.
+	 */
+	if (truncated) {
+		uh_connection_close(cl);
+		return;
+	}
+
+	uh_request_done(cl);
+}
+
+static void proxy_upstream_write_cb(struct ustream *s, int bytes)
+{
+	struct proxy_conn *c = container_of(s, struct proxy_conn, r.sfd.stream);
+	struct client *cl = c->r.cl;
+
+	if (!cl || !cl->dispatch.data_blocked ||
+	    ustream_pending_data(s, true) > PROXY_UPLOAD_MAX / 2)
+		return;
+
+	cl->dispatch.data_blocked = false;
+	client_poll_post_data(cl);
+}
+
+static int proxy_data_send(struct client *cl, const char *data, int len)
+{
+	struct dispatch_proxy *p = &cl->dispatch.proxy;
+	struct ustream *us;
+
+	if (!p->conn)
+		return len;
+
+	us = &p->conn->r.sfd.stream;
+	if (p->upload_chunked)
+		ustream_printf(us, "%X\r\n", len);
+
+	ustream_write(us, data, len, true);
+
+	if (p->upload_chunked)
+		ustream_write(us, "\r\n", 2, false);
+
+	/* stop reading from the client until the upstream catches up */
+	if (ustream_pending_data(us, true) > PROXY_UPLOAD_MAX)
+		cl->dispatch.data_blocked = true;
+
+	return len;
+}
+
+static void proxy_data_done(struct client *cl)
+{
+	struct dispatch_proxy *p = &cl->dispatch.proxy;
+
+	if (p->conn && p->upload_chunked)
+		ustream_printf(&p->conn->r.sfd.stream, "0\r\n\r\n");
+
+	p->upload_done = true;
+}
+
+static void proxy_write_cb(struct client *cl)
+{
+	struct proxy_conn *c = cl->dispatch.proxy.conn;
+	struct ustream *s;
+
+	if (!c || ustream_pending_data(cl->us, true))
+		return;
+
+	s = &c->r.sfd.stream;
+	if (!s->notify_read)
+		return;
+
+	ustream_set_read_blocked(s, false);
+	s->notify_read(s, 0);
+}
+
+static void proxy_free(struct client *cl)
+{
+	struct dispatch_proxy *p = &cl->dispatch.proxy;
+
+	if (p->conn)
+		proxy_conn_release(p->conn, false);
+
+	p->conn = NULL;
+	blob_buf_free(&p->hdr);
+	free(p->url);
+	proxy_route_put(p->route);
+}
+
+static void proxy_close_fds(struct client *cl)
+{
+	struct proxy_conn *c = cl->dispatch.proxy.conn;
+
+	if (c)
+		close(c->r.sfd.fd.fd);
+}
+
+static bool proxy_connect(struct client *cl, struct proxy_upstream *up, bool fresh)
+{
+	struct dispatch_proxy *p = &cl->dispatch.proxy;
+	struct proxy_conn *c;
+
+	c = proxy_conn_get(up, fresh);
+	if (!c)
+		return false;
+
+	p->up = up;
+	p->conn = c;
+	p->start = uh_time_us();
+	c->requests++;
+	up->active++;
+	up->requests++;
+
+	uh_relay_attach(cl, &c->r);
+	c->r.process_done = true;
+	c->r.ret = -1;
+	c->r.status_cb = proxy_status_cb;
+	c->r.header_cb = proxy_header_cb;
+	c->r.header_end = proxy_header_end;
+	c->r.close = proxy_close_cb;
+	c->r.sfd.stream.notify_write = proxy_upstream_write_cb;
+
+	if (conf.script_timeout > 0)
+		uloop_timeout_set(&c->timeout, conf.script_timeout * 1000);
+
+	proxy_send_request(cl);
+
+	return true;
+}
+
+static char *proxy_target(struct proxy_route *route, const char *url, int len)
+{
+	const char *rest = url + len;
+	char *target;
+
+	/* without a path the URL is passed on unchanged */
+	if (!route->path)
+		return strdup(url);
+
+	target = malloc(strlen(route->path) + strlen(rest) + 2);
+	if (target)
+		sprintf(target, "%s%s%s", route->path, *rest == '/' ? "" : "/", rest);
+
+	return target;
+}
+
+enum proxy_hdr {
+	HDR_AUTHORIZATION,
+	__HDR_MAX
+};
+
+static void proxy_handle_request(struct client *cl, char *url, struct path_info *pi)
+{
+	static const struct blobmsg_policy hdr_policy[__HDR_MAX] = {
+		[HDR_AUTHORIZATION] = { "authorization", BLOBMSG_TYPE_STRING },
+	};
+	struct dispatch_proxy *p = &cl->dispatch.proxy;
+	struct http_request *req = &cl->request;
+	struct blob_attr *tb[__HDR_MAX];
+	struct proxy_upstream *up, *failed = NULL;
+	struct proxy_route *route;
+	struct path_info pa = {};
+	int len, i;
+
+	route = uh_trie_match(&proxy_trie, url, true, &len);
+	if (!route)
+		return uh_client_error(cl, 404, "Not Found",
+				       "No upstream is configured for %s", url);
+
+	blobmsg_parse(hdr_policy, __HDR_MAX, tb, blob_data(cl->hdr.head), blob_len(cl->hdr.head));
+	pa.name = url;
+	if (tb[HDR_AUTHORIZATION])
+		pa.auth = blobmsg_data(tb[HDR_AUTHORIZATION]);
+
+	if (!uh_auth_check(cl, &pa))
+		return;
+
+	p->url = proxy_target(route, url, len);
+	if (!p->url)
+		return uh_client_error(cl, 500, "Internal Server Error",
+				       "Out of memory");
+
+	p->route = route;
+	route->refs++;
+	p->has_body = req->content_length > 0 || req->transfer_chunked;
+	p->upload_chunked = req->transfer_chunked;
+
+	cl->dispatch.free = proxy_free;
+	cl->dispatch.close_fds = proxy_close_fds;
+	cl->dispatch.write_cb = proxy_write_cb;
+	cl->dispatch.data_send = proxy_data_send;
+	cl->dispatch.data_done = proxy_data_done;
+
+	for (i = 0; i < route->n_members; i++) {
+		up = proxy_select(route, failed);
+		if (!up)
+			break;
+
+		if (proxy_connect(cl, up, false)) {
+			/* a deferred request may have its body waiting already */
+			client_poll_post_data(cl);
+			return;
+		}
+
+		proxy_upstream_failed(up);
+		failed = up;
+	}
+
+	uh_client_error(cl, 502, "Bad Gateway",
+			"Couldn't connect to upstream%s%s: %s",
+			failed ? " " : "", failed ? failed->name : "",
+			strerror(errno));
+}
+
+static void proxy_status_prometheus(struct client *cl)
+{
+	struct proxy_upstream *up;
+
+#define proxy_metric(_name, _type, _fmt, _val)					\
+	uh_chunk_printf(cl, "# TYPE uhttpd_upstream_" _name " " _type "\n");	\
+	list_for_each_entry(up, &upstreams, list)				\
+		uh_chunk_printf(cl, "uhttpd_upstream_" _name			\
+				"{upstream=\"%s\"} " _fmt "\n", up->name, _val);
+
+	proxy_metric("up", "gauge", "%d",
+		     !up->probe_failed && up->down_until <= uh_time_ms());
+	proxy_metric("active", "gauge", "%d", up->active);
+	proxy_metric("idle", "gauge", "%d", up->n_idle);
+	proxy_metric("requests_total", "counter", "%lu", up->requests);
+	proxy_metric("failures_total", "counter", "%lu", up->failures);
+	proxy_metric("probe_failures_total", "counter", "%lu", up->probe_failures);
+
+#undef proxy_metric
+
+	/* a summary without quantiles, _sum and _count share the metric type */
+	uh_chunk_printf(cl, "# TYPE uhttpd_upstream_response_seconds summary\n");
+	list_for_each_entry(up, &upstreams, list)
+		uh_chunk_printf(cl, "uhttpd_upstream_response_seconds_sum"
+				"{upstream=\"%s\"} %g\n"
+				"uhttpd_upstream_response_seconds_count"
+				"{upstream=\"%s\"} %lu\n",
+				up->name, up->latency_us / 1e6,
+				up->name, up->responses);
+}
+
+void uh_proxy_status(struct client *cl, bool prometheus)
+{
+	struct proxy_upstream *up;
+	uint64_t now = uh_time_ms();
+
+	if (prometheus)
+		return proxy_status_prometheus(cl);
+
+	list_for_each_entry(up, &upstreams, list)
+		uh_chunk_printf(cl, "upstream_%s: up=%d active=%d idle=%d "
+			"requests=%lu failures=%lu probe_failures=%lu "
+			"avg_us=%llu ewma_us=%llu\n",
+			up->name, !up->probe_failed && up->down_until <= now,
+			up->active, up->n_idle, up->requests, up->failures,
+			up->probe_failures,
+			(unsigned long long) (up->responses ? up->latency_us / up->responses : 0),
+			(unsigned long long) up->ewma_us);
+}
+
+static bool proxy_check_url(const char *url)
+{
+	return uh_trie_match(&proxy_trie, url, true, NULL) != NULL;
+}
+
+struct dispatch_handler proxy_dispatch = {
+	.name = "proxy",
+	.check_url = proxy_check_url,
+	.handle_request = proxy_handle_request,
+};
@@ -65,6 +65,7 @@ static void relay_error(struct relay *r)
 static void relay_process_headers(struct relay *r)
 {
 	struct ustream *s = &r->sfd.stream;
+	bool (*status_cb)(struct relay *r, char *line);
 	char *buf, *newline;
 	int len;
 
@@ -88,12 +89,25 @@ static void relay_process_headers(struct relay *r)
 			newline--;
 
 		*newline = 0;
+		if (r->status_cb) {
+			status_cb = r->status_cb;
+			r->status_cb = NULL;
+			if (!status_cb(r, buf)) {
+				relay_error(r);
+				return;
+			}
+
+			ustream_consume(s, line_len);
+			continue;
+		}
+
+		/* header_end may start over for interim responses */
 		if (newline == buf) {
 			r->header_cb = NULL;
+			ustream_consume(s, line_len);
 			if (r->header_end)
 				r->header_end(r);
-			ustream_consume(s, line_len);
-			break;
+			continue;
 		}
 
 		val = uh_split_header(buf);
@@ -107,13 +121,58 @@ static void relay_process_headers(struct relay *r)
 	}
 }
 
+/* returns 1 if a framing line was consumed, 0 if more data is needed */
+static int relay_process_chunk(struct relay *r, char *buf)
+{
+	struct ustream *s = &r->sfd.stream;
+	char *newline, *sep;
+
+	newline = strchr(buf, '\n');
+	if (!newline)
+		return 0;
+
+	switch (r->chunk_state) {
+	case RELAY_CHUNK_SIZE:
+		r->content_length = strtoll(buf, &sep, 16);
+		if (sep == buf || r->content_length < 0 ||
+		    (*sep != ';' && *sep != '\r' && *sep != '\n'))
+			return -1;
+
+		r->chunk_state = r->content_length ? RELAY_CHUNK_DATA : RELAY_CHUNK_TRAILER;
+		break;
+
+	case RELAY_CHUNK_END:
+		if (newline - buf > 1 || (newline != buf && *buf != '\r'))
+			return -1;
+
+		r->chunk_state = RELAY_CHUNK_SIZE;
+		break;
+
+	case RELAY_CHUNK_TRAILER:
+		if (newline == buf || *buf == '\r')
+			r->chunk_state = RELAY_CHUNK_NONE;
+		break;
+
+	default:
+		return -1;
+	}
+
+	ustream_consume(s, newline + 1 - buf);
+	return 1;
+}
+
+static bool relay_body_done(struct relay *r)
+{
+	return r->framed && !r->content_length && r->chunk_state == RELAY_CHUNK_NONE;
+}
+
 static void relay_read_cb(struct ustream *s, int bytes)
 {
 	struct relay *r = container_of(s, struct relay, sfd.stream);
 	struct client *cl = r->cl;
 	struct ustream *us = cl->us;
 	char *buf;
-	int len;
+	int len, ret;
 
 	relay_process_headers(r);
 
@@ -127,17 +186,43 @@ static void relay_read_cb(struct ustream *s, int bytes)
 		return;
 	}
 
-	if (!s->eof && ustream_pending_data(us, true)) {
-		ustream_set_read_blocked(s, true);
-		return;
-	}
+	while (!relay_body_done(r)) {
+		if (!s->eof && ustream_pending_data(us, true)) {
+			ustream_set_read_blocked(s, true);
+			return;
+		}
 
-	buf = ustream_get_read_buf(s, &len);
-	if (!buf || !len)
-		return;
+		buf = ustream_get_read_buf(s, &len);
+		if (!buf || !len)
+			return;
+
+		if (r->chunk_state != RELAY_CHUNK_NONE &&
+		    r->chunk_state != RELAY_CHUNK_DATA) {
+			ret = relay_process_chunk(r, buf);
+			if (ret < 0)
+				relay_error(r);
+			if (ret <= 0)
+				return;
+
+			continue;
+		}
+
+		if (r->framed && len > r->content_length)
+			len = r->content_length;
+
+		uh_chunk_write(cl, buf, len);
+		ustream_consume(s, len);
+
+		if (!r->framed)
+			continue;
 
-	uh_chunk_write(cl, buf, len);
-	ustream_consume(s, len);
+		r->content_length -= len;
+		if (!r->content_length && r->chunk_state == RELAY_CHUNK_DATA)
+			r->chunk_state = RELAY_CHUNK_END;
+	}
+
+	/* the response is complete, the stream may carry on with the next one */
+	uh_relay_close(r, 0);
 }
 
 static void relay_close_if_done(struct relay *r)
@@ -154,6 +239,11 @@ static void relay_state_cb(struct ustream *s)
 {
 	struct relay *r = container_of(s, struct relay, sfd.stream);
 
+	if (s->write_error && !s->eof) {
+		relay_error(r);
+		return;
+	}
+
 	if (r->process_done)
 		relay_close_if_done(r);
 }
@@ -177,13 +267,23 @@ void uh_relay_kill(struct client *cl, struct relay *r)
 	ustream_state_change(us);
 }
 
-void uh_relay_open(struct client *cl, struct relay *r, int fd, int pid)
+void uh_relay_attach(struct client *cl, struct relay *r)
 {
 	struct ustream *us = &r->sfd.stream;
 
 	r->cl = cl;
+	r->framed = false;
+	r->chunk_state = RELAY_CHUNK_NONE;
+	r->content_length = 0;
 	us->notify_read = relay_read_cb;
 	us->notify_state = relay_state_cb;
+}
+
+void uh_relay_open(struct client *cl, struct relay *r, int fd, int pid)
+{
+	struct ustream *us = &r->sfd.stream;
+
+	uh_relay_attach(cl, r);
 	us->string_data = true;
 	ustream_fd_init(&r->sfd, fd);
 
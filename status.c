@@ -0,0 +1,307 @@
+/*
+ * uhttpd - Tiny single-threaded httpd
+ *
+ *   Copyright (C) 2010-2013 Jo-Philipp Wich <xm@subsignal.org>
+ *   Copyright (C) 2013 Felix Fietkau <nbd@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "uhttpd.h"
+
+/*
+ * Request latencies are kept in log-linear histograms: every power of two
+ * of microseconds is split into UH_HIST_SUB linear buckets, which bounds
+ * the relative error to 25% up to about a minute. All counters live in
+ * static tables, recording a request is a handful of increments.
+ */
+
+#define UH_HIST_SUB		4
+#define UH_HIST_BUCKETS		100
+#define UH_STATS_HANDLERS	8
+#define UH_STATS_CODES		600
+
+struct handler_stats {
+	const char *name;
+	unsigned long requests;
+	uint64_t usec_total;
+	unsigned long hist[UH_HIST_BUCKETS];
+};
+
+struct server_stats uh_stats;
+
+static struct handler_stats handler_stats[UH_STATS_HANDLERS] = {
+	{ .name = "file" },
+};
+static int n_handler_stats = 1;
+static unsigned long status_codes[UH_STATS_CODES];
+static uint64_t start_time;
+
+struct handler_stats *uh_stats_handler(const char *name)
+{
+	int i;
+
+	if (!name)
+		name = "other";
+
+	for (i = 0; i < n_handler_stats; i++)
+		if (!strcmp(handler_stats[i].name, name))
+			return &handler_stats[i];
+
+	if (n_handler_stats == UH_STATS_HANDLERS)
+		return &handler_stats[UH_STATS_HANDLERS - 1];
+
+	handler_stats[n_handler_stats].name = name;
+	return &handler_stats[n_handler_stats++];
+}
+
+static int uh_hist_bucket(uint64_t usec)
+{
+	int e, idx;
+
+	if (usec < UH_HIST_SUB)
+		return usec;
+
+	e = 63 - __builtin_clzll(usec);
+	idx = (e - 1) * UH_HIST_SUB + ((usec >> (e - 2)) & (UH_HIST_SUB - 1));
+
+	return min(idx, UH_HIST_BUCKETS - 1);
+}
+
+/* upper bound of a bucket in microseconds */
+static uint64_t uh_hist_bound(int idx)
+{
+	int e = idx / UH_HIST_SUB + 1;
+	int sub = idx % UH_HIST_SUB;
+
+	if (idx < UH_HIST_SUB)
+		return idx + 1;
+
+	return (uint64_t) (UH_HIST_SUB + sub + 1) << (e - 2);
+}
+
+void uh_stats_request_done(struct client *cl)
+{
+	struct http_request *r = &cl->request;
+	struct handler_stats *hs = r->stats;
+	uint64_t usec;
+
+	if (r->status > 0 && r->status < UH_STATS_CODES)
+		status_codes[r->status]++;
+
+	if (!r->start)
+		return;
+
+	if (!hs)
+		hs = &handler_stats[0];
+
+	usec = uh_time_us() - r->start;
+	hs->requests++;
+	hs->usec_total += usec;
+	hs->hist[uh_hist_bucket(usec)]++;
+	r->start = 0;
+}
+
+static uint64_t uh_hist_percentile(struct handler_stats *hs, int permille)
+{
+	unsigned long rank, sum = 0;
+	int i;
+
+	if (!hs->requests)
+		return 0;
+
+	rank = (hs->requests * permille + 999) / 1000;
+	for (i = 0; i < UH_HIST_BUCKETS; i++) {
+		sum += hs->hist[i];
+		if (sum >= rank)
+			return uh_hist_bound(i);
+	}
+
+	return uh_hist_bound(UH_HIST_BUCKETS - 1);
+}
+
+static void uh_status_text(struct client *cl)
+{
+	struct handler_stats *hs;
+	int i;
+
+	uh_chunk_printf(cl, "uptime: %llu\n",
+		(unsigned long long) (uh_time_ms() - start_time) / 1000);
+	uh_chunk_printf(cl, "connections_accepted: %lu\n", uh_stats.accepted);
+	uh_chunk_printf(cl, "connections_active: %d\n", n_clients);
+	uh_chunk_printf(cl, "connections_rejected_limit: %lu\n", limit_rejected_conns);
+	uh_chunk_printf(cl, "requests_rejected_limit: %lu\n", limit_rejected_requests);
+	uh_chunk_printf(cl, "bytes_in: %llu\n", (unsigned long long) uh_stats.bytes_in);
+	uh_chunk_printf(cl, "bytes_out: %llu\n", (unsigned long long) uh_stats.bytes_out);
+	uh_chunk_printf(cl, "log_dropped: %lu\n", log_dropped);
+	uh_chunk_printf(cl, "h2_connections: %lu\n", uh_stats.h2_connections);
+	uh_chunk_printf(cl, "h2_streams: %lu\n", uh_stats.h2_streams);
+#ifdef HAVE_TLS
+	uh_chunk_printf(cl, "tls_handshakes: %lu\n", uh_stats.tls_handshakes);
+	uh_chunk_printf(cl, "tls_resumed: %lu\n", uh_stats.tls_resumed);
+	uh_chunk_printf(cl, "tls_offloaded: %lu\n", uh_stats.tls_offloaded);
+#endif
+
+	uh_chunk_printf(cl, "script_queue: %u\n", script_stats.queued);
+	uh_chunk_printf(cl, "script_queue_max: %u\n", script_stats.max_queued);
+	uh_chunk_printf(cl, "script_deferred: %lu\n", script_stats.deferred);
+	uh_chunk_printf(cl, "script_expired: %lu\n", script_stats.expired);
+	uh_chunk_printf(cl, "script_wait_ms_max: %llu\n",
+		(unsigned long long) script_stats.wait_ms_max);
+
+	uh_chunk_printf(cl, "cache_hits: %lu\n", cache_stats.hits);
+	uh_chunk_printf(cl, "cache_stale: %lu\n", cache_stats.stale);
+	uh_chunk_printf(cl, "cache_misses: %lu\n", cache_stats.misses);
+	uh_chunk_printf(cl, "cache_collapsed: %lu\n", cache_stats.collapsed);
+	uh_chunk_printf(cl, "cache_stored: %lu\n", cache_stats.stored);
+	uh_chunk_printf(cl, "cache_bytes: %d\n", cache_stats.used);
+	uh_chunk_printf(cl, "collapse_followers: %lu\n", collapse_followers);
+
+	for (i = 0; i < UH_STATS_CODES; i++)
+		if (status_codes[i])
+			uh_chunk_printf(cl, "status_%d: %lu\n", i, status_codes[i]);
+
+	for (i = 0; i < n_handler_stats; i++) {
+		hs = &handler_stats[i];
+		uh_chunk_printf(cl, "handler_%s: requests=%lu avg_us=%llu "
+			"p50_us=%llu p90_us=%llu p99_us=%llu\n",
+			hs->name, hs->requests,
+			(unsigned long long) (hs->requests ? hs->usec_total / hs->requests : 0),
+			(unsigned long long) uh_hist_percentile(hs, 500),
+			(unsigned long long) uh_hist_percentile(hs, 900),
+			(unsigned long long) uh_hist_percentile(hs, 990));
+	}
+
+	uh_proxy_status(cl, false);
+}
+
+static void uh_status_prometheus(struct client *cl)
+{
+	struct handler_stats *hs;
+	unsigned long sum;
+	int i, j;
+
+	uh_chunk_printf(cl, "# TYPE uhttpd_connections_accepted_total counter\n"
+		"uhttpd_connections_accepted_total %lu\n", uh_stats.accepted);
+	uh_chunk_printf(cl, "# TYPE uhttpd_connections_active gauge\n"
+		"uhttpd_connections_active %d\n", n_clients);
+	uh_chunk_printf(cl, "# TYPE uhttpd_rejected_total counter\n"
+		"uhttpd_rejected_total{reason=\"connections\"} %lu\n"
+		"uhttpd_rejected_total{reason=\"rate\"} %lu\n"
+		"uhttpd_rejected_total{reason=\"queue\"} %lu\n",
+		limit_rejected_conns, limit_rejected_requests, script_stats.expired);
+	uh_chunk_printf(cl, "# TYPE uhttpd_bytes_total counter\n"
+		"uhttpd_bytes_total{direction=\"in\"} %llu\n"
+		"uhttpd_bytes_total{direction=\"out\"} %llu\n",
+		(unsigned long long) uh_stats.bytes_in,
+		(unsigned long long) uh_stats.bytes_out);
+	uh_chunk_printf(cl, "# TYPE uhttpd_h2_connections_total counter\n"
+		"uhttpd_h2_connections_total %lu\n", uh_stats.h2_connections);
+	uh_chunk_printf(cl, "# TYPE uhttpd_h2_streams_total counter\n"
+		"uhttpd_h2_streams_total %lu\n", uh_stats.h2_streams);
+#ifdef HAVE_TLS
+	uh_chunk_printf(cl, "# TYPE uhttpd_tls_handshakes_total counter\n"
+		"uhttpd_tls_handshakes_total{session=\"new\"} %lu\n"
+		"uhttpd_tls_handshakes_total{session=\"resumed\"} %lu\n",
+		uh_stats.tls_handshakes - uh_stats.tls_resumed,
+		uh_stats.tls_resumed);
+	uh_chunk_printf(cl, "# TYPE uhttpd_tls_offloaded_total counter\n"
+		"uhttpd_tls_offloaded_total %lu\n", uh_stats.tls_offloaded);
+#endif
+	uh_chunk_printf(cl, "# TYPE uhttpd_script_queue gauge\n"
+		"uhttpd_script_queue %u\n", script_stats.queued);
+	uh_chunk_printf(cl, "# TYPE uhttpd_cache_requests_total counter\n"
+		"uhttpd_cache_requests_total{result=\"hit\"} %lu\n"
+		"uhttpd_cache_requests_total{result=\"stale\"} %lu\n"
+		"uhttpd_cache_requests_total{result=\"miss\"} %lu\n"
+		"uhttpd_cache_requests_total{result=\"collapsed\"} %lu\n",
+		cache_stats.hits, cache_stats.stale, cache_stats.misses,
+		cache_stats.collapsed);
+	uh_chunk_printf(cl, "# TYPE uhttpd_cache_bytes gauge\n"
+		"uhttpd_cache_bytes %d\n", cache_stats.used);
+	uh_chunk_printf(cl, "# TYPE uhttpd_collapsed_requests_total counter\n"
+		"uhttpd_collapsed_requests_total %lu\n", collapse_followers);
+
+	uh_chunk_printf(cl, "# TYPE uhttpd_responses_total counter\n");
+	for (i = 0; i < UH_STATS_CODES; i++)
+		if (status_codes[i])
+			uh_chunk_printf(cl, "uhttpd_responses_total{code=\"%d\"} %lu\n",
+				i, status_codes[i]);
+
+	/* only export the power of two boundaries to keep the output small */
+	uh_chunk_printf(cl, "# TYPE uhttpd_request_duration_seconds histogram\n");
+	for (i = 0; i < n_handler_stats; i++) {
+		hs = &handler_stats[i];
+		sum = 0;
+
+		for (j = 0; j < UH_HIST_BUCKETS; j++) {
+			sum += hs->hist[j];
+			if (j < UH_HIST_SUB - 1 || j % UH_HIST_SUB != UH_HIST_SUB - 1)
+				continue;
+
+			uh_chunk_printf(cl, "uhttpd_request_duration_seconds_bucket"
+				"{handler=\"%s\",le=\"%g\"} %lu\n",
+				hs->name, uh_hist_bound(j) / 1e6, sum);
+		}
+
+		uh_chunk_printf(cl, "uhttpd_request_duration_seconds_bucket"
+			"{handler=\"%s\",le=\"+Inf\"} %lu\n", hs->name, hs->requests);
+		uh_chunk_printf(cl, "uhttpd_request_duration_seconds_sum"
+			"{handler=\"%s\"} %g\n", hs->name, hs->usec_total / 1e6);
+		uh_chunk_printf(cl, "uhttpd_request_duration_seconds_count"
+			"{handler=\"%s\"} %lu\n", hs->name, hs->requests);
+	}
+
+	uh_proxy_status(cl, true);
+}
+
+static bool status_check_url(const char *url)
+{
+	return uh_path_match(conf.status_prefix, url);
+}
+
+static void status_handle_request(struct client *cl, char *url, struct path_info *pi)
+{
+	const char *sub = url + strlen(conf.status_prefix);
+	bool prometheus = !strncmp(sub, "/metrics", 8);
+
+	uh_http_header(cl, 200, "OK");
+	ustream_printf(cl->us, "Content-Type: text/plain%s\r\n\r\n",
+		       prometheus ? "; version=0.0.4" : "");
+
+	if (cl->request.method != UH_HTTP_MSG_HEAD) {
+		if (prometheus)
+			uh_status_prometheus(cl);
+		else
+			uh_status_text(cl);
+	}
+
+	uh_request_done(cl);
+}
+
+static struct dispatch_handler status_dispatch = {
+	.name = "status",
+	.check_url = status_check_url,
+	.handle_request = status_handle_request,
+};
+
+void uh_status_init(void)
+{
+	start_time = uh_time_ms();
+
+	if (!conf.status_prefix)
+		return;
+
+	status_dispatch.prefix = conf.status_prefix;
+	uh_dispatch_add(&status_dispatch);
+}
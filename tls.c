@@ -18,8 +18,14 @@
  */
 
 #include <dlfcn.h>
+#include <fcntl.h>
+#ifdef linux
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#endif
 #include "uhttpd.h"
 #include "tls.h"
+#include "ustream-ssl-ext.h"
 
 #ifdef __APPLE__
 #define LIB_EXT "dylib"
@@ -27,10 +33,118 @@
 #define LIB_EXT "so"
 #endif
 
+#define UH_TLS_SESSION_CACHE	256
+#define UH_TLS_SESSION_TIMEOUT	7200
+#define UH_TLS_TICKET_KEYS	2
+#define UH_TLS_TICKET_KEY_LEN	48
+#define UH_TLS_TICKET_ROTATE	3600
+
+#ifdef linux
+#ifndef SOL_TLS
+#define SOL_TLS			282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP			31
+#endif
+#endif
+
 static struct ustream_ssl_ops *ops;
 static void *dlh;
 static void *ctx;
 
+/*
+ * Optional entry points, see ustream-ssl-ext.h. They are looked up
+ * separately, so libraries without them keep working without the extra
+ * features.
+ */
+static struct {
+	__typeof__(ustream_ssl_context_set_alpn) *context_set_alpn;
+	__typeof__(ustream_ssl_context_set_session_cache) *context_set_session_cache;
+	__typeof__(ustream_ssl_context_set_ticket_keys) *context_set_ticket_keys;
+	__typeof__(ustream_ssl_session_reused) *session_reused;
+	__typeof__(ustream_ssl_get_tx_crypto_info) *get_tx_crypto_info;
+	__typeof__(ustream_ssl_set_tx_offload) *set_tx_offload;
+} ext;
+
+/*
+ * Session ticket keys, each one made up of a 16 byte key name, a 16 byte
+ * HMAC secret and a 16 byte AES key. The first one encrypts new tickets, the
+ * previous one is kept for decryption, so tickets stay valid across one
+ * rotation. Passing no keys turns tickets off.
+ */
+static uint8_t ticket_keys[UH_TLS_TICKET_KEYS][UH_TLS_TICKET_KEY_LEN];
+static int n_ticket_keys;
+static struct uloop_timeout ticket_timer;
+
+static void uh_tls_ext_init(void)
+{
+	ext.context_set_alpn = dlsym(dlh, "ustream_ssl_context_set_alpn");
+	ext.context_set_session_cache = dlsym(dlh, "ustream_ssl_context_set_session_cache");
+	ext.context_set_ticket_keys = dlsym(dlh, "ustream_ssl_context_set_ticket_keys");
+	ext.session_reused = dlsym(dlh, "ustream_ssl_session_reused");
+	ext.get_tx_crypto_info = dlsym(dlh, "ustream_ssl_get_tx_crypto_info");
+	ext.set_tx_offload = dlsym(dlh, "ustream_ssl_set_tx_offload");
+}
+
+static bool uh_tls_random(void *buf, int len)
+{
+	int fd, ret;
+
+	fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	ret = read(fd, buf, len);
+	close(fd);
+
+	return ret == len;
+}
+
+static bool uh_tls_ticket_rotate(void)
+{
+	memmove(ticket_keys[1], ticket_keys[0],
+		(UH_TLS_TICKET_KEYS - 1) * UH_TLS_TICKET_KEY_LEN);
+
+	/* a predictable key would be worse than no tickets at all */
+	if (!uh_tls_random(ticket_keys[0], UH_TLS_TICKET_KEY_LEN))
+		return false;
+
+	if (n_ticket_keys < UH_TLS_TICKET_KEYS)
+		n_ticket_keys++;
+
+	return !ext.context_set_ticket_keys(ctx, ticket_keys, n_ticket_keys,
+					    UH_TLS_TICKET_KEY_LEN);
+}
+
+static void uh_tls_ticket_timer_cb(struct uloop_timeout *t)
+{
+	if (!uh_tls_ticket_rotate()) {
+		fprintf(stderr, "Failed to rotate TLS session ticket keys, "
+				"disabling session tickets\n");
+		ext.context_set_ticket_keys(ctx, NULL, 0, UH_TLS_TICKET_KEY_LEN);
+		return;
+	}
+
+	uloop_timeout_set(t, UH_TLS_TICKET_ROTATE * 1000);
+}
+
+/* let returning clients skip the full handshake */
+static void uh_tls_resumption_init(void)
+{
+	if (!ext.context_set_session_cache || !ext.context_set_ticket_keys) {
+		fprintf(stderr, "ustream-ssl does not support session resumption, "
+				"every connection needs a full handshake\n");
+		return;
+	}
+
+	if (ext.context_set_session_cache(ctx, UH_TLS_SESSION_CACHE,
+					  UH_TLS_SESSION_TIMEOUT))
+		fprintf(stderr, "Failed to set up the TLS session cache\n");
+
+	ticket_timer.cb = uh_tls_ticket_timer_cb;
+	uh_tls_ticket_timer_cb(&ticket_timer);
+}
+
 int uh_tls_init(const char *key, const char *crt)
 {
 	static bool _init = false;
@@ -63,6 +177,19 @@ int uh_tls_init(const char *key, const char *crt)
 		return -EINVAL;
 	}
 
+	uh_tls_ext_init();
+	uh_tls_resumption_init();
+
+	/* without ALPN, HTTPS clients only use HTTP/2 if they know in advance */
+	if (conf.http2 &&
+	    (!ext.context_set_alpn || ext.context_set_alpn(ctx, "h2,http/1.1")))
+		fprintf(stderr, "ustream-ssl does not support ALPN, "
+				"HTTP/2 over TLS requires prior knowledge\n");
+
+	if (conf.ktls && (!ext.get_tx_crypto_info || !ext.set_tx_offload))
+		fprintf(stderr, "ustream-ssl does not support key export, "
+				"kernel TLS is disabled\n");
+
 	return 0;
 }
 
@@ -70,6 +197,7 @@ static void tls_ustream_read_cb(struct ustream *s, int bytes)
 {
 	struct client *cl = container_of(s, struct client, ssl);
 
+	uh_stats.bytes_in += bytes;
 	uh_client_read_cb(cl);
 }
 
@@ -77,10 +205,72 @@ static void tls_ustream_write_cb(struct ustream *s, int bytes)
 {
 	struct client *cl = container_of(s, struct client, ssl);
 
+	uh_stats.bytes_out += bytes;
+	cl->bytes_out += bytes;
 	if (cl->dispatch.write_cb)
 		cl->dispatch.write_cb(cl);
 }
 
+#ifdef linux
+static bool ktls_unavailable;
+
+/*
+ * Hand the encryption of outgoing records to the kernel, file bodies can
+ * then be passed on with sendfile(). Only done while nothing is queued, as
+ * records already encrypted by the library must not end up behind keys the
+ * kernel continues from.
+ */
+static void uh_tls_ktls_enable(struct client *cl)
+{
+	uint64_t info[16];
+	int fd = cl->sfd.fd.fd;
+	int len;
+
+	if (ktls_unavailable || !ext.get_tx_crypto_info || !ext.set_tx_offload)
+		return;
+
+	if (cl->us->w.data_bytes || cl->sfd.stream.w.data_bytes)
+		return;
+
+	/* not every cipher suite can be handled by the kernel */
+	len = ext.get_tx_crypto_info(&cl->ssl, info, sizeof(info));
+	if (len <= 0)
+		return;
+
+	if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls"))) {
+		if (errno == ENOENT || errno == ENOPROTOOPT) {
+			fprintf(stderr, "Kernel TLS is not available, "
+					"HTTPS data is encrypted in userspace\n");
+			ktls_unavailable = true;
+		}
+		goto out;
+	}
+
+	/* without keys the tls ULP passes data through unchanged */
+	if (setsockopt(fd, SOL_TLS, TLS_TX, info, len))
+		goto out;
+
+	ext.set_tx_offload(&cl->ssl);
+	cl->ktls = true;
+	uh_stats.tls_offloaded++;
+
+out:
+	memset(info, 0, sizeof(info));
+}
+#endif
+
+static void tls_notify_connected(struct ustream_ssl *ssl)
+{
+	uh_stats.tls_handshakes++;
+	if (ext.session_reused && ext.session_reused(ssl))
+		uh_stats.tls_resumed++;
+
+#ifdef linux
+	if (conf.ktls)
+		uh_tls_ktls_enable(container_of(ssl, struct client, ssl));
+#endif
+}
+
 static void tls_notify_state(struct ustream *s)
 {
 	struct client *cl = container_of(s, struct client, ssl);
@@ -95,6 +285,7 @@ void uh_tls_client_attach(struct client *cl)
 	cl->us->notify_read = tls_ustream_read_cb;
 	cl->us->notify_write = tls_ustream_write_cb;
 	cl->us->notify_state = tls_notify_state;
+	cl->ssl.notify_connected = tls_notify_connected;
 }
 
 void uh_tls_client_detach(struct client *cl)
@@ -0,0 +1,164 @@
+/*
+ * uhttpd - Tiny single-threaded httpd
+ *
+ *   Copyright (C) 2010-2013 Jo-Philipp Wich <xm@subsignal.org>
+ *   Copyright (C) 2013 Felix Fietkau <nbd@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <ctype.h>
+#include "uhttpd.h"
+#include "trie.h"
+
+/*
+ * Compressed prefix tree used to match URLs against configured prefixes
+ * in a single pass over the URL, independent of the number of entries.
+ */
+
+static inline char trie_char(struct uh_trie *t, char c)
+{
+	return t->nocase ? tolower(c) : c;
+}
+
+static struct uh_trie_node *
+trie_find_child(struct uh_trie *t, struct uh_trie_node *node, char c)
+{
+	struct uh_trie_node *cur;
+
+	c = trie_char(t, c);
+	for (cur = node->child; cur; cur = cur->next)
+		if (trie_char(t, cur->key[0]) == c)
+			return cur;
+
+	return NULL;
+}
+
+static struct uh_trie_node *trie_node_new(const char *key, int len)
+{
+	struct uh_trie_node *node;
+	char *new_key;
+
+	node = calloc_a(sizeof(*node), &new_key, len + 1);
+	if (!node)
+		return NULL;
+
+	node->key = memcpy(new_key, key, len);
+	node->key[len] = 0;
+	node->key_len = len;
+
+	return node;
+}
+
+/* Returns the value slot for key, creating the node if needed */
+void **uh_trie_insert(struct uh_trie *t, const char *key)
+{
+	struct uh_trie_node *node = &t->root;
+	struct uh_trie_node *cur, *mid, *tail, **pos;
+	int i;
+
+	while (*key) {
+		cur = trie_find_child(t, node, *key);
+		if (!cur) {
+			cur = trie_node_new(key, strlen(key));
+			if (!cur)
+				return NULL;
+
+			cur->next = node->child;
+			node->child = cur;
+			return &cur->value;
+		}
+
+		for (i = 0; i < cur->key_len && key[i]; i++)
+			if (trie_char(t, key[i]) != trie_char(t, cur->key[i]))
+				break;
+
+		if (i < cur->key_len) {
+			/* split the edge at the first difference */
+			mid = trie_node_new(cur->key, i);
+			tail = trie_node_new(cur->key + i, cur->key_len - i);
+			if (!mid || !tail) {
+				free(mid);
+				free(tail);
+				return NULL;
+			}
+
+			tail->child = cur->child;
+			tail->value = cur->value;
+			mid->child = tail;
+			mid->next = cur->next;
+
+			for (pos = &node->child; *pos != cur; pos = &(*pos)->next);
+			*pos = mid;
+			free(cur);
+			cur = mid;
+		}
+
+		node = cur;
+		key += i;
+	}
+
+	return &node->value;
+}
+
+/*
+ * Find the value stored for the longest key which is a prefix of str.
+ * With path set, the prefix must be followed by '/' or the end of str.
+ */
+void *uh_trie_match(struct uh_trie *t, const char *str, bool path, int *len)
+{
+	struct uh_trie_node *node = &t->root;
+	void *best = NULL;
+	int pos = 0, i;
+
+	while (1) {
+		if (node->value && (!path || str[pos] == '/' || !str[pos])) {
+			best = node->value;
+			if (len)
+				*len = pos;
+		}
+
+		if (!str[pos])
+			break;
+
+		node = trie_find_child(t, node, str[pos]);
+		if (!node)
+			break;
+
+		for (i = 1; i < node->key_len; i++)
+			if (trie_char(t, str[pos + i]) != trie_char(t, node->key[i]))
+				return best;
+
+		pos += node->key_len;
+	}
+
+	return best;
+}
+
+static void trie_node_free(struct uh_trie_node *node)
+{
+	struct uh_trie_node *cur, *next;
+
+	for (cur = node->child; cur; cur = next) {
+		next = cur->next;
+		trie_node_free(cur);
+		free(cur);
+	}
+}
+
+/* Values are owned by the caller and not freed here */
+void uh_trie_free(struct uh_trie *t)
+{
+	trie_node_free(&t->root);
+	memset(&t->root, 0, sizeof(t->root));
+}
@@ -0,0 +1,42 @@
+/*
+ * uhttpd - Tiny single-threaded httpd
+ *
+ *   Copyright (C) 2010-2013 Jo-Philipp Wich <xm@subsignal.org>
+ *   Copyright (C) 2013 Felix Fietkau <nbd@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __UHTTPD_TRIE_H
+#define __UHTTPD_TRIE_H
+
+#include <stdbool.h>
+
+struct uh_trie_node {
+	struct uh_trie_node *child;
+	struct uh_trie_node *next;
+	void *value;
+	char *key;
+	int key_len;
+};
+
+struct uh_trie {
+	struct uh_trie_node root;
+	bool nocase;
+};
+
+void **uh_trie_insert(struct uh_trie *t, const char *key);
+void *uh_trie_match(struct uh_trie *t, const char *str, bool path, int *len);
+void uh_trie_free(struct uh_trie *t);
+
+#endif
@@ -23,6 +23,7 @@
 #include <libubox/avl-cmp.h>
 #include <stdio.h>
 #include <poll.h>
+#include <time.h>
 
 #include "uhttpd.h"
 #include "plugin.h"
@@ -36,6 +37,46 @@ static struct blob_buf buf;
 
 #define UH_UBUS_MAX_POST_SIZE	4096
 #define UH_UBUS_DEFAULT_SID	"00000000000000000000000000000000"
+#define UH_UBUS_CANON_DEPTH	16
+#define UH_UBUS_SSE_QUEUE	32
+#define UH_UBUS_SSE_MAX_PENDING	4096
+
+struct uh_ubus_cache_key {
+	uint32_t hash;
+	const char *object;
+	const char *method;
+	struct blob_attr *args;
+};
+
+struct uh_ubus_cache_entry {
+	struct uh_ubus_cache_key key;
+	struct avl_node avl;
+	struct list_head lru;
+	struct list_head waiters;
+
+	struct ubus_request req;
+	struct uloop_timeout timeout;
+	struct blob_buf buf;
+	struct blob_attr *data;
+
+	int64_t expire;
+	bool pending;
+	int ret;
+	int ttl;
+	int size;
+};
+
+struct uh_ubus_event {
+	struct list_head list;
+	int len;
+	char data[];
+};
+
+static int uh_ubus_cache_cmp(const void *k1, const void *k2, void *ptr);
+
+static AVL_TREE(cache, uh_ubus_cache_cmp, false, NULL);
+static LIST_HEAD(cache_lru);
+static int cache_used;
 
 enum {
 	RPC_JSONRPC,
@@ -164,6 +205,22 @@ static void uh_ubus_json_error(struct client *cl, enum rpc_error type)
 	uh_ubus_send_response(cl);
 }
 
+static void uh_ubus_send_result(struct client *cl, int ret, struct blob_attr *data)
+{
+	struct blob_attr *cur;
+	void *r;
+	int rem;
+
+	uh_ubus_init_response(cl);
+	r = blobmsg_open_array(&buf, "result");
+	blobmsg_add_u32(&buf, "", ret);
+	if (data)
+		blob_for_each_attr(cur, data, rem)
+			blobmsg_add_blob(&buf, cur);
+	blobmsg_close_array(&buf, r);
+	uh_ubus_send_response(cl);
+}
+
 static void
 uh_ubus_request_data_cb(struct ubus_request *req, int type, struct blob_attr *msg)
 {
@@ -177,18 +234,309 @@ uh_ubus_request_cb(struct ubus_request *req, int ret)
 {
 	struct dispatch_ubus *du = container_of(req, struct dispatch_ubus, req);
 	struct client *cl = container_of(du, struct client, dispatch.ubus);
-	struct blob_attr *cur;
-	void *r;
-	int rem;
 
 	uloop_timeout_cancel(&du->timeout);
-	uh_ubus_init_response(cl);
-	r = blobmsg_open_array(&buf, "result");
-	blobmsg_add_u32(&buf, "", ret);
-	blob_for_each_attr(cur, du->buf.head, rem)
-		blobmsg_add_blob(&buf, cur);
-	blobmsg_close_array(&buf, r);
-	uh_ubus_send_response(cl);
+	uh_ubus_send_result(cl, ret, du->buf.head);
+}
+
+static int64_t uh_ubus_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t uh_ubus_hash(uint32_t hash, const void *data, int len)
+{
+	const uint8_t *p = data;
+
+	/* FNV-1a */
+	while (len-- > 0)
+		hash = (hash ^ *p++) * 16777619;
+
+	return hash;
+}
+
+static int uh_ubus_cache_cmp(const void *k1, const void *k2, void *ptr)
+{
+	const struct uh_ubus_cache_key *a = k1, *b = k2;
+	int len_a = blob_raw_len(a->args), len_b = blob_raw_len(b->args);
+	int ret;
+
+	if (a->hash != b->hash)
+		return a->hash < b->hash ? -1 : 1;
+
+	ret = strcmp(a->object, b->object);
+	if (ret)
+		return ret;
+
+	ret = strcmp(a->method, b->method);
+	if (ret)
+		return ret;
+
+	if (len_a != len_b)
+		return len_a - len_b;
+
+	return memcmp(a->args, b->args, len_a);
+}
+
+static int uh_ubus_canon_cmp(const void *a, const void *b)
+{
+	struct blob_attr * const *attr_a = a, * const *attr_b = b;
+
+	return strcmp(blobmsg_name(*attr_a), blobmsg_name(*attr_b));
+}
+
+/*
+ * Copy the members of a table or array into buf, with table members sorted
+ * by name, so that argument objects which only differ in key order produce
+ * the same blob and hence the same cache key.
+ */
+static bool uh_ubus_canon_add(struct blob_buf *b, struct blob_attr *attr,
+			      bool table, int depth)
+{
+	struct blob_attr **list, *cur;
+	bool ret = true;
+	void *c;
+	int i, n = 0, rem;
+
+	if (depth > UH_UBUS_CANON_DEPTH)
+		return false;
+
+	blobmsg_for_each_attr(cur, attr, rem)
+		n++;
+
+	list = alloca((n + 1) * sizeof(*list));
+	n = 0;
+	blobmsg_for_each_attr(cur, attr, rem)
+		list[n++] = cur;
+
+	if (table)
+		qsort(list, n, sizeof(*list), uh_ubus_canon_cmp);
+
+	for (i = 0; ret && i < n; i++) {
+		cur = list[i];
+
+		switch (blobmsg_type(cur)) {
+		case BLOBMSG_TYPE_TABLE:
+			c = blobmsg_open_table(b, blobmsg_name(cur));
+			ret = uh_ubus_canon_add(b, cur, true, depth + 1);
+			blobmsg_close_table(b, c);
+			break;
+		case BLOBMSG_TYPE_ARRAY:
+			c = blobmsg_open_array(b, blobmsg_name(cur));
+			ret = uh_ubus_canon_add(b, cur, false, depth + 1);
+			blobmsg_close_array(b, c);
+			break;
+		default:
+			blobmsg_add_blob(b, cur);
+			break;
+		}
+	}
+
+	return ret;
+}
+
+static int uh_ubus_cache_ttl(const char *object, const char *method)
+{
+	struct ubus_cache_rule *rule;
+
+	list_for_each_entry(rule, &conf.ubus_cache_rules, list) {
+		if (strcmp(rule->object, object) != 0)
+			continue;
+
+		if (strcmp(rule->method, "*") != 0 &&
+		    strcmp(rule->method, method) != 0)
+			continue;
+
+		return rule->ttl;
+	}
+
+	return 0;
+}
+
+static void uh_ubus_cache_free(struct uh_ubus_cache_entry *e)
+{
+	avl_delete(&cache, &e->avl);
+	list_del(&e->lru);
+	cache_used -= e->size;
+
+	uloop_timeout_cancel(&e->timeout);
+	blob_buf_free(&e->buf);
+	free(e->data);
+	free(e);
+}
+
+static void uh_ubus_cache_shrink(void)
+{
+	struct uh_ubus_cache_entry *e, *tmp;
+
+	list_for_each_entry_safe(e, tmp, &cache_lru, lru) {
+		if (cache_used <= conf.ubus_cache_size)
+			break;
+
+		if (!e->pending)
+			uh_ubus_cache_free(e);
+	}
+}
+
+static struct client *uh_ubus_cache_next_waiter(struct uh_ubus_cache_entry *e)
+{
+	struct dispatch_ubus *du;
+
+	if (list_empty(&e->waiters))
+		return NULL;
+
+	du = list_first_entry(&e->waiters, struct dispatch_ubus, cache_list);
+	list_del(&du->cache_list);
+	du->cache_wait = false;
+
+	return container_of(du, struct client, dispatch.ubus);
+}
+
+static void
+uh_ubus_cache_data_cb(struct ubus_request *req, int type, struct blob_attr *msg)
+{
+	struct uh_ubus_cache_entry *e = container_of(req, struct uh_ubus_cache_entry, req);
+
+	blobmsg_add_field(&e->buf, BLOBMSG_TYPE_TABLE, "", blob_data(msg), blob_len(msg));
+}
+
+static void
+uh_ubus_cache_complete_cb(struct ubus_request *req, int ret)
+{
+	struct uh_ubus_cache_entry *e = container_of(req, struct uh_ubus_cache_entry, req);
+	struct client *cl;
+
+	uloop_timeout_cancel(&e->timeout);
+	e->pending = false;
+	e->ret = ret;
+	e->data = blob_memdup(e->buf.head);
+	blob_buf_free(&e->buf);
+	e->expire = uh_ubus_time() + e->ttl * 1000;
+
+	if (e->data) {
+		e->size += blob_raw_len(e->data);
+		cache_used += blob_raw_len(e->data);
+	} else if (!ret) {
+		/* the reply is lost, don't pretend it was empty */
+		e->ret = UBUS_STATUS_UNKNOWN_ERROR;
+	}
+
+	while ((cl = uh_ubus_cache_next_waiter(e)) != NULL)
+		uh_ubus_send_result(cl, e->ret, e->data);
+
+	/* only successful replies are worth keeping */
+	if (ret || !e->data)
+		uh_ubus_cache_free(e);
+
+	uh_ubus_cache_shrink();
+}
+
+static void uh_ubus_cache_timeout_cb(struct uloop_timeout *timeout)
+{
+	struct uh_ubus_cache_entry *e = container_of(timeout, struct uh_ubus_cache_entry, timeout);
+	struct client *cl;
+
+	ubus_abort_request(ctx, &e->req);
+
+	while ((cl = uh_ubus_cache_next_waiter(e)) != NULL)
+		uh_ubus_json_error(cl, ERROR_TIMEOUT);
+
+	uh_ubus_cache_free(e);
+}
+
+static struct uh_ubus_cache_entry *
+uh_ubus_cache_new(struct uh_ubus_cache_key *key, uint32_t obj, int ttl)
+{
+	struct uh_ubus_cache_entry *e;
+	char *object, *method;
+	struct blob_attr *args;
+	int len = blob_raw_len(key->args);
+
+	e = calloc_a(sizeof(*e),
+		&object, strlen(key->object) + 1,
+		&method, strlen(key->method) + 1,
+		&args, len);
+
+	if (!e)
+		return NULL;
+
+	e->key.hash = key->hash;
+	e->key.object = strcpy(object, key->object);
+	e->key.method = strcpy(method, key->method);
+	e->key.args = memcpy(args, key->args, len);
+	e->ttl = ttl;
+	INIT_LIST_HEAD(&e->waiters);
+
+	blob_buf_init(&e->buf, 0);
+	if (ubus_invoke_async(ctx, obj, e->key.method, e->key.args, &e->req)) {
+		blob_buf_free(&e->buf);
+		free(e);
+		return NULL;
+	}
+
+	e->req.data_cb = uh_ubus_cache_data_cb;
+	e->req.complete_cb = uh_ubus_cache_complete_cb;
+	ubus_complete_request_async(ctx, &e->req);
+
+	e->timeout.cb = uh_ubus_cache_timeout_cb;
+	uloop_timeout_set(&e->timeout, conf.script_timeout * 1000);
+
+	e->pending = true;
+	e->size = sizeof(*e) + strlen(object) + strlen(method) + len;
+	e->avl.key = &e->key;
+	avl_insert(&cache, &e->avl);
+	list_add_tail(&e->lru, &cache_lru);
+	cache_used += e->size;
+
+	return e;
+}
+
+/*
+ * Serve a call from the response cache. Identical calls which arrive while
+ * the backend request is still in flight are queued on the same entry, so
+ * only a single ubus invoke is issued for them.
+ */
+static bool uh_ubus_cache_request(struct client *cl, const char *object,
+				  struct blob_attr *args, int ttl)
+{
+	struct dispatch_ubus *du = &cl->dispatch.ubus;
+	struct uh_ubus_cache_entry *e;
+	struct uh_ubus_cache_key key = {
+		.object = object,
+		.method = du->func,
+		.args = args,
+	};
+
+	key.hash = uh_ubus_hash(2166136261u, object, strlen(object) + 1);
+	key.hash = uh_ubus_hash(key.hash, du->func, strlen(du->func) + 1);
+	key.hash = uh_ubus_hash(key.hash, args, blob_raw_len(args));
+
+	e = avl_find_element(&cache, &key, e, avl);
+	if (e && !e->pending && e->expire <= uh_ubus_time()) {
+		uh_ubus_cache_free(e);
+		e = NULL;
+	}
+
+	if (!e) {
+		e = uh_ubus_cache_new(&key, du->obj, ttl);
+		if (!e)
+			return false;
+	}
+
+	if (!e->pending) {
+		list_move_tail(&e->lru, &cache_lru);
+		uh_ubus_send_result(cl, e->ret, e->data);
+		return true;
+	}
+
+	list_add_tail(&du->cache_list, &e->waiters);
+	du->cache_wait = true;
+	uh_ubus_cache_shrink();
+
+	return true;
 }
 
 static void
@@ -225,6 +573,19 @@ static void uh_ubus_request_free(struct client *cl)
 
 	if (du->req_pending)
 		ubus_abort_request(ctx, &du->req);
+
+	if (du->cache_wait)
+		list_del(&du->cache_list);
+
+	if (du->subscribed) {
+		struct uh_ubus_event *ev, *tmp;
+
+		ubus_unregister_event_handler(ctx, &du->ev);
+		list_for_each_entry_safe(ev, tmp, &du->events, list)
+			free(ev);
+
+		uloop_timeout_cancel(&du->timeout);
+	}
 }
 
 static void uh_ubus_single_error(struct client *cl, enum rpc_error type)
@@ -234,17 +595,25 @@ static void uh_ubus_single_error(struct client *cl, enum rpc_error type)
 	ops->request_done(cl);
 }
 
-static void uh_ubus_send_request(struct client *cl, json_object *obj, struct blob_attr *args)
+static void uh_ubus_send_request(struct client *cl, const char *object, struct blob_attr *args)
 {
 	struct dispatch *d = &cl->dispatch;
 	struct dispatch_ubus *du = &d->ubus;
 	struct blob_attr *cur;
 	static struct blob_buf req;
-	int ret, rem;
+	int ret, rem, ttl;
 
 	blob_buf_init(&req, 0);
-	blobmsg_for_each_attr(cur, args, rem)
-		blobmsg_add_blob(&req, cur);
+
+	ttl = uh_ubus_cache_ttl(object, du->func);
+	if (ttl > 0 && uh_ubus_canon_add(&req, args, true, 0)) {
+		if (uh_ubus_cache_request(cl, object, req.head, ttl))
+			return;
+	} else {
+		blob_buf_init(&req, 0);
+		blobmsg_for_each_attr(cur, args, rem)
+			blobmsg_add_blob(&req, cur);
+	}
 
 	blob_buf_init(&du->buf, 0);
 	memset(&du->req, 0, sizeof(du->req));
@@ -383,7 +752,7 @@ static void uh_ubus_handle_request_object(struct client *cl, struct json_object
 		goto error;
 	}
 
-	uh_ubus_send_request(cl, obj, data.data);
+	uh_ubus_send_request(cl, data.object, data.data);
 	return;
 
 error:
@@ -443,30 +812,174 @@ error:
 	return 0;
 }
 
+static void uh_ubus_sse_flush(struct client *cl)
+{
+	struct dispatch_ubus *du = &cl->dispatch.ubus;
+	struct uh_ubus_event *ev;
+
+	while (ustream_pending_data(cl->us, true) < UH_UBUS_SSE_MAX_PENDING) {
+		if (du->dropped) {
+			ops->chunk_printf(cl, "event: dropped\ndata: %u\n\n", du->dropped);
+			du->dropped = 0;
+			continue;
+		}
+
+		if (list_empty(&du->events))
+			break;
+
+		ev = list_first_entry(&du->events, struct uh_ubus_event, list);
+		list_del(&ev->list);
+		du->n_events--;
+
+		ops->chunk_write(cl, ev->data, ev->len);
+		free(ev);
+	}
+}
+
+static void uh_ubus_sse_event_cb(struct ubus_context *ctx, struct ubus_event_handler *ev,
+				 const char *type, struct blob_attr *msg)
+{
+	struct dispatch_ubus *du = container_of(ev, struct dispatch_ubus, ev);
+	struct client *cl = container_of(du, struct client, dispatch.ubus);
+	struct uh_ubus_event *e;
+	char *str;
+	int len;
+
+	if (du->n_events >= UH_UBUS_SSE_QUEUE) {
+		du->dropped++;
+		return;
+	}
+
+	str = blobmsg_format_json(msg, true);
+	if (!str)
+		return;
+
+	len = strlen(type) + strlen(str) + sizeof("event: \ndata: \n\n");
+	e = calloc(1, sizeof(*e) + len);
+	if (e) {
+		e->len = snprintf(e->data, len, "event: %s\ndata: %s\n\n", type, str);
+		list_add_tail(&e->list, &du->events);
+		du->n_events++;
+	}
+	free(str);
+
+	uh_ubus_sse_flush(cl);
+}
+
+static void uh_ubus_sse_keepalive_cb(struct uloop_timeout *timeout)
+{
+	struct dispatch_ubus *du = container_of(timeout, struct dispatch_ubus, timeout);
+	struct client *cl = container_of(du, struct client, dispatch.ubus);
+
+	/* keep the stream (and the client timeout) alive while idle */
+	if (list_empty(&du->events) && !du->dropped)
+		ops->chunk_printf(cl, ": keepalive\n\n");
+
+	uloop_timeout_set(&du->timeout, max(conf.network_timeout * 500, 1000));
+}
+
+/* returns 1 if the argument was found, 0 if not and -1 if it does not fit */
+static int uh_ubus_query_arg(const char *query, const char *name, char *dest, int dest_l)
+{
+	int name_l = strlen(name);
+	const char *end;
+	int len;
+
+	while (query && *query) {
+		end = strchr(query, '&');
+		if (!end)
+			end = query + strlen(query);
+
+		if (!strncmp(query, name, name_l) && query[name_l] == '=') {
+			query += name_l + 1;
+			len = ops->urldecode(dest, dest_l - 1, query, end - query);
+			if (len < 0)
+				return -1;
+
+			dest[len] = 0;
+			return 1;
+		}
+
+		query = *end ? end + 1 : NULL;
+	}
+
+	return 0;
+}
+
+static void uh_ubus_subscribe(struct client *cl, const char *sid, const char *query)
+{
+	struct dispatch *d = &cl->dispatch;
+	struct dispatch_ubus *du = &d->ubus;
+	char pattern[256];
+	int ret;
+
+	if (cl->request.method != UH_HTTP_MSG_GET)
+		return ops->client_error(cl, 400, "Bad Request", "Invalid Request");
+
+	/* only a missing pattern means all events */
+	ret = uh_ubus_query_arg(query, "pattern", pattern, sizeof(pattern));
+	if (!ret)
+		strcpy(pattern, "*");
+	else if (ret < 0 || !pattern[0])
+		return ops->client_error(cl, 400, "Bad Request", "Invalid event pattern");
+
+	if (!conf.ubus_noauth && !uh_ubus_allowed(sid, pattern, ":subscribe"))
+		return ops->client_error(cl, 403, "Forbidden", "Access denied");
+
+	INIT_LIST_HEAD(&du->events);
+	du->ev.cb = uh_ubus_sse_event_cb;
+	if (ubus_register_event_handler(ctx, &du->ev, pattern))
+		return ops->client_error(cl, 500, "Internal Server Error",
+					 "Unable to register event handler");
+
+	du->subscribed = true;
+	d->close_fds = uh_ubus_close_fds;
+	d->free = uh_ubus_request_free;
+	d->write_cb = uh_ubus_sse_flush;
+
+	ops->http_header(cl, 200, "OK");
+	ustream_printf(cl->us, "Content-Type: text/event-stream\r\n");
+	ustream_printf(cl->us, "Cache-Control: no-cache\r\n\r\n");
+
+	du->timeout.cb = uh_ubus_sse_keepalive_cb;
+	uh_ubus_sse_keepalive_cb(&du->timeout);
+}
+
 static void uh_ubus_handle_request(struct client *cl, char *url, struct path_info *pi)
 {
 	struct dispatch *d = &cl->dispatch;
-	char *sid, *sep;
+	char *sid, *sep, *query;
 
 	blob_buf_init(&buf, 0);
 
+	query = strchr(url, '?');
+	if (query)
+		*query++ = 0;
+
+	url += strlen(conf.ubus_prefix);
+	while (*url == '/')
+		url++;
+
+	sep = strchr(url, '/');
+	if (sep)
+		*sep++ = 0;
+
 	if (conf.ubus_noauth) {
 		sid = UH_UBUS_DEFAULT_SID;
+		if (!sep)
+			sep = url;
 	}
 	else {
-		url += strlen(conf.ubus_prefix);
-		while (*url == '/')
-			url++;
-
-		sep = strchr(url, '/');
-		if (sep)
-			*sep = 0;
-
 		sid = url;
 	}
 
-	if (strlen(sid) != 32 ||
-	    cl->request.method != UH_HTTP_MSG_POST)
+	if (strlen(sid) != 32)
+		return ops->client_error(cl, 400, "Bad Request", "Invalid Request");
+
+	if (sep && !strcmp(sep, "subscribe"))
+		return uh_ubus_subscribe(cl, sid, query);
+
+	if (cl->request.method != UH_HTTP_MSG_POST)
 		return ops->client_error(cl, 400, "Bad Request", "Invalid Request");
 
 	d->close_fds = uh_ubus_close_fds;
@@ -487,6 +1000,7 @@ static int
 uh_ubus_init(void)
 {
 	static struct dispatch_handler ubus_dispatch = {
+		.name = "ubus",
 		.check_url = uh_ubus_check_url,
 		.handle_request = uh_ubus_handle_request,
 	};
@@ -497,6 +1011,7 @@ uh_ubus_init(void)
 		exit(1);
 	}
 
+	ubus_dispatch.prefix = conf.ubus_prefix;
 	ops->dispatch_add(&ubus_dispatch);
 
 	uloop_done();
@@ -38,6 +38,7 @@
 #endif
 
 #include "utils.h"
+#include "trie.h"
 
 #define UH_LIMIT_CLIENTS	64
 
@@ -56,6 +57,10 @@ struct config {
 	const char *lua_handler;
 	const char *lua_prefix;
 	const char *ubus_prefix;
+	const char *status_prefix;
+	const char *log_file;
+	const char *log_format;
+	int log_sample;
 	const char *ubus_socket;
 	int no_symlinks;
 	int no_dirlists;
@@ -64,13 +69,36 @@ struct config {
 	int tcp_keepalive;
 	int max_script_requests;
 	int max_connections;
+	int listen_backlog;
+	int tcp_defer_accept;
+	int tcp_fastopen;
+	int limit_conns;
+	int limit_rate;
+	int limit_burst;
+	int limit_ipv6_prefix;
+	int shed_load;
 	int http_keepalive;
 	int script_timeout;
+	int script_queue_timeout;
+	int max_client_script_requests;
 	int ubus_noauth;
+	int ubus_cache_size;
+	struct list_head ubus_cache_rules;
+	int cache_size;
+	int http2;
+	int ktls;
+};
+
+struct ubus_cache_rule {
+	struct list_head list;
+	const char *object;
+	const char *method;
+	int ttl;
 };
 
 struct auth_realm {
 	struct list_head list;
+	struct auth_realm *next;
 	const char *path;
 	const char *user;
 	const char *pass;
@@ -86,6 +114,7 @@ enum http_version {
 	UH_HTTP_VER_0_9,
 	UH_HTTP_VER_1_0,
 	UH_HTTP_VER_1_1,
+	UH_HTTP_VER_2,
 };
 
 enum http_user_agent {
@@ -111,6 +140,19 @@ struct http_request {
 	uint8_t transfer_chunked;
 	const struct auth_realm *realm;
 	bool captive_redirect;
+	int status;
+	uint64_t start;
+	struct handler_stats *stats;
+
+	uint64_t t_begin;
+	uint64_t t_dispatch;
+	uint64_t t_first_byte;
+	uint64_t bytes_mark;
+	bool cache_bypass;
+	bool collapse_bypass;
+	bool upgrade;
+	bool upgraded;
+	struct vhost *vhost;
 };
 
 enum client_state {
@@ -119,12 +161,28 @@ enum client_state {
 	CLIENT_STATE_DATA,
 	CLIENT_STATE_DONE,
 	CLIENT_STATE_CLOSE,
+	CLIENT_STATE_H2,
+};
+
+struct vhost {
+	struct list_head list;
+	const char *name;
+	const char *docroot;
+	char *handlers;
+	int refs;
+	bool retired;
+
+	struct list_head index_files;
+	struct list_head aliases;
+	struct uh_trie alias_trie;
+	struct uh_trie realm_trie;
 };
 
 struct interpreter {
 	struct list_head list;
 	const char *path;
 	const char *ext;
+	bool config;
 };
 
 struct path_info {
@@ -144,6 +202,14 @@ struct env_var {
 	const char *value;
 };
 
+enum relay_chunk_state {
+	RELAY_CHUNK_NONE,
+	RELAY_CHUNK_SIZE,
+	RELAY_CHUNK_DATA,
+	RELAY_CHUNK_END,
+	RELAY_CHUNK_TRAILER,
+};
+
 struct relay {
 	struct ustream_fd sfd;
 	struct uloop_process proc;
@@ -153,6 +219,12 @@ struct relay {
 	int ret;
 	int header_ofs;
 
+	/* body framing, without it the body extends to the end of the stream */
+	bool framed;
+	enum relay_chunk_state chunk_state;
+	int64_t content_length;
+
+	bool (*status_cb)(struct relay *r, char *line);
 	void (*header_cb)(struct relay *r, const char *name, const char *value);
 	void (*header_end)(struct relay *r);
 	void (*close)(struct relay *r, int ret);
@@ -167,9 +239,74 @@ struct dispatch_proc {
 	char *status_msg;
 };
 
+struct arduino_conn;
+struct arduino_stream;
+
+struct dispatch_arduino {
+	struct arduino_conn *conn;
+	struct arduino_stream *stream;
+};
+
+struct proxy_conn;
+struct proxy_route;
+struct proxy_upstream;
+
+struct dispatch_proxy {
+	struct proxy_route *route;
+	struct proxy_upstream *up;
+	struct proxy_conn *conn;
+	char *url;
+	uint64_t start;
+
+	struct blob_buf hdr;
+	int status_code;
+	char status_msg[64];
+	int64_t content_length;
+	bool chunked;
+	bool keepalive;
+
+	bool has_body;
+	bool upload_chunked;
+	bool upload_done;
+	bool retried;
+};
+
+struct dispatch_ws {
+	struct ustream_fd sfd;
+	struct uloop_timeout ping;
+	struct uloop_timeout resume;
+
+	/* frame being received from the client */
+	uint8_t hdr[14];
+	int hdr_len;
+	uint8_t mask[4];
+	unsigned int mask_ofs;
+	uint64_t remaining;
+	uint8_t opcode;
+	bool fin;
+	bool payload;
+	bool in_message;
+
+	uint8_t ctrl[125];
+	int ctrl_len;
+
+	bool text;
+	bool got_data;
+	bool closing;
+};
+
 struct dispatch_handler {
 	struct list_head list;
 	bool script;
+	bool cache;
+
+	const char *name;
+	const char *prefix;
+	struct handler_stats *stats;
+
+	int max_requests;
+	int n_requests;
+	struct list_head pending;
 
 	bool (*check_url)(const char *url);
 	bool (*check_path)(struct path_info *pi, const char *url);
@@ -194,9 +331,23 @@ struct dispatch_ubus {
 	bool req_pending;
 	bool array;
 	int array_idx;
+
+	struct list_head cache_list;
+	bool cache_wait;
+
+	struct ubus_event_handler ev;
+	struct list_head events;
+	int n_events;
+	unsigned int dropped;
+	bool subscribed;
 };
 #endif
 
+struct uh_cache_fill;
+struct uh_collapse;
+struct h2_conn;
+struct h2_stream;
+
 struct dispatch {
 	int (*data_send)(struct client *cl, const char *data, int len);
 	void (*data_done)(struct client *cl);
@@ -207,14 +358,23 @@ struct dispatch {
 	void *req_data;
 	void (*req_free)(struct client *cl);
 
+	struct uh_cache_fill *cache;
+	struct uh_collapse *collapse;
+
 	bool data_blocked;
 
 	union {
 		struct {
 			struct blob_attr **hdr;
 			int fd;
+			off_t remain;
+			bool sendfile;
 		} file;
 		struct dispatch_proc proc;
+		struct dispatch_arduino arduino;
+		struct dispatch_proxy proxy;
+		struct dispatch_ws ws;
+		struct h2_conn *h2;
 #ifdef HAVE_UBUS
 		struct dispatch_ubus ubus;
 #endif
@@ -235,29 +395,98 @@ struct client {
 
 	enum client_state state;
 	bool tls;
+	/* records are encrypted by the kernel */
+	bool ktls;
 
 	struct http_request request;
 	struct uh_addr srv_addr, peer_addr;
 
 	struct blob_buf hdr;
 	struct dispatch dispatch;
+
+	struct uh_limit_entry *limit;
+	uint64_t bytes_out;
+
+	/* set for the requests multiplexed over an HTTP/2 connection */
+	struct h2_stream *h2;
+};
+
+struct script_stats {
+	unsigned int queued;
+	unsigned int max_queued;
+	unsigned long deferred;
+	unsigned long dispatched;
+	unsigned long expired;
+	uint64_t wait_ms_total;
+	uint64_t wait_ms_max;
+};
+
+struct cache_stats {
+	unsigned long hits;
+	unsigned long stale;
+	unsigned long misses;
+	unsigned long collapsed;
+	unsigned long stored;
+	int used;
+};
+
+struct server_stats {
+	unsigned long accepted;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	unsigned long h2_connections;
+	unsigned long h2_streams;
+	unsigned long tls_handshakes;
+	unsigned long tls_resumed;
+	unsigned long tls_offloaded;
 };
 
 extern char uh_buf[4096];
 extern int n_clients;
 extern struct config conf;
+extern struct script_stats script_stats;
+extern struct cache_stats cache_stats;
+extern struct server_stats uh_stats;
+extern unsigned long limit_rejected_conns;
+extern unsigned long limit_rejected_requests;
 extern const char * const http_versions[];
 extern const char * const http_methods[];
 extern struct dispatch_handler arduino_dispatch;
 extern struct dispatch_handler cgi_dispatch;
-
-void uh_index_add(const char *filename);
-
-bool uh_accept_client(int fd, bool tls);
+extern struct dispatch_handler proxy_dispatch;
+
+void uh_index_add(const char *filename, bool config);
+void uh_index_reset(void);
+void uh_index_free(struct vhost *vh);
+
+extern struct vhost default_vhost;
+void uh_vhost_begin(const char *name, const char *docroot);
+void uh_vhost_set_handlers(const char *handlers);
+void uh_vhost_end(void);
+void uh_vhost_reset(void);
+struct vhost *uh_vhost_config(void);
+void uh_vhost_select(struct client *cl, const char *host);
+void uh_vhost_put(struct vhost *vh);
+struct vhost *uh_client_vhost(struct client *cl);
+const char *uh_vhost_docroot(struct vhost *vh);
+bool uh_vhost_handler_allowed(struct vhost *vh, const char *name);
+
+bool uh_accept_client(int fd, bool tls, const struct sockaddr_in6 *srv_addr);
+bool uh_reject_client(int fd, bool tls);
+
+bool uh_limit_accept(struct client *cl);
+void uh_limit_release(struct client *cl);
+bool uh_limit_request(struct client *cl);
+bool uh_evict_idle_client(void);
 
 void uh_unblock_listeners(void);
 void uh_setup_listeners(void);
 int uh_socket_bind(const char *host, const char *port, bool tls);
+int uh_socket_adopt(int sock, bool tls);
+int uh_socket_inherit(int sock, bool tls);
+void uh_close_listeners(void);
+int uh_listeners_send(int sock);
+int uh_listeners_recv(int sock, int *n_tls);
 
 bool uh_use_chunked(struct client *cl);
 void uh_chunk_write(struct client *cl, const void *data, int len);
@@ -274,30 +503,89 @@ void __printf(4, 5)
 uh_client_error(struct client *cl, int code, const char *summary, const char *fmt, ...);
 
 void uh_handle_request(struct client *cl);
+void uh_connection_close(struct client *cl);
 void client_poll_post_data(struct client *cl);
 void uh_client_read_cb(struct client *cl);
 void uh_client_notify_state(struct client *cl);
+void uh_client_header(struct client *cl, const char *name, const char *val);
+void uh_client_header_complete(struct client *cl);
+void uh_client_release(struct client *cl);
 
 void uh_captive_set_host(const char *host, const char *url);
+void uh_captive_reset(void);
 bool uh_captive_check_host(const char *host);
 bool uh_captive_redirect(struct client *cl);
 
 void uh_arduino_set_options(char *_url_prefix, char *_bridge_ip, int _bridge_port);
 void uh_arduino_set_timeout(int timeout);
+void uh_arduino_set_framed(bool framed);
+int uh_arduino_connect(void);
 
 void uh_alias_add(const char *from, const char *to);
-bool uh_alias_transform(const char *url, char *dest, int dest_l);
+void uh_alias_reset(void);
+void uh_alias_free(struct vhost *vh);
+bool uh_alias_transform(struct vhost *vh, const char *url, char *dest, int dest_l);
+
+void uh_proxy_add(const char *prefix, const char *target);
+void uh_proxy_set_balance(const char *prefix, const char *method);
+void uh_proxy_set_fails(const char *prefix, int max_fails, int fail_timeout);
+void uh_proxy_set_probe(const char *prefix, int interval, const char *url);
+void uh_proxy_reset(void);
+void uh_proxy_status(struct client *cl, bool prometheus);
+
+void uh_websocket_add(const char *prefix, const char *target);
+void uh_websocket_reset(void);
+bool uh_websocket_request(struct client *cl);
+
+bool uh_h2_accept(struct client *cl, char *buf, int len);
+bool uh_h2_read(struct client *cl, char *buf, int len);
+void uh_h2_stream_poll(struct client *cl);
+void uh_h2_stream_done(struct client *cl);
 
 void uh_auth_add(const char *path, const char *user, const char *pass);
+void uh_auth_reset(void);
+void uh_auth_free(struct vhost *vh);
 bool uh_auth_check(struct client *cl, struct path_info *pi);
 
 void uh_close_listen_fds(void);
 void uh_close_fds(void);
 
-void uh_interpreter_add(const char *ext, const char *path);
+void uh_interpreter_add(const char *ext, const char *path, bool config);
+void uh_interpreter_reset(void);
 void uh_dispatch_add(struct dispatch_handler *d);
+void uh_dispatch_compile(void);
+void uh_dispatch_set_limit(const char *name, int max);
+void uh_dispatch_reset_limits(void);
+
+struct handler_stats *uh_stats_handler(const char *name);
+void uh_stats_request_done(struct client *cl);
+void uh_status_init(void);
+
+void uh_cache_add_vary(const char *name);
+void uh_cache_reset(void);
+bool uh_cache_request(struct client *cl);
+void uh_cache_header(struct client *cl, const char *name, const char *val);
+void uh_cache_header_end(struct client *cl, int code, const char *msg);
+void uh_cache_data(struct client *cl, const void *data, int len);
+void uh_cache_finish(struct client *cl, bool ok);
+
+extern unsigned long collapse_followers;
+void uh_collapse_add(const char *prefix);
+void uh_collapse_reset(void);
+bool uh_collapse_request(struct client *cl, const char *url);
+void uh_collapse_header(struct client *cl, const char *name, const char *val);
+void uh_collapse_header_end(struct client *cl, int code, const char *msg);
+void uh_collapse_data(struct client *cl, const void *data, int len);
+void uh_collapse_finish(struct client *cl, bool ok);
+
+extern unsigned long log_dropped;
+int uh_log_init(void);
+void uh_log_reopen(void);
+void uh_log_request(struct client *cl);
+void uh_log_done(void);
 
 void uh_relay_open(struct client *cl, struct relay *r, int fd, int pid);
+void uh_relay_attach(struct client *cl, struct relay *r);
 void uh_relay_close(struct relay *r, int ret);
 void uh_relay_free(struct relay *r);
 void uh_relay_kill(struct client *cl, struct relay *r);
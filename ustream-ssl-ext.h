@@ -0,0 +1,80 @@
+/*
+ * uhttpd - Tiny single-threaded httpd
+ *
+ *   Copyright (C) 2010-2013 Jo-Philipp Wich <xm@subsignal.org>
+ *   Copyright (C) 2013 Felix Fietkau <nbd@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __UHTTPD_USTREAM_SSL_EXT_H
+#define __UHTTPD_USTREAM_SSL_EXT_H
+
+#include <stdbool.h>
+
+/*
+ * Optional entry points of the TLS library, on top of ustream_ssl_ops.
+ * uhttpd looks each of them up with dlsym() in libustream-ssl, a library
+ * which provides one has to export it under this name and with exactly
+ * this signature. Anything missing only disables the matching feature.
+ *
+ * bench/tls-stub.c implements all of them on top of OpenSSL.
+ */
+
+struct ustream_ssl;
+struct ustream_ssl_ctx;
+
+/*
+ * Keep up to size sessions of a server context for timeout seconds, so
+ * clients can resume them by session id.
+ */
+int ustream_ssl_context_set_session_cache(struct ustream_ssl_ctx *ctx,
+					  int size, int timeout);
+
+/*
+ * Replace the session ticket keys of a server context. keys holds n_keys
+ * keys of key_len bytes, only 48 is supported: a 16 byte key name, a 16
+ * byte HMAC-SHA256 secret and a 16 byte AES-128-CBC key. New tickets are
+ * issued with the first key, the others are only used to accept tickets,
+ * which are then reissued with the first one. No keys turn tickets off.
+ */
+int ustream_ssl_context_set_ticket_keys(struct ustream_ssl_ctx *ctx,
+					const void *keys, int n_keys, int key_len);
+
+/*
+ * Offer the given protocols through ALPN on a server context, protos is a
+ * comma separated list in order of preference, e.g. "h2,http/1.1". Clients
+ * which offer none of them get no ALPN answer.
+ */
+int ustream_ssl_context_set_alpn(struct ustream_ssl_ctx *ctx, const char *protos);
+
+/* whether the completed handshake of us resumed an earlier session */
+bool ustream_ssl_session_reused(struct ustream_ssl *us);
+
+/*
+ * Export the sending state of a connected us for kernel TLS: fill info with
+ * the struct tls12_crypto_info_* of <linux/tls.h> which setsockopt(SOL_TLS,
+ * TLS_TX) takes, holding the key, salt and sequence number of the next
+ * record. Returns its length, 0 if the cipher suite can not be handed to
+ * the kernel and -1 if len is too small.
+ */
+int ustream_ssl_get_tx_crypto_info(struct ustream_ssl *us, void *info, int len);
+
+/*
+ * The kernel encrypts the records sent on us from now on, data written to
+ * the stream goes to the connection as it is. The library must not send
+ * any record of its own afterwards.
+ */
+void ustream_ssl_set_tx_offload(struct ustream_ssl *us);
+
+#endif
@@ -25,6 +25,9 @@ bool uh_use_chunked(struct client *cl)
 	if (cl->request.version != UH_HTTP_VER_1_1)
 		return false;
 
+	if (cl->request.upgraded)
+		return false;
+
 	if (cl->request.method == UH_HTTP_MSG_HEAD)
 		return false;
 
@@ -36,6 +39,11 @@ void uh_chunk_write(struct client *cl, const void *data, int len)
 	bool chunked = uh_use_chunked(cl);
 
 	uloop_timeout_set(&cl->timeout, conf.network_timeout * 1000);
+	if (cl->dispatch.cache)
+		uh_cache_data(cl, data, len);
+	if (cl->dispatch.collapse)
+		uh_collapse_data(cl, data, len);
+
 	if (chunked)
 		ustream_printf(cl->us, "%X\r\n", len);
 	ustream_write(cl->us, data, len, true);
@@ -191,6 +199,35 @@ int uh_b64decode(char *buf, int blen, const void *src, int slen)
 	return len;
 }
 
+int uh_b64encode(char *buf, int blen, const void *src, int slen)
+{
+	static const char tbl[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	const unsigned char *str = src;
+	unsigned int cin;
+	int len = 0;
+	int i;
+
+	if (blen < (slen + 2) / 3 * 4 + 1)
+		return -1;
+
+	for (i = 0; i < slen; i += 3) {
+		cin = str[i] << 16;
+		if (i + 1 < slen)
+			cin |= str[i + 1] << 8;
+		if (i + 2 < slen)
+			cin |= str[i + 2];
+
+		buf[len++] = tbl[(cin >> 18) & 0x3f];
+		buf[len++] = tbl[(cin >> 12) & 0x3f];
+		buf[len++] = i + 1 < slen ? tbl[(cin >> 6) & 0x3f] : '=';
+		buf[len++] = i + 2 < slen ? tbl[cin & 0x3f] : '=';
+	}
+
+	buf[len] = 0;
+	return len;
+}
+
 bool uh_path_match(const char *prefix, const char *url)
 {
 	int len = strlen(prefix);
@@ -218,6 +255,22 @@ char *uh_split_header(char *str)
 	return val;
 }
 
+uint64_t uh_time_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t uh_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 bool uh_addr_rfc1918(struct uh_addr *addr)
 {
 	uint32_t a;
@@ -70,8 +70,11 @@ time_t timegm (struct tm *tm);
 int uh_urldecode(char *buf, int blen, const char *src, int slen);
 int uh_urlencode(char *buf, int blen, const char *src, int slen);
 int uh_b64decode(char *buf, int blen, const void *src, int slen);
+int uh_b64encode(char *buf, int blen, const void *src, int slen);
 bool uh_path_match(const char *prefix, const char *url);
 char *uh_split_header(char *str);
 bool uh_addr_rfc1918(struct uh_addr *addr);
+uint64_t uh_time_ms(void);
+uint64_t uh_time_us(void);
 
 #endif
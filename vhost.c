@@ -0,0 +1,272 @@
+/*
+ * uhttpd - Tiny single-threaded httpd
+ *
+ *   Copyright (C) 2010-2013 Jo-Philipp Wich <xm@subsignal.org>
+ *   Copyright (C) 2013 Felix Fietkau <nbd@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <ctype.h>
+#include <strings.h>
+
+#include "uhttpd.h"
+
+/*
+ * Virtual hosts. Each one has its own document root, index files, aliases,
+ * realms and optionally a restricted set of handlers. The Host header is
+ * looked up once per request, requests for unknown hosts are served by the
+ * default host, which carries the global configuration.
+ */
+
+#define UH_VHOST_BUCKETS	32
+
+struct vhost default_vhost = {
+	.index_files = LIST_HEAD_INIT(default_vhost.index_files),
+	.aliases = LIST_HEAD_INIT(default_vhost.aliases),
+	.realm_trie = { .nocase = true },
+};
+
+static struct list_head vhost_table[UH_VHOST_BUCKETS];
+static LIST_HEAD(retired_vhosts);
+static struct vhost *config_vhost = &default_vhost;
+static int n_vhosts;
+
+static unsigned int uh_vhost_hash(const char *name, int len)
+{
+	uint32_t hash = 2166136261u;
+
+	while (len-- > 0)
+		hash = (hash ^ (uint8_t) tolower(*name++)) * 16777619u;
+
+	return hash % UH_VHOST_BUCKETS;
+}
+
+static void uh_vhost_table_init(void)
+{
+	int i;
+
+	if (vhost_table[0].next)
+		return;
+
+	for (i = 0; i < UH_VHOST_BUCKETS; i++)
+		INIT_LIST_HEAD(&vhost_table[i]);
+}
+
+static struct vhost *uh_vhost_find(const char *name, int len)
+{
+	struct vhost *vh;
+
+	if (!n_vhosts)
+		return NULL;
+
+	list_for_each_entry(vh, &vhost_table[uh_vhost_hash(name, len)], list)
+		if (!strncasecmp(vh->name, name, len) && !vh->name[len])
+			return vh;
+
+	return NULL;
+}
+
+/* strip the port and a trailing dot, the Host header may carry both */
+static int uh_vhost_name_len(const char *host)
+{
+	const char *end;
+	int len;
+
+	if (*host == '[') {
+		end = strchr(host, ']');
+		len = end ? end - host + 1 : strlen(host);
+	} else {
+		end = strchr(host, ':');
+		len = end ? end - host : strlen(host);
+	}
+
+	if (len > 1 && host[len - 1] == '.')
+		len--;
+
+	return len;
+}
+
+void uh_vhost_select(struct client *cl, const char *host)
+{
+	struct vhost *vh;
+
+	vh = uh_vhost_find(host, uh_vhost_name_len(host));
+	if (!vh)
+		return;
+
+	uh_vhost_put(cl->request.vhost);
+	cl->request.vhost = vh;
+	vh->refs++;
+}
+
+/*
+ * The vhost of a request. A request may outlive a reload, for example
+ * while it waits for another one, in that case the host is looked up
+ * again in the new configuration.
+ */
+struct vhost *uh_client_vhost(struct client *cl)
+{
+	struct vhost *vh = cl->request.vhost;
+	struct vhost *cur;
+
+	if (!vh)
+		return &default_vhost;
+
+	if (!vh->retired)
+		return vh;
+
+	cur = uh_vhost_find(vh->name, strlen(vh->name));
+	uh_vhost_put(vh);
+	cl->request.vhost = cur;
+	if (!cur)
+		return &default_vhost;
+
+	cur->refs++;
+	return cur;
+}
+
+const char *uh_vhost_docroot(struct vhost *vh)
+{
+	return vh->docroot ? vh->docroot : conf.docroot;
+}
+
+bool uh_vhost_handler_allowed(struct vhost *vh, const char *name)
+{
+	const char *cur;
+	int len;
+
+	if (!vh->handlers)
+		return true;
+
+	if (!name)
+		return false;
+
+	len = strlen(name);
+	for (cur = vh->handlers; cur; cur = strchr(cur, ',')) {
+		if (*cur == ',')
+			cur++;
+
+		if (!strncmp(cur, name, len) && (!cur[len] || cur[len] == ','))
+			return true;
+	}
+
+	return false;
+}
+
+/* NULL after a bad V: line, its host lines are then dropped */
+struct vhost *uh_vhost_config(void)
+{
+	return config_vhost;
+}
+
+void uh_vhost_begin(const char *name, const char *docroot)
+{
+	struct vhost *vh;
+	char *new_name, *new_root;
+	char root[PATH_MAX];
+	int len = uh_vhost_name_len(name);
+
+	uh_vhost_table_init();
+	config_vhost = NULL;
+
+	if (!len || !realpath(docroot, root)) {
+		fprintf(stderr, "Invalid virtual host %s:%s, ignoring its settings\n",
+			name, docroot);
+		return;
+	}
+
+	if (uh_vhost_find(name, len)) {
+		fprintf(stderr, "Duplicate virtual host %s, ignoring its settings\n", name);
+		return;
+	}
+
+	vh = calloc_a(sizeof(*vh),
+		&new_name, len + 1,
+		&new_root, strlen(root) + 1);
+
+	if (!vh)
+		return;
+
+	vh->name = strncpy(new_name, name, len);
+	vh->docroot = strcpy(new_root, root);
+	vh->realm_trie.nocase = true;
+	INIT_LIST_HEAD(&vh->index_files);
+	INIT_LIST_HEAD(&vh->aliases);
+	list_add_tail(&vh->list, &vhost_table[uh_vhost_hash(name, len)]);
+	n_vhosts++;
+
+	/* the following configuration lines apply to this host */
+	config_vhost = vh;
+}
+
+void uh_vhost_set_handlers(const char *handlers)
+{
+	struct vhost *vh = config_vhost;
+
+	if (!vh)
+		return;
+
+	if (vh == &default_vhost) {
+		fprintf(stderr, "Handler lists are only supported for virtual hosts\n");
+		return;
+	}
+
+	free(vh->handlers);
+	vh->handlers = strdup(handlers);
+}
+
+void uh_vhost_end(void)
+{
+	config_vhost = &default_vhost;
+}
+
+static void uh_vhost_free(struct vhost *vh)
+{
+	list_del(&vh->list);
+	free(vh->handlers);
+	free(vh);
+}
+
+void uh_vhost_put(struct vhost *vh)
+{
+	if (!vh || --vh->refs > 0 || !vh->retired)
+		return;
+
+	uh_vhost_free(vh);
+}
+
+void uh_vhost_reset(void)
+{
+	struct vhost *vh, *tmp;
+	int i;
+
+	uh_vhost_table_init();
+
+	for (i = 0; i < UH_VHOST_BUCKETS; i++) {
+		list_for_each_entry_safe(vh, tmp, &vhost_table[i], list) {
+			uh_index_free(vh);
+			uh_alias_free(vh);
+			uh_auth_free(vh);
+			vh->retired = true;
+			n_vhosts--;
+
+			if (vh->refs > 0)
+				list_move_tail(&vh->list, &retired_vhosts);
+			else
+				uh_vhost_free(vh);
+		}
+	}
+
+	config_vhost = &default_vhost;
+}
@@ -0,0 +1,729 @@
+/*
+ * uhttpd - Tiny single-threaded httpd
+ *
+ *   Copyright (C) 2010-2013 Jo-Philipp Wich <xm@subsignal.org>
+ *   Copyright (C) 2013 Felix Fietkau <nbd@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <strings.h>
+
+#include <libubox/blobmsg.h>
+
+#include "uhttpd.h"
+
+/*
+ * WebSocket bridge. An upgrade request for a configured prefix is answered
+ * by uhttpd itself, afterwards the payload of the client's data frames is
+ * passed to a local backend as a plain byte stream, and whatever the
+ * backend writes is sent back to the client in frames. Control frames are
+ * handled here, the backend never sees any framing.
+ */
+
+#define WS_GUID			"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_PING_INTERVAL	30
+#define WS_PENDING_MAX		(64 * 1024)
+#define WS_FRAME_MAX		(16 * 1024)
+
+enum ws_opcode {
+	WS_OP_CONT	= 0x0,
+	WS_OP_TEXT	= 0x1,
+	WS_OP_BINARY	= 0x2,
+	WS_OP_CLOSE	= 0x8,
+	WS_OP_PING	= 0x9,
+	WS_OP_PONG	= 0xa,
+};
+
+enum ws_close_code {
+	WS_CLOSE_NORMAL		= 1000,
+	WS_CLOSE_GOING_AWAY	= 1001,
+	WS_CLOSE_PROTOCOL	= 1002,
+	WS_CLOSE_ERROR		= 1011,
+};
+
+enum ws_target {
+	WS_TARGET_INET,
+	WS_TARGET_UNIX,
+	WS_TARGET_ARDUINO,
+};
+
+struct ws_route {
+	struct list_head list;
+	enum ws_target type;
+	bool text;
+
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+};
+
+static LIST_HEAD(ws_routes);
+static struct uh_trie ws_trie;
+
+static void ws_route_free(struct ws_route *route)
+{
+	list_del(&route->list);
+	free(route);
+}
+
+static bool ws_route_resolve(struct ws_route *route, char *target)
+{
+	static const struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct sockaddr_un *sun = (struct sockaddr_un *) &route->addr;
+	struct addrinfo *ai;
+	char *host = target, *port, *sep;
+	int ret;
+
+	if (!strcmp(target, "arduino")) {
+		route->type = WS_TARGET_ARDUINO;
+		return true;
+	}
+
+	if (!strncmp(target, "unix:", 5)) {
+		if (strlen(target + 5) >= sizeof(sun->sun_path))
+			return false;
+
+		route->type = WS_TARGET_UNIX;
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, target + 5);
+		route->addr_len = sizeof(*sun);
+		return true;
+	}
+
+	if (*host == '[') {
+		sep = strchr(++host, ']');
+		if (!sep || sep[1] != ':')
+			return false;
+
+		*sep = 0;
+		port = sep + 2;
+	} else {
+		port = strrchr(host, ':');
+		if (!port)
+			return false;
+
+		*port++ = 0;
+	}
+
+	/* resolve once, instead of on every connection */
+	ret = getaddrinfo(host, port, &hints, &ai);
+	if (ret) {
+		fprintf(stderr, "Unable to resolve WebSocket backend %s: %s\n",
+			host, gai_strerror(ret));
+		return false;
+	}
+
+	route->type = WS_TARGET_INET;
+	memcpy(&route->addr, ai->ai_addr, ai->ai_addrlen);
+	route->addr_len = ai->ai_addrlen;
+	freeaddrinfo(ai);
+
+	return true;
+}
+
+void uh_websocket_add(const char *prefix, const char *target)
+{
+	struct ws_route *route;
+	char *str, *sep;
+	void **slot;
+
+	str = strcpy(alloca(strlen(target) + 1), target);
+	route = calloc(1, sizeof(*route));
+	if (!route)
+		return;
+
+	sep = strrchr(str, ':');
+	if (sep && !strcmp(sep, ":text")) {
+		route->text = true;
+		*sep = 0;
+	}
+
+	if (!ws_route_resolve(route, str))
+		goto error;
+
+	slot = uh_trie_insert(&ws_trie, prefix);
+	if (!slot)
+		goto error;
+
+	if (*slot)
+		ws_route_free(*slot);
+
+	list_add_tail(&route->list, &ws_routes);
+	*slot = route;
+	return;
+
+error:
+	fprintf(stderr, "Invalid WebSocket backend %s for %s\n", target, prefix);
+	free(route);
+}
+
+void uh_websocket_reset(void)
+{
+	struct ws_route *route, *tmp;
+
+	/* connections only use a route while they are set up */
+	list_for_each_entry_safe(route, tmp, &ws_routes, list)
+		ws_route_free(route);
+
+	uh_trie_free(&ws_trie);
+}
+
+#define SHA1_ROL(v, n)	(((v) << (n)) | ((v) >> (32 - (n))))
+
+static void ws_sha1_block(uint32_t *h, const uint8_t *p)
+{
+	uint32_t w[80], a, b, c, d, e, f, k, t;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = p[i * 4] << 24 | p[i * 4 + 1] << 16 |
+		       p[i * 4 + 2] << 8 | p[i * 4 + 3];
+
+	for (i = 16; i < 80; i++)
+		w[i] = SHA1_ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+	a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+
+	for (i = 0; i < 80; i++) {
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+
+		t = SHA1_ROL(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = SHA1_ROL(b, 30);
+		b = a;
+		a = t;
+	}
+
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+}
+
+/* only used for the handshake, so the input is always short */
+static void ws_sha1(const void *data, int len, uint8_t *digest)
+{
+	uint32_t h[5] = {
+		0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+	};
+	const uint8_t *p = data;
+	uint8_t block[64];
+	uint64_t bits = (uint64_t) len * 8;
+	int i, rem;
+
+	for (; len >= 64; len -= 64, p += 64)
+		ws_sha1_block(h, p);
+
+	rem = len;
+	memset(block, 0, sizeof(block));
+	memcpy(block, p, rem);
+	block[rem] = 0x80;
+
+	if (rem >= 56) {
+		ws_sha1_block(h, block);
+		memset(block, 0, sizeof(block));
+	}
+
+	for (i = 0; i < 8; i++)
+		block[63 - i] = bits >> (i * 8);
+
+	ws_sha1_block(h, block);
+
+	for (i = 0; i < 20; i++)
+		digest[i] = h[i / 4] >> (24 - (i % 4) * 8);
+}
+
+static void ws_send_frame(struct client *cl, int opcode, const void *data, int len)
+{
+	uint8_t hdr[10];
+	int hdr_len = 2;
+
+	hdr[0] = 0x80 | opcode;
+	if (len < 126) {
+		hdr[1] = len;
+	} else if (len < 65536) {
+		hdr[1] = 126;
+		hdr[2] = len >> 8;
+		hdr[3] = len;
+		hdr_len = 4;
+	} else {
+		hdr[1] = 127;
+		memset(hdr + 2, 0, 4);
+		hdr[6] = len >> 24;
+		hdr[7] = len >> 16;
+		hdr[8] = len >> 8;
+		hdr[9] = len;
+		hdr_len = 10;
+	}
+
+	ustream_write(cl->us, (char *) hdr, hdr_len, true);
+	if (len)
+		ustream_write(cl->us, data, len, false);
+}
+
+static void ws_finish(struct client *cl, const void *data, int len)
+{
+	struct dispatch_ws *ws = &cl->dispatch.ws;
+
+	if (ws->closing)
+		return;
+
+	ws->closing = true;
+	ws_send_frame(cl, WS_OP_CLOSE, data, len);
+	uh_request_done(cl);
+}
+
+static void ws_close(struct client *cl, int code)
+{
+	uint8_t buf[2] = { code >> 8, code };
+
+	ws_finish(cl, buf, sizeof(buf));
+}
+
+/* don't split a UTF-8 sequence over two text frames */
+static int ws_utf8_cut(const char *buf, int len)
+{
+	int i, n;
+
+	for (i = len - 1; i >= 0 && i >= len - 4; i--) {
+		uint8_t c = buf[i];
+
+		if ((c & 0xc0) == 0x80)
+			continue;
+
+		if (c < 0x80)
+			return len;
+
+		n = (c >= 0xf0) ? 4 : (c >= 0xe0) ? 3 : 2;
+		return len - i >= n ? len : i;
+	}
+
+	return len;
+}
+
+static void ws_backend_read_cb(struct ustream *s, int bytes)
+{
+	struct client *cl = container_of(s, struct client, dispatch.ws.sfd.stream);
+	struct dispatch_ws *ws = &cl->dispatch.ws;
+	char *buf;
+	int len, cur;
+
+	while ((buf = ustream_get_read_buf(s, &len)) != NULL) {
+		/* the client is slow, leave the rest in the socket for now */
+		if (cl->us->w.data_bytes > WS_PENDING_MAX) {
+			ustream_set_read_blocked(s, true);
+			break;
+		}
+
+		cur = min(len, WS_FRAME_MAX);
+		if (ws->text) {
+			cur = ws_utf8_cut(buf, cur);
+			if (!cur && len < 4 && !s->eof)
+				break;
+
+			if (!cur)
+				cur = min(len, WS_FRAME_MAX);
+		}
+
+		ws_send_frame(cl, ws->text ? WS_OP_TEXT : WS_OP_BINARY, buf, cur);
+		ustream_consume(s, cur);
+	}
+}
+
+static void ws_resume_cb(struct uloop_timeout *t)
+{
+	struct client *cl = container_of(t, struct client, dispatch.ws.resume);
+
+	cl->dispatch.data_blocked = false;
+	client_poll_post_data(cl);
+}
+
+static void ws_backend_write_cb(struct ustream *s, int bytes)
+{
+	struct client *cl = container_of(s, struct client, dispatch.ws.sfd.stream);
+
+	if (!cl->dispatch.data_blocked || s->w.data_bytes > WS_PENDING_MAX / 2)
+		return;
+
+	/* not from here, the client may close and free this stream */
+	uloop_timeout_set(&cl->dispatch.ws.resume, 1);
+}
+
+static void ws_backend_state_cb(struct ustream *s)
+{
+	struct client *cl = container_of(s, struct client, dispatch.ws.sfd.stream);
+
+	ws_backend_read_cb(s, 0);
+
+	/* a slow client gets the rest first, see ws_client_write_cb */
+	if (s->write_error || !ustream_pending_data(s, false))
+		ws_close(cl, s->write_error ? WS_CLOSE_ERROR : WS_CLOSE_NORMAL);
+}
+
+static void ws_client_write_cb(struct client *cl)
+{
+	struct dispatch_ws *ws = &cl->dispatch.ws;
+	struct ustream *s = &ws->sfd.stream;
+
+	if (!s->read_blocked || cl->us->w.data_bytes > WS_PENDING_MAX / 2)
+		return;
+
+	ustream_set_read_blocked(s, false);
+	s->notify_read(s, 0);
+
+	/* the backend is gone and everything it sent has been framed */
+	if (s->eof && !ustream_pending_data(s, false))
+		ws_close(cl, WS_CLOSE_NORMAL);
+}
+
+static void ws_ping_cb(struct uloop_timeout *t)
+{
+	struct client *cl = container_of(t, struct client, dispatch.ws.ping);
+	struct dispatch_ws *ws = &cl->dispatch.ws;
+
+	/* nothing at all since the last ping, not even the pong */
+	if (!ws->got_data)
+		return ws_close(cl, WS_CLOSE_GOING_AWAY);
+
+	ws->got_data = false;
+	ws_send_frame(cl, WS_OP_PING, NULL, 0);
+	uloop_timeout_set(t, WS_PING_INTERVAL * 1000);
+}
+
+static int ws_header_len(const uint8_t *hdr, int len)
+{
+	int need = 2;
+
+	if (len < 2)
+		return need;
+
+	if ((hdr[1] & 0x7f) == 126)
+		need += 2;
+	else if ((hdr[1] & 0x7f) == 127)
+		need += 8;
+
+	if (hdr[1] & 0x80)
+		need += 4;
+
+	return need;
+}
+
+static bool ws_parse_header(struct dispatch_ws *ws)
+{
+	const uint8_t *hdr = ws->hdr;
+	uint64_t len = hdr[1] & 0x7f;
+	int ofs = 2, i;
+	bool control;
+
+	/* no extensions are negotiated, and clients must mask */
+	if ((hdr[0] & 0x70) || !(hdr[1] & 0x80))
+		return false;
+
+	if (len == 126) {
+		len = hdr[2] << 8 | hdr[3];
+		ofs = 4;
+	} else if (len == 127) {
+		for (len = 0, i = 2; i < 10; i++)
+			len = len << 8 | hdr[i];
+
+		if (len >> 63)
+			return false;
+
+		ofs = 10;
+	}
+
+	memcpy(ws->mask, hdr + ofs, sizeof(ws->mask));
+	ws->mask_ofs = 0;
+	ws->remaining = len;
+	ws->opcode = hdr[0] & 0x0f;
+	ws->fin = !!(hdr[0] & 0x80);
+	control = ws->opcode & 0x8;
+
+	if (control) {
+		if (!ws->fin || len > sizeof(ws->ctrl))
+			return false;
+
+		ws->ctrl_len = 0;
+		return ws->opcode == WS_OP_CLOSE || ws->opcode == WS_OP_PING ||
+		       ws->opcode == WS_OP_PONG;
+	}
+
+	switch (ws->opcode) {
+	case WS_OP_CONT:
+		if (!ws->in_message)
+			return false;
+		break;
+
+	case WS_OP_TEXT:
+	case WS_OP_BINARY:
+		if (ws->in_message)
+			return false;
+		break;
+
+	default:
+		return false;
+	}
+
+	ws->in_message = !ws->fin;
+	return true;
+}
+
+static void ws_unmask(struct dispatch_ws *ws, char *dest, const char *src, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		dest[i] = src[i] ^ ws->mask[ws->mask_ofs++ & 3];
+}
+
+/* returns false once the connection is finished */
+static bool ws_control_frame(struct client *cl)
+{
+	struct dispatch_ws *ws = &cl->dispatch.ws;
+
+	switch (ws->opcode) {
+	case WS_OP_PING:
+		ws_send_frame(cl, WS_OP_PONG, ws->ctrl, ws->ctrl_len);
+		break;
+
+	case WS_OP_CLOSE:
+		/* echo the status code, the reason is not repeated */
+		ws_finish(cl, ws->ctrl, min(ws->ctrl_len, 2));
+		return false;
+	}
+
+	return true;
+}
+
+static int ws_data_send(struct client *cl, const char *data, int len)
+{
+	struct dispatch_ws *ws = &cl->dispatch.ws;
+	struct ustream *s = &ws->sfd.stream;
+	char buf[4096];
+	int done = 0, cur;
+
+	if (ws->closing)
+		return len;
+
+	ws->got_data = true;
+
+	while (done < len) {
+		if (!ws->payload) {
+			ws->hdr[ws->hdr_len++] = data[done++];
+			if (ws->hdr_len < ws_header_len(ws->hdr, ws->hdr_len))
+				continue;
+
+			ws->hdr_len = 0;
+			if (!ws_parse_header(ws)) {
+				ws_close(cl, WS_CLOSE_PROTOCOL);
+				return len;
+			}
+
+			ws->payload = true;
+		}
+
+		cur = min((uint64_t) (len - done), ws->remaining);
+		if (ws->opcode & 0x8) {
+			ws_unmask(ws, (char *) ws->ctrl + ws->ctrl_len, data + done, cur);
+			ws->ctrl_len += cur;
+		} else {
+			cur = min(cur, (int) sizeof(buf));
+			ws_unmask(ws, buf, data + done, cur);
+			ustream_write(s, buf, cur, false);
+		}
+
+		done += cur;
+		ws->remaining -= cur;
+
+		if (!ws->remaining) {
+			ws->payload = false;
+			if ((ws->opcode & 0x8) && !ws_control_frame(cl))
+				return len;
+		}
+
+		if (s->w.data_bytes > WS_PENDING_MAX) {
+			cl->dispatch.data_blocked = true;
+			break;
+		}
+	}
+
+	return done;
+}
+
+static void ws_free(struct client *cl)
+{
+	struct dispatch_ws *ws = &cl->dispatch.ws;
+
+	uloop_timeout_cancel(&ws->ping);
+	uloop_timeout_cancel(&ws->resume);
+	ustream_free(&ws->sfd.stream);
+	close(ws->sfd.fd.fd);
+}
+
+static void ws_close_fds(struct client *cl)
+{
+	close(cl->dispatch.ws.sfd.fd.fd);
+}
+
+static int ws_connect(struct ws_route *route)
+{
+	int fd, one = 1;
+
+	if (route->type == WS_TARGET_ARDUINO)
+		return uh_arduino_connect();
+
+	fd = socket(route->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	if (route->type == WS_TARGET_INET)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (connect(fd, (struct sockaddr *) &route->addr, route->addr_len) < 0 &&
+	    errno != EINPROGRESS) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+enum {
+	HDR_CONNECTION,
+	HDR_AUTHORIZATION,
+	HDR_WS_KEY,
+	HDR_WS_VERSION,
+	__HDR_MAX
+};
+
+/*
+ * Called for every request carrying "Upgrade: websocket". Returns true if
+ * the request was taken over, either upgraded or answered with an error.
+ */
+bool uh_websocket_request(struct client *cl)
+{
+	static const struct blobmsg_policy hdr_policy[__HDR_MAX] = {
+		[HDR_CONNECTION] = { "connection", BLOBMSG_TYPE_STRING },
+		[HDR_AUTHORIZATION] = { "authorization", BLOBMSG_TYPE_STRING },
+		[HDR_WS_KEY] = { "sec-websocket-key", BLOBMSG_TYPE_STRING },
+		[HDR_WS_VERSION] = { "sec-websocket-version", BLOBMSG_TYPE_STRING },
+	};
+	struct dispatch_ws *ws = &cl->dispatch.ws;
+	struct http_request *req = &cl->request;
+	struct blob_attr *tb[__HDR_MAX];
+	struct path_info pa = {};
+	struct ws_route *route;
+	char *url = blobmsg_data(blob_data(cl->hdr.head));
+	char key[64 + sizeof(WS_GUID)], accept[32];
+	uint8_t digest[20], nonce[18];
+	int fd;
+
+	if (req->method != UH_HTTP_MSG_GET || req->version != UH_HTTP_VER_1_1)
+		return false;
+
+	blobmsg_parse(hdr_policy, __HDR_MAX, tb, blob_data(cl->hdr.head), blob_len(cl->hdr.head));
+	if (!tb[HDR_CONNECTION] ||
+	    !strcasestr(blobmsg_data(tb[HDR_CONNECTION]), "upgrade"))
+		return false;
+
+	route = uh_trie_match(&ws_trie, url, true, NULL);
+	if (!route)
+		return false;
+
+	req->t_dispatch = uh_time_us();
+	req->stats = uh_stats_handler("websocket");
+
+	pa.name = url;
+	if (tb[HDR_AUTHORIZATION])
+		pa.auth = blobmsg_data(tb[HDR_AUTHORIZATION]);
+
+	if (!uh_auth_check(cl, &pa))
+		return true;
+
+	if (!tb[HDR_WS_VERSION] || strcmp(blobmsg_data(tb[HDR_WS_VERSION]), "13")) {
+		uh_http_header(cl, 426, "Upgrade Required");
+		ustream_printf(cl->us, "Sec-WebSocket-Version: 13\r\n\r\n");
+		uh_request_done(cl);
+		return true;
+	}
+
+	if (!tb[HDR_WS_KEY] || req->content_length > 0 || req->transfer_chunked ||
+	    strlen(blobmsg_data(tb[HDR_WS_KEY])) > 64 ||
+	    uh_b64decode((char *) nonce, sizeof(nonce), blobmsg_data(tb[HDR_WS_KEY]),
+			 blobmsg_data_len(tb[HDR_WS_KEY]) - 1) != 16) {
+		uh_client_error(cl, 400, "Bad Request", "Invalid WebSocket handshake");
+		return true;
+	}
+
+	fd = ws_connect(route);
+	if (fd < 0) {
+		uh_client_error(cl, 502, "Bad Gateway",
+				"Unable to connect to the WebSocket backend: %s",
+				strerror(errno));
+		return true;
+	}
+
+	snprintf(key, sizeof(key), "%s" WS_GUID, (char *) blobmsg_data(tb[HDR_WS_KEY]));
+	ws_sha1(key, strlen(key), digest);
+	uh_b64encode(accept, sizeof(accept), digest, sizeof(digest));
+
+	/* from here on, the connection belongs to the WebSocket protocol */
+	req->upgraded = true;
+	req->connection_close = true;
+	req->status = 101;
+	req->t_first_byte = uh_time_us();
+	ustream_printf(cl->us,
+		"HTTP/1.1 101 Switching Protocols\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+
+	ws->text = route->text;
+	ws->got_data = true;
+	ws->ping.cb = ws_ping_cb;
+	ws->resume.cb = ws_resume_cb;
+	uloop_timeout_set(&ws->ping, WS_PING_INTERVAL * 1000);
+
+	ws->sfd.stream.string_data = false;
+	ws->sfd.stream.notify_read = ws_backend_read_cb;
+	ws->sfd.stream.notify_write = ws_backend_write_cb;
+	ws->sfd.stream.notify_state = ws_backend_state_cb;
+	ustream_fd_init(&ws->sfd, fd);
+
+	cl->dispatch.free = ws_free;
+	cl->dispatch.close_fds = ws_close_fds;
+	cl->dispatch.write_cb = ws_client_write_cb;
+	cl->dispatch.data_send = ws_data_send;
+
+	return true;
+}